@@ -68,6 +68,78 @@ static Mutex s_lastMutex(false,"CallEndpoint::last");
 static const String s_audioType = "audio";
 static const String s_copyParams = "copyparams";
 
+// Maximum time an idle routing pool thread waits for requests, must be well below 1s
+#define ROUTER_WAKEUP_USEC 250000
+// Time after which an idle routing pool thread exits
+#define ROUTER_IDLE_USEC 60000000
+// Maximum number of pending wakeups of routing pool threads
+#define ROUTER_WAKEUPS 256
+// Number of one second slots in the channel timer wheel of each driver
+#define TIMER_SLOTS 256
+// Number of buckets in the channel index of each driver
+#define CHAN_BUCKETS 509
+
+namespace TelEngine {
+
+// Routing request waiting in the routing pool queue
+class RouteRequest : public GenObject
+{
+public:
+    inline RouteRequest(Driver* driver, const char* id, Message* msg)
+	: m_driver(driver), m_id(id), m_msg(msg), m_queued(Time::now())
+	{ }
+    ~RouteRequest()
+	{ TelEngine::destruct(m_msg); }
+    Driver* m_driver;
+    String m_id;
+    Message* m_msg;
+    u_int64_t m_queued;
+};
+
+// Thread of the shared pool that routes calls from a bounded queue
+class RouterPool : public Thread
+{
+public:
+    enum Result {
+	Disabled,
+	Queued,
+	Full
+    };
+    RouterPool();
+    ~RouterPool();
+    virtual void run();
+    // Load the pool settings from the [telephony] section
+    static void configure();
+    // Queue a routing request, the message is consumed only if queued
+    static Result enqueue(Driver* driver, const String& id, Message* msg);
+    // Account a call entering routing in a driver
+    static void routing(Driver* driver);
+    // Account a call leaving routing and the time it spent queued and routing
+    static void routed(Driver* driver, bool ok, u_int64_t wait, u_int64_t time);
+    // Route a call, shared by the router threads and the pool
+    static bool route(Driver* driver, const String& id, Message* msg);
+    static int count;
+    static int idle;
+private:
+    RouteRequest* dequeue();
+    bool retire();
+    bool m_counted;
+};
+
+};
+
+static Mutex s_routeMutex(false,"RouterPool");
+static Semaphore s_routeSemaphore(ROUTER_WAKEUPS,"RouterPool",0);
+static ObjList s_routeQueue;
+static ObjList* s_routeAppend = &s_routeQueue;
+static unsigned int s_routeQueued = 0;
+static int s_routeThreads = 0;
+static unsigned int s_routeQueueMax = 1000;
+static unsigned int s_routeCongest = 500;
+static bool s_routeCong = false;
+int RouterPool::count = 0;
+int RouterPool::idle = 0;
+
 // Check if a Lock taken on the common mutex succeeded, wait up to 55s more in congestion
 static bool checkRetry(Lock& lock)
 {
@@ -388,7 +460,7 @@ static Mutex s_paramMutex(true,"ChannelParams");
 Channel::Channel(Driver* driver, const char* id, bool outgoing)
     : CallEndpoint(id),
       m_parameters(""), m_driver(driver), m_outgoing(outgoing),
-      m_timeout(0), m_maxcall(0), m_maxPDD(0), m_dtmfTime(0),
+      m_timeout(0), m_maxcall(0), m_maxPDD(0), m_timerCheck(0), m_timerSlot(-1), m_dtmfTime(0),
       m_toutAns(0), m_dtmfSeq(0), m_answered(false)
 {
     init();
@@ -397,7 +469,7 @@ Channel::Channel(Driver* driver, const char* id, bool outgoing)
 Channel::Channel(Driver& driver, const char* id, bool outgoing)
     : CallEndpoint(id),
       m_parameters(""), m_driver(&driver), m_outgoing(outgoing),
-      m_timeout(0), m_maxcall(0), m_maxPDD(0), m_dtmfTime(0),
+      m_timeout(0), m_maxcall(0), m_maxPDD(0), m_timerCheck(0), m_timerSlot(-1), m_dtmfTime(0),
       m_toutAns(0), m_dtmfSeq(0), m_answered(false)
 {
     init();
@@ -451,6 +523,7 @@ void Channel::cleanup()
     m_timeout = 0;
     m_maxcall = 0;
     m_maxPDD = 0;
+    m_timerCheck = 0;
     status("deleted");
     m_targetid.clear();
     dropChan();
@@ -483,6 +556,7 @@ void Channel::initChan()
     m_driver->m_total++;
     m_driver->m_chanCount++;
     m_driver->channels().append(this);
+    m_driver->m_chanIndex.append(this)->setDelete(false);
     m_driver->changed();
 }
 
@@ -493,6 +567,11 @@ void Channel::dropChan()
     m_driver->lock();
     if (!m_driver)
 	Debug(DebugFail,"Driver lost in dropChan! [%p]",this);
+    if (m_timerSlot >= 0) {
+	m_driver->m_timerWheel[m_timerSlot].remove(this,false);
+	m_timerSlot = -1;
+    }
+    m_driver->m_chanIndex.remove(this,false,true);
     if (m_driver->channels().remove(this,false)) {
 	if (m_driver->m_chanCount > 0)
 	    m_driver->m_chanCount--;
@@ -560,7 +639,12 @@ void Channel::dispatched(const Message& msg, bool handled)
 void Channel::setId(const char* newId)
 {
     debugName(0);
+    Lock lock(m_driver);
     CallEndpoint::setId(newId);
+    // move to the index bucket of the new ID
+    if (m_driver)
+	m_driver->m_chanIndex.resync(this);
+    lock.drop();
     debugName(id());
 }
 
@@ -695,15 +779,29 @@ bool Channel::startRouter(Message* msg)
 {
     if (!msg)
 	return false;
+    const char* error = "failure";
+    const char* reason = "Internal server error";
     if (m_driver) {
-	Router* r = new Router(m_driver,id(),msg);
-	if (r->startup())
-	    return true;
-	delete r;
+	switch (RouterPool::enqueue(m_driver,id(),msg)) {
+	    case RouterPool::Queued:
+		return true;
+	    case RouterPool::Full:
+		TelEngine::destruct(msg);
+		error = "congestion";
+		reason = "Too many calls waiting for routing";
+		break;
+	    default:
+		{
+		    Router* r = new Router(m_driver,id(),msg);
+		    if (r->startup())
+			return true;
+		    delete r;
+		}
+	}
     }
     else
 	TelEngine::destruct(msg);
-    callRejected("failure","Internal server error");
+    callRejected(error,reason);
     // dereference and die if the channel is dynamic
     if (m_driver && m_driver->varchan())
 	deref();
@@ -859,6 +957,44 @@ void Channel::statusParams(String& str)
     }
 }
 
+// Get the earliest time at which checkTimers() must be called, zero if none
+u_int64_t Channel::nextTimer() const
+{
+    u_int64_t t = m_timeout;
+    if (m_maxcall && !(t && (t <= m_maxcall)))
+	t = m_maxcall;
+    if (m_maxPDD && !(t && (t <= m_maxPDD)))
+	t = m_maxPDD;
+    if (m_timerCheck && !(t && (t <= m_timerCheck)))
+	t = m_timerCheck;
+    return t;
+}
+
+// Move the channel in the driver's timer wheel slot of its earliest timer
+// Timers due before the next slot to check go in that slot
+void Channel::updateTimers()
+{
+    Driver* drv = m_driver;
+    if (!drv)
+	return;
+    Lock lock(drv);
+    int slot = -1;
+    u_int64_t t = nextTimer();
+    if (t) {
+	t /= 1000000;
+	if (t < drv->m_timerSec)
+	    t = drv->m_timerSec;
+	slot = (int)(t % TIMER_SLOTS);
+    }
+    if (slot == m_timerSlot)
+	return;
+    if (m_timerSlot >= 0)
+	drv->m_timerWheel[m_timerSlot].remove(this,false);
+    m_timerSlot = slot;
+    if (slot >= 0)
+	drv->m_timerWheel[slot].append(this)->setDelete(false);
+}
+
 void Channel::checkTimers(Message& msg, const Time& tmr)
 {
     if (timeout() && (timeout() < tmr))
@@ -1349,12 +1485,19 @@ Driver::Driver(const char* name, const char* type)
     : Module(name,type),
       m_init(false), m_varchan(true),
       m_routing(0), m_routed(0), m_total(0),
+      m_routeWait(0), m_routeTime(0),
       m_nextid(0), m_timeout(0),
-      m_maxroute(0), m_maxchans(0), m_chanCount(0), m_dtmfDups(false)
+      m_maxroute(0), m_maxchans(0), m_chanCount(0), m_dtmfDups(false),
+      m_chanIndex(CHAN_BUCKETS), m_timerWheel(new ObjList[TIMER_SLOTS]), m_timerSec(0)
 {
     m_prefix << name << "/";
 }
 
+Driver::~Driver()
+{
+    delete[] m_timerWheel;
+}
+
 void* Driver::getObject(const String& name) const
 {
     if (name == YATOM("Driver"))
@@ -1399,8 +1542,38 @@ bool Driver::isBusy() const
 
 Channel* Driver::find(const String& id) const
 {
-    const ObjList* pos = m_chans.find(id);
-    return pos ? static_cast<Channel*>(pos->get()) : 0;
+    return static_cast<Channel*>(m_chanIndex[id]);
+}
+
+// Collect referenced channels from the timer wheel slots due up to now
+// Each checked channel is put back in the slot of its earliest timer
+void Driver::dueTimers(ObjList& due, const Time& now)
+{
+    u_int64_t sec = now.sec();
+    u_int64_t from = m_timerSec;
+    if (sec < from)
+	return;
+    if (!from || ((sec - from) >= TIMER_SLOTS))
+	from = sec + 1 - TIMER_SLOTS;
+    // channels not yet due in the current second will be checked next time
+    m_timerSec = sec + 1;
+    for (; from <= sec; from++) {
+	ObjList& list = m_timerWheel[from % TIMER_SLOTS];
+	if (!list.skipNull())
+	    continue;
+	ObjList check;
+	while (Channel* c = static_cast<Channel*>(list.remove(false))) {
+	    c->m_timerSlot = -1;
+	    check.append(c)->setDelete(false);
+	}
+	for (ObjList* l = check.skipNull(); l; l = l->skipNext()) {
+	    Channel* c = static_cast<Channel*>(l->get());
+	    u_int64_t t = c->nextTimer();
+	    if (t && (t < now) && c->ref())
+		due.append(c);
+	    c->updateTimers();
+	}
+    }
 }
 
 bool Driver::received(Message &msg, int id)
@@ -1412,19 +1585,14 @@ bool Driver::received(Message &msg, int id)
     switch (id) {
 	case Timer:
 	    {
-		// check each channel for timeouts
-		lock();
-		ListIterator iter(m_chans);
+		// check only the channels with expired timers
 		Time t;
-		for (;;) {
-		    RefPointer<Channel> c = static_cast<Channel*>(iter.get());
-		    unlock();
-		    if (!c)
-			break;
-		    c->checkTimers(msg,t);
-		    c = 0;
-		    lock();
-		}
+		ObjList due;
+		lock();
+		dueTimers(due,t);
+		unlock();
+		for (ObjList* l = due.skipNull(); l; l = l->skipNext())
+		    static_cast<Channel*>(l->get())->checkTimers(msg,t);
 	    }
 	    return Module::received(msg,id);
 	case Status:
@@ -1603,6 +1771,8 @@ void Driver::statusParams(String& str)
     Module::statusParams(str);
     str.append("routed=",",") << m_routed;
     str << ",routing=" << m_routing;
+    str << ",routewait=" << m_routeWait;
+    str << ",routetime=" << m_routeTime;
     str << ",total=" << m_total;
     str << ",chans=" << m_chanCount;
 }
@@ -1665,6 +1835,7 @@ void Driver::loadLimits()
     maxRoute(Engine::config().getIntValue(YSTRING("telephony"),"maxroute"));
     maxChans(Engine::config().getIntValue(YSTRING("telephony"),"maxchans"));
     dtmfDups(Engine::config().getBoolValue(YSTRING("telephony"),"dtmfdups"));
+    RouterPool::configure();
 }
 
 unsigned int Driver::nextid()
@@ -1685,103 +1856,106 @@ void Router::run()
 {
     if (!(m_driver && m_msg))
 	return;
-    m_driver->lock();
-    m_driver->m_routing++;
-    m_driver->changed();
-    m_driver->unlock();
+    RouterPool::routing(m_driver);
+    u_int64_t t = Time::now();
     bool ok = route();
-    m_driver->lock();
-    m_driver->m_routing--;
-    if (ok)
-	m_driver->m_routed++;
-    m_driver->changed();
-    m_driver->unlock();
+    RouterPool::routed(m_driver,ok,0,Time::now() - t);
 }
 
 bool Router::route()
 {
     DDebug(m_driver,DebugAll,"Routing thread for '%s' [%p]",m_id.c_str(),this);
+    return RouterPool::route(m_driver,m_id,m_msg);
+}
+
+void Router::cleanup()
+{
+    destruct(m_msg);
+}
 
+
+bool RouterPool::route(Driver* driver, const String& id, Message* msg)
+{
     RefPointer<Channel> chan;
-    String tmp(m_msg->getValue(YSTRING("callto")));
+    String tmp(msg->getValue(YSTRING("callto")));
     bool ok = !tmp.null();
     if (ok)
-	m_msg->retValue() = tmp;
+	msg->retValue() = tmp;
     else {
-	if (*m_msg == YSTRING("call.preroute")) {
-	    ok = Engine::dispatch(m_msg);
-	    m_driver->lock();
-	    chan = m_driver->find(m_id);
-	    m_driver->unlock();
+	if (*msg == YSTRING("call.preroute")) {
+	    ok = Engine::dispatch(msg);
+	    driver->lock();
+	    chan = driver->find(id);
+	    driver->unlock();
 	    if (!chan) {
-		Debug(m_driver,DebugInfo,"Connection '%s' vanished while prerouting!",m_id.c_str());
+		Debug(driver,DebugInfo,"Connection '%s' vanished while prerouting!",id.c_str());
 		return false;
 	    }
-	    const String* cp = m_msg->getParam(s_copyParams);
+	    const String* cp = msg->getParam(s_copyParams);
 	    if (!TelEngine::null(cp)) {
 		Channel::paramMutex().lock();
-		chan->parameters().copyParams(*m_msg,*cp);
+		chan->parameters().copyParams(*msg,*cp);
 		Channel::paramMutex().unlock();
 	    }
-	    bool dropCall = ok && ((m_msg->retValue() == YSTRING("-")) || (m_msg->retValue() == YSTRING("error")));
+	    bool dropCall = ok && ((msg->retValue() == YSTRING("-")) || (msg->retValue() == YSTRING("error")));
 	    if (dropCall)
-		chan->callRejected(m_msg->getValue(YSTRING("error"),"unknown"),
-		    m_msg->getValue(YSTRING("reason")),m_msg);
+		chan->callRejected(msg->getValue(YSTRING("error"),"unknown"),
+		    msg->getValue(YSTRING("reason")),msg);
 	    else
-		dropCall = !chan->callPrerouted(*m_msg,ok);
+		dropCall = !chan->callPrerouted(*msg,ok);
 	    if (dropCall) {
 		// get rid of the dynamic chans
-		if (m_driver->varchan())
+		if (driver->varchan())
 		    chan->deref();
 		return false;
 	    }
 	    chan = 0;
-	    *m_msg = "call.route";
-	    m_msg->retValue().clear();
+	    *msg = "call.route";
+	    msg->retValue().clear();
 	}
-	ok = Engine::dispatch(m_msg);
+	ok = Engine::dispatch(msg);
     }
 
-    m_driver->lock();
-    chan = m_driver->find(m_id);
-    m_driver->unlock();
+    driver->lock();
+    chan = driver->find(id);
+    driver->unlock();
 
     if (!chan) {
-	Debug(m_driver,DebugInfo,"Connection '%s' vanished while routing!",m_id.c_str());
+	Debug(driver,DebugInfo,"Connection '%s' vanished while routing!",id.c_str());
 	return false;
     }
     // chan will keep it referenced even if message user data is changed
-    m_msg->userData(chan);
+    msg->userData(chan);
 
     static const char s_noroute[] = "noroute";
     static const char s_looping[] = "looping";
     static const char s_noconn[] = "noconn";
 
-    if (ok && m_msg->retValue().trimSpaces()) {
-	if ((m_msg->retValue() == YSTRING("-")) || (m_msg->retValue() == YSTRING("error")))
-	    chan->callRejected(m_msg->getValue(YSTRING("error"),"unknown"),
-		m_msg->getValue("reason"),m_msg);
-	else if (m_msg->getIntValue(YSTRING("antiloop"),1) <= 0) {
-	    const char* error = m_msg->getValue(YSTRING("error"),s_looping);
-	    chan->callRejected(error,m_msg->getValue(YSTRING("reason"),
-		((s_looping == error) ? "Call is looping" : (const char*)0)),m_msg);
+    if (ok && msg->retValue().trimSpaces()) {
+	if ((msg->retValue() == YSTRING("-")) || (msg->retValue() == YSTRING("error")))
+	    chan->callRejected(msg->getValue(YSTRING("error"),"unknown"),
+		msg->getValue("reason"),msg);
+	else if (msg->getIntValue(YSTRING("antiloop"),1) <= 0) {
+	    const char* error = msg->getValue(YSTRING("error"),s_looping);
+	    chan->callRejected(error,msg->getValue(YSTRING("reason"),
+		((s_looping == error) ? "Call is looping" : (const char*)0)),msg);
 	}
-	else if (chan->callRouted(*m_msg)) {
-	    *m_msg = "call.execute";
-	    m_msg->setParam("callto",m_msg->retValue());
-	    m_msg->clearParam(YSTRING("error"));
-	    m_msg->retValue().clear();
-	    ok = Engine::dispatch(m_msg);
+	else if (chan->callRouted(*msg)) {
+	    *msg = "call.execute";
+	    msg->setParam("callto",msg->retValue());
+	    msg->clearParam(YSTRING("error"));
+	    msg->retValue().clear();
+	    ok = Engine::dispatch(msg);
 	    if (ok)
-		chan->callAccept(*m_msg);
+		chan->callAccept(*msg);
 	    else {
-		const char* error = m_msg->getValue(YSTRING("error"),s_noconn);
-		const char* reason = m_msg->getValue(YSTRING("reason"),
+		const char* error = msg->getValue(YSTRING("error"),s_noconn);
+		const char* reason = msg->getValue(YSTRING("reason"),
 		    ((s_noconn == error) ? "Could not connect to target" : (const char*)0));
 		Message m(s_disconnected);
-		const String* cp = m_msg->getParam(s_copyParams);
+		const String* cp = msg->getParam(s_copyParams);
 		if (!TelEngine::null(cp))
-		    m.copyParams(*m_msg,*cp);
+		    m.copyParams(*msg,*cp);
 		chan->complete(m);
 		m.setParam("error",error);
 		m.setParam("reason",reason);
@@ -1789,25 +1963,160 @@ bool Router::route()
 		m.userData(chan);
 		m.setNotify();
 		if (!Engine::dispatch(m))
-		    chan->callRejected(error,reason,m_msg);
+		    chan->callRejected(error,reason,msg);
 	    }
 	}
     }
     else {
-	const char* error = m_msg->getValue(YSTRING("error"),s_noroute);
-	chan->callRejected(error,m_msg->getValue(YSTRING("reason"),
-	    ((s_noroute == error) ? "No route to call target" : (const char*)0)),m_msg);
+	const char* error = msg->getValue(YSTRING("error"),s_noroute);
+	chan->callRejected(error,msg->getValue(YSTRING("reason"),
+	    ((s_noroute == error) ? "No route to call target" : (const char*)0)),msg);
     }
 
     // dereference again if the channel is dynamic
-    if (m_driver->varchan())
+    if (driver->varchan())
 	chan->deref();
     return ok;
 }
 
-void Router::cleanup()
+// The pool slot is reserved by enqueue(), the destructor releases it
+RouterPool::RouterPool()
+    : Thread("Call Router"),
+      m_counted(true)
 {
-    destruct(m_msg);
+}
+
+RouterPool::~RouterPool()
+{
+    if (!m_counted)
+	return;
+    Lock lock(s_routeMutex);
+    count--;
+}
+
+void RouterPool::run()
+{
+    u_int64_t busy = Time::now();
+    for (;;) {
+	while (RouteRequest* req = dequeue()) {
+	    u_int64_t t = Time::now();
+	    bool ok = route(req->m_driver,req->m_id,req->m_msg);
+	    busy = Time::now();
+	    routed(req->m_driver,ok,t - req->m_queued,busy - t);
+	    TelEngine::destruct(req);
+	}
+	if (((Time::now() - busy) > ROUTER_IDLE_USEC) && retire())
+	    return;
+	s_routeMutex.lock();
+	idle++;
+	s_routeMutex.unlock();
+	s_routeSemaphore.lock(ROUTER_WAKEUP_USEC);
+	s_routeMutex.lock();
+	idle--;
+	s_routeMutex.unlock();
+	Thread::check(true);
+    }
+}
+
+// Remove the oldest request from the queue, leave congestion if it got short
+RouteRequest* RouterPool::dequeue()
+{
+    Lock lock(s_routeMutex);
+    if (s_routeQueue.next() == s_routeAppend)
+	s_routeAppend = &s_routeQueue;
+    RouteRequest* req = static_cast<RouteRequest*>(s_routeQueue.remove(false));
+    if (!req)
+	return 0;
+    s_routeQueued--;
+    if (!(s_routeCong && (s_routeQueued <= s_routeCongest / 2)))
+	return req;
+    s_routeCong = false;
+    lock.drop();
+    Engine::setCongestion();
+    return req;
+}
+
+// Leave the pool if idle, the last thread stays while requests are queued
+bool RouterPool::retire()
+{
+    Lock lock(s_routeMutex);
+    if (s_routeQueued && (count <= 1))
+	return false;
+    count--;
+    m_counted = false;
+    lock.drop();
+    DDebug(DebugInfo,"Removing idle call routing thread (%d left)",count);
+    return true;
+}
+
+void RouterPool::configure()
+{
+    const NamedList* tel = Engine::config().getSection(YSTRING("telephony"));
+    Lock lock(s_routeMutex);
+    if (tel) {
+	s_routeThreads = tel->getIntValue(YSTRING("routethreads"),0,0,10000);
+	s_routeQueueMax = tel->getIntValue(YSTRING("routequeue"),1000,1);
+	s_routeCongest = tel->getIntValue(YSTRING("routecongestion"),s_routeQueueMax / 2,0);
+    }
+    else {
+	s_routeThreads = 0;
+	s_routeQueueMax = 1000;
+	s_routeCongest = 500;
+    }
+}
+
+RouterPool::Result RouterPool::enqueue(Driver* driver, const String& id, Message* msg)
+{
+    s_routeMutex.lock();
+    Result res = s_routeThreads ? ((s_routeQueued < s_routeQueueMax) ? Queued : Full) : Disabled;
+    s_routeMutex.unlock();
+    if (res != Queued)
+	return res;
+    // account it before any pool thread can pick it up
+    routing(driver);
+    Lock lock(s_routeMutex);
+    s_routeAppend = s_routeAppend->append(new RouteRequest(driver,id,msg));
+    s_routeQueued++;
+    // reserve the thread slot now so concurrent callers can't exceed the limit
+    bool grow = (s_routeQueued > (unsigned int)idle) && (count < s_routeThreads);
+    if (grow)
+	count++;
+    bool cong = s_routeCongest && !s_routeCong && (s_routeQueued >= s_routeCongest);
+    if (cong)
+	s_routeCong = true;
+    lock.drop();
+    s_routeSemaphore.unlock();
+    if (grow) {
+	RouterPool* r = new RouterPool;
+	if (!r->startup()) {
+	    Debug(DebugWarn,"Failed to start call routing thread (%d running)",count);
+	    delete r;
+	}
+    }
+    if (cong)
+	Engine::setCongestion("Too many calls waiting for routing");
+    return Queued;
+}
+
+void RouterPool::routing(Driver* driver)
+{
+    driver->lock();
+    driver->m_routing++;
+    driver->changed();
+    driver->unlock();
+}
+
+void RouterPool::routed(Driver* driver, bool ok, u_int64_t wait, u_int64_t time)
+{
+    driver->lock();
+    driver->m_routing--;
+    if (ok)
+	driver->m_routed++;
+    // running averages of queue wait and routing time in usec
+    driver->m_routeWait = (unsigned int)((7 * (u_int64_t)driver->m_routeWait + wait) / 8);
+    driver->m_routeTime = (unsigned int)((7 * (u_int64_t)driver->m_routeTime + time) / 8);
+    driver->changed();
+    driver->unlock();
 }
 
 
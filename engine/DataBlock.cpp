@@ -22,6 +22,14 @@
 #include <string.h>
 #include <stdlib.h>
 
+// Vectorized G.711 decoding needs per function target support in the compiler
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define G711_AVX2
+#include <immintrin.h>
+#define AVX2_FUNC __attribute__((target("avx2")))
+#endif
+
 using namespace TelEngine;
 
 namespace { // anonymous
@@ -71,6 +79,89 @@ public:
     }
 };
 
+#ifdef G711_AVX2
+// Set at startup if the CPU supports AVX2 and the kernels match the tables
+static bool s_decodeAvx2 = false;
+
+// Multiply 16 bit lanes by 2^n, n must be in range 0..7
+static inline AVX2_FUNC __m256i shiftLeft16(__m256i val, __m256i n)
+{
+    const __m256i pow2 = _mm256_setr_epi8(1,2,4,8,16,32,64,(char)128,0,0,0,0,0,0,0,0,
+	1,2,4,8,16,32,64,(char)128,0,0,0,0,0,0,0,0);
+    // set the high byte of each index to get a zero high byte in the result
+    n = _mm256_or_si256(n,_mm256_set1_epi16((short)0x8000));
+    return _mm256_mullo_epi16(val,_mm256_shuffle_epi8(pow2,n));
+}
+
+// Decode 16 mu-Law samples held in 16 bit lanes
+static inline AVX2_FUNC __m256i decodeMuLaw16(__m256i val)
+{
+    val = _mm256_xor_si256(val,_mm256_set1_epi16(0xff));
+    __m256i mag = _mm256_slli_epi16(_mm256_and_si256(val,_mm256_set1_epi16(0x0f)),3);
+    mag = _mm256_add_epi16(mag,_mm256_set1_epi16(0x84));
+    mag = shiftLeft16(mag,_mm256_and_si256(_mm256_srli_epi16(val,4),_mm256_set1_epi16(0x07)));
+    mag = _mm256_sub_epi16(mag,_mm256_set1_epi16(0x84));
+    // sign bit set in the complemented value means negative
+    __m256i neg = _mm256_cmpgt_epi16(val,_mm256_set1_epi16(0x7f));
+    return _mm256_sub_epi16(_mm256_xor_si256(mag,neg),neg);
+}
+
+// Decode 16 A-Law samples held in 16 bit lanes
+static inline AVX2_FUNC __m256i decodeALaw16(__m256i val)
+{
+    val = _mm256_xor_si256(val,_mm256_set1_epi16(0x55));
+    __m256i seg = _mm256_and_si256(_mm256_srli_epi16(val,4),_mm256_set1_epi16(0x07));
+    __m256i mag = _mm256_slli_epi16(_mm256_and_si256(val,_mm256_set1_epi16(0x0f)),4);
+    mag = _mm256_add_epi16(mag,_mm256_set1_epi16(0x08));
+    // segments above the first one have an implicit leading bit
+    __m256i lead = _mm256_cmpgt_epi16(seg,_mm256_setzero_si256());
+    mag = _mm256_add_epi16(mag,_mm256_and_si256(lead,_mm256_set1_epi16(0x100)));
+    mag = shiftLeft16(mag,_mm256_add_epi16(seg,lead));
+    __m256i neg = _mm256_cmpgt_epi16(_mm256_set1_epi16(0x80),val);
+    return _mm256_sub_epi16(_mm256_xor_si256(mag,neg),neg);
+}
+
+// Decode G.711 to signed linear 16 samples at a time
+// Returns the number of samples decoded, the caller must handle the rest
+static AVX2_FUNC unsigned int decodeAvx2(unsigned short* d, const unsigned char* s,
+    unsigned int len, bool aLaw)
+{
+    unsigned int n = len & ~15;
+    for (unsigned int i = 0; i < n; i += 16) {
+	__m256i val = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + i)));
+	val = aLaw ? decodeALaw16(val) : decodeMuLaw16(val);
+	_mm256_storeu_si256((__m256i*)(d + i),val);
+    }
+    return n;
+}
+
+// Enable the vectorized decoder only if it agrees with the tables for all inputs
+static bool checkAvx2()
+{
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2"))
+	return false;
+    unsigned char codes[256];
+    unsigned short out[256];
+    for (int i = 0; i < 256; i++)
+	codes[i] = i;
+    if (decodeAvx2(out,codes,256,true) != 256 || ::memcmp(out,a2s,sizeof(out)))
+	return false;
+    if (decodeAvx2(out,codes,256,false) != 256 || ::memcmp(out,u2s,sizeof(out)))
+	return false;
+    return true;
+}
+
+class InitG711Avx2
+{
+public:
+    InitG711Avx2()
+	{ s_decodeAvx2 = checkAvx2(); }
+};
+
+static InitG711Avx2 s_initG711Avx2;
+#endif
+
 static InitG711 s_initG711;
 
 }; // anonymous namespace
@@ -341,6 +432,14 @@ bool DataBlock::convert(const DataBlock& src, const String& sFormat,
 	unsigned char *s = (unsigned char *) src.data();
 	unsigned short *d = (unsigned short *) data();
 	unsigned short *c = (unsigned short *) ctable;
+#ifdef G711_AVX2
+	if (s_decodeAvx2) {
+	    unsigned int n = decodeAvx2(d,s,len,(c == a2s));
+	    s += n;
+	    d += n;
+	    len -= n;
+	}
+#endif
 	while (len--)
 	    *d++ = c[*s++];
     }
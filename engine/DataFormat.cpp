@@ -362,6 +362,58 @@ private:
     const TranslatorCaps* m_capabilities;
 };
 
+// Longest factory chain whose cost is tracked separately
+#define ROUTE_MAX_LEN 8
+
+// All factories converting between a pair of formats, in installation order
+class TranslatorRoute : public GenObject
+{
+public:
+    TranslatorRoute(const FormatInfo* src, const FormatInfo* dest);
+    void add(TranslatorFactory* factory, int cost);
+    int cost(unsigned int maxLen = 0) const;
+    inline const FormatInfo* src() const
+	{ return m_src; }
+    inline const FormatInfo* dest() const
+	{ return m_dest; }
+    inline const ObjList& factories() const
+	{ return m_factories; }
+private:
+    const FormatInfo* m_src;
+    const FormatInfo* m_dest;
+    ObjList m_factories;
+    int m_cost[ROUTE_MAX_LEN];
+};
+
+// Routes starting from or ending in a format
+class TranslatorRow : public String
+{
+public:
+    inline TranslatorRow(const char* format)
+	: String(format)
+	{ }
+    inline ObjList& routes()
+	{ return m_routes; }
+    inline const ObjList& routes() const
+	{ return m_routes; }
+private:
+    ObjList m_routes;
+};
+
+// Snapshot of the conversions offered by the installed factories
+class TranslatorTable : public RefObject
+{
+public:
+    TranslatorTable(const ObjList& factories);
+    const TranslatorRoute* find(const FormatInfo* src, const FormatInfo* dest) const;
+    const ObjList* fromSource(const FormatInfo* src) const;
+    const ObjList* toDest(const FormatInfo* dest) const;
+private:
+    TranslatorRow* row(HashList& list, const FormatInfo* format);
+    HashList m_bySource;
+    HashList m_byDest;
+};
+
 };
 
 using namespace TelEngine;
@@ -1186,6 +1238,9 @@ Mutex DataTranslator::s_mutex(true,"DataTranslator");
 ObjList DataTranslator::s_factories;
 unsigned int DataTranslator::s_maxChain = 3;
 static ObjList s_compose;
+// Current translator table, replaced when the factory set changes
+static TranslatorTable* s_table = 0;
+static Mutex s_tableMutex(false,"TranslatorTable");
 static SimpleFactory s_sFactory(s_simpleCaps,"g711");
 static SimpleFactory s_sFactory16k(s_simpleCaps16k,"g711wb");
 static SimpleFactory s_sFactory32k(s_simpleCaps32k,"g711uwb");
@@ -1202,6 +1257,45 @@ void DataTranslator::setMaxChain(unsigned int maxChain)
     s_maxChain = maxChain;
 }
 
+// Get a reference to the current translator table, may return NULL
+static TranslatorTable* currentTable()
+{
+    Lock lock(s_tableMutex);
+    TranslatorTable* table = s_table;
+    if (table && !table->ref())
+	table = 0;
+    return table;
+}
+
+// Drop the current translator table, caller must hold the translators mutex
+static void invalidateTable()
+{
+    s_tableMutex.lock();
+    TranslatorTable* table = s_table;
+    s_table = 0;
+    s_tableMutex.unlock();
+    TelEngine::destruct(table);
+}
+
+TranslatorTable* DataTranslator::table()
+{
+    TranslatorTable* table = currentTable();
+    if (table)
+	return table;
+    Lock lock(s_mutex);
+    compose();
+    // another thread may have rebuilt it while we were waiting
+    table = currentTable();
+    if (table)
+	return table;
+    table = new TranslatorTable(s_factories);
+    table->ref();
+    s_tableMutex.lock();
+    s_table = table;
+    s_tableMutex.unlock();
+    return table;
+}
+
 void DataTranslator::install(TranslatorFactory* factory)
 {
     if (!factory)
@@ -1211,6 +1305,7 @@ void DataTranslator::install(TranslatorFactory* factory)
 	return;
     s_factories.append(factory)->setDelete(false);
     s_compose.append(factory)->setDelete(false);
+    invalidateTable();
 }
 
 void DataTranslator::compose()
@@ -1314,6 +1409,7 @@ void DataTranslator::uninstall(TranslatorFactory* factory)
     s_mutex.lock();
     s_compose.remove(factory,false);
     s_factories.remove(factory,false);
+    invalidateTable();
     // notify chained factories about the removal
     ListIterator iter(s_factories);
     while (TranslatorFactory* f = static_cast<TranslatorFactory*>(iter.get()))
@@ -1326,27 +1422,19 @@ ObjList* DataTranslator::srcFormats(const DataFormat& dFormat, int maxCost, unsi
     const FormatInfo* fi = dFormat.getInfo();
     if (!fi)
 	return lst;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	if (maxLen && (f->length() > maxLen))
+    TranslatorTable* t = table();
+    for (const ObjList* l = t->toDest(fi); l; l = l->skipNext()) {
+	const TranslatorRoute* r = static_cast<const TranslatorRoute*>(l->get());
+	int c = r->cost(maxLen);
+	if ((c < 0) || ((maxCost >= 0) && (c > maxCost)))
 	    continue;
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if (caps->dest == fi) {
-		if ((maxCost >= 0) && (caps->cost > maxCost))
-		    continue;
-		if (!lst)
-		    lst = new ObjList;
-		else if (lst->find(caps->src->name))
-		    continue;
-		lst->append(new String(caps->src->name));
-	    }
-	}
+	if (!lst)
+	    lst = new ObjList;
+	else if (lst->find(r->src()->name))
+	    continue;
+	lst->append(new String(r->src()->name));
     }
-    s_mutex.unlock();
+    TelEngine::destruct(t);
     return lst;
 }
 
@@ -1355,27 +1443,19 @@ ObjList* DataTranslator::destFormats(const DataFormat& sFormat, int maxCost, uns
     const FormatInfo* fi = sFormat.getInfo();
     if (!fi)
 	return lst;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	if (maxLen && (f->length() > maxLen))
+    TranslatorTable* t = table();
+    for (const ObjList* l = t->fromSource(fi); l; l = l->skipNext()) {
+	const TranslatorRoute* r = static_cast<const TranslatorRoute*>(l->get());
+	int c = r->cost(maxLen);
+	if ((c < 0) || ((maxCost >= 0) && (c > maxCost)))
 	    continue;
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if (caps->src == fi) {
-		if ((maxCost >= 0) && (caps->cost > maxCost))
-		    continue;
-		if (!lst)
-		    lst = new ObjList;
-		else if (lst->find(caps->dest->name))
-		    continue;
-		lst->append(new String(caps->dest->name));
-	    }
-	}
+	if (!lst)
+	    lst = new ObjList;
+	else if (lst->find(r->dest()->name))
+	    continue;
+	lst->append(new String(r->dest()->name));
     }
-    s_mutex.unlock();
+    TelEngine::destruct(t);
     return lst;
 }
 
@@ -1408,8 +1488,6 @@ ObjList* DataTranslator::allFormats(const ObjList* formats, bool existing, bool
     if (!formats)
 	return 0;
     ObjList* lst = 0;
-    s_mutex.lock();
-    compose();
     const ObjList* fmts;
     if (existing) {
 	// put existing formats first
@@ -1441,7 +1519,6 @@ ObjList* DataTranslator::allFormats(const ObjList* formats, bool existing, bool
 	for (flist* l = s_flist; l; l = l->next)
 	    mergeOne(lst,formats,fmto,l->info,sameRate,sameChans);
     }
-    s_mutex.unlock();
     return lst;
 }
 
@@ -1463,9 +1540,10 @@ bool DataTranslator::canConvert(const DataFormat& fmt1, const DataFormat& fmt2)
     const FormatInfo* fi2 = fmt2.getInfo();
     if (!(fi1 && fi2))
 	return false;
-    Lock lock(s_mutex);
-    compose();
-    return canConvert(fi1,fi2);
+    TranslatorTable* t = table();
+    bool ok = t->find(fi1,fi2) && t->find(fi2,fi1);
+    TelEngine::destruct(t);
+    return ok;
 }
 
 bool DataTranslator::canConvert(const FormatInfo* fmt1, const FormatInfo* fmt2)
@@ -1491,25 +1569,14 @@ bool DataTranslator::canConvert(const FormatInfo* fmt1, const FormatInfo* fmt2)
 
 int DataTranslator::cost(const DataFormat& sFormat, const DataFormat& dFormat)
 {
-    int c = -1;
     const FormatInfo* src = sFormat.getInfo();
     const FormatInfo* dest = dFormat.getInfo();
     if (!(src && dest))
-	return c;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if ((c == -1) || (c > caps->cost)) {
-		if ((caps->src == src) && (caps->dest == dest))
-		    c = caps->cost;
-	    }
-	}
-    }
-    s_mutex.unlock();
+	return -1;
+    TranslatorTable* t = table();
+    const TranslatorRoute* r = t->find(src,dest);
+    int c = r ? r->cost() : -1;
+    TelEngine::destruct(t);
     return c;
 }
 
@@ -1521,12 +1588,33 @@ DataTranslator* DataTranslator::create(const DataFormat& sFormat, const DataForm
     }
 
     DataTranslator *trans = 0;
+    TranslatorTable* t = 0;
+    const TranslatorRoute* r = 0;
+    const FormatInfo* src = sFormat.getInfo();
+    const FormatInfo* dest = dFormat.getInfo();
+    if (src && dest) {
+	t = table();
+	r = t->find(src,dest);
+	if (!r) {
+	    TelEngine::destruct(t);
+	    Debug(DebugInfo,"No DataTranslator created for '%s' -> '%s'",
+		sFormat.c_str(),dFormat.c_str());
+	    return 0;
+	}
+    }
     bool counting = getObjCounting();
     NamedCounter* saved = Thread::getCurrentObjCounter(counting);
 
+    // hold the mutex while creating so factories are not removed meanwhile
     s_mutex.lock();
-    compose();
-    ObjList *l = s_factories.skipNull();
+    ObjList *l = 0;
+    if (r && (t == s_table))
+	l = r->factories().skipNull();
+    else {
+	// unknown formats or the factories changed since we got the table
+	compose();
+	l = s_factories.skipNull();
+    }
     for (; l; l=l->skipNext()) {
 	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
 	if (counting)
@@ -1539,6 +1627,7 @@ DataTranslator* DataTranslator::create(const DataFormat& sFormat, const DataForm
 	}
     }
     s_mutex.unlock();
+    TelEngine::destruct(t);
     if (counting)
 	Thread::setCurrentObjCounter(saved);
 
@@ -1781,4 +1870,98 @@ DataTranslator* ChainedFactory::create(const DataFormat& sFormat, const DataForm
     return trans2;
 }
 
+
+TranslatorRoute::TranslatorRoute(const FormatInfo* src, const FormatInfo* dest)
+    : m_src(src), m_dest(dest)
+{
+    for (int i = 0; i < ROUTE_MAX_LEN; i++)
+	m_cost[i] = -1;
+}
+
+void TranslatorRoute::add(TranslatorFactory* factory, int cost)
+{
+    if (!m_factories.find(factory))
+	m_factories.append(factory)->setDelete(false);
+    unsigned int len = factory->length();
+    if (len < 1)
+	len = 1;
+    if (len > ROUTE_MAX_LEN)
+	len = ROUTE_MAX_LEN;
+    int& c = m_cost[len - 1];
+    if ((c < 0) || (c > cost))
+	c = cost;
+}
+
+// Cheapest cost of chains up to a given length, -1 if there is none
+int TranslatorRoute::cost(unsigned int maxLen) const
+{
+    if (!maxLen || (maxLen > ROUTE_MAX_LEN))
+	maxLen = ROUTE_MAX_LEN;
+    int c = -1;
+    for (unsigned int i = 0; i < maxLen; i++) {
+	if ((m_cost[i] >= 0) && ((c < 0) || (c > m_cost[i])))
+	    c = m_cost[i];
+    }
+    return c;
+}
+
+
+TranslatorTable::TranslatorTable(const ObjList& factories)
+    : m_bySource(17), m_byDest(17)
+{
+    for (const ObjList* l = factories.skipNull(); l; l = l->skipNext()) {
+	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
+	const TranslatorCaps* caps = f->getCapabilities();
+	for (; caps && caps->src && caps->dest; caps++) {
+	    TranslatorRow* srcRow = row(m_bySource,caps->src);
+	    TranslatorRoute* r = 0;
+	    for (ObjList* o = srcRow->routes().skipNull(); o; o = o->skipNext()) {
+		TranslatorRoute* tmp = static_cast<TranslatorRoute*>(o->get());
+		if (tmp->dest() == caps->dest) {
+		    r = tmp;
+		    break;
+		}
+	    }
+	    if (!r) {
+		r = new TranslatorRoute(caps->src,caps->dest);
+		srcRow->routes().append(r);
+		row(m_byDest,caps->dest)->routes().append(r)->setDelete(false);
+	    }
+	    r->add(f,caps->cost);
+	}
+    }
+}
+
+TranslatorRow* TranslatorTable::row(HashList& list, const FormatInfo* format)
+{
+    TranslatorRow* r = static_cast<TranslatorRow*>(list[format->name]);
+    if (!r) {
+	r = new TranslatorRow(format->name);
+	list.append(r);
+    }
+    return r;
+}
+
+const TranslatorRoute* TranslatorTable::find(const FormatInfo* src, const FormatInfo* dest) const
+{
+    for (const ObjList* l = fromSource(src); l; l = l->skipNext()) {
+	const TranslatorRoute* r = static_cast<const TranslatorRoute*>(l->get());
+	if (r->dest() == dest)
+	    return r;
+    }
+    return 0;
+}
+
+const ObjList* TranslatorTable::fromSource(const FormatInfo* src) const
+{
+    const TranslatorRow* r = static_cast<const TranslatorRow*>(m_bySource[src->name]);
+    return r ? r->routes().skipNull() : 0;
+}
+
+const ObjList* TranslatorTable::toDest(const FormatInfo* dest) const
+{
+    const TranslatorRow* r = static_cast<const TranslatorRow*>(m_byDest[dest->name]);
+    return r ? r->routes().skipNull() : 0;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
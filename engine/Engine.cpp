@@ -88,13 +88,17 @@ namespace TelEngine {
 class EnginePrivate : public Thread
 {
 public:
-    EnginePrivate()
-	: Thread("Engine Worker")
-	{ count++; }
-    ~EnginePrivate()
-	{ count--; }
+    EnginePrivate();
+    ~EnginePrivate();
     virtual void run();
+    static void dispatched(u_int64_t usec);
+    static void check(unsigned int queued);
     static int count;
+    static int idle;
+    static unsigned int dispatchTime;
+private:
+    bool retire();
+    bool m_counted;
 };
 
 class EngineCommand : public MessageHandler
@@ -165,6 +169,10 @@ using namespace TelEngine;
 static u_int64_t s_nextinit = 0;
 static u_int64_t s_restarts = 0;
 static bool s_makeworker = true;
+// Maximum time a worker waits for queued messages, must be well below 1s
+#define WORKER_WAKEUP_USEC 250000
+// Minimum interval between creating demand driven workers
+#define WORKER_GROW_USEC 2000
 static bool s_keepclosing = false;
 static bool s_nounload = false;
 static int s_super_handle = -1;
@@ -223,6 +231,8 @@ Engine* Engine::s_self = 0;
 bool Engine::s_started = false;
 int Engine::s_haltcode = -1;
 int EnginePrivate::count = 0;
+int EnginePrivate::idle = 0;
+unsigned int EnginePrivate::dispatchTime = 0;
 static String s_cfgpath(CFG_PATH);
 static String s_usrpath;
 static bool s_createusr = true;
@@ -231,6 +241,11 @@ static bool s_dynplugin = false;
 static Engine::PluginMode s_loadMode = Engine::LoadFail;
 static int s_minworkers = 1;
 static int s_maxworkers = 10;
+static u_int64_t s_workerIdle = 60000000;
+static u_int64_t s_workerLatency = 20000;
+static u_int64_t s_workerNext = 0;
+static bool s_workerCong = false;
+static Mutex s_workMutex(false,"EngineWorkers");
 static int s_exit = -1;
 unsigned int Engine::s_congestion = 0;
 static Mutex s_congMutex(false,"Congestion");
@@ -490,6 +505,8 @@ bool EngineStatusHandler::received(Message &msg)
 #endif
     msg.retValue() << ",threads=" << Thread::count();
     msg.retValue() << ",workers=" << EnginePrivate::count;
+    msg.retValue() << ",idleworkers=" << EnginePrivate::idle;
+    msg.retValue() << ",dispatchtime=" << EnginePrivate::dispatchTime;
     msg.retValue() << ",mutexes=" << Mutex::count();
     int locks = Mutex::locks();
     if (locks >= 0)
@@ -854,14 +871,104 @@ bool EngineHelp::received(Message &msg)
 }
 
 
+EnginePrivate::EnginePrivate()
+    : Thread("Engine Worker"),
+      m_counted(true)
+{
+    Lock lock(s_workMutex);
+    count++;
+}
+
+EnginePrivate::~EnginePrivate()
+{
+    if (!m_counted)
+	return;
+    Lock lock(s_workMutex);
+    count--;
+}
+
 void EnginePrivate::run()
 {
     setCurrentObjCounter(s_workCnt);
+    MessageDispatcher& disp = Engine::self()->m_dispatcher;
+    u_int64_t busy = Time::now();
     for (;;) {
 	s_makeworker = false;
-	Engine::self()->m_dispatcher.dequeue();
-	Thread::idle(true);
+	for (;;) {
+	    u_int64_t t = Time::now();
+	    if (!disp.dequeueOne())
+		break;
+	    busy = Time::now();
+	    dispatched(busy - t);
+	    check(disp.messageCount());
+	}
+	if (s_workerIdle && ((Time::now() - busy) > s_workerIdle) && retire())
+	    return;
+	s_workMutex.lock();
+	idle++;
+	bool cong = s_workerCong;
+	s_workerCong = false;
+	s_workMutex.unlock();
+	if (cong)
+	    Engine::setCongestion();
+	if (disp.queueSize()) {
+	    // sleep until a message is queued, wake up anyway to signal we're alive
+	    disp.waitMessage(WORKER_WAKEUP_USEC);
+	}
+	else
+	    Thread::idle();
+	s_workMutex.lock();
+	idle--;
+	s_workMutex.unlock();
+	Thread::check(true);
+    }
+}
+
+// Leave the pool if there are more than the minimum number of workers
+bool EnginePrivate::retire()
+{
+    Lock lock(s_workMutex);
+    if (count <= s_minworkers)
+	return false;
+    count--;
+    m_counted = false;
+    lock.drop();
+    Debug(DebugInfo,"Removing idle message dispatching thread (%d left)",count);
+    return true;
+}
+
+// Update the average time taken to dispatch a queued message
+void EnginePrivate::dispatched(u_int64_t usec)
+{
+    // statistics only, a lost update is harmless
+    dispatchTime = (unsigned int)((7 * (u_int64_t)dispatchTime + usec) / 8);
+}
+
+// Create a worker if the queued messages are expected to wait too long
+void EnginePrivate::check(unsigned int queued)
+{
+    if (idle || !s_workerLatency || !count)
+	return;
+    u_int64_t wait = (u_int64_t)queued * (dispatchTime ? dispatchTime : 1) / count;
+    if (wait < s_workerLatency)
+	return;
+    u_int64_t now = Time::now();
+    Lock lock(s_workMutex);
+    if (idle || (now < s_workerNext))
+	return;
+    s_workerNext = now + WORKER_GROW_USEC;
+    if (count >= s_maxworkers) {
+	if (s_workerCong)
+	    return;
+	s_workerCong = true;
+	lock.drop();
+	Engine::setCongestion("All message dispatching threads are busy");
+	return;
     }
+    lock.drop();
+    DDebug(DebugInfo,"Creating message dispatching thread for %u queued messages (%d running)",
+	queued,count);
+    (new EnginePrivate)->startup();
 }
 
 
@@ -1439,7 +1546,10 @@ int Engine::engineInit()
 	s_modpath = modPath;
     s_minworkers = s_cfg.getIntValue("general","minworkers",s_minworkers,1,25);
     s_maxworkers = s_cfg.getIntValue("general","maxworkers",s_maxworkers,s_minworkers);
+    s_workerIdle = 1000000 * (u_int64_t)s_cfg.getIntValue("general","workeridle",60,0);
+    s_workerLatency = 1000 * (u_int64_t)s_cfg.getIntValue("general","workerlatency",20,0);
     s_maxevents = s_cfg.getIntValue("general","maxevents",s_maxevents);
+    m_dispatcher.queueSize(s_cfg.getIntValue("general","queuesize",0,0,1048576));
     s_restarts = s_cfg.getIntValue("general","restarts");
     m_dispatcher.warnTime(1000*(u_int64_t)s_cfg.getIntValue("general","warntime"));
     extraPath(clientMode() ? "client" : "server");
@@ -1467,7 +1577,10 @@ int Engine::engineInit()
 #endif
     s_params.addParam("minworkers",String(s_minworkers));
     s_params.addParam("maxworkers",String(s_maxworkers));
+    s_params.addParam("workeridle",String((unsigned int)(s_workerIdle / 1000000)));
+    s_params.addParam("workerlatency",String((unsigned int)(s_workerLatency / 1000)));
     s_params.addParam("maxevents",String(s_maxevents));
+    s_params.addParam("queuesize",String(m_dispatcher.queueSize()));
     if (track)
 	s_params.addParam("trackparam",track);
 #ifdef _WINDOWS
@@ -2033,7 +2146,20 @@ bool Engine::enqueue(Message* msg, bool skipHooks)
 	    return true;
 	}
     }
-    return s_self ? s_self->m_dispatcher.enqueue(msg) : false;
+    if (!(s_self && s_self->m_dispatcher.enqueue(msg)))
+	return false;
+    EnginePrivate::check(s_self->m_dispatcher.messageCount());
+    return true;
+}
+
+bool Engine::suspend(Message& msg)
+{
+    return s_self && s_self->m_dispatcher.suspend(msg);
+}
+
+bool Engine::resume(Message* msg, bool handled)
+{
+    return msg && s_self && s_self->m_dispatcher.resume(msg,handled);
 }
 
 bool Engine::dispatch(Message* msg)
@@ -24,7 +24,7 @@
 using namespace TelEngine;
 
 HashList::HashList(unsigned int size)
-    : m_size(size), m_lists(0)
+    : m_size(size), m_lists(0), m_generation(0)
 {
     XDebug(DebugAll,"HashList::HashList(%u) [%p]",size,this);
     if (m_size < 1)
@@ -117,6 +117,8 @@ GenObject* HashList::remove(GenObject* obj, bool delobj, bool useHash)
 void HashList::clear()
 {
     XDebug(DebugAll,"HashList::clear() [%p]",this);
+    // Iterators must not look at the destroyed lists any more
+    m_generation++;
     for (unsigned int i = 0; i < m_size; i++)
 	TelEngine::destruct(m_lists[i]);
 }
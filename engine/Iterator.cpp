@@ -21,14 +21,27 @@
 
 using namespace TelEngine;
 
+// State of a list iterator image item after the list changed
+enum {
+    ItemPresent = 0,                     // Object is in the list once
+    ItemGone,                            // Object is no longer in the list
+    ItemMultiple,                        // Object is in the list more than once
+};
+
+static inline unsigned int objHash(const GenObject* obj)
+{
+    unsigned long val = (unsigned long)obj;
+    return (unsigned int)((val >> 4) ^ (val >> 16)) * 2654435761U;
+}
+
 ListIterator::ListIterator(ObjList& list, int offset)
-    : m_objects(0), m_hashes(0)
+    : m_objects(0), m_hashes(0), m_generations(0), m_index(0), m_indexMask(0), m_states(0)
 {
     assign(list,offset);
 }
 
 ListIterator::ListIterator(HashList& list, int offset)
-    : m_objects(0), m_hashes(0)
+    : m_objects(0), m_hashes(0), m_generations(0), m_index(0), m_indexMask(0), m_states(0)
 {
     assign(list,offset);
 }
@@ -39,6 +52,12 @@ ListIterator::~ListIterator()
     delete[] m_objects;
     if (m_hashes)
 	delete[] m_hashes;
+    if (m_generations)
+	delete[] m_generations;
+    if (m_index)
+	delete[] m_index;
+    if (m_states)
+	delete[] m_states;
 }
 
 void ListIterator::clear()
@@ -55,12 +74,28 @@ void ListIterator::clear()
 	m_hashes = 0;
 	delete[] tmph;
     }
+    if (m_generations) {
+	unsigned int* tmpg = m_generations;
+	m_generations = 0;
+	delete[] tmpg;
+    }
+    if (m_index) {
+	unsigned int* tmpi = m_index;
+	m_index = 0;
+	delete[] tmpi;
+    }
+    if (m_states) {
+	unsigned char* tmps = m_states;
+	m_states = 0;
+	delete[] tmps;
+    }
 }
 
 void ListIterator::assign(ObjList& list, int offset)
 {
     clear();
     m_objList = &list;
+    m_generation = list.generation();
     m_length = list.count();
     if (!m_length)
 	return;
@@ -80,11 +115,13 @@ void ListIterator::assign(HashList& list, int offset)
 {
     clear();
     m_hashList = &list;
+    m_generation = list.generation();
     m_length = list.count();
     if (!m_length)
 	return;
     m_objects = new GenObject* [m_length];
     m_hashes = new unsigned int[m_length];
+    m_generations = new unsigned int[m_length];
     offset = (m_length - offset) % m_length;
     unsigned int i = 0;
     for (unsigned int n = 0; n < list.length(); n++) {
@@ -97,6 +134,7 @@ void ListIterator::assign(HashList& list, int offset)
 	    unsigned int idx = ((i++) + offset) % m_length;
 	    m_objects[idx] = l->get();
 	    m_hashes[idx] = l->get()->toString().hash();
+	    m_generations[idx] = l->generation();
 	}
     }
     while (i < m_length)
@@ -111,16 +149,100 @@ GenObject* ListIterator::get(unsigned int index) const
     if (!obj)
 	return 0;
     if (m_objList) {
-	if (m_objList->find(obj) && obj->alive())
+	if (m_objList->generation() != m_generation)
+	    revalidate();
+	if ((!m_states || (m_states[index] != ItemGone)) && obj->alive())
 	    return obj;
     }
     else if (m_hashList) {
+	// Each hash bucket keeps its own generation, they are short anyway
+	//  so just search the bucket if it changed
+	if (m_hashList->generation() == m_generation) {
+	    ObjList* l = m_hashList->getHashList(m_hashes[index]);
+	    if (l && (l->generation() == m_generations[index]))
+		return obj->alive() ? obj : 0;
+	}
 	if (m_hashList->find(obj,m_hashes[index]) && obj->alive())
 	    return obj;
     }
     return 0;
 }
 
+// The list was modified, update the state of image items
+// Image indexes are kept in a table hashed by object address, built on the
+//  first change, so a single addition or removal since the last check costs
+//  a lookup and any other change a single pass through the list
+void ListIterator::revalidate() const
+{
+    unsigned int gen = m_objList->generation();
+    bool single = (gen == m_generation + 1);
+    m_generation = gen;
+    if (!m_index) {
+	unsigned int size = 16;
+	while (size < 2 * m_length)
+	    size <<= 1;
+	m_indexMask = size - 1;
+	m_index = new unsigned int[size];
+	for (unsigned int i = 0; i < size; i++)
+	    m_index[i] = m_length;
+	m_states = new unsigned char[m_length];
+	for (unsigned int i = 0; i < m_length; i++) {
+	    m_states[i] = ItemPresent;
+	    if (!m_objects[i])
+		continue;
+	    unsigned int s = objHash(m_objects[i]) & m_indexMask;
+	    while (m_index[s] < m_length)
+		s = (s + 1) & m_indexMask;
+	    m_index[s] = i;
+	}
+    }
+    const ObjList* head = m_objList->headConst();
+    GenObject* obj = head->m_changed;
+    if (single && obj) {
+	// Only the state of the changed object may be different
+	unsigned int idx = m_length;
+	unsigned int n = 0;
+	for (unsigned int s = objHash(obj) & m_indexMask; m_index[s] < m_length; s = (s + 1) & m_indexMask) {
+	    if (m_objects[m_index[s]] == obj) {
+		idx = m_index[s];
+		n++;
+	    }
+	}
+	if (!n)
+	    return;
+	if (n == 1) {
+	    unsigned char& st = m_states[idx];
+	    if (head->m_added) {
+		// Added back or once more
+		st = (st == ItemGone) ? ItemPresent : ItemMultiple;
+		return;
+	    }
+	    if (st == ItemPresent) {
+		st = ItemGone;
+		return;
+	    }
+	}
+	// Object is more than once in image or list, count its copies
+    }
+    unsigned int* found = new unsigned int[m_length];
+    for (unsigned int i = 0; i < m_length; i++)
+	found[i] = 0;
+    for (ObjList* l = m_objList->skipNull(); l; l = l->skipNext()) {
+	GenObject* o = l->get();
+	for (unsigned int s = objHash(o) & m_indexMask; m_index[s] < m_length; s = (s + 1) & m_indexMask) {
+	    if (m_objects[m_index[s]] == o)
+		found[m_index[s]]++;
+	}
+    }
+    for (unsigned int i = 0; i < m_length; i++) {
+	if (!found[i])
+	    m_states[i] = ItemGone;
+	else
+	    m_states[i] = (found[i] > 1) ? ItemMultiple : ItemPresent;
+    }
+    delete[] found;
+}
+
 GenObject* ListIterator::get()
 {
     while (m_current < m_length) {
@@ -22,6 +22,9 @@
 
 using namespace TelEngine;
 
+// Maximum number of pending wakeups of threads waiting for queued messages
+#define MSG_QUEUE_WAKEUPS 256
+
 class QueueWorker : public GenObject, public Thread
 {
 public:
@@ -35,9 +38,19 @@ private:
     RefPointer<MessageQueue> m_queue;
 };
 
+// Suspend state of a message being dispatched
+enum {
+    NotSuspendable = 0,
+    Suspendable,
+    Suspending,
+    Suspended,
+    Resumed
+};
+
 Message::Message(const char* name, const char* retval, bool broadcast)
     : NamedList(name),
-      m_return(retval), m_data(0), m_notify(false), m_broadcast(broadcast)
+      m_return(retval), m_data(0), m_notify(false), m_broadcast(broadcast), m_queued(false),
+      m_handled(false), m_suspend(0), m_resumePrio(0), m_resumeAddr(0)
 {
     XDebug(DebugAll,"Message::Message(\"%s\",\"%s\",%s) [%p]",
 	name,retval,String::boolText(broadcast),this);
@@ -46,7 +59,8 @@ Message::Message(const char* name, const char* retval, bool broadcast)
 Message::Message(const Message& original)
     : NamedList(original),
       m_return(original.retValue()), m_time(original.msgTime()),
-      m_data(0), m_notify(false), m_broadcast(original.broadcast())
+      m_data(0), m_notify(false), m_broadcast(original.broadcast()), m_queued(false),
+      m_handled(false), m_suspend(0), m_resumePrio(0), m_resumeAddr(0)
 {
     XDebug(DebugAll,"Message::Message(&%p) [%p]",&original,this);
 }
@@ -54,7 +68,8 @@ Message::Message(const Message& original)
 Message::Message(const Message& original, bool broadcast)
     : NamedList(original),
       m_return(original.retValue()), m_time(original.msgTime()),
-      m_data(0), m_notify(false), m_broadcast(broadcast)
+      m_data(0), m_notify(false), m_broadcast(broadcast), m_queued(false),
+      m_handled(false), m_suspend(0), m_resumePrio(0), m_resumeAddr(0)
 {
     XDebug(DebugAll,"Message::Message(&%p,%s) [%p]",
 	&original,String::boolText(broadcast),this);
@@ -295,9 +310,68 @@ bool MessageRelay::receivedInternal(Message& msg)
 }
 
 
+// List of handlers for the same message name, sorted by priority
+class HandlerBucket : public String
+{
+public:
+    inline explicit HandlerBucket(const String& name)
+	: String(name)
+	{ }
+    inline ObjList& handlers()
+	{ return m_handlers; }
+private:
+    ObjList m_handlers;
+};
+
+// Check if a handler is placed before a priority and address position
+static inline bool handlerBefore(const MessageHandler* h, unsigned int prio, const void* addr)
+{
+    return (h->priority() < prio) || ((h->priority() == prio) && ((const void*)h < addr));
+}
+
+// Insert a handler in a list sorted by priority, equal priority sorted by address
+static ObjList* insertHandler(ObjList& list, MessageHandler* handler, bool autoDelete = true)
+{
+    unsigned int p = handler->priority();
+    int pos = 0;
+    ObjList* l = list.skipNull();
+    for (; l; l = l->skipNext(), pos++) {
+	if (!handlerBefore(static_cast<MessageHandler*>(l->get()),p,handler))
+	    break;
+    }
+    if (l) {
+	XDebug(DebugAll,"Inserting handler [%p] on place #%d",handler,pos);
+	l = l->insert(handler);
+    }
+    else {
+	XDebug(DebugAll,"Appending handler [%p] on place #%d",handler,pos);
+	l = list.append(handler);
+    }
+    l->setDelete(autoDelete);
+    return l;
+}
+
+// Find the first handler in a sorted list placed after a priority and address
+static ObjList* skipHandlers(ObjList* list, unsigned int prio, const void* addr)
+{
+    for (list = list ? list->skipNull() : 0; list; list = list->skipNext()) {
+	if (!handlerBefore(static_cast<MessageHandler*>(list->get()),prio,addr)) {
+	    if (list->get() == addr)
+		list = list->skipNext();
+	    break;
+	}
+    }
+    return list;
+}
+
+
 MessageDispatcher::MessageDispatcher(const char* trackParam)
     : Mutex(false,"MessageDispatcher"),
+      m_index(64),
+      m_msgMutex(false,"MessageQueue"),
+      m_msgSemaphore(MSG_QUEUE_WAKEUPS,"MessageQueue"),
       m_hookMutex(false,"PostHooks"),
+      m_ring(0), m_ringSize(0), m_ringHead(0), m_ringCount(0), m_msgCount(0),
       m_msgAppend(&m_messages), m_hookAppend(&m_hooks),
       m_trackParam(trackParam), m_changes(0), m_warnTime(0),
       m_hookCount(0), m_hookHole(false)
@@ -311,6 +385,7 @@ MessageDispatcher::~MessageDispatcher()
     lock();
     clear();
     unlock();
+    queueSize(0);
 }
 
 bool MessageDispatcher::install(MessageHandler* handler)
@@ -319,31 +394,19 @@ bool MessageDispatcher::install(MessageHandler* handler)
     if (!handler)
 	return false;
     Lock lock(this);
-    ObjList *l = m_handlers.find(handler);
-    if (l)
+    if (m_handlers.find(handler))
 	return false;
-    unsigned p = handler->priority();
-    int pos = 0;
-    for (l=&m_handlers; l; l=l->next(),pos++) {
-	MessageHandler *h = static_cast<MessageHandler *>(l->get());
-	if (!h)
-	    continue;
-	if (h->priority() < p)
-	    continue;
-	if (h->priority() > p)
-	    break;
-	// at the same priority we sort them in pointer address order
-	if (h > handler)
-	    break;
-    }
     m_changes++;
-    if (l) {
-	XDebug(DebugAll,"Inserting handler [%p] on place #%d",handler,pos);
-	l->insert(handler);
-    }
+    insertHandler(m_handlers,handler);
+    if (handler->null())
+	insertHandler(m_wildcards,handler,false);
     else {
-	XDebug(DebugAll,"Appending handler [%p] on place #%d",handler,pos);
-	m_handlers.append(handler);
+	HandlerBucket* b = static_cast<HandlerBucket*>(m_index[*handler]);
+	if (!b) {
+	    b = new HandlerBucket(*handler);
+	    m_index.append(b);
+	}
+	insertHandler(b->handlers(),handler,false);
     }
     handler->m_dispatcher = this;
     if (handler->null())
@@ -358,6 +421,24 @@ bool MessageDispatcher::uninstall(MessageHandler* handler)
     handler = static_cast<MessageHandler *>(m_handlers.remove(handler,false));
     if (handler) {
 	m_changes++;
+	if (!m_wildcards.remove(handler,false)) {
+	    HandlerBucket* b = static_cast<HandlerBucket*>(m_index[*handler]);
+	    if (!(b && b->handlers().remove(handler,false))) {
+		// handler name was changed after install - search all buckets
+		b = 0;
+		for (unsigned int i = 0; !b && i < m_index.length(); i++) {
+		    for (ObjList* l = m_index.getList(i); l; l = l->next()) {
+			HandlerBucket* hb = static_cast<HandlerBucket*>(l->get());
+			if (hb && hb->handlers().remove(handler,false)) {
+			    b = hb;
+			    break;
+			}
+		    }
+		}
+	    }
+	    if (b && !b->handlers().skipNull())
+		m_index.remove(b,true,true);
+	}
 	if (handler->m_unsafe > 0) {
 	    DDebug(DebugNote,"Waiting for unsafe MessageHandler %p '%s'",
 		handler,handler->c_str());
@@ -377,6 +458,12 @@ bool MessageDispatcher::uninstall(MessageHandler* handler)
 }
 
 bool MessageDispatcher::dispatch(Message& msg)
+{
+    return dispatchInternal(msg,0);
+}
+
+// Dispatch a message, it may be suspended only if dispatched from the queue
+bool MessageDispatcher::dispatchInternal(Message& msg, bool* suspended)
 {
 #ifdef XDEBUG
     Debugger debug("MessageDispatcher::dispatch","(%p) (\"%s\")",&msg,msg.c_str());
@@ -387,76 +474,105 @@ bool MessageDispatcher::dispatch(Message& msg)
     bool retv = false;
     bool counting = getObjCounting();
     NamedCounter* saved = Thread::getCurrentObjCounter(counting);
-    ObjList *l = &m_handlers;
+    // a synchronous dispatch from a handler must not alter the outer state
+    int state = msg.m_suspend;
+    msg.m_suspend = suspended ? Suspendable : NotSuspendable;
     Lock mylock(this);
-    for (; l; l=l->next()) {
-	MessageHandler *h = static_cast<MessageHandler*>(l->get());
-	if (h && (h->null() || *h == msg)) {
-	    if (h->filter() && (*(h->filter()) != msg.getValue(h->filter()->name())))
-		continue;
-	    if (counting)
-		Thread::setCurrentObjCounter(h->objectsCounter());
-
-	    unsigned int c = m_changes;
-	    unsigned int p = h->priority();
-	    if (trackParam() && h->trackName()) {
-		NamedString* tracked = msg.getParam(trackParam());
-		if (tracked)
-		    tracked->append(h->trackName(),",");
-		else
-		    msg.addParam(trackParam(),h->trackName());
-	    }
-	    // mark handler as unsafe to destroy / uninstall
-	    h->m_unsafe++;
-	    mylock.drop();
-
-	    u_int64_t tm = m_warnTime ? Time::now() : 0;
-
-	    retv = h->receivedInternal(msg) || retv;
-
-	    if (tm) {
-		tm = Time::now() - tm;
-		if (tm > m_warnTime) {
-		    mylock.acquire(this);
-		    const char* name = (c == m_changes) ? h->trackName().c_str() : 0;
-		    Debug(DebugInfo,"Message '%s' [%p] passed through %p%s%s%s in " FMT64U " usec",
-			msg.c_str(),&msg,h,
-			(name ? " '" : ""),(name ? name : ""),(name ? "'" : ""),tm);
-		}
+    // walk the handlers for this name and the broadcast ones in priority order
+    HandlerBucket* b = static_cast<HandlerBucket*>(m_index[msg]);
+    ObjList* n = 0;
+    ObjList* w = 0;
+    if (msg.m_resumeAddr) {
+	// resumed message - continue after the handler that suspended it
+	retv = msg.m_handled;
+	if (!retv || msg.broadcast()) {
+	    n = skipHandlers(b ? &b->handlers() : 0,msg.m_resumePrio,msg.m_resumeAddr);
+	    w = skipHandlers(&m_wildcards,msg.m_resumePrio,msg.m_resumeAddr);
+	}
+	msg.m_resumeAddr = 0;
+    }
+    else {
+	n = b ? b->handlers().skipNull() : 0;
+	w = m_wildcards.skipNull();
+    }
+    while (n || w) {
+	MessageHandler* h = 0;
+	if (n && !(w && handlerBefore(static_cast<MessageHandler*>(w->get()),
+		static_cast<MessageHandler*>(n->get())->priority(),n->get()))) {
+	    h = static_cast<MessageHandler*>(n->get());
+	    n = n->skipNext();
+	}
+	else {
+	    h = static_cast<MessageHandler*>(w->get());
+	    w = w->skipNext();
+	}
+	if (h->filter() && (*(h->filter()) != msg.getValue(h->filter()->name())))
+	    continue;
+	if (counting)
+	    Thread::setCurrentObjCounter(h->objectsCounter());
+
+	unsigned int c = m_changes;
+	unsigned int p = h->priority();
+	if (trackParam() && h->trackName()) {
+	    NamedString* tracked = msg.getParam(trackParam());
+	    if (tracked)
+		tracked->append(h->trackName(),",");
+	    else
+		msg.addParam(trackParam(),h->trackName());
+	}
+	// mark handler as unsafe to destroy / uninstall
+	h->m_unsafe++;
+	mylock.drop();
+
+	u_int64_t tm = m_warnTime ? Time::now() : 0;
+
+	retv = h->receivedInternal(msg) || retv;
+
+	if (suspended && (msg.m_suspend > Suspendable)) {
+	    // the message stays valid until we mark it as suspended
+	    Lock lck(m_msgMutex);
+	    if (msg.m_suspend == Suspending) {
+		msg.m_suspend = Suspended;
+		msg.m_handled = retv;
+		msg.m_resumePrio = p;
+		msg.m_resumeAddr = h;
+		lck.drop();
+		if (counting)
+		    Thread::setCurrentObjCounter(saved);
+		*suspended = true;
+		return false;
 	    }
+	    // already resumed by the handler, just go on
+	    msg.m_suspend = Suspendable;
+	    retv = msg.m_handled || retv;
+	}
 
-	    if (retv && !msg.broadcast())
-		break;
-	    mylock.acquire(this);
-	    if (c == m_changes)
-		continue;
-	    // the handler list has changed - find again
-	    NDebug(DebugAll,"Rescanning handler list for '%s' [%p] at priority %u",
-		msg.c_str(),&msg,p);
-	    ObjList* l2 = &m_handlers;
-	    for (l = l2; l; l=l->next()) {
-		MessageHandler *mh = static_cast<MessageHandler*>(l->get());
-		if (!mh)
-		    continue;
-		if (mh == h)
-		    // exact match - silently continue where we left
-		    break;
-
-		// gone past last handler priority - exit with last handler
-		if ((mh->priority() > p) || ((mh->priority() == p) && (mh > h))) {
-		    Debug(DebugAll,"Handler list for '%s' [%p] changed, skipping from %p (%u) to %p (%u)",
-			msg.c_str(),&msg,h,p,mh,mh->priority());
-		    // l will advance in the outer for loop so use previous
-		    l = l2;
-		    break;
-		}
-		l2 = l;
+	if (tm) {
+	    tm = Time::now() - tm;
+	    if (tm > m_warnTime) {
+		mylock.acquire(this);
+		const char* name = (c == m_changes) ? h->trackName().c_str() : 0;
+		Debug(DebugInfo,"Message '%s' [%p] passed through %p%s%s%s in " FMT64U " usec",
+		    msg.c_str(),&msg,h,
+		    (name ? " '" : ""),(name ? name : ""),(name ? "'" : ""),tm);
 	    }
-	    if (!l)
-		break;
 	}
+
+	if (retv && !msg.broadcast())
+	    break;
+	mylock.acquire(this);
+	if (c == m_changes)
+	    continue;
+	// the handler lists have changed - find again where we left
+	NDebug(DebugAll,"Rescanning handler list for '%s' [%p] at priority %u",
+	    msg.c_str(),&msg,p);
+	b = static_cast<HandlerBucket*>(m_index[msg]);
+	n = skipHandlers(b ? &b->handlers() : 0,p,h);
+	w = skipHandlers(&m_wildcards,p,h);
     }
     mylock.drop();
+    if (!suspended)
+	msg.m_suspend = state;
     if (counting)
 	Thread::setCurrentObjCounter(msg.getObjCounter());
     msg.dispatched(retv);
@@ -480,6 +596,7 @@ bool MessageDispatcher::dispatch(Message& msg)
     }
 
     m_hookMutex.lock();
+    ObjList* l;
     if (m_hookHole && !m_hookCount) {
 	// compact the list, remove the holes
 	for (l = &m_hooks; l; l = l->next()) {
@@ -515,37 +632,135 @@ bool MessageDispatcher::dispatch(Message& msg)
 
 bool MessageDispatcher::enqueue(Message* msg)
 {
-    Lock lock(this);
-    if (!msg || m_messages.find(msg))
+    if (!msg)
 	return false;
-    m_msgAppend = m_msgAppend->append(msg);
+    Lock lock(m_msgMutex);
+    if (msg->m_queued)
+	return false;
+    msg->m_queued = true;
+    // use the ring only if no older message is waiting in the list
+    if ((m_ringCount < m_ringSize) && (m_ringCount == m_msgCount))
+	m_ring[(m_ringHead + m_ringCount++) % m_ringSize] = msg;
+    else
+	m_msgAppend = m_msgAppend->append(msg);
+    m_msgCount++;
+    bool wake = (m_ring != 0);
+    lock.drop();
+    if (wake)
+	m_msgSemaphore.unlock();
     return true;
 }
 
-bool MessageDispatcher::dequeueOne()
+// Remove the first message from the waiting list, call with queue locked
+Message* MessageDispatcher::popMessage()
 {
-    lock();
     if (m_messages.next() == m_msgAppend)
 	m_msgAppend = &m_messages;
-    Message* msg = static_cast<Message *>(m_messages.remove(false));
-    unlock();
+    return static_cast<Message *>(m_messages.remove(false));
+}
+
+bool MessageDispatcher::dequeueOne()
+{
+    Message* msg = 0;
+    m_msgMutex.lock();
+    if (m_ringCount) {
+	msg = m_ring[m_ringHead];
+	m_ring[m_ringHead] = 0;
+	m_ringHead = (m_ringHead + 1) % m_ringSize;
+	m_ringCount--;
+	// keep FIFO order by moving the oldest listed message in the ring
+	if (m_msgCount > m_ringCount + 1)
+	    m_ring[(m_ringHead + m_ringCount++) % m_ringSize] = popMessage();
+    }
+    else if (m_msgCount)
+	msg = popMessage();
+    if (msg) {
+	msg->m_queued = false;
+	m_msgCount--;
+    }
+    m_msgMutex.unlock();
     if (!msg)
 	return false;
-    dispatch(*msg);
-    msg->destruct();
+    bool suspended = false;
+    dispatchInternal(*msg,&suspended);
+    // a suspended message is now owned by the handler that will resume it
+    if (!suspended)
+	msg->destruct();
+    return true;
+}
+
+bool MessageDispatcher::suspend(Message& msg)
+{
+    Lock lock(m_msgMutex);
+    if (msg.m_suspend != Suspendable)
+	return false;
+    msg.m_suspend = Suspending;
     return true;
 }
 
+bool MessageDispatcher::resume(Message* msg, bool handled)
+{
+    if (!msg)
+	return false;
+    Lock lock(m_msgMutex);
+    switch (msg->m_suspend) {
+	case Suspending:
+	    // still inside the handler, the dispatching thread will continue
+	    msg->m_suspend = Resumed;
+	    msg->m_handled = handled;
+	    return true;
+	case Suspended:
+	    msg->m_suspend = NotSuspendable;
+	    msg->m_handled = msg->m_handled || handled;
+	    break;
+	default:
+	    return false;
+    }
+    lock.drop();
+    return enqueue(msg);
+}
+
 void MessageDispatcher::dequeue()
 {
     while (dequeueOne())
 	;
 }
 
+void MessageDispatcher::queueSize(unsigned int slots)
+{
+    Lock lock(m_msgMutex);
+    if (slots == m_ringSize)
+	return;
+    // collect all waiting messages in their queued order
+    ObjList tmp;
+    ObjList* app = &tmp;
+    unsigned int n = m_msgCount - m_ringCount;
+    for (; m_ringCount; m_ringCount--) {
+	app = app->append(m_ring[m_ringHead]);
+	m_ringHead = (m_ringHead + 1) % m_ringSize;
+    }
+    for (; n; n--)
+	app = app->append(popMessage());
+    delete[] m_ring;
+    m_ring = slots ? new Message*[slots] : 0;
+    m_ringSize = slots;
+    m_ringHead = 0;
+    while (Message* msg = static_cast<Message*>(tmp.remove(false))) {
+	if (m_ringCount < m_ringSize)
+	    m_ring[m_ringCount++] = msg;
+	else
+	    m_msgAppend = m_msgAppend->append(msg);
+    }
+}
+
+bool MessageDispatcher::waitMessage(long maxwait)
+{
+    return m_ring && m_msgSemaphore.lock(maxwait);
+}
+
 unsigned int MessageDispatcher::messageCount()
 {
-    Lock lock(this);
-    return m_messages.count();
+    return m_msgCount;
 }
 
 unsigned int MessageDispatcher::handlerCount()
@@ -22,6 +22,15 @@
 
 using namespace TelEngine;
 
+#ifndef ATOMIC_OPS
+// Header line parameters parsing mutex pool array size
+#ifndef MIMEPARAMS_MUTEX_COUNT
+#define MIMEPARAMS_MUTEX_COUNT 47
+#endif
+
+static MutexPool s_paramsMutex(MIMEPARAMS_MUTEX_COUNT,false,"MimeParams");
+#endif
+
 // Utility function, checks if a character is a folded line continuation
 static bool isContinuationBlank(char c)
 {
@@ -32,7 +41,7 @@ static bool isContinuationBlank(char c)
  * MimeHeaderLine
  */
 MimeHeaderLine::MimeHeaderLine(const char* name, const String& value, char sep)
-    : NamedString(name), m_separator(sep ? sep : ';')
+    : NamedString(name), m_separator(sep ? sep : ';'), m_parseState(0)
 {
     if (value.null())
 	return;
@@ -44,39 +53,18 @@ MimeHeaderLine::MimeHeaderLine(const char* name, const String& value, char sep)
     }
     assign(value,sp);
     trimBlanks();
-    while (sp < (int)value.length()) {
-	int ep = findSep(value,m_separator,sp+1);
-	if (ep <= sp)
-	    ep = value.length();
-	int eq = value.find('=',sp+1);
-	if ((eq > 0) && (eq < ep)) {
-	    String pname(value.substr(sp+1,eq-sp-1));
-	    String pvalue(value.substr(eq+1,ep-eq-1));
-	    pname.trimBlanks();
-	    pvalue.trimBlanks();
-	    if (!pname.null()) {
-		XDebug(DebugAll,"hdr param name='%s' value='%s'",pname.c_str(),pvalue.c_str());
-		m_params.append(new NamedString(pname,pvalue));
-	    }
-	}
-	else {
-	    String pname(value.substr(sp+1,ep-sp-1));
-	    pname.trimBlanks();
-	    if (!pname.null()) {
-		XDebug(DebugAll,"hdr param name='%s' (no value)",pname.c_str());
-		m_params.append(new NamedString(pname));
-	    }
-	}
-	sp = ep;
-    }
+    // parameters are split only when somebody asks for them
+    setRawParams(value.c_str() + sp);
 }
 
 MimeHeaderLine::MimeHeaderLine(const MimeHeaderLine& original, const char* newName)
     : NamedString(newName ? newName : original.name().c_str(),original),
-      m_separator(original.separator())
+      m_separator(original.separator()), m_parseState(0)
 {
     XDebug(DebugAll,"MimeHeaderLine::MimeHeaderLine(%p '%s') [%p]",&original,name().c_str(),this);
-    const ObjList* l = &original.params();
+    // copies may be handed to other threads so they always start parsed
+    original.checkParams();
+    const ObjList* l = &original.m_params;
     for (; l; l = l->next()) {
 	const NamedString* t = static_cast<const NamedString*>(l->get());
 	if (t)
@@ -101,8 +89,75 @@ MimeHeaderLine* MimeHeaderLine::clone(const char* newName) const
     return new MimeHeaderLine(*this,newName);
 }
 
+void MimeHeaderLine::parseRaw()
+{
+    // Lines may be read from several threads, only the one that moves the
+    //  state from not parsed to being parsed touches the raw text
+#ifdef ATOMIC_OPS
+#ifdef _WINDOWS
+    if (InterlockedCompareExchange((LONG*)&m_parseState,2,1) != 1) {
+#else
+    if (!__sync_bool_compare_and_swap(&m_parseState,1,2)) {
+#endif
+	while (m_parseState)
+	    Thread::yield();
+#ifdef _WINDOWS
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+	return;
+    }
+    parseParams(m_rawParams);
+    m_rawParams.clear();
+#ifdef _WINDOWS
+    InterlockedExchange((LONG*)&m_parseState,0);
+#else
+    __sync_lock_release(&m_parseState);
+#endif
+#else
+    Lock lock(s_paramsMutex.mutex(this));
+    if (!m_parseState)
+	return;
+    parseParams(m_rawParams);
+    m_rawParams.clear();
+    m_parseState = 0;
+#endif
+}
+
+void MimeHeaderLine::parseParams(const String& text)
+{
+    int sp = 0;
+    while (sp < (int)text.length()) {
+	int ep = findSep(text,m_separator,sp+1);
+	if (ep <= sp)
+	    ep = text.length();
+	int eq = text.find('=',sp+1);
+	if ((eq > 0) && (eq < ep)) {
+	    String pname(text.substr(sp+1,eq-sp-1));
+	    String pvalue(text.substr(eq+1,ep-eq-1));
+	    pname.trimBlanks();
+	    pvalue.trimBlanks();
+	    if (!pname.null()) {
+		XDebug(DebugAll,"hdr param name='%s' value='%s'",pname.c_str(),pvalue.c_str());
+		m_params.append(new NamedString(pname,pvalue));
+	    }
+	}
+	else {
+	    String pname(text.substr(sp+1,ep-sp-1));
+	    pname.trimBlanks();
+	    if (!pname.null()) {
+		XDebug(DebugAll,"hdr param name='%s' (no value)",pname.c_str());
+		m_params.append(new NamedString(pname));
+	    }
+	}
+	sp = ep;
+    }
+}
+
 void MimeHeaderLine::buildLine(String& line, bool header) const
 {
+    checkParams();
     if (header)
 	line << name() << ": ";
     line << *this;
@@ -121,6 +176,7 @@ const NamedString* MimeHeaderLine::getParam(const char* name) const
 {
     if (!(name && *name))
 	return 0;
+    checkParams();
     const ObjList* l = &m_params;
     for (; l; l = l->next()) {
 	const NamedString* t = static_cast<const NamedString*>(l->get());
@@ -132,6 +188,7 @@ const NamedString* MimeHeaderLine::getParam(const char* name) const
 
 void MimeHeaderLine::setParam(const char* name, const char* value)
 {
+    checkParams();
     ObjList* p = m_params.find(name);
     if (p)
 	*static_cast<NamedString*>(p->get()) = value;
@@ -141,6 +198,7 @@ void MimeHeaderLine::setParam(const char* name, const char* value)
 
 void MimeHeaderLine::delParam(const char* name)
 {
+    checkParams();
     ObjList* p = m_params.find(name);
     if (p)
 	p->remove();
@@ -275,20 +333,43 @@ MimeAuthLine::MimeAuthLine(const char* name, const String& value)
     }
     assign(value,sp);
     trimBlanks();
-    while (sp < (int)value.length()) {
-	int ep = value.find(m_separator,sp+1);
-	int quot = value.find('"',sp+1);
+    setRawParams(value.c_str() + sp);
+}
+
+MimeAuthLine::MimeAuthLine(const MimeAuthLine& original, const char* newName)
+    : MimeHeaderLine(original,newName)
+{
+}
+
+void* MimeAuthLine::getObject(const String& name) const
+{
+    if (name == YATOM("MimeAuthLine"))
+	return const_cast<MimeAuthLine*>(this);
+    return MimeHeaderLine::getObject(name);
+}
+
+MimeHeaderLine* MimeAuthLine::clone(const char* newName) const
+{
+    return new MimeAuthLine(*this,newName);
+}
+
+void MimeAuthLine::parseParams(const String& text)
+{
+    int sp = 0;
+    while (sp < (int)text.length()) {
+	int ep = text.find(m_separator,sp+1);
+	int quot = text.find('"',sp+1);
 	if ((quot > sp) && (quot < ep)) {
-	    quot = value.find('"',quot+1);
+	    quot = text.find('"',quot+1);
 	    if (quot > sp)
-		ep = value.find(m_separator,quot+1);
+		ep = text.find(m_separator,quot+1);
 	}
 	if (ep <= sp)
-	    ep = value.length();
-	int eq = value.find('=',sp+1);
+	    ep = text.length();
+	int eq = text.find('=',sp+1);
 	if ((eq > 0) && (eq < ep)) {
-	    String pname(value.substr(sp+1,eq-sp-1));
-	    String pvalue(value.substr(eq+1,ep-eq-1));
+	    String pname(text.substr(sp+1,eq-sp-1));
+	    String pvalue(text.substr(eq+1,ep-eq-1));
 	    pname.trimBlanks();
 	    pvalue.trimBlanks();
 	    if (!pname.null()) {
@@ -297,7 +378,7 @@ MimeAuthLine::MimeAuthLine(const char* name, const String& value)
 	    }
 	}
 	else {
-	    String pname(value.substr(sp+1,ep-sp-1));
+	    String pname(text.substr(sp+1,ep-sp-1));
 	    pname.trimBlanks();
 	    if (!pname.null()) {
 		XDebug(DebugAll,"auth param name='%s' (no value)",pname.c_str());
@@ -308,25 +389,9 @@ MimeAuthLine::MimeAuthLine(const char* name, const String& value)
     }
 }
 
-MimeAuthLine::MimeAuthLine(const MimeAuthLine& original, const char* newName)
-    : MimeHeaderLine(original,newName)
-{
-}
-
-void* MimeAuthLine::getObject(const String& name) const
-{
-    if (name == YATOM("MimeAuthLine"))
-	return const_cast<MimeAuthLine*>(this);
-    return MimeHeaderLine::getObject(name);
-}
-
-MimeHeaderLine* MimeAuthLine::clone(const char* newName) const
-{
-    return new MimeAuthLine(*this,newName);
-}
-
 void MimeAuthLine::buildLine(String& line, bool header) const
 {
+    checkParams();
     if (header)
 	line << name() << ": ";
     line << *this;
@@ -29,7 +29,8 @@ const ObjList& ObjList::empty()
 }
 
 ObjList::ObjList()
-    : m_next(0), m_obj(0), m_delete(true)
+    : m_next(0), m_obj(0), m_head(0), m_delete(true), m_added(false),
+      m_generation(0), m_changed(0)
 {
     XDebug(DebugAll,"ObjList::ObjList() [%p]",this);
 }
@@ -168,6 +169,11 @@ GenObject* ObjList::set(const GenObject* obj, bool delold)
 	return 0;
     GenObject *tmp = m_obj;
     m_obj = const_cast<GenObject*>(obj);
+    // A replacement is two changes, report it as an unknown one
+    if (tmp)
+	changed(obj ? 0 : tmp,false);
+    else
+	changed(m_obj,true);
     if (delold && tmp) {
 	tmp->destruct();
 	return 0;
@@ -181,9 +187,11 @@ ObjList* ObjList::insert(const GenObject* obj, bool compact)
     Debugger debug("ObjList::insert","(%p,%d) [%p]",obj,compact,this);
 #endif
     if (m_obj || !compact) {
+	// Existing object moves to the new item
 	ObjList *n = new ObjList();
-	n->set(m_obj);
-	set(obj,false);
+	n->m_head = head();
+	n->m_obj = m_obj;
+	m_obj = const_cast<GenObject*>(obj);
 	n->m_delete = m_delete;
 	n->m_next = m_next;
 	m_delete = true;
@@ -191,6 +199,8 @@ ObjList* ObjList::insert(const GenObject* obj, bool compact)
     }
     else
 	m_obj = const_cast<GenObject*>(obj);
+    if (m_obj)
+	changed(m_obj,true);
     return this;
 }
 
@@ -202,6 +212,7 @@ ObjList* ObjList::append(const GenObject* obj, bool compact)
     ObjList *n = last();
     if (n->get() || !compact) {
 	n->m_next = new ObjList();
+	n->m_next->m_head = head();
 	n = n->m_next;
     }
     else
@@ -238,6 +249,8 @@ ObjList* ObjList::setUnique(const GenObject* obj, bool compact)
 GenObject* ObjList::remove(bool delobj)
 {
     GenObject *tmp = m_obj;
+    if (tmp)
+	changed(tmp,false);
 
     if (m_next) {
 	ObjList *n = m_next;
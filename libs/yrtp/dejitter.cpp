@@ -19,39 +19,36 @@
  */
 
 #include <yatertp.h>
+#include <string.h>
+
+// Number of packets the buffer can hold, must be a power of 2
+#define DEJITTER_SLOTS 64
+// Granularity of the payload slot size
+#define DEJITTER_ALIGN 64
 
 using namespace TelEngine;
 
-namespace { // anonymous
+namespace TelEngine {
 
-class RTPDelayedData : public DataBlock
+// Descriptor of one slot of the dejitter ring buffer
+class RTPDelayedData
 {
 public:
-    inline RTPDelayedData(u_int64_t when, bool mark, int payload,
-	unsigned int tstamp, const void* data, int len)
-	: DataBlock(const_cast<void*>(data),len), m_scheduled(when),
-	  m_marker(mark), m_payload(payload), m_timestamp(tstamp)
-	{ }
-    inline u_int64_t scheduled() const
-	{ return m_scheduled; }
-    inline bool marker() const
-	{ return m_marker; }
-    int payload() const
-	{ return m_payload; }
-    inline unsigned int timestamp() const
-	{ return m_timestamp; }
-private:
     u_int64_t m_scheduled;
-    bool m_marker;
-    int m_payload;
     unsigned int m_timestamp;
+    int m_payload;
+    int m_len;
+    u_int16_t m_seq;
+    bool m_marker;
+    bool m_used;
 };
 
-}; // anonymous namespace
+}; // namespace TelEngine
 
 
 RTPDejitter::RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned int maxdelay)
-    : m_receiver(receiver), m_minDelay(mindelay), m_maxDelay(maxdelay),
+    : m_slots(0), m_buffer(0), m_slotSize(0), m_count(0), m_headSeq(0), m_tailSeq(0),
+      m_receiver(receiver), m_minDelay(mindelay), m_maxDelay(maxdelay),
       m_headStamp(0), m_tailStamp(0), m_headTime(0), m_sampRate(125000), m_fastRate(10)
 {
     if (m_maxDelay > 1000000)
@@ -62,23 +59,65 @@ RTPDejitter::RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned
 	m_minDelay = 5000;
     if (m_minDelay > m_maxDelay - 30000)
 	m_minDelay = m_maxDelay - 30000;
+    m_slots = new RTPDelayedData[DEJITTER_SLOTS];
+    ::memset(m_slots,0,DEJITTER_SLOTS * sizeof(RTPDelayedData));
 }
 
 RTPDejitter::~RTPDejitter()
 {
-    DDebug(DebugInfo,"Dejitter destroyed with %u packets [%p]",m_packets.count(),this);
+    DDebug(DebugInfo,"Dejitter destroyed with %u packets [%p]",m_count,this);
+    delete[] m_slots;
+    delete[] m_buffer;
 }
 
 void RTPDejitter::clear()
 {
-    m_packets.clear();
+    for (unsigned int i = 0; i < DEJITTER_SLOTS; i++)
+	m_slots[i].m_used = false;
+    m_count = 0;
     m_headStamp = m_tailStamp = 0;
 }
 
-bool RTPDejitter::rtpRecv(bool marker, int payload, unsigned int timestamp, const void* data, int len)
+// Find the queued packet with the lowest sequence number
+RTPDelayedData* RTPDejitter::first() const
+{
+    if (!m_count)
+	return 0;
+    for (u_int16_t seq = m_headSeq; ; seq++) {
+	RTPDelayedData* slot = m_slots + (seq & (DEJITTER_SLOTS - 1));
+	if (slot->m_used)
+	    return slot;
+    }
+}
+
+// Remove a packet from buffer and skip over any missing before it
+void RTPDejitter::drop(RTPDelayedData* slot)
+{
+    slot->m_used = false;
+    m_count--;
+    m_headSeq = slot->m_seq + 1;
+}
+
+// Make sure payload slots can hold a packet of given length
+void RTPDejitter::reserve(int len)
+{
+    if (len <= (int)m_slotSize)
+	return;
+    unsigned int size = (len + DEJITTER_ALIGN - 1) & ~(DEJITTER_ALIGN - 1);
+    unsigned char* buf = new unsigned char[DEJITTER_SLOTS * size];
+    for (unsigned int i = 0; m_count && (i < DEJITTER_SLOTS); i++) {
+	if (m_slots[i].m_used && m_slots[i].m_len)
+	    ::memcpy(buf + i * size,m_buffer + i * m_slotSize,m_slots[i].m_len);
+    }
+    delete[] m_buffer;
+    m_buffer = buf;
+    m_slotSize = size;
+}
+
+bool RTPDejitter::rtpRecv(bool marker, int payload, unsigned int timestamp,
+    u_int16_t seq, const void* data, int len)
 {
     u_int64_t when = 0;
-    bool insert = false;
 
     if (m_headStamp) {
 	// at least one packet got out of the queue
@@ -117,9 +156,7 @@ bool RTPDejitter::rtpRecv(bool marker, int payload, unsigned int timestamp, cons
 	if (m_tailStamp) {
 	    if (timestamp == m_tailStamp)
 		return true;
-	    if (((int)(timestamp - m_tailStamp)) < 0)
-		insert = true;
-	    else if (when > now + m_maxDelay) {
+	    if ((((int)(timestamp - m_tailStamp)) > 0) && (when > now + m_maxDelay)) {
 		DDebug(DebugNote,"Packet with TS %u falls after max buffer [%p]",timestamp,this);
 		return false;
 	    }
@@ -135,48 +172,68 @@ bool RTPDejitter::rtpRecv(bool marker, int payload, unsigned int timestamp, cons
 	when = Time::now() + m_minDelay;
     }
 
-    if (insert) {
-	for (ObjList* l = m_packets.skipNull(); l; l = l->skipNext()) {
-	    RTPDelayedData* pkt = static_cast<RTPDelayedData*>(l->get());
-	    if (pkt->timestamp() == timestamp)
-		return true;
-	    if (pkt->timestamp() > timestamp && pkt->scheduled() > when) {
-		l->insert(new RTPDelayedData(when,marker,payload,timestamp,data,len));
-		return true;
-	    }
-	}
+    int16_t dSeq = seq - m_headSeq;
+    if (!m_count && !(m_headStamp && (dSeq >= 0) && (dSeq < DEJITTER_SLOTS))) {
+	// nothing to keep order with, start the buffer at this packet
+	m_headSeq = seq;
+	dSeq = 0;
     }
-    m_tailStamp = timestamp;
-    m_packets.append(new RTPDelayedData(when,marker,payload,timestamp,data,len));
+    if (dSeq < 0) {
+	DDebug(DebugNote,"Dejitter dropping SEQ %u, expecting %u [%p]",seq,m_headSeq,this);
+	return false;
+    }
+    if (dSeq >= DEJITTER_SLOTS) {
+	DDebug(DebugNote,"Packet with SEQ %u falls after buffer end [%p]",seq,this);
+	return false;
+    }
+    RTPDelayedData* slot = m_slots + (seq & (DEJITTER_SLOTS - 1));
+    if (slot->m_used)
+	return true;
+    reserve(len);
+    if (len > 0)
+	::memcpy(m_buffer + (slot - m_slots) * m_slotSize,data,len);
+    slot->m_scheduled = when;
+    slot->m_timestamp = timestamp;
+    slot->m_payload = payload;
+    slot->m_len = len;
+    slot->m_seq = seq;
+    slot->m_marker = marker;
+    slot->m_used = true;
+    if (!m_count++ || (((int16_t)(seq - m_tailSeq)) > 0)) {
+	m_tailSeq = seq;
+	m_tailStamp = timestamp;
+    }
+    if (group())
+	group()->requestTick(this,when);
     return true;
 }
 
 void RTPDejitter::timerTick(const Time& when)
 {
-    RTPDelayedData* packet = static_cast<RTPDelayedData*>(m_packets.get());
-    if (!packet) {
+    RTPDelayedData* slot = first();
+    if (!slot) {
 	m_tailStamp = 0;
 	if (m_headStamp && (m_headTime + m_maxDelay < when))
 	    m_headStamp = 0;
 	return;
     }
-    if (packet->scheduled() > when)
+    if (slot->m_scheduled > when)
 	return;
-    m_packets.remove(packet,false);
+    // packets missing before this one are late, they will be dropped
+    drop(slot);
     // remember the last delivered
-    m_headStamp = packet->timestamp();
-    m_headTime = packet->scheduled();
+    m_headStamp = slot->m_timestamp;
+    m_headTime = slot->m_scheduled;
     if (m_receiver)
-	m_receiver->rtpRecv(packet->marker(),packet->payload(),
-	    packet->timestamp(),packet->data(),packet->length());
-    TelEngine::destruct(packet);
+	m_receiver->rtpRecv(slot->m_marker,slot->m_payload,slot->m_timestamp,
+	    (slot->m_len ? m_buffer + (slot - m_slots) * m_slotSize : 0),slot->m_len);
     unsigned int count = 0;
-    while ((packet = static_cast<RTPDelayedData*>(m_packets.get()))) {
-	long int delayed = (long int)(when - packet->scheduled());
+    while ((slot = first())) {
+	long int delayed = (long int)(when - slot->m_scheduled);
 	if (delayed <= 0 || delayed <= (long)m_minDelay)
 	    break;
 	// we are too delayed - probably rtpRecv() took too long to complete...
-	m_packets.remove(packet,true);
+	drop(slot);
 	count++;
     }
     if (count)
@@ -184,4 +241,17 @@ void RTPDejitter::timerTick(const Time& when)
 	    "Dropped %u delayed packet%s from buffer [%p]",count,((count > 1) ? "s" : ""),this);
 }
 
+u_int64_t RTPDejitter::nextTick(const Time& when)
+{
+    RTPDelayedData* slot = first();
+    if (slot)
+	return slot->m_scheduled;
+    // tail is cleared and head expired only by timer ticks
+    if (m_tailStamp)
+	return 0;
+    if (m_headStamp)
+	return m_headTime + m_maxDelay;
+    return when + 1000000;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
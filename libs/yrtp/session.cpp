@@ -273,7 +273,7 @@ void RTPReceiver::rtpData(const void* data, int len)
     m_rollover = rollover;
 
     if (m_dejitter) {
-	if (!m_dejitter->rtpRecv(marker,typ,m_tsLast,pc,len))
+	if (!m_dejitter->rtpRecv(marker,typ,m_tsLast,seq,pc,len))
 	    m_ioLostPkt++;
 	return;
     }
@@ -598,6 +598,19 @@ UDPSession::~UDPSession()
     transport(0);
 }
 
+u_int64_t UDPSession::nextTick(const Time& when)
+{
+    // a received packet resets the timeout which is rearmed on next tick
+    u_int64_t next = when + 1000000;
+    if (m_timeoutInterval && (m_timeoutTime != INF_TIMEOUT)) {
+	if (!m_timeoutTime)
+	    return 0;
+	if (m_timeoutTime < next)
+	    next = m_timeoutTime;
+    }
+    return next;
+}
+
 void UDPSession::timeout(bool initial)
 {
     DDebug(DebugNote,"UDPSession::timeout(%s) [%p]",String::boolText(initial),this);
@@ -707,6 +720,15 @@ void RTPSession::timerTick(const Time& when)
     }
 }
 
+u_int64_t RTPSession::nextTick(const Time& when)
+{
+    // sender and receiver have nothing to do on timer ticks
+    u_int64_t next = UDPSession::nextTick(when);
+    if (m_reportInterval && (m_reportTime < next))
+	next = m_reportTime;
+    return next;
+}
+
 void RTPSession::rtpData(const void* data, int len)
 {
     if ((m_direction & RecvOnly) == 0)
@@ -20,11 +20,56 @@
 
 #include <yatertp.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_MMSG
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#endif
+
 #define BUF_SIZE 1500
+// Number of slots in the timer wheel of groups in event mode
+#define WHEEL_SLOTS 256
+// Maximum interval between ticks of a processor in event mode
+#define MAX_TICK_USEC 1000000
+// Maximum time a group in event mode waits for socket events
+#define MAX_WAIT_MSEC 100
+// Number of socket events and received packets handled in one batch
+#define EVENT_BATCH 16
+// Number of outgoing RTP packets a transport can queue between flushes
+#define SEND_BATCH 8
 
 using namespace TelEngine;
 
 static unsigned long s_sleep = 5;
+static bool s_events = false;
+static bool s_batch = false;
+static bool s_gso = true;
+static u_int64_t s_txPackets = 0;
+static u_int64_t s_txCalls = 0;
+static Mutex s_txStatsMutex(false,"RTPSendStats");
+
+namespace TelEngine {
+
+// Outgoing RTP packets of a transport waiting for its group to send them
+class RTPSendQueue : public Mutex
+{
+public:
+    inline RTPSendQueue()
+	: Mutex(false,"RTPSendQueue"),
+	  m_group(0), m_count(0), m_used(0), m_queued(false)
+	{ }
+    RTPGroup* m_group;
+    unsigned int m_count;
+    unsigned int m_used;
+    bool m_queued;
+    unsigned int m_len[SEND_BATCH];
+    unsigned char m_buf[SEND_BATCH * BUF_SIZE];
+};
+
+}; // namespace TelEngine
 
 // Set IPv6 sin6_scope_id for remote addresses from local address
 // recvFrom() will set the sin6_scope_id of the remote socket address
@@ -44,7 +89,9 @@ static inline void setScopeId(const SocketAddr& local, SocketAddr& sa1,
 
 RTPGroup::RTPGroup(int msec, Priority prio)
     : Mutex(true,"RTPGroup"),
-      Thread("RTP Group",prio), m_listChanged(false)
+      Thread("RTP Group",prio), m_listChanged(false), m_batch(s_batch),
+      m_txMutex(false,"RTPGroupSend"),
+      m_epoll(-1), m_wheel(0), m_tick(0), m_tickBase(0), m_tickLen(0)
 {
     DDebug(DebugInfo,"RTPGroup::RTPGroup() [%p]",this);
     if (msec < 1)
@@ -52,11 +99,28 @@ RTPGroup::RTPGroup(int msec, Priority prio)
     if (msec > 50)
 	msec = 50;
     m_sleep = msec;
+#ifdef HAVE_EPOLL
+    if (s_events) {
+	m_epoll = ::epoll_create(EVENT_BATCH);
+	if (m_epoll >= 0) {
+	    m_wheel = new ObjList[WHEEL_SLOTS];
+	    m_tickLen = 1000 * ((m_sleep < s_sleep) ? s_sleep : m_sleep);
+	    m_tickBase = Time::now();
+	}
+	else
+	    Debug(DebugWarn,"RTPGroup failed to create epoll, error %d [%p]",errno,this);
+    }
+#endif
 }
 
 RTPGroup::~RTPGroup()
 {
     DDebug(DebugInfo,"RTPGroup::~RTPGroup() [%p]",this);
+#ifdef HAVE_EPOLL
+    if (m_epoll >= 0)
+	::close(m_epoll);
+#endif
+    delete[] m_wheel;
 }
 
 void RTPGroup::cleanup()
@@ -74,13 +138,26 @@ void RTPGroup::cleanup()
 	}
 	l = l->next();
     }
+    // processors that joined without setting their group still watch us
+    for (l = m_processors.skipNull(); l; l = l->skipNext()) {
+	RTPProcessor* p = static_cast<RTPProcessor*>(l->get());
+	p->m_due = 0;
+	p->groupJoined(this,false);
+    }
     m_processors.clear();
+    for (unsigned int i = 0; m_wheel && (i < WHEEL_SLOTS); i++)
+	m_wheel[i].clear();
     unlock();
 }
 
 void RTPGroup::run()
 {
     DDebug(DebugInfo,"RTPGroup::run() [%p]",this);
+    if (events()) {
+	runEvents();
+	DDebug(DebugInfo,"RTPGroup::run() ran out of processors [%p]",this);
+	return;
+    }
     bool ok = true;
     while (ok) {
 	unsigned long msec = m_sleep;
@@ -102,18 +179,166 @@ void RTPGroup::run()
 		    break;
 	    }
 	}
+	if (m_batch)
+	    flushSend();
 	unlock();
 	Thread::msleep(msec,true);
     }
     DDebug(DebugInfo,"RTPGroup::run() ran out of processors [%p]",this);
 }
 
+// Event mode loop: wait for readable sockets or for the next due timer slot
+void RTPGroup::runEvents()
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event ev[EVENT_BATCH];
+    for (;;) {
+	lock();
+	if (!m_processors.skipNull()) {
+	    unlock();
+	    break;
+	}
+	// sleep until the first timer slot holding processors
+	unsigned int n = 1;
+	for (; n < WHEEL_SLOTS; n++) {
+	    if (m_wheel[(m_tick + n) % WHEEL_SLOTS].skipNull())
+		break;
+	}
+	int64_t wait = (int64_t)(m_tickBase + (m_tick + n) * m_tickLen) - (int64_t)Time::now();
+	int msec = (wait > 0) ? (int)((wait + 999) / 1000) : 0;
+	if (msec > MAX_WAIT_MSEC)
+	    msec = MAX_WAIT_MSEC;
+	// queued packets must be sent at least once per tick
+	if (m_batch && (msec > (int)(m_tickLen / 1000)))
+	    msec = m_tickLen / 1000;
+	m_listChanged = false;
+	unlock();
+	int cnt = ::epoll_wait(m_epoll,ev,EVENT_BATCH,msec);
+	Thread::check();
+	lock();
+	Time t;
+	for (int i = 0; i < cnt; i++) {
+	    // transports are at least 2 bytes aligned, lowest bit marks RTCP
+	    RTPTransport* trans = (RTPTransport*)(uintptr_t)(ev[i].data.u64 & ~(u_int64_t)1);
+	    // transports may have left since we started waiting
+	    if (m_listChanged && !m_processors.find(trans))
+		continue;
+	    if (ev[i].data.u64 & 1)
+		trans->readRTCP();
+	    else
+		trans->readRTP();
+	}
+	// call processors from all timer slots that became due
+	u_int64_t last = m_tick;
+	m_tick = (t - m_tickBase) / m_tickLen;
+	if (m_tick - last > WHEEL_SLOTS)
+	    last = m_tick - WHEEL_SLOTS;
+	while (last < m_tick)
+	    tickSlot((unsigned int)(++last % WHEEL_SLOTS),t);
+	if (m_batch)
+	    flushSend();
+	unlock();
+    }
+#endif
+}
+
+// Call all due processors of a timer wheel slot, must be called with group locked
+void RTPGroup::tickSlot(unsigned int slot, const Time& when)
+{
+    ObjList* l = m_wheel[slot].skipNull();
+    while (l) {
+	RTPProcessor* p = static_cast<RTPProcessor*>(l->get());
+	if (p->m_due > m_tick) {
+	    // wrapped around the wheel, not yet due
+	    l = l->skipNext();
+	    continue;
+	}
+	l->remove(false);
+	p->m_due = 0;
+	m_listChanged = false;
+	p->timerTick(when);
+	if (!m_listChanged || m_processors.find(p))
+	    schedule(p,p->nextTick(when));
+	// the slot may have changed while processing so restart from its head
+	l = m_wheel[slot].skipNull();
+    }
+}
+
+// Put a processor in the timer wheel, must be called with group locked
+void RTPGroup::schedule(RTPProcessor* proc, u_int64_t when, bool earlier)
+{
+    if (!m_wheel)
+	return;
+    u_int64_t tick = m_tick + 1;
+    if (when > m_tickBase) {
+	u_int64_t t = (when - m_tickBase + m_tickLen - 1) / m_tickLen;
+	if (t > tick)
+	    tick = t;
+    }
+    u_int64_t max = m_tick + (MAX_TICK_USEC + m_tickLen - 1) / m_tickLen;
+    if (tick > max)
+	tick = max;
+    if (proc->m_due) {
+	if (earlier && (proc->m_due <= tick))
+	    return;
+	m_wheel[proc->m_due % WHEEL_SLOTS].remove(proc,false);
+    }
+    proc->m_due = tick;
+    m_wheel[tick % WHEEL_SLOTS].append(proc)->setDelete(false);
+}
+
+// Remove a processor from the timer wheel, must be called with group locked
+void RTPGroup::unschedule(RTPProcessor* proc)
+{
+    if (!(m_wheel && proc->m_due))
+	return;
+    m_wheel[proc->m_due % WHEEL_SLOTS].remove(proc,false);
+    proc->m_due = 0;
+}
+
+void RTPGroup::requestTick(RTPProcessor* proc, u_int64_t when)
+{
+    if (!(proc && m_wheel))
+	return;
+    Lock lock(this);
+    schedule(proc,when,true);
+}
+
+// Add or remove the sockets of a transport to the watched set
+bool RTPGroup::watch(RTPTransport* trans, bool add)
+{
+#ifdef HAVE_EPOLL
+    if (m_epoll < 0)
+	return false;
+    Lock lock(this);
+    bool ok = false;
+    for (int i = 0; i < 2; i++) {
+	Socket& sock = i ? trans->m_rtcpSock : trans->m_rtpSock;
+	if (!sock.valid())
+	    continue;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (u_int64_t)(uintptr_t)trans | (unsigned int)i;
+	if (!::epoll_ctl(m_epoll,add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,sock.handle(),&ev))
+	    ok = true;
+	else if (add)
+	    Debug(DebugWarn,"RTPGroup failed to watch socket %d, error %d [%p]",
+		sock.handle(),errno,this);
+    }
+    return ok;
+#else
+    return false;
+#endif
+}
+
 void RTPGroup::join(RTPProcessor* proc)
 {
     DDebug(DebugAll,"RTPGroup::join(%p) [%p]",proc,this);
     lock();
     m_listChanged = true;
     m_processors.append(proc)->setDelete(false);
+    schedule(proc,0);
+    proc->groupJoined(this,true);
     startup();
     unlock();
 }
@@ -123,7 +348,10 @@ void RTPGroup::part(RTPProcessor* proc)
     DDebug(DebugAll,"RTPGroup::part(%p) [%p]",proc,this);
     lock();
     m_listChanged = true;
-    m_processors.remove(proc,false);
+    if (m_processors.remove(proc,false)) {
+	unschedule(proc);
+	proc->groupJoined(this,false);
+    }
     unlock();
 }
 
@@ -136,9 +364,46 @@ void RTPGroup::setMinSleep(int msec)
     s_sleep = msec;
 }
 
+void RTPGroup::setEvents(bool enable)
+{
+#ifdef HAVE_EPOLL
+    s_events = enable;
+#endif
+}
+
+void RTPGroup::setBatching(bool enable)
+{
+#ifdef HAVE_MMSG
+    s_batch = enable;
+#endif
+}
+
+void RTPGroup::sendStats(u_int64_t& packets, u_int64_t& calls)
+{
+    Lock lock(s_txStatsMutex);
+    packets = s_txPackets;
+    calls = s_txCalls;
+}
+
+// Send the packets queued by transports, must be called with group locked
+void RTPGroup::flushSend()
+{
+    for (;;) {
+	m_txMutex.lock();
+	RTPTransport* trans = static_cast<RTPTransport*>(m_txPending.remove(false));
+	m_txMutex.unlock();
+	if (!trans)
+	    break;
+	// transports can't leave the group while we hold its lock
+	Lock lock(trans->m_txQueue);
+	trans->m_txQueue->m_queued = false;
+	trans->flushRTP();
+    }
+}
+
 
 RTPProcessor::RTPProcessor()
-    : m_wrongSrc(0), m_group(0)
+    : m_wrongSrc(0), m_group(0), m_due(0)
 {
     DDebug(DebugAll,"RTPProcessor::RTPProcessor() [%p]",this);
 }
@@ -173,10 +438,19 @@ void RTPProcessor::getStats(String& stats) const
 {
 }
 
+u_int64_t RTPProcessor::nextTick(const Time& when)
+{
+    return 0;
+}
+
+void RTPProcessor::groupJoined(RTPGroup* grp, bool joined)
+{
+}
+
 
 RTPTransport::RTPTransport(RTPTransport::Type type)
     : RTPProcessor(),
-      m_type(type), m_processor(0), m_monitor(0), m_autoRemote(false),
+      m_watch(0), m_txQueue(0), m_type(type), m_processor(0), m_monitor(0), m_autoRemote(false),
       m_warnSendErrorRtp(true), m_warnSendErrorRtcp(true)
 {
     DDebug(DebugAll,"RTPTransport::RTPTransport(%d) [%p]",type,this);
@@ -191,6 +465,7 @@ RTPTransport::~RTPTransport()
     group(0);
     setProcessor();
     setMonitor();
+    delete m_txQueue;
 }
 
 void RTPTransport::destruct()
@@ -205,64 +480,184 @@ void RTPTransport::timerTick(const Time& when)
 {
     XDebug(DebugAll,"RTPTransport::timerTick() group=%p [%p]",group(),this);
     if (m_rtpSock.valid()) {
-	char buf[BUF_SIZE];
-	int len;
-	while ((len = m_rtpSock.recvFrom(buf,sizeof(buf),m_rxAddrRTP)) > 0) {
-	    XDebug(DebugAll,"RTP/UDPTL from '%s:%d' length %d [%p]",
-		m_rxAddrRTP.host().c_str(),m_rxAddrRTP.port(),len,this);
-	    switch (m_type) {
-		case RTP:
-		    if (len < 12)
-			continue;
-		    if (((unsigned char)buf[0] & 0xc0) != 0x80)
-			continue;
-		    break;
-		case UDPTL:
-		    if (len < 6)
-			continue;
-		    break;
-		default:
-		    break;
+	// in event mode the group reads the sockets when they become readable
+	if (!m_watch)
+	    readRTP();
+	m_rtpSock.timerTick(when);
+    }
+    if (m_rtcpSock.valid()) {
+	if (!m_watch)
+	    readRTCP();
+	m_rtcpSock.timerTick(when);
+    }
+}
+
+u_int64_t RTPTransport::nextTick(const Time& when)
+{
+    // socket filters need to be called periodically
+    if (m_rtpSock.filtered() || m_rtcpSock.filtered())
+	return 0;
+    return when + MAX_TICK_USEC;
+}
+
+void RTPTransport::groupJoined(RTPGroup* grp, bool joined)
+{
+    if (joined) {
+	if (!m_watch && grp->events() && grp->watch(this,true))
+	    m_watch = grp;
+	if (grp->batching() && (m_type == RTP)) {
+	    if (!m_txQueue)
+		m_txQueue = new RTPSendQueue;
+	    Lock lock(m_txQueue);
+	    if (!m_txQueue->m_group)
+		m_txQueue->m_group = grp;
+	}
+	return;
+    }
+    if (grp == m_watch) {
+	grp->watch(this,false);
+	m_watch = 0;
+    }
+    if (m_txQueue) {
+	Lock lock(m_txQueue);
+	if (grp == m_txQueue->m_group) {
+	    // send what is left now, nobody will flush the queue later
+	    if (m_txQueue->m_queued) {
+		Lock lck(grp->m_txMutex);
+		grp->m_txPending.remove(this,false);
+		m_txQueue->m_queued = false;
 	    }
-	    if (!m_remoteAddr.valid())
-		continue;
-	    // looks like it's RTP or UDPTL, at least by length and version
-	    bool preferred = false;
-	    if ((m_autoRemote || (preferred = (m_rxAddrRTP == m_remotePref))) && (m_rxAddrRTP != m_remoteAddr)) {
-		Debug(DebugInfo,"Auto changing RTP address from %s:%d to%s %s:%d",
-		    m_remoteAddr.host().c_str(),m_remoteAddr.port(),
-		    (preferred ? " preferred" : ""),
-		    m_rxAddrRTP.host().c_str(),m_rxAddrRTP.port());
-		// if we received from the preferred address don't auto change any more
-		if (preferred)
-		    m_remotePref.clear();
-		remoteAddr(m_rxAddrRTP);
+	    flushRTP();
+	    m_txQueue->m_group = 0;
+	}
+    }
+}
+
+// Read all packets waiting in the RTP socket
+void RTPTransport::readRTP()
+{
+#ifdef HAVE_MMSG
+    // packet filters are applied only by recvFrom()
+    if (!m_rtpSock.filtered()) {
+	char buf[EVENT_BATCH][BUF_SIZE];
+	struct sockaddr_storage addr[EVENT_BATCH];
+	struct iovec iov[EVENT_BATCH];
+	struct mmsghdr msgs[EVENT_BATCH];
+	int n = EVENT_BATCH;
+	while (n == EVENT_BATCH && m_rtpSock.valid()) {
+	    for (int i = 0; i < EVENT_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = BUF_SIZE;
+		::memset(&msgs[i],0,sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	    }
-	    m_autoRemote = false;
-	    if (m_rxAddrRTP == m_remoteAddr) {
-		if (m_processor)
-		    m_processor->rtpData(buf,len);
-		if (m_monitor)
-		    m_monitor->rtpData(buf,len);
+	    n = ::recvmmsg(m_rtpSock.handle(),msgs,EVENT_BATCH,MSG_DONTWAIT,0);
+	    for (int i = 0; i < n; i++) {
+		m_rxAddrRTP.assign((struct sockaddr*)&addr[i],msgs[i].msg_hdr.msg_namelen);
+		recvRTP(buf[i],msgs[i].msg_len);
 	    }
-	    else if (m_processor)
-		m_processor->incWrongSrc();
 	}
-	m_rtpSock.timerTick(when);
+	return;
     }
-    if (m_rtcpSock.valid()) {
-	char buf[BUF_SIZE];
-	int len;
-	while (((len = m_rtcpSock.recvFrom(buf,sizeof(buf),m_rxAddrRTCP)) >= 8) && (m_rxAddrRTCP == m_remoteRTCP)) {
-	    XDebug(DebugAll,"RTCP from '%s:%d' length %d [%p]",
-		m_rxAddrRTCP.host().c_str(),m_rxAddrRTCP.port(),len,this);
-	    if (m_processor)
-		m_processor->rtcpData(buf,len);
-	    if (m_monitor)
-		m_monitor->rtcpData(buf,len);
+#endif
+    char buf[BUF_SIZE];
+    int len;
+    while ((len = m_rtpSock.recvFrom(buf,sizeof(buf),m_rxAddrRTP)) > 0)
+	recvRTP(buf,len);
+}
+
+// Read all packets waiting in the RTCP socket
+void RTPTransport::readRTCP()
+{
+#ifdef HAVE_MMSG
+    if (!m_rtcpSock.filtered()) {
+	char buf[EVENT_BATCH][BUF_SIZE];
+	struct sockaddr_storage addr[EVENT_BATCH];
+	struct iovec iov[EVENT_BATCH];
+	struct mmsghdr msgs[EVENT_BATCH];
+	int n = EVENT_BATCH;
+	while (n == EVENT_BATCH && m_rtcpSock.valid()) {
+	    for (int i = 0; i < EVENT_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = BUF_SIZE;
+		::memset(&msgs[i],0,sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	    }
+	    n = ::recvmmsg(m_rtcpSock.handle(),msgs,EVENT_BATCH,MSG_DONTWAIT,0);
+	    for (int i = 0; i < n; i++) {
+		m_rxAddrRTCP.assign((struct sockaddr*)&addr[i],msgs[i].msg_hdr.msg_namelen);
+		if (((int)msgs[i].msg_len >= 8) && (m_rxAddrRTCP == m_remoteRTCP))
+		    recvRTCP(buf[i],msgs[i].msg_len);
+	    }
 	}
-	m_rtcpSock.timerTick(when);
+	return;
     }
+#endif
+    char buf[BUF_SIZE];
+    int len;
+    while (((len = m_rtcpSock.recvFrom(buf,sizeof(buf),m_rxAddrRTCP)) >= 8) && (m_rxAddrRTCP == m_remoteRTCP))
+	recvRTCP(buf,len);
+}
+
+// Process one packet received on the RTP socket
+void RTPTransport::recvRTP(const char* buf, int len)
+{
+    XDebug(DebugAll,"RTP/UDPTL from '%s:%d' length %d [%p]",
+	m_rxAddrRTP.host().c_str(),m_rxAddrRTP.port(),len,this);
+    switch (m_type) {
+	case RTP:
+	    if (len < 12)
+		return;
+	    if (((unsigned char)buf[0] & 0xc0) != 0x80)
+		return;
+	    break;
+	case UDPTL:
+	    if (len < 6)
+		return;
+	    break;
+	default:
+	    break;
+    }
+    if (!m_remoteAddr.valid())
+	return;
+    // looks like it's RTP or UDPTL, at least by length and version
+    bool preferred = false;
+    if ((m_autoRemote || (preferred = (m_rxAddrRTP == m_remotePref))) && (m_rxAddrRTP != m_remoteAddr)) {
+	Debug(DebugInfo,"Auto changing RTP address from %s:%d to%s %s:%d",
+	    m_remoteAddr.host().c_str(),m_remoteAddr.port(),
+	    (preferred ? " preferred" : ""),
+	    m_rxAddrRTP.host().c_str(),m_rxAddrRTP.port());
+	// if we received from the preferred address don't auto change any more
+	if (preferred)
+	    m_remotePref.clear();
+	remoteAddr(m_rxAddrRTP);
+    }
+    m_autoRemote = false;
+    if (m_rxAddrRTP == m_remoteAddr) {
+	if (m_processor)
+	    m_processor->rtpData(buf,len);
+	if (m_monitor)
+	    m_monitor->rtpData(buf,len);
+    }
+    else if (m_processor)
+	m_processor->incWrongSrc();
+}
+
+// Process one packet received on the RTCP socket
+void RTPTransport::recvRTCP(const char* buf, int len)
+{
+    XDebug(DebugAll,"RTCP from '%s:%d' length %d [%p]",
+	m_rxAddrRTCP.host().c_str(),m_rxAddrRTCP.port(),len,this);
+    if (m_processor)
+	m_processor->rtcpData(buf,len);
+    if (m_monitor)
+	m_monitor->rtcpData(buf,len);
 }
 
 // Send data to remote party
@@ -314,9 +709,119 @@ void RTPTransport::rtpData(const void* data, int len)
 	default:
 	    break;
     }
+    if (m_txQueue && queueRTP(data,len))
+	return;
     sendData(m_rtpSock,m_remoteAddr,data,len,"RTP",m_warnSendErrorRtp);
 }
 
+// Add a RTP packet to the send queue, return false if it must be sent now
+bool RTPTransport::queueRTP(const void* data, int len)
+{
+    if (len > BUF_SIZE)
+	return false;
+    Lock lock(m_txQueue);
+    RTPGroup* grp = m_txQueue->m_group;
+    if (!grp)
+	return false;
+    // the group thread is late, send the queued packets ourselves
+    if (m_txQueue->m_count >= SEND_BATCH)
+	flushRTP();
+    ::memcpy(m_txQueue->m_buf + m_txQueue->m_used,data,len);
+    m_txQueue->m_len[m_txQueue->m_count++] = len;
+    m_txQueue->m_used += len;
+    if (!m_txQueue->m_queued) {
+	m_txQueue->m_queued = true;
+	Lock lck(grp->m_txMutex);
+	grp->m_txPending.append(this)->setDelete(false);
+    }
+    return true;
+}
+
+// Send all queued RTP packets, must be called with send queue locked
+void RTPTransport::flushRTP()
+{
+    unsigned int n = m_txQueue->m_count;
+    if (!n)
+	return;
+    unsigned int used = m_txQueue->m_used;
+    m_txQueue->m_count = 0;
+    m_txQueue->m_used = 0;
+    unsigned char* buf = m_txQueue->m_buf;
+    unsigned int sent = 0;
+    unsigned int calls = 0;
+#ifdef HAVE_MMSG
+    if (m_rtpSock.valid() && m_remoteAddr.valid()) {
+#ifdef UDP_SEGMENT
+	if (s_gso && (n > 1)) {
+	    // segmentation offload needs all but the last packet of same size
+	    unsigned int seg = m_txQueue->m_len[0];
+	    bool ok = (m_txQueue->m_len[n - 1] <= seg);
+	    for (unsigned int i = 1; ok && (i < n - 1); i++)
+		ok = (m_txQueue->m_len[i] == seg);
+	    if (ok) {
+		char ctrl[CMSG_SPACE(sizeof(u_int16_t))];
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = used;
+		struct msghdr msg;
+		::memset(&msg,0,sizeof(msg));
+		msg.msg_name = m_remoteAddr.address();
+		msg.msg_namelen = m_remoteAddr.length();
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+		*(u_int16_t*)CMSG_DATA(cm) = seg;
+		calls++;
+		if (::sendmsg(m_rtpSock.handle(),&msg,0) == (int)used)
+		    sent = n;
+		else if ((errno == EIO) || (errno == EINVAL) || (errno == ENOPROTOOPT)) {
+		    s_gso = false;
+		    Debug(DebugNote,"UDP segmentation offload not usable, error %d [%p]",errno,this);
+		}
+	    }
+	}
+#endif
+	struct iovec iov[SEND_BATCH];
+	struct mmsghdr msgs[SEND_BATCH];
+	unsigned int ofs = 0;
+	for (unsigned int i = 0; i < n; i++) {
+	    iov[i].iov_base = buf + ofs;
+	    iov[i].iov_len = m_txQueue->m_len[i];
+	    ofs += m_txQueue->m_len[i];
+	    ::memset(&msgs[i],0,sizeof(msgs[i]));
+	    msgs[i].msg_hdr.msg_name = m_remoteAddr.address();
+	    msgs[i].msg_hdr.msg_namelen = m_remoteAddr.length();
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < n) {
+	    calls++;
+	    int r = ::sendmmsg(m_rtpSock.handle(),msgs + sent,n - sent,0);
+	    if (r <= 0)
+		break;
+	    sent += r;
+	}
+    }
+#endif
+    // whatever was not sent in batch goes the regular way, reporting errors
+    unsigned int ofs = 0;
+    for (unsigned int i = 0; i < n; i++) {
+	if (i >= sent) {
+	    calls++;
+	    sendData(m_rtpSock,m_remoteAddr,buf + ofs,m_txQueue->m_len[i],"RTP",m_warnSendErrorRtp);
+	}
+	ofs += m_txQueue->m_len[i];
+    }
+    Lock lock(s_txStatsMutex);
+    s_txPackets += n;
+    s_txCalls += calls;
+}
+
 void RTPTransport::rtcpData(const void* data, int len)
 {
     if ((len < 8) || !data)
@@ -342,6 +847,21 @@ void RTPTransport::setMonitor(RTPProcessor* monitor)
 }
 
 bool RTPTransport::localAddr(SocketAddr& addr, bool rtcp)
+{
+    if (!localAddrInternal(addr,rtcp))
+	return false;
+    // sockets were just created, watch them if our group is in event mode
+    RTPGroup* grp = group();
+    if (grp && !m_watch && grp->events()) {
+	Lock lock(grp);
+	if (grp->m_processors.find(this) && grp->watch(this,true))
+	    m_watch = grp;
+    }
+    return true;
+}
+
+// Create and bind the RTP and RTCP sockets
+bool RTPTransport::localAddrInternal(SocketAddr& addr, bool rtcp)
 {
     // check if sockets are already created and bound
     if (m_rtpSock.valid())
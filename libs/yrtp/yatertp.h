@@ -50,6 +50,8 @@ class RTPSession;
 class RTPSender;
 class RTPReceiver;
 class RTPSecure;
+class RTPSendQueue;
+class RTPDelayedData;
 
 /**
  * A base class that contains just placeholders to process raw RTP and RTCP packets.
@@ -128,10 +130,29 @@ protected:
      */
     virtual void timerTick(const Time& when) = 0;
 
+    /**
+     * Retrieve when the next call of timerTick() is needed.
+     * This is used only by RTP groups that run in event mode, processors
+     *  are anyway called at least once every second.
+     * The default implementation asks to be called at every group tick
+     * @param when Current time
+     * @return Time in microseconds when timerTick() should be called next,
+     *  zero to be called at the next group tick
+     */
+    virtual u_int64_t nextTick(const Time& when);
+
+    /**
+     * Method called by a RTP group after this processor joined or before it leaves it
+     * @param grp The RTP group joined or left
+     * @param joined True if the group was joined, false if it is being left
+     */
+    virtual void groupJoined(RTPGroup* grp, bool joined);
+
     unsigned int m_wrongSrc;
 
 private:
     RTPGroup* m_group;
+    u_int64_t m_due;
 };
 
 /**
@@ -142,6 +163,7 @@ private:
 class YRTP_API RTPGroup : public GenObject, public Mutex, public Thread
 {
     friend class RTPProcessor;
+    friend class RTPTransport;
 
 public:
     /**
@@ -172,6 +194,54 @@ public:
      */
     static void setMinSleep(int msec);
 
+    /**
+     * Set the system global event mode used by groups created after this call.
+     * In event mode the group waits for socket readiness, reads packets in
+     *  batches and calls processors only when their timers are due.
+     * Event mode is available only if the operating system supports epoll
+     * @param enable True to create new groups in event mode
+     */
+    static void setEvents(bool enable);
+
+    /**
+     * Check if this group runs in event mode
+     * @return True if sockets are watched and processors are kept in a timer wheel
+     */
+    inline bool events() const
+	{ return m_epoll >= 0; }
+
+    /**
+     * Request that a processor of this group is called no later than a given time.
+     * This has no effect if the group is not in event mode
+     * @param proc Pointer to the RTP processor
+     * @param when Time in microseconds when the processor should be called
+     */
+    void requestTick(RTPProcessor* proc, u_int64_t when);
+
+    /**
+     * Set the system global send batching used by groups created after this call.
+     * With batching enabled the RTP packets of each transport are queued and
+     *  sent together by the group thread once per tick using sendmmsg() and,
+     *  if the kernel supports it, UDP segmentation offload.
+     * Batching is available only if the operating system supports sendmmsg()
+     * @param enable True to batch packets sent by transports of new groups
+     */
+    static void setBatching(bool enable);
+
+    /**
+     * Check if this group batches the RTP packets sent by its transports
+     * @return True if packets are queued and sent by the group thread
+     */
+    inline bool batching() const
+	{ return m_batch; }
+
+    /**
+     * Retrieve the system global statistics of batched sending
+     * @param packets Number of RTP packets sent from send queues
+     * @param calls Number of system calls used to send them
+     */
+    static void sendStats(u_int64_t& packets, u_int64_t& calls);
+
     /**
      * Add a RTP processor to this group
      * @param proc Pointer to the RTP processor to add
@@ -185,9 +255,23 @@ public:
     void part(RTPProcessor* proc);
 
 private:
+    void runEvents();
+    void schedule(RTPProcessor* proc, u_int64_t when, bool earlier = false);
+    void unschedule(RTPProcessor* proc);
+    void tickSlot(unsigned int slot, const Time& when);
+    bool watch(RTPTransport* trans, bool add);
+    void flushSend();
     ObjList m_processors;
     bool m_listChanged;
+    bool m_batch;
+    ObjList m_txPending;
+    Mutex m_txMutex;
     unsigned long m_sleep;
+    int m_epoll;
+    ObjList* m_wheel;
+    u_int64_t m_tick;
+    u_int64_t m_tickBase;
+    unsigned int m_tickLen;
 };
 
 /**
@@ -329,7 +413,31 @@ protected:
      */
     virtual void rtcpData(const void* data, int len);
 
+    /**
+     * Retrieve when the next call of timerTick() is needed
+     * @param when Current time
+     * @return Time in microseconds when timerTick() should be called next
+     */
+    virtual u_int64_t nextTick(const Time& when);
+
+    /**
+     * Start or stop watching the sockets when joining or leaving a group in event mode
+     * @param grp The RTP group joined or left
+     * @param joined True if the group was joined, false if it is being left
+     */
+    virtual void groupJoined(RTPGroup* grp, bool joined);
+
 private:
+    friend class RTPGroup;
+    bool localAddrInternal(SocketAddr& addr, bool rtcp);
+    void readRTP();
+    void readRTCP();
+    void recvRTP(const char* buf, int len);
+    void recvRTCP(const char* buf, int len);
+    bool queueRTP(const void* data, int len);
+    void flushRTP();
+    RTPGroup* m_watch;
+    RTPSendQueue* m_txQueue;
     Type m_type;
     RTPProcessor* m_processor;
     RTPProcessor* m_monitor;
@@ -373,12 +481,13 @@ public:
      * @param marker True if the marker bit is set in data packet
      * @param payload Payload number
      * @param timestamp Sampling instant of the packet data
+     * @param seq Sequence number of the packet, selects its buffer slot
      * @param data Pointer to data block to process
      * @param len Length of the data block in bytes
      * @return True if the data packet was queued
      */
     virtual bool rtpRecv(bool marker, int payload, unsigned int timestamp,
-	const void* data, int len);
+	u_int16_t seq, const void* data, int len);
 
     /**
      * Clear the delayed packets queue and all variables
@@ -392,8 +501,23 @@ protected:
      */
     virtual void timerTick(const Time& when);
 
+    /**
+     * Retrieve when the next packet needs to be delivered
+     * @param when Current time
+     * @return Time in microseconds when timerTick() should be called next
+     */
+    virtual u_int64_t nextTick(const Time& when);
+
 private:
-    ObjList m_packets;
+    RTPDelayedData* first() const;
+    void reserve(int len);
+    void drop(RTPDelayedData* slot);
+    RTPDelayedData* m_slots;
+    unsigned char* m_buffer;
+    unsigned int m_slotSize;
+    unsigned int m_count;
+    u_int16_t m_headSeq;
+    u_int16_t m_tailSeq;
     RTPReceiver* m_receiver;
     unsigned int m_minDelay;
     unsigned int m_maxDelay;
@@ -972,6 +1096,13 @@ protected:
      */
     virtual void timeout(bool initial);
 
+    /**
+     * Retrieve when the receiver timeout needs to be checked
+     * @param when Current time
+     * @return Time in microseconds when timerTick() should be called next
+     */
+    virtual u_int64_t nextTick(const Time& when);
+
     RTPTransport* m_transport;
     u_int64_t m_timeoutTime;
     u_int64_t m_timeoutInterval;
@@ -1311,6 +1442,13 @@ protected:
      */
     virtual void timerTick(const Time& when);
 
+    /**
+     * Retrieve when the receiver timeout or the next RTCP report are due
+     * @param when Current time
+     * @return Time in microseconds when timerTick() should be called next
+     */
+    virtual u_int64_t nextTick(const Time& when);
+
     /**
      * Send a RTCP report
      * @param when Time to use as base for timestamps
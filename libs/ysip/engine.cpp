@@ -110,6 +110,86 @@ static TokenDict sip_responses[] = {
 
 TokenDict* TelEngine::SIPResponses = sip_responses;
 
+// Number of hash buckets in the transaction indexes
+#define TRANS_INDEX_SIZE 1024
+// Initial size of the ready queue and timer heap, they grow as needed
+#define TRANS_QUEUE_SIZE 64
+
+namespace { // anonymous
+
+// Transactions sharing the same index key, kept in engine list order
+class SIPTransBucket : public String
+{
+public:
+    inline explicit SIPTransBucket(const String& key)
+	: String(key)
+	{ }
+    inline ObjList& transactions()
+	{ return m_transactions; }
+private:
+    ObjList m_transactions;
+};
+
+}; // anonymous namespace
+
+// Build the branch index key of a transaction or message
+static inline void branchKey(String& key, const String& branch, const String& method)
+{
+    key.clear();
+    key << branch << " " << method;
+}
+
+// Add a transaction to the bucket of a key
+static void bucketAdd(HashList& index, const String& key, SIPTransaction* trans, bool first)
+{
+    SIPTransBucket* b = static_cast<SIPTransBucket*>(index[key]);
+    if (!b) {
+	b = new SIPTransBucket(key);
+	index.append(b);
+    }
+    if (first)
+	b->transactions().insert(trans)->setDelete(false);
+    else
+	b->transactions().append(trans)->setDelete(false);
+}
+
+// Remove a transaction from the bucket of a key, drop the bucket if empty
+static void bucketRemove(HashList& index, const String& key, SIPTransaction* trans)
+{
+    SIPTransBucket* b = static_cast<SIPTransBucket*>(index[key]);
+    if (!b)
+	return;
+    b->transactions().remove(trans,false);
+    if (!b->transactions().skipNull())
+	index.remove(b,true,true);
+}
+
+// Match a message against the transactions of a bucket
+static SIPTransaction* bucketMatch(HashList& index, const String& key, SIPMessage* message,
+    const String& branch, SIPTransaction*& forked, bool skipBranch = false)
+{
+    SIPTransBucket* b = static_cast<SIPTransBucket*>(index[key]);
+    if (!b)
+	return 0;
+    for (ObjList* l = b->transactions().skipNull(); l; l = l->skipNext()) {
+	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
+	// already tried from the branch index
+	if (skipBranch && (t->getBranch() == branch))
+	    continue;
+	switch (t->processMessage(message,branch)) {
+	    case SIPTransaction::Matched:
+		return t;
+	    case SIPTransaction::NoDialog:
+		forked = t;
+		break;
+	    case SIPTransaction::NoMatch:
+	    default:
+		break;
+	}
+    }
+    return 0;
+}
+
 SIPParty::SIPParty(Mutex* mutex)
     : m_mutex(mutex), m_reliable(false), m_localPort(0), m_partyPort(0)
 {
@@ -167,17 +247,223 @@ SIPEvent::~SIPEvent()
 }
 
 
-SIPEngine::SIPEngine(const char* userAgent)
+SIPShard::SIPShard(unsigned int index)
+    : Mutex(true,"SIPShard"),
+      m_index(index),
+      m_branchIndex(TRANS_INDEX_SIZE), m_callIdIndex(TRANS_INDEX_SIZE),
+      m_ready(0), m_readySize(0), m_readyHead(0), m_readyCount(0),
+      m_timers(0), m_timersSize(0), m_timersCount(0),
+      m_wakeup(1,"SIPShard")
+{
+}
+
+SIPShard::~SIPShard()
+{
+    clear();
+    delete[] m_ready;
+    delete[] m_timers;
+}
+
+void SIPShard::remove(SIPTransaction* transaction)
+{
+    Lock lock(this);
+    m_transList.remove(transaction,false);
+    // the list may have been cleared directly, always clean the indexes
+    indexRemove(transaction);
+    purge(transaction);
+}
+
+void SIPShard::add(SIPTransaction* transaction, bool first)
+{
+    Lock lock(this);
+    if (first)
+	m_transList.insert(transaction);
+    else
+	m_transList.append(transaction);
+    indexAdd(transaction,first);
+    readyAdd(transaction);
+}
+
+void SIPShard::clear()
+{
+    Lock lock(this);
+    for (unsigned int i = 0; i < m_readyCount; i++) {
+	SIPTransaction* t = m_ready[(m_readyHead + i) % m_readySize];
+	if (t)
+	    t->m_ready = false;
+    }
+    m_readyCount = 0;
+    for (unsigned int i = 0; i < m_timersCount; i++)
+	m_timers[i]->m_timerPos = -1;
+    m_timersCount = 0;
+    m_transList.clear();
+    m_branchIndex.clear();
+    m_callIdIndex.clear();
+}
+
+// Queue a transaction to be checked for events at the next getEvent()
+void SIPShard::readyAdd(SIPTransaction* transaction, bool first)
+{
+    Lock lock(this);
+    if (transaction->m_ready)
+	return;
+    if (m_readyCount >= m_readySize) {
+	unsigned int size = m_readySize ? 2 * m_readySize : TRANS_QUEUE_SIZE;
+	SIPTransaction** ready = new SIPTransaction*[size];
+	for (unsigned int i = 0; i < m_readyCount; i++)
+	    ready[i] = m_ready[(m_readyHead + i) % m_readySize];
+	delete[] m_ready;
+	m_ready = ready;
+	m_readySize = size;
+	m_readyHead = 0;
+    }
+    if (first) {
+	m_readyHead = (m_readyHead + m_readySize - 1) % m_readySize;
+	m_ready[m_readyHead] = transaction;
+    }
+    else
+	m_ready[(m_readyHead + m_readyCount) % m_readySize] = transaction;
+    transaction->m_ready = true;
+    if (!m_readyCount++)
+	m_wakeup.unlock();
+}
+
+// Take the first transaction out of the ready queue, must be called locked
+SIPTransaction* SIPShard::readyGet()
+{
+    while (m_readyCount) {
+	SIPTransaction* t = m_ready[m_readyHead];
+	m_readyHead = (m_readyHead + 1) % m_readySize;
+	m_readyCount--;
+	// purged transactions leave an empty slot
+	if (t) {
+	    t->m_ready = false;
+	    return t;
+	}
+    }
+    return 0;
+}
+
+// Put a transaction in the timer heap according to its timeout
+void SIPShard::timerUpdate(SIPTransaction* transaction)
+{
+    Lock lock(this);
+    if (!transaction->m_timeout) {
+	timerRemove(transaction);
+	return;
+    }
+    if (transaction->m_timerPos < 0) {
+	if (m_timersCount >= m_timersSize) {
+	    unsigned int size = m_timersSize ? 2 * m_timersSize : TRANS_QUEUE_SIZE;
+	    SIPTransaction** timers = new SIPTransaction*[size];
+	    for (unsigned int i = 0; i < m_timersCount; i++)
+		timers[i] = m_timers[i];
+	    delete[] m_timers;
+	    m_timers = timers;
+	    m_timersSize = size;
+	}
+	transaction->m_timerPos = m_timersCount;
+	m_timers[m_timersCount++] = transaction;
+    }
+    timerMove(transaction->m_timerPos);
+}
+
+// Take a transaction out of the timer heap, must be called locked
+void SIPShard::timerRemove(SIPTransaction* transaction)
+{
+    int pos = transaction->m_timerPos;
+    if (pos < 0)
+	return;
+    transaction->m_timerPos = -1;
+    if ((unsigned int)pos == --m_timersCount)
+	return;
+    m_timers[pos] = m_timers[m_timersCount];
+    m_timers[pos]->m_timerPos = pos;
+    timerMove(pos);
+}
+
+// Move a heap entry up or down until the heap is ordered again
+void SIPShard::timerMove(unsigned int pos)
+{
+    SIPTransaction* t = m_timers[pos];
+    while (pos) {
+	unsigned int parent = (pos - 1) / 2;
+	if (m_timers[parent]->m_timeout <= t->m_timeout)
+	    break;
+	m_timers[pos] = m_timers[parent];
+	m_timers[pos]->m_timerPos = pos;
+	pos = parent;
+    }
+    for (;;) {
+	unsigned int child = 2 * pos + 1;
+	if (child >= m_timersCount)
+	    break;
+	if ((child + 1 < m_timersCount) && (m_timers[child + 1]->m_timeout < m_timers[child]->m_timeout))
+	    child++;
+	if (t->m_timeout <= m_timers[child]->m_timeout)
+	    break;
+	m_timers[pos] = m_timers[child];
+	m_timers[pos]->m_timerPos = pos;
+	pos = child;
+    }
+    m_timers[pos] = t;
+    t->m_timerPos = pos;
+}
+
+// Remove a transaction from the ready queue and timer heap
+void SIPShard::purge(SIPTransaction* transaction)
+{
+    timerRemove(transaction);
+    if (!transaction->m_ready)
+	return;
+    transaction->m_ready = false;
+    for (unsigned int i = 0; i < m_readyCount; i++) {
+	SIPTransaction*& t = m_ready[(m_readyHead + i) % m_readySize];
+	if (t == transaction)
+	    t = 0;
+    }
+}
+
+// Add a transaction to the indexes, at the start or end of its buckets
+void SIPShard::indexAdd(SIPTransaction* transaction, bool first, bool callId)
+{
+    if (transaction->getBranch()) {
+	String key;
+	branchKey(key,transaction->getBranch(),transaction->getMethod());
+	bucketAdd(m_branchIndex,key,transaction,first);
+    }
+    if (callId)
+	bucketAdd(m_callIdIndex,transaction->getCallID(),transaction,first);
+}
+
+// Remove a transaction from the indexes using its current keys
+void SIPShard::indexRemove(SIPTransaction* transaction, bool callId)
+{
+    if (transaction->getBranch()) {
+	String key;
+	branchKey(key,transaction->getBranch(),transaction->getMethod());
+	bucketRemove(m_branchIndex,key,transaction);
+    }
+    if (callId)
+	bucketRemove(m_callIdIndex,transaction->getCallID(),transaction);
+}
+
+
+SIPEngine::SIPEngine(const char* userAgent, unsigned int shards)
     : Mutex(true,"SIPEngine"),
       m_t1(500000), m_t4(5000000), m_reqTransCount(5), m_rspTransCount(6),
       m_maxForwards(70),
       m_flags(0), m_lazyTrying(false),
       m_userAgent(userAgent), m_nc(0), m_nonce_time(0),
       m_nonce_mutex(false,"SIPEngine::nonce"),
-      m_autoChangeParty(false)
+      m_autoChangeParty(false),
+      m_shards(0), m_shardCount(shards ? shards : 1), m_nextShard(0)
 {
     debugName("sipengine");
-    DDebug(this,DebugInfo,"SIPEngine::SIPEngine() [%p]",this);
+    DDebug(this,DebugInfo,"SIPEngine::SIPEngine(%u) [%p]",m_shardCount,this);
+    m_shards = new SIPShard*[m_shardCount];
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	m_shards[i] = new SIPShard(i);
     m_seq = new SIPSequence;
     m_seq->deref();
     if (m_userAgent.null())
@@ -191,6 +477,10 @@ SIPEngine::SIPEngine(const char* userAgent)
 SIPEngine::~SIPEngine()
 {
     DDebug(this,DebugInfo,"SIPEngine::~SIPEngine() [%p]",this);
+    clearTransactions();
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	delete m_shards[i];
+    delete[] m_shards;
 }
 
 SIPTransaction* SIPEngine::addMessage(SIPParty* ep, const char* buf, int len)
@@ -227,24 +517,29 @@ SIPTransaction* SIPEngine::addMessage(SIPMessage* message)
     String branch;
     if (br && br->startsWith("z9hG4bK"))
 	branch = *br;
-    Lock lock(this);
+    // all transactions of a call live in the same shard
+    const String& callId = message->getHeaderValue("Call-ID");
+    SIPShard* s = shard(callId);
+    Lock lock(s);
     SIPTransaction* forked = 0;
-    ObjList* l = &m_transList;
-    for (; l; l = l->next()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (!t)
-	    continue;
-	switch (t->processMessage(message,branch)) {
-	    case SIPTransaction::Matched:
-		return t;
-	    case SIPTransaction::NoDialog:
-		forked = t;
-		break;
-	    case SIPTransaction::NoMatch:
-	    default:
-		break;
+    SIPTransaction* t = 0;
+    if (branch) {
+	String key;
+	branchKey(key,branch,message->method);
+	t = bucketMatch(s->m_branchIndex,key,message,branch,forked);
+	if (!t && message->isACK()) {
+	    // ACK to a non-2xx shares the branch of the INVITE...
+	    branchKey(key,branch,YSTRING("INVITE"));
+	    t = bucketMatch(s->m_branchIndex,key,message,branch,forked);
+	    // ...while ACK to a 2xx is a new transaction of the same call
+	    if (!t)
+		t = bucketMatch(s->m_callIdIndex,callId,message,branch,forked,true);
 	}
     }
+    else
+	t = bucketMatch(s->m_callIdIndex,callId,message,branch,forked);
+    if (t)
+	return t;
     if (forked)
 	return forkInvite(message,forked);
 
@@ -260,6 +555,40 @@ SIPTransaction* SIPEngine::addMessage(SIPMessage* message)
     return new SIPTransaction(message,this,message->isOutgoing());
 }
 
+void SIPEngine::remove(SIPTransaction* transaction)
+{
+    if (transaction && transaction->m_shard)
+	transaction->m_shard->remove(transaction);
+}
+
+void SIPEngine::append(SIPTransaction* transaction)
+{
+    if (transaction && transaction->m_shard)
+	transaction->m_shard->add(transaction,false);
+}
+
+void SIPEngine::insert(SIPTransaction* transaction)
+{
+    if (transaction && transaction->m_shard)
+	transaction->m_shard->add(transaction,true);
+}
+
+void SIPEngine::clearTransactions()
+{
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	m_shards[i]->clear();
+}
+
+unsigned int SIPEngine::transactionCount()
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	Lock lock(m_shards[i]);
+	n += m_shards[i]->m_transList.count();
+    }
+    return n;
+}
+
 SIPTransaction* SIPEngine::forkInvite(SIPMessage* answer, SIPTransaction* trans)
 {
     // TODO: build new transaction or CANCEL
@@ -279,37 +608,71 @@ bool SIPEngine::process()
 
 SIPEvent* SIPEngine::getEvent()
 {
-    Lock lock(this);
-    ObjList* l = m_transList.skipNull();
-    if (!l)
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	SIPEvent* e = getEvent((m_nextShard++) % m_shardCount);
+	if (e)
+	    return e;
+    }
+    return 0;
+}
+
+SIPEvent* SIPEngine::getEvent(unsigned int index)
+{
+    SIPShard* s = shard(index);
+    if (!s)
 	return 0;
+    Lock lock(s);
     u_int64_t time = Time::now();
-    for (; l; l = l->skipNext()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	SIPEvent* e = t->getEvent(true,time);
-	if (e) {
-	    DDebug(this,DebugInfo,"Got pending event %p (state %s) from transaction %p [%p]",
-		e,SIPTransaction::stateName(e->getState()),t,this);
-	    if (t->getState() == SIPTransaction::Invalid)
-		m_transList.remove(t);
-	    return e;
-	}
+    // transactions whose timer expired get a chance to process it
+    while (s->m_timersCount && (s->m_timers[0]->m_timeout <= time)) {
+	SIPTransaction* t = s->m_timers[0];
+	s->timerRemove(t);
+	s->readyAdd(t);
     }
-    time = Time::now();
-    for (l = m_transList.skipNull(); l; l = l->skipNext()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
+    SIPTransaction* t;
+    while ((t = s->readyGet())) {
 	SIPEvent* e = t->getEvent(false,time);
 	if (e) {
 	    DDebug(this,DebugInfo,"Got event %p (state %s) from transaction %p [%p]",
 		e,SIPTransaction::stateName(e->getState()),t,this);
-	    if (t->getState() == SIPTransaction::Invalid)
-		m_transList.remove(t);
+	    if (t->getState() == SIPTransaction::Invalid) {
+		s->remove(t);
+		TelEngine::destruct(t);
+	    }
+	    else
+		// it may have more events, check it again first
+		s->readyAdd(t,true);
 	    return e;
 	}
+	s->timerUpdate(t);
     }
     return 0;
 }
 
+bool SIPEngine::waitEvent(u_int64_t maxwait, unsigned int index)
+{
+    SIPShard* s = shard(index);
+    if (!s)
+	return false;
+    s->lock();
+    if (s->m_readyCount) {
+	s->unlock();
+	return true;
+    }
+    if (s->m_timersCount) {
+	u_int64_t now = Time::now();
+	u_int64_t due = s->m_timers[0]->m_timeout;
+	if (due <= now) {
+	    s->unlock();
+	    return true;
+	}
+	if (due - now < maxwait)
+	    maxwait = due - now;
+    }
+    s->unlock();
+    return s->m_wakeup.lock((long)maxwait);
+}
+
 void SIPEngine::processEvent(SIPEvent *event)
 {
     if (!event)
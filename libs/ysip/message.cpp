@@ -23,12 +23,77 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 
 using namespace TelEngine;
 
 static Regexp s_angled("<\\([^>]\\+\\)>");
 
+static const TokenDict s_headerIds[] = {
+    { "Via", SIPMessage::HdrVia },
+    { "From", SIPMessage::HdrFrom },
+    { "To", SIPMessage::HdrTo },
+    { "Call-ID", SIPMessage::HdrCallId },
+    { "CSeq", SIPMessage::HdrCSeq },
+    { "Contact", SIPMessage::HdrContact },
+    { "Max-Forwards", SIPMessage::HdrMaxForwards },
+    { "Content-Length", SIPMessage::HdrContentLength },
+    { "Content-Type", SIPMessage::HdrContentType },
+    { "Route", SIPMessage::HdrRoute },
+    { "Record-Route", SIPMessage::HdrRecordRoute },
+    { "Expires", SIPMessage::HdrExpires },
+    { "Event", SIPMessage::HdrEvent },
+    { "Allow", SIPMessage::HdrAllow },
+    { "Supported", SIPMessage::HdrSupported },
+    { "Require", SIPMessage::HdrRequire },
+    { "WWW-Authenticate", SIPMessage::HdrWwwAuthenticate },
+    { "Proxy-Authenticate", SIPMessage::HdrProxyAuthenticate },
+    { "Authorization", SIPMessage::HdrAuthorization },
+    { "Proxy-Authorization", SIPMessage::HdrProxyAuthorization },
+    { 0, 0 }
+};
+
+static inline bool isBlank(char c)
+{
+    return (c == ' ') || (c == '\t');
+}
+
+// Get the next header line from buffer, trimmed of blanks
+// Points into the buffer unless the line is folded or has NUL characters,
+//  in that case an unfolded copy is returned in the folded string
+static const char* nextLine(const char*& buf, int& len, int& lineLen, String*& folded)
+{
+    const char* s = buf;
+    int e = 0;
+    while ((e < len) && s[e] && (s[e] != '\r') && (s[e] != '\n'))
+	e++;
+    int skip = 0;
+    if (e < len) {
+	if (s[e]) {
+	    skip = 1;
+	    if ((s[e] == '\r') && (e + 1 < len) && (s[e + 1] == '\n'))
+		skip = 2;
+	}
+	// continuation lines or NUL characters need the full unfolding
+	if (!skip || (e && (e + skip < len) && isBlank(s[e + skip]))) {
+	    folded = MimeBody::getUnfoldedLine(buf,len);
+	    lineLen = folded->length();
+	    return folded->c_str();
+	}
+    }
+    buf += e + skip;
+    len -= e + skip;
+    while (e && isBlank(*s)) {
+	s++;
+	e--;
+    }
+    while (e && isBlank(s[e - 1]))
+	e--;
+    lineLen = e;
+    return s;
+}
+
 SIPMessage::SIPMessage(const SIPMessage& original)
     : RefObject(),
       version(original.version), method(original.method), uri(original.uri),
@@ -38,6 +103,7 @@ SIPMessage::SIPMessage(const SIPMessage& original)
       m_outgoing(original.isOutgoing()), m_ack(original.isACK()),
       m_cseq(-1), m_flags(original.getFlags())
 {
+    ::memset(m_index,0,sizeof(m_index));
     DDebug(DebugAll,"SIPMessage::SIPMessage(&%p) [%p]",
 	&original,this);
     if (original.body)
@@ -68,6 +134,7 @@ SIPMessage::SIPMessage(const char* _method, const char* _uri, const char* _versi
       body(0), m_ep(0), m_valid(true),
       m_answer(false), m_outgoing(true), m_ack(false), m_cseq(-1), m_flags(-1)
 {
+    ::memset(m_index,0,sizeof(m_index));
     DDebug(DebugAll,"SIPMessage::SIPMessage('%s','%s','%s') [%p]",
 	_method,_uri,_version,this);
 }
@@ -76,6 +143,7 @@ SIPMessage::SIPMessage(SIPParty* ep, const char* buf, int len, unsigned int* bod
     : code(0), body(0), m_ep(ep), m_valid(false),
       m_answer(false), m_outgoing(false), m_ack(false), m_cseq(-1), m_flags(-1)
 {
+    ::memset(m_index,0,sizeof(m_index));
     DDebug(DebugInfo,"SIPMessage::SIPMessage(%p,%d) [%p]\r\n------\r\n%s------",
 	buf,len,this,buf);
     if (m_ep)
@@ -94,6 +162,7 @@ SIPMessage::SIPMessage(const SIPMessage* message, int _code, const char* _reason
       m_ep(0), m_valid(false),
       m_answer(true), m_outgoing(true), m_ack(false), m_cseq(-1), m_flags(-1)
 {
+    ::memset(m_index,0,sizeof(m_index));
     DDebug(DebugAll,"SIPMessage::SIPMessage(%p,%d,'%s') [%p]",
 	message,_code,_reason,this);
     if (!_reason)
@@ -123,6 +192,7 @@ SIPMessage::SIPMessage(const SIPMessage* original, const SIPMessage* answer)
       body(0), m_ep(0), m_valid(false),
       m_answer(false), m_outgoing(true), m_ack(true), m_cseq(-1), m_flags(-1)
 {
+    ::memset(m_index,0,sizeof(m_index));
     DDebug(DebugAll,"SIPMessage::SIPMessage(%p,%p) [%p]",original,answer,this);
     if (!(original && original->isValid()))
 	return;
@@ -142,7 +212,7 @@ SIPMessage::SIPMessage(const SIPMessage* original, const SIPMessage* answer)
 	    getParty()->appendAddr(tmp,true);
 	}
 	hl = new MimeHeaderLine("Via",tmp);
-	header.append(hl);
+	addHeader(hl);
     }
     if (answer && (answer->code == 200) && (original->method &= "INVITE")) {
 	String tmp("z9hG4bK");
@@ -245,7 +315,7 @@ void SIPMessage::complete(SIPEngine* engine, const char* user, const char* domai
 	    hl->setParam("alias");
 	if (!((flags & (NotReqRport|RportAfterBranch)) || isAnswer() || isACK()))
 	    hl->setParam("rport");
-	header.append(hl);
+	addHeader(hl);
     }
     if (!(isAnswer() || hl->getParam("branch"))) {
 	String tmp("z9hG4bK");
@@ -272,7 +342,7 @@ void SIPMessage::complete(SIPEngine* engine, const char* user, const char* domai
 		tmp << String::uriEscape(user,'@',"+?&") << "@";
 	    tmp << domain << ">";
 	    hl = new MimeHeaderLine("From",tmp);
-	    header.append(hl);
+	    addHeader(hl);
 	}
 	if (!hl->getParam("tag"))
 	    hl->setParam("tag",String((unsigned int)Random::random()));
@@ -283,7 +353,7 @@ void SIPMessage::complete(SIPEngine* engine, const char* user, const char* domai
 	String tmp;
 	tmp << "<" << uri << ">";
 	hl = new MimeHeaderLine("To",tmp);
-	header.append(hl);
+	addHeader(hl);
     }
     if (hl && dlgTag && !hl->getParam("tag"))
 	hl->setParam("tag",dlgTag);
@@ -358,7 +428,7 @@ bool SIPMessage::copyHeader(const SIPMessage* message, const char* name, const c
 {
     const MimeHeaderLine* hl = message ? message->getHeader(name) : 0;
     if (hl) {
-	header.append(hl->clone(newName));
+	addHeader(hl->clone(newName));
 	return true;
     }
     return false;
@@ -374,7 +444,7 @@ int SIPMessage::copyAllHeaders(const SIPMessage* message, const char* name, cons
 	const MimeHeaderLine* hl = static_cast<const MimeHeaderLine*>(l->get());
 	if (hl && (hl->name() &= name)) {
 	    ++c;
-	    header.append(hl->clone(newName));
+	    addHeader(hl->clone(newName));
 	}
     }
     return c;
@@ -419,66 +489,77 @@ bool SIPMessage::parseFirst(String& line)
 bool SIPMessage::parse(const char* buf, int len, unsigned int* bodyLen)
 {
     DDebug(DebugAll,"SIPMessage::parse(%p,%d) [%p]",buf,len,this);
-    String* line = 0;
+    String* folded = 0;
+    const char* line = 0;
+    int lineLen = 0;
     while (len > 0) {
-	line = MimeBody::getUnfoldedLine(buf,len);
-	if (!line->null())
+	line = nextLine(buf,len,lineLen,folded);
+	if (lineLen)
 	    break;
 	// Skip any initial empty lines
-	TelEngine::destruct(line);
+	TelEngine::destruct(folded);
     }
-    if (!line)
-	return false;
-    if (!parseFirst(*line)) {
-	line->destruct();
+    if (!lineLen) {
+	TelEngine::destruct(folded);
 	return false;
     }
-    line->destruct();
+    String first(line,lineLen);
+    TelEngine::destruct(folded);
+    if (!parseFirst(first))
+	return false;
     int clen = -1;
     while (len > 0) {
-	line = MimeBody::getUnfoldedLine(buf,len);
-	if (line->null()) {
+	line = nextLine(buf,len,lineLen,folded);
+	if (!lineLen) {
 	    // Found end of headers
-	    line->destruct();
+	    TelEngine::destruct(folded);
 	    break;
 	}
-	int col = line->find(':');
-	if (col <= 0) {
-	    line->destruct();
+	const char* col = (const char*)::memchr(line,':',lineLen);
+	int nameLen = col ? (col - line) : 0;
+	while (nameLen && isBlank(line[nameLen - 1]))
+	    nameLen--;
+	if (!nameLen) {
+	    TelEngine::destruct(folded);
 	    return false;
 	}
-	String name = line->substr(0,col);
-	name.trimBlanks();
-	if (name.null()) {
-	    line->destruct();
-	    return false;
+	String name(line,nameLen);
+	const char* hdr = uncompactForm(name);
+	const char* val = col + 1;
+	const char* end = line + lineLen;
+	while ((val < end) && isBlank(*val))
+	    val++;
+	String value(val,end - val);
+	TelEngine::destruct(folded);
+	XDebug(DebugAll,"SIPMessage::parse header='%s' value='%s'",hdr,value.c_str());
+
+	HeaderId id = headerId(hdr);
+	MimeHeaderLine* hl = 0;
+	switch (id) {
+	    case HdrWwwAuthenticate:
+	    case HdrProxyAuthenticate:
+	    case HdrAuthorization:
+	    case HdrProxyAuthorization:
+		hl = new MimeAuthLine(hdr,value);
+		break;
+	    default:
+		hl = new MimeHeaderLine(hdr,value);
 	}
-	name = uncompactForm(name);
-	*line >> ":";
-	line->trimBlanks();
-	XDebug(DebugAll,"SIPMessage::parse header='%s' value='%s'",name.c_str(),line->c_str());
-
-	if ((name &= "WWW-Authenticate") ||
-	    (name &= "Proxy-Authenticate") ||
-	    (name &= "Authorization") ||
-	    (name &= "Proxy-Authorization"))
-	    header.append(new MimeAuthLine(name,*line));
-	else
-	    header.append(new MimeHeaderLine(name,*line));
+	header.append(hl);
+	indexHeader(hl,id);
 
-	if ((clen < 0) && (name &= "Content-Length"))
-	    clen = line->toInteger(-1,10);
-	else if ((m_cseq < 0) && (name &= "CSeq")) {
-	    int sep = line->find(' ');
+	if ((clen < 0) && (id == HdrContentLength))
+	    clen = value.toInteger(-1,10);
+	else if ((m_cseq < 0) && (id == HdrCSeq)) {
+	    int sep = value.find(' ');
 	    if (sep > 0) {
-		m_cseq = line->substr(0,sep).toInteger(-1,10);
+		m_cseq = value.substr(0,sep).toInteger(-1,10);
 		if (m_answer) {
-		    method = line->substr(sep + 1);
+		    method = value.substr(sep + 1);
 		    method.trimBlanks().toUpper();
 		}
 	    }
 	}
-	line->destruct();
     }
     if (!bodyLen) {
 	if (clen >= 0) {
@@ -532,15 +613,54 @@ void SIPMessage::buildBody(const char* buf, int len)
 	    if (!delobj)
 		body->appendHdr(line);
 	}
+	headersChanged();
     }
     DDebug(DebugAll,"SIPMessage::buildBody %d header lines, body %p",
 	header.count(),body);
 }
 
+SIPMessage::HeaderId SIPMessage::headerId(const char* name)
+{
+    if (!(name && *name))
+	return HdrUnknown;
+    char c = ::tolower(*name);
+    for (const TokenDict* d = s_headerIds; d->token; d++) {
+	if ((::tolower(*d->token) == c) && !::strcasecmp(d->token,name))
+	    return (HeaderId)d->value;
+    }
+    return HdrUnknown;
+}
+
+void SIPMessage::indexHeader(MimeHeaderLine* line, HeaderId id)
+{
+    if (line && (id < HdrUnknown) && !m_index[id])
+	m_index[id] = line;
+}
+
+void SIPMessage::addHeader(MimeHeaderLine* line)
+{
+    if (!line)
+	return;
+    header.append(line);
+    indexHeader(line,headerId(line->name()));
+}
+
+void SIPMessage::headersChanged()
+{
+    ::memset(m_index,0,sizeof(m_index));
+    for (ObjList* l = header.skipNull(); l; l = l->skipNext()) {
+	MimeHeaderLine* t = static_cast<MimeHeaderLine*>(l->get());
+	indexHeader(t,headerId(t->name()));
+    }
+}
+
 const MimeHeaderLine* SIPMessage::getHeader(const char* name) const
 {
     if (!(name && *name))
 	return 0;
+    HeaderId id = headerId(name);
+    if (id < HdrUnknown)
+	return m_index[id];
     const ObjList* l = &header;
     for (; l; l = l->next()) {
 	const MimeHeaderLine* t = static_cast<const MimeHeaderLine*>(l->get());
@@ -568,14 +688,19 @@ void SIPMessage::clearHeaders(const char* name)
 {
     if (!(name && *name))
 	return;
+    bool changed = false;
     ObjList* l = &header;
     while (l) {
 	const MimeHeaderLine* t = static_cast<const MimeHeaderLine*>(l->get());
-	if (t && (t->name() &= name))
+	if (t && (t->name() &= name)) {
 	    l->remove();
+	    changed = true;
+	}
 	else
 	    l = l->next();
     }
+    if (changed)
+	headersChanged();
 }
 
 int SIPMessage::countHeaders(const char* name) const
@@ -30,7 +30,8 @@ using namespace TelEngine;
 SIPTransaction::SIPTransaction(SIPMessage* message, SIPEngine* engine, bool outgoing)
     : m_outgoing(outgoing), m_invite(false), m_transmit(false), m_state(Invalid),
       m_response(0), m_timeouts(0), m_timeout(0),
-      m_firstMessage(message), m_lastMessage(0), m_pending(0), m_engine(engine), m_private(0)
+      m_firstMessage(message), m_lastMessage(0), m_pending(0), m_engine(engine), m_private(0),
+      m_shard(0), m_ready(false), m_timerPos(-1)
 {
     DDebug(getEngine(),DebugAll,"SIPTransaction::SIPTransaction(%p,%p,%d) [%p]",
 	message,engine,outgoing,this);
@@ -66,6 +67,7 @@ SIPTransaction::SIPTransaction(SIPMessage* message, SIPEngine* engine, bool outg
     m_invite = (getMethod() == YSTRING("INVITE"));
     m_state = Initial;
     m_transCount = outgoing ? m_engine->getReqTransCount() : m_engine->getRspTransCount();
+    m_shard = m_engine->shard(m_callid);
     m_engine->append(this);
 }
 
@@ -77,7 +79,7 @@ SIPTransaction::SIPTransaction(SIPTransaction& original, SIPMessage* answer)
       m_firstMessage(original.m_firstMessage), m_lastMessage(original.m_lastMessage),
       m_pending(0), m_engine(original.m_engine),
       m_branch(original.m_branch), m_callid(original.m_callid), m_tag(original.m_tag),
-      m_private(0)
+      m_private(0), m_shard(original.m_shard), m_ready(false), m_timerPos(-1)
 {
     DDebug(getEngine(),DebugAll,"SIPTransaction::SIPTransaction(&%p,%p) [%p]",
 	&original,answer,this);
@@ -88,10 +90,15 @@ SIPTransaction::SIPTransaction(SIPTransaction& original, SIPMessage* answer)
     msg->complete(m_engine);
     msg->addHeader(auth);
     const NamedString* ns = msg->getParam("Via","branch",true);
+    // the original gets a new branch so move it in the shard's index
+    m_shard->lock();
+    m_shard->indexRemove(&original,false);
     if (ns)
 	original.m_branch = *ns;
     else
 	original.m_branch.clear();
+    m_shard->indexAdd(&original,false,false);
+    m_shard->unlock();
     ns = msg->getParam("To","tag");
     if (ns)
 	original.m_tag = *ns;
@@ -122,7 +129,7 @@ SIPTransaction::SIPTransaction(const SIPTransaction& original, const String& tag
       m_firstMessage(original.m_firstMessage), m_lastMessage(0),
       m_pending(0), m_engine(original.m_engine),
       m_branch(original.m_branch), m_callid(original.m_callid), m_tag(tag),
-      m_private(0)
+      m_private(0), m_shard(original.m_shard), m_ready(false), m_timerPos(-1)
 {
     if (m_firstMessage)
 	m_firstMessage->ref();
@@ -187,6 +194,8 @@ bool SIPTransaction::changeState(int newstate)
     DDebug(getEngine(),DebugAll,"SIPTransaction state changed from %s to %s [%p]",
 	stateName(m_state),stateName(newstate),this);
     m_state = newstate;
+    // new state may need processing at the next getEvent()
+    m_shard->readyAdd(this);
     return true;
 }
 
@@ -232,6 +241,14 @@ void SIPTransaction::setPendingEvent(SIPEvent* event, bool replace)
 	    delete event;
     else
 	m_pending = event;
+    if (m_pending)
+	m_shard->readyAdd(this);
+}
+
+void SIPTransaction::setTransmit()
+{
+    m_transmit = true;
+    m_shard->readyAdd(this);
 }
 
 void SIPTransaction::setTransCount(int count)
@@ -251,6 +268,7 @@ void SIPTransaction::setTimeout(u_int64_t delay, unsigned int count)
     m_timeouts = count;
     m_delay = delay;
     m_timeout = (count && delay) ? Time::now() + delay : 0;
+    m_shard->timerUpdate(this);
 #ifdef DEBUG
     if (m_timeout)
 	Debug(getEngine(),DebugAll,"SIPTransaction new %d timeouts initially " FMT64U " usec apart [%p]",
@@ -284,6 +302,7 @@ SIPEvent* SIPTransaction::getEvent(bool pendingOnly, u_int64_t time)
 	    timeout = --m_timeouts;
 	    m_delay *= 2; // exponential back-off
 	    m_timeout = (m_timeouts) ? time + m_delay : 0;
+	    m_shard->timerUpdate(this);
 	    DDebug(getEngine(),DebugAll,"SIPTransaction fired timer #%d [%p]",timeout,this);
 	}
     }
@@ -324,7 +343,7 @@ void SIPTransaction::setResponse(SIPMessage* message)
 	Debug(getEngine(),DebugWarn,"SIPTransaction::setResponse(%p) in client mode [%p]",message,this);
 	return;
     }
-    Lock lock(m_engine);
+    Lock lock(m_shard);
     setLatestMessage(message);
     setTransmit();
     if (message && (message->code >= 200)) {
@@ -710,7 +729,7 @@ void SIPTransaction::msgTransmitFailed(SIPMessage* msg)
 {
     if (!msg)
 	return;
-    Lock lock(getEngine());
+    Lock lock(m_shard);
     DDebug(getEngine(),DebugNote,
 	"SIPTransaction send failed state=%s msg=%p first=%p last=%p [%p]",
 	stateName(m_state),msg,m_firstMessage,m_lastMessage,this);
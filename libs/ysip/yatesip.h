@@ -52,6 +52,7 @@ extern YSIP_API TokenDict* SIPResponses;
 
 class SIPEngine;
 class SIPEvent;
+class SIPShard;
 
 class YSIP_API SIPParty : public RefObject
 {
@@ -161,6 +162,33 @@ public:
 	NoConnReuse       = 0x0040,      // Don't add 'alias' parameter to Via header (reliable only)
     };
 
+    /**
+     * Well known headers whose first occurrence is indexed for fast lookup
+     */
+    enum HeaderId {
+	HdrVia = 0,
+	HdrFrom,
+	HdrTo,
+	HdrCallId,
+	HdrCSeq,
+	HdrContact,
+	HdrMaxForwards,
+	HdrContentLength,
+	HdrContentType,
+	HdrRoute,
+	HdrRecordRoute,
+	HdrExpires,
+	HdrEvent,
+	HdrAllow,
+	HdrSupported,
+	HdrRequire,
+	HdrWwwAuthenticate,
+	HdrProxyAuthenticate,
+	HdrAuthorization,
+	HdrProxyAuthorization,
+	HdrUnknown                       // Not indexed, also the number of indexed headers
+    };
+
     /**
      * Copy constructor
      */
@@ -320,6 +348,21 @@ public:
      */
     const MimeHeaderLine* getHeader(const char* name) const;
 
+    /**
+     * Find a well known header line by its identifier
+     * @param id Identifier of the header to locate
+     * @return A pointer to the first matching header line or 0 if not found
+     */
+    inline const MimeHeaderLine* getHeader(HeaderId id) const
+	{ return (id < HdrUnknown) ? m_index[id] : 0; }
+
+    /**
+     * Find the identifier of a well known header
+     * @param name Name of the header, compact forms are not recognized
+     * @return Identifier of the header, HdrUnknown if it's not a well known one
+     */
+    static HeaderId headerId(const char* name);
+
     /**
      * Find the last header line that matches a given name name
      * @param name Name of the header to locate
@@ -366,14 +409,19 @@ public:
      * @param value Content of the new header line
      */
     inline void addHeader(const char* name, const char* value = 0)
-	{ header.append(new MimeHeaderLine(name,value)); }
+	{ addHeader(new MimeHeaderLine(name,value)); }
 
     /**
      * Append an already constructed header line
      * @param line Header line to add
      */
-    inline void addHeader(MimeHeaderLine* line)
-	{ header.append(line); }
+    void addHeader(MimeHeaderLine* line);
+
+    /**
+     * Rebuild the index of well known headers.
+     * This method must be called after directly changing the header list
+     */
+    void headersChanged();
 
     /**
      * Clear all header lines that match a name
@@ -498,6 +546,7 @@ public:
 
     /**
      * All the headers should be in this list.
+     * Call headersChanged() after adding or removing lines directly.
      */
     ObjList header;
 
@@ -524,6 +573,8 @@ protected:
     String m_authPass;
 private:
     SIPMessage(); // no, thanks
+    void indexHeader(MimeHeaderLine* line, HeaderId id);
+    MimeHeaderLine* m_index[HdrUnknown];
 };
 
 /**
@@ -843,6 +894,12 @@ public:
     inline SIPEngine* getEngine() const
 	{ return m_engine; }
 
+    /**
+     * The engine shard holding this transaction, selected by Call-ID
+     */
+    inline SIPShard* getShard() const
+	{ return m_shard; }
+
     /**
      * Check if this transaction was initiated by the remote peer or locally
      * @return True if the transaction was created by an outgoing message
@@ -914,8 +971,7 @@ public:
      * Set the (re)transmission flag that allows the latest outgoing message
      *  to be send over the wire
      */
-    inline void setTransmit()
-	{ m_transmit = true; }
+    void setTransmit();
 
     /**
      * Change transaction status to Cleared
@@ -1133,6 +1189,13 @@ protected:
     String m_callid;
     String m_tag;
     void *m_private;
+
+private:
+    friend class SIPEngine;
+    friend class SIPShard;
+    SIPShard* m_shard;
+    bool m_ready;
+    int m_timerPos;
 };
 
 /**
@@ -1218,17 +1281,75 @@ protected:
     int m_state;
 };
 
+/**
+ * A partition of the SIP engine transactions. Transactions are assigned to
+ *  a shard by the hash of their Call-ID so all transactions of a dialog are
+ *  matched and processed by the same shard
+ * @short A partition of the SIP transaction list
+ */
+class YSIP_API SIPShard : public Mutex
+{
+    friend class SIPEngine;
+    friend class SIPTransaction;
+    YNOCOPY(SIPShard);
+public:
+    /**
+     * Get the index of this shard in the engine
+     * @return Index of the shard
+     */
+    inline unsigned int index() const
+	{ return m_index; }
+
+    /**
+     * Get the list of transactions of this shard.
+     * The shard must be kept locked while using the list
+     * @return The list that holds the transactions of the shard
+     */
+    inline const ObjList& transactions() const
+	{ return m_transList; }
+
+private:
+    SIPShard(unsigned int index);
+    ~SIPShard();
+    void remove(SIPTransaction* transaction);
+    void add(SIPTransaction* transaction, bool first);
+    void clear();
+    void indexAdd(SIPTransaction* transaction, bool first, bool callId = true);
+    void indexRemove(SIPTransaction* transaction, bool callId = true);
+    void readyAdd(SIPTransaction* transaction, bool first = false);
+    SIPTransaction* readyGet();
+    void timerUpdate(SIPTransaction* transaction);
+    void timerRemove(SIPTransaction* transaction);
+    void timerMove(unsigned int pos);
+    void purge(SIPTransaction* transaction);
+    unsigned int m_index;
+    ObjList m_transList;
+    HashList m_branchIndex;
+    HashList m_callIdIndex;
+    SIPTransaction** m_ready;
+    unsigned int m_readySize;
+    unsigned int m_readyHead;
+    unsigned int m_readyCount;
+    SIPTransaction** m_timers;
+    unsigned int m_timersSize;
+    unsigned int m_timersCount;
+    Semaphore m_wakeup;
+};
+
 /**
  * The SIP engine holds common methods and the list of current transactions
  * @short The SIP engine and transaction list
  */
 class YSIP_API SIPEngine : public DebugEnabler, public Mutex
 {
+    friend class SIPTransaction;
 public:
     /**
      * Create the SIP Engine
+     * @param userAgent Value of the User-Agent header, NULL to use the default
+     * @param shards Number of shards to partition the transactions in
      */
-    SIPEngine(const char* userAgent = 0);
+    SIPEngine(const char* userAgent = 0, unsigned int shards = 1);
 
     /**
      * Destroy the SIP Engine
@@ -1302,13 +1423,33 @@ public:
 
     /**
      * Get a SIPEvent from the queue.
-     * This method mainly looks into the transaction list and get all kind of
-     * events, like an incoming request (INVITE, REGISTRATION), a timer, an
-     * outgoing message.
+     * This method looks into the transactions that changed or whose timer
+     * expired and gets all kind of events, like an incoming request (INVITE,
+     * REGISTRATION), a timer, an outgoing message.
+     * Shards are checked in turn so none of them is starved.
      * This method is thread safe
      */
     SIPEvent *getEvent();
 
+    /**
+     * Get a SIPEvent from the queue of a single shard.
+     * Each shard can be served by its own thread, events of a dialog are
+     *  always returned by the same shard.
+     * This method is thread safe
+     * @param shard Index of the shard to check
+     * @return A newly allocated event or NULL if none is available
+     */
+    SIPEvent* getEvent(unsigned int shard);
+
+    /**
+     * Wait until a transaction of a shard may have an event or a timer expires.
+     * This method is thread safe
+     * @param maxwait Maximum time to wait in microseconds
+     * @param shard Index of the shard to wait for
+     * @return True if an event may be available, false if timed out
+     */
+    bool waitEvent(u_int64_t maxwait, unsigned int shard = 0);
+
     /**
      * This method should be called very often to get the events from the list and
      * to send them to processEvent method.
@@ -1484,39 +1625,58 @@ public:
 	{ return m_allowed; }
 
     /**
-     * Remove a transaction from the list without dereferencing it
+     * Remove a transaction from the list and indexes without dereferencing it
      * @param transaction Pointer to transaction to remove
      */
-    inline void remove(SIPTransaction* transaction)
-	{ lock(); m_transList.remove(transaction,false); unlock(); }
+    void remove(SIPTransaction* transaction);
 
     /**
-     * Append a transaction to the end of the list
+     * Append a transaction to the end of the list and index it
      * @param transaction Pointer to transaction to append
      */
-    inline void append(SIPTransaction* transaction)
-	{ lock(); m_transList.append(transaction); unlock(); }
+    void append(SIPTransaction* transaction);
 
     /**
-     * Insert a transaction at the start of the list
+     * Insert a transaction at the start of the list and index it
      * @param transaction Pointer to transaction to insert
      */
-    inline void insert(SIPTransaction* transaction)
-	{ lock(); m_transList.insert(transaction); unlock(); }
+    void insert(SIPTransaction* transaction);
+
+    /**
+     * Remove and dereference all transactions
+     */
+    void clearTransactions();
 
     /**
      * Get the number of active SIP transactions
-     * @return Count of transactions in the list
+     * @return Count of transactions in all shards
      */
-    inline unsigned int transactionCount()
-	{ Lock mylock(this); return m_transList.count(); }
+    unsigned int transactionCount();
 
-protected:
     /**
-     * The list that holds all the SIP transactions.
+     * Get the number of shards the transactions are partitioned in
+     * @return Number of shards, at least one
      */
-    ObjList m_transList;
+    inline unsigned int shards() const
+	{ return m_shardCount; }
+
+    /**
+     * Get a shard by its index
+     * @param index Index of the shard
+     * @return Pointer to the shard, NULL if index is out of range
+     */
+    inline SIPShard* shard(unsigned int index) const
+	{ return (index < m_shardCount) ? m_shards[index] : 0; }
+
+    /**
+     * Get the shard holding the transactions of a call
+     * @param callId Call-ID of the transactions
+     * @return Pointer to the shard, never NULL
+     */
+    inline SIPShard* shard(const String& callId) const
+	{ return m_shards[callId.hash() % m_shardCount]; }
 
+protected:
     u_int64_t m_t1;
     u_int64_t m_t4;
     int m_reqTransCount;
@@ -1533,6 +1693,11 @@ protected:
     u_int32_t m_nonce_time;
     Mutex m_nonce_mutex;
     bool m_autoChangeParty;
+
+private:
+    SIPShard** m_shards;
+    unsigned int m_shardCount;
+    unsigned int m_nextShard;
 };
 
 }
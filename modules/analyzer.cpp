@@ -677,8 +677,10 @@ void AnalyzerChan::startChannel(NamedList& params)
 void AnalyzerChan::setDuration(NamedList& params)
 {
     int t = params.getIntValue("duration",120000);
-    if (t > 0)
+    if (t > 0) {
 	m_stopTime = Time::now() + 1000 * (uint64_t)t;
+	timerCheck(m_stopTime);
+    }
 }
 
 void AnalyzerChan::addSource()
@@ -29,6 +29,9 @@
 using namespace TelEngine;
 namespace { // anonymous
 
+// Number of independently locked partitions of the CDR table
+#define CDR_STRIPES 16
+
 enum {
     CdrStart,
     CdrCall,
@@ -131,18 +134,55 @@ class Hungup : public String
 public:
     inline Hungup(const String& id, bool emitHangup)
 	: String(id),
-	  m_hangup(emitHangup), m_expires(Time::now() + s_exp)
+	  m_next(0), m_hangup(emitHangup), m_expires(Time::now() + s_exp)
 	{ DDebug("cdrbuild",DebugInfo,"Hungup '%s'",id.c_str()); }
     inline u_int64_t expires() const
 	{ return m_expires; }
     inline bool hangup()
 	{ return m_hangup && !(m_hangup = false); }
     static u_int64_t s_exp;
+    // Next guard in expiration order
+    Hungup* m_next;
 private:
     bool m_hangup;
     u_int64_t m_expires;
 };
 
+// A partition of the CDR records and hungup guards with its own lock
+// All methods must be called with the stripe locked
+class CdrStripe : public Mutex
+{
+public:
+    CdrStripe();
+    ~CdrStripe();
+    inline CdrBuilder* find(const String& id) const
+	{ return static_cast<CdrBuilder*>(m_cdrs[id]); }
+    inline Hungup* findHungup(const String& id) const
+	{ return static_cast<Hungup*>(m_hungup[id]); }
+    inline const HashList& cdrs() const
+	{ return m_cdrs; }
+    inline unsigned int count() const
+	{ return m_count; }
+    inline unsigned int hungupCount() const
+	{ return m_hungupCount; }
+    void append(CdrBuilder* cdr);
+    // Remove and destroy a CDR record
+    void remove(CdrBuilder* cdr);
+    // Destroy all CDR records, return how many were destroyed
+    unsigned int clear();
+    // Add a guard for an ID, return false if one already exists
+    bool appendHungup(const String& id, bool emitHangup);
+    void expireHungup(u_int64_t now);
+private:
+    HashList m_cdrs;
+    HashList m_hungup;
+    // Guards are queued in creation order so the oldest expires first
+    Hungup* m_first;
+    Hungup* m_last;
+    unsigned int m_count;
+    unsigned int m_hungupCount;
+};
+
 class StatusThread : public Thread
 {
 public:
@@ -180,18 +220,19 @@ private:
 };
 
 
-static ObjList s_cdrs;
-static ObjList s_hungup;
+static CdrStripe s_stripes[CDR_STRIPES];
 CustomTimer m_startTime;
 CustomTimer m_answerTime;
 CustomTimer m_hangupTime;
 CustomTimer m_durationTime(true);
 u_int64_t Hungup::s_exp = 5000000;
 
-// This mutex protects both the CDR list and the params list
+// This mutex protects the configuration, the CDR stripes are locked too
+//  when changing parameters used while building records
 static Mutex s_mutex(false,"CdrBuild");
 static ObjList s_params;
 static int s_res = 1;
+static Mutex s_seqMutex(false,"CdrBuild::seq");
 static int s_seq = 0;
 static String s_runId;
 static bool s_cdrUpdates = true;
@@ -292,15 +333,88 @@ static const char* printTime(char* buf, u_int64_t usec, int count)
     return buf;
 }
 
+// Find the stripe holding an ID
+static inline CdrStripe& cdrStripe(const String& id)
+{
+    return s_stripes[id.hash() % CDR_STRIPES];
+}
+
+// Lock all stripes, always in the same order
+static void lockStripes()
+{
+    for (unsigned int i = 0; i < CDR_STRIPES; i++)
+	s_stripes[i].lock();
+}
+
+static void unlockStripes()
+{
+    for (unsigned int i = 0; i < CDR_STRIPES; i++)
+	s_stripes[i].unlock();
+}
+
+
+CdrStripe::CdrStripe()
+    : Mutex(false,"CdrBuild::stripe"),
+      m_cdrs(127), m_hungup(127),
+      m_first(0), m_last(0), m_count(0), m_hungupCount(0)
+{
+}
+
+CdrStripe::~CdrStripe()
+{
+    // records add hungup guards when destroyed so clear them first
+    clear();
+}
+
+void CdrStripe::append(CdrBuilder* cdr)
+{
+    m_cdrs.append(cdr);
+    m_count++;
+}
+
+void CdrStripe::remove(CdrBuilder* cdr)
+{
+    if (m_cdrs.remove(cdr,false,true)) {
+	m_count--;
+	TelEngine::destruct(cdr);
+    }
+}
+
+unsigned int CdrStripe::clear()
+{
+    unsigned int n = m_count;
+    m_cdrs.clear();
+    m_count = 0;
+    return n;
+}
+
+bool CdrStripe::appendHungup(const String& id, bool emitHangup)
+{
+    if (findHungup(id))
+	return false;
+    Hungup* h = new Hungup(id,emitHangup);
+    m_hungup.append(h);
+    if (m_last)
+	m_last->m_next = h;
+    else
+	m_first = h;
+    m_last = h;
+    m_hungupCount++;
+    return true;
+}
+
 // Expire hungup guard records
-static void expireHungup()
+// A shorter guard time set on reload may keep some guards a bit longer
+void CdrStripe::expireHungup(u_int64_t now)
 {
-    Time t;
-    while (Hungup* h = static_cast<Hungup*>(s_hungup.get())) {
-	if (h->expires() > t.usec())
-	    return;
+    while (m_first && (m_first->expires() <= now)) {
+	Hungup* h = m_first;
+	m_first = h->m_next;
+	if (!m_first)
+	    m_last = 0;
 	DDebug("cdrbuild",DebugInfo,"Expiring hungup guard for '%s'",h->c_str());
-	s_hungup.remove(h);
+	m_hungup.remove(h,true,true);
+	m_hungupCount--;
     }
 }
 
@@ -310,7 +424,9 @@ CdrBuilder::CdrBuilder(const char *name)
       m_first(true), m_write(true)
 {
     m_statusTime = m_start = m_call = m_ringing = m_answer = m_hangup = 0;
+    s_seqMutex.lock();
     m_cdrId = ++s_seq;
+    s_seqMutex.unlock();
 }
 
 CdrBuilder::~CdrBuilder()
@@ -321,8 +437,8 @@ CdrBuilder::~CdrBuilder()
 	    addParam("reason","CDR shutdown");
     }
     emit("finalize");
-    if (Hungup::s_exp && !s_hungup.find(*this))
-	s_hungup.append(new Hungup(*this,false));
+    if (Hungup::s_exp)
+	cdrStripe(*this).appendHungup(*this,false);
 }
 
 void CdrBuilder::emit(const char *operation)
@@ -467,7 +583,7 @@ bool CdrBuilder::update(const Message& msg, int type, u_int64_t val)
 	    if (reason)
 		setParam("reason",reason);
 	}
-	s_cdrs.remove(this);
+	cdrStripe(*this).remove(this);
 	return true;
     }
     // cdrwrite must be consistent over all emitted messages so we read it once
@@ -506,7 +622,7 @@ bool CdrBuilder::update(const Message& msg, int type, u_int64_t val)
     update(type,val);
 
     if (type == CdrHangup) {
-	s_cdrs.remove(this);
+	cdrStripe(*this).remove(this);
 	// object is now destroyed, "this" no longer valid
 	return false;
     }
@@ -515,20 +631,24 @@ bool CdrBuilder::update(const Message& msg, int type, u_int64_t val)
     return false;
 }
 
+// Find a record, the stripe holding the ID must be locked
 CdrBuilder* CdrBuilder::find(String &id)
 {
-    return static_cast<CdrBuilder*>(s_cdrs[id]);
+    return cdrStripe(id).find(id);
 }
 
 
 bool CdrHandler::received(Message &msg)
 {
-    Lock lock(s_mutex);
     if (m_type == EngHalt) {
-	unsigned int n = s_cdrs.count();
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < CDR_STRIPES; i++) {
+	    Lock lock(s_stripes[i]);
+	    n += s_stripes[i].clear();
+	}
 	if (n)
-	    Debug("cdrbuild",DebugWarn,"Forcibly finalizing %u CDR records.",n);
-	s_cdrs.clear();
+	    Debug("cdrbuild",DebugWarn,"Forcibly finalized %u CDR records.",n);
+	Lock lock(s_mutex);
 	if (s_updaterThread)
 	    s_updaterThread->exit();
 	return false;
@@ -555,15 +675,17 @@ bool CdrHandler::received(Message &msg)
     bool rval = false;
     int type = m_type;
     int level = DebugInfo;
-    CdrBuilder *b = CdrBuilder::find(id);
+    CdrStripe& stripe = cdrStripe(id);
+    Lock lock(stripe);
+    CdrBuilder *b = stripe.find(id);
     if (!b) {
 	switch (type) {
 	    case CdrStart:
 	    case CdrCall:
 	    case CdrAnswer:
 		{
-		    expireHungup();
-		    Hungup* h = static_cast<Hungup*>(s_hungup[id]);
+		    stripe.expireHungup(Time::now());
+		    Hungup* h = stripe.findHungup(id);
 		    if (h) {
 			if (h->hangup())
 			    // seen hangup but not emitted call.cdr - do it now
@@ -578,14 +700,12 @@ bool CdrHandler::received(Message &msg)
 		if ((type != CdrHangup) && !msg.getBoolValue(YSTRING("cdrcreate"),true))
 		    break;
 		b = new CdrBuilder(id);
-		s_cdrs.append(b);
+		stripe.append(b);
 		break;
 	    case CdrHangup:
-		expireHungup();
-		if (Hungup::s_exp && !s_hungup.find(id))
-		    // remember to emit a finalize if we ever see a startup
-		    s_hungup.append(new Hungup(id,true));
-		else
+		stripe.expireHungup(Time::now());
+		// remember to emit a finalize if we ever see a startup
+		if (!(Hungup::s_exp && stripe.appendHungup(id,true)))
 		    level = DebugMild;
 		break;
 	}
@@ -597,10 +717,13 @@ bool CdrHandler::received(Message &msg)
     } else
 	Debug("cdrbuild",level,"Got message '%s' for untracked id '%s'",
 	    msg.c_str(),id.c_str());
+    lock.drop();
     if ((type == CdrRinging) || (type == CdrProgress) || (type == CdrAnswer)) {
 	id = msg.getValue(YSTRING("peerid"));
 	if (id.null())
 	    id = msg.getValue(YSTRING("targetid"));
+	if (id)
+	    lock.acquire(cdrStripe(id));
 	if (id && (b = CdrBuilder::find(id))) {
 	    b->update(type,msg.msgTime().usec(),msg.getValue("status"));
 	    b->emit();
@@ -618,25 +741,34 @@ bool StatusHandler::received(Message &msg)
     if (!(TelEngine::null(sel) || (*sel == YSTRING("cdrbuild"))))
 	return false;
     String st("name=cdrbuild,type=cdr,format=Status|Caller|Called|BillId|Duration");
-    s_mutex.lock();
-    expireHungup();
-    st << ";cdrs=" << s_cdrs.count() << ",hungup=" << s_hungup.count();
-    if (msg.getBoolValue(YSTRING("details"),true)) {
-	st << ";";
-	ObjList *l = &s_cdrs;
-	bool first = true;
-	for (; l; l=l->next()) {
-	    CdrBuilder *b = static_cast<CdrBuilder *>(l->get());
-	    if (b) {
-		if (first)
-		    first = false;
-		else
-		    st << ",";
-		st << *b << "=" << b->getStatus();
+    bool details = msg.getBoolValue(YSTRING("details"),true);
+    unsigned int cdrs = 0;
+    unsigned int hungup = 0;
+    String list;
+    u_int64_t now = Time::now();
+    for (unsigned int i = 0; i < CDR_STRIPES; i++) {
+	CdrStripe& stripe = s_stripes[i];
+	Lock lock(stripe);
+	stripe.expireHungup(now);
+	cdrs += stripe.count();
+	hungup += stripe.hungupCount();
+	if (!details)
+	    continue;
+	const HashList& hash = stripe.cdrs();
+	for (unsigned int j = 0; j < hash.length(); j++) {
+	    for (ObjList* l = hash.getList(j); l; l = l->skipNext()) {
+		CdrBuilder *b = static_cast<CdrBuilder *>(l->get());
+		if (b) {
+		    if (list)
+			list << ",";
+		    list << *b << "=" << b->getStatus();
+		}
 	    }
 	}
     }
-    s_mutex.unlock();
+    st << ";cdrs=" << cdrs << ",hungup=" << hungup;
+    if (details)
+	st << ";" << list;
     msg.retValue() << st << "\r\n";
     return false;
 }
@@ -654,34 +786,36 @@ bool CommandHandler::received(Message &msg)
     return false;
 }
 
-void StatusThread::run()
+// Emit status for records whose status time has passed
+static void emitStatus(bool answered)
 {
-    // Check if we should emit cdr status
-    Time now;
-    s_mutex.lock();
-    for (ObjList* o = s_cdrs.skipNull();o;o = o->skipNext()) {
-	CdrBuilder* cdr = static_cast<CdrBuilder*>(o->get());
-	if (cdr->getStatus() != YSTRING("answered"))
-	    continue;
-	if (cdr->m_statusTime && (cdr->m_statusTime < now.msec())) {
-	    cdr->emit("status");
-	    cdr->m_statusTime = s_statusUpdate ? (now.msec() + s_statusUpdate) : (u_int64_t)-1;
+    for (unsigned int i = 0; i < CDR_STRIPES; i++) {
+	Lock lock(s_stripes[i]);
+	Time t;
+	const HashList& hash = s_stripes[i].cdrs();
+	for (unsigned int j = 0; j < hash.length(); j++) {
+	    for (ObjList* o = hash.getList(j); o; o = o->skipNext()) {
+		CdrBuilder* cdr = static_cast<CdrBuilder*>(o->get());
+		if (!cdr || (answered && (cdr->getStatus() != YSTRING("answered"))))
+		    continue;
+		if (cdr->m_statusTime && (cdr->m_statusTime < t.msec())) {
+		    cdr->emit("status");
+		    cdr->m_statusTime = s_statusUpdate ? (t.msec() + s_statusUpdate) : (u_int64_t)-1;
+		}
+	    }
 	}
     }
-    s_mutex.unlock();
+}
+
+void StatusThread::run()
+{
+    // Check if we should emit cdr status
+    emitStatus(true);
 
     // Check cdrs for timeout and emit cdr status
     while (!m_exit) {
 	Thread::msleep(m_maxSleep);
-	Lock lock(s_mutex);
-	Time t;
-	for (ObjList* o = s_cdrs.skipNull();o;o = o->skipNext()) {
-	    CdrBuilder* cdr = static_cast<CdrBuilder*>(o->get());
-	    if (cdr->m_statusTime && (cdr->m_statusTime < t.msec())) {
-		cdr->emit("status");
-		cdr->m_statusTime = s_statusUpdate ? (t.msec() + s_statusUpdate) : (u_int64_t)-1;
-	    }
-	}
+	emitStatus(false);
     }
 }
 
@@ -844,6 +978,7 @@ void CdrBuildPlugin::initialize()
     else if (exp > 600000)
 	exp = 600000;
     s_mutex.lock();
+    lockStripes();
     Hungup::s_exp = 1000 * (u_int64_t)exp;
     s_params.clear();
     const struct _params* params = s_defParams;
@@ -923,6 +1058,7 @@ void CdrBuildPlugin::initialize()
 	break;
     }
 
+    unlockStripes();
     s_mutex.unlock();
     if (m_first) {
 	m_first = false;
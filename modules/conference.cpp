@@ -23,6 +23,12 @@
 
 #include <yatephone.h>
 
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace TelEngine;
 namespace { // anonymous
 
@@ -35,6 +41,9 @@ namespace { // anonymous
 // maximum size we allow the buffer to grow
 #define MAX_BUFFER 960
 
+// capacity of the per channel sample ring buffer
+#define BUF_SAMPLES (MAX_BUFFER / 2)
+
 // minimum notification interval in msec
 #define MIN_INTERVAL 1000
 
@@ -42,6 +51,9 @@ namespace { // anonymous
 #define MAX_SPEAKERS 8
 #define DEF_SPEAKERS 3
 
+// maximum number of loudest speakers we mix when limiting the mix
+#define MAX_MIXERS 32
+
 // Speaking detector energy square hysteresis
 #define SPEAK_HIST_MIN 16384
 #define SPEAK_HIST_MAX 32768
@@ -75,6 +87,31 @@ class ConfConsumer;
 class ConfSource;
 class ConfChan;
 
+// Fixed size ring buffer holding the samples of a channel until mixed
+class ConfBuffer
+{
+public:
+    inline ConfBuffer()
+	: m_head(0), m_count(0)
+	{ }
+    inline unsigned int samples() const
+	{ return m_count; }
+    inline unsigned int length() const
+	{ return m_count * sizeof(int16_t); }
+    inline void clear()
+	{ m_head = m_count = 0; }
+    // Append samples at the end, fails if they don't fit
+    bool append(const int16_t* data, unsigned int samples);
+    // Drop samples from the start of the buffer
+    void consume(unsigned int samples);
+    // Get the contiguous samples starting at an offset, returns their count
+    unsigned int span(unsigned int offs, const int16_t*& data) const;
+private:
+    int16_t m_data[BUF_SAMPLES];
+    unsigned int m_head;
+    unsigned int m_count;
+};
+
 // The list of conference rooms
 static ObjList s_rooms;
 
@@ -145,9 +182,11 @@ private:
     unsigned int m_lonelyInterval;
     ConfChan* m_speakers[MAX_SPEAKERS];
     int m_trackSpeakers;
+    int m_mixSpeakers;
     int m_trackInterval;
     u_int64_t m_nextNotify;
     u_int64_t m_nextSpeakers;
+    int m_mix[BUF_SAMPLES];
 };
 
 // A conference channel is just a dumb holder of its data channels
@@ -191,7 +230,7 @@ class ConfConsumer : public DataConsumer
 public:
     ConfConsumer(ConfRoom* room, bool smart = false)
 	: m_room(room), m_src(0), m_muted(false), m_smart(smart), m_speak(false),
-	  m_energy2(ENERGY_MIN), m_noise2(ENERGY_MIN), m_envelope2(ENERGY_MIN)
+	  m_mixed(false), m_energy2(ENERGY_MIN), m_noise2(ENERGY_MIN), m_envelope2(ENERGY_MIN)
 	{ DDebug(DebugAll,"ConfConsumer::ConfConsumer(%p,%s) [%p]",room,String::boolText(smart),this); m_format = room->getFormat(); }
     ~ConfConsumer()
 	{ DDebug(DebugAll,"ConfConsumer::~ConfConsumer() [%p]",this); }
@@ -215,19 +254,21 @@ public:
     inline bool hasSignal() const
 	{ return (!m_muted) && (m_energy2 >= m_noise2); }
     inline bool shouldMix() const
-	{ return hasSignal() && (m_buffer.length() > 1); }
+	{ return hasSignal() && m_buffer.samples(); }
 private:
-    void consumed(const int* mixed, unsigned int samples);
-    void dataForward(const int* mixed, unsigned int samples);
+    void consumed(const int* mixed, const DataBlock& common, unsigned int samples);
+    void dataForward(const int* mixed, const DataBlock& common, unsigned int samples);
     RefPointer<ConfRoom> m_room;
     ConfSource* m_src;
     bool m_muted;
     bool m_smart;
     bool m_speak;
+    // set while mixing if our data was added to the mix
+    bool m_mixed;
     unsigned int m_energy2;
     unsigned int m_noise2;
     unsigned int m_envelope2;
-    DataBlock m_buffer;
+    ConfBuffer m_buffer;
 };
 
 // Per channel data source with that channel's data removed from the mix
@@ -305,6 +346,93 @@ static unsigned int binLog(unsigned int x)
     return v;
 }
 
+// Add samples to the mix accumulator
+static void mixAdd(int* mix, const int16_t* data, unsigned int samples)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= samples; i += 8) {
+	__m128i val = _mm_loadu_si128((const __m128i*)(data + i));
+	// sign extend by duplicating in both halves and shifting down
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(val,val),16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(val,val),16);
+	__m128i* m = (__m128i*)(mix + i);
+	_mm_storeu_si128(m,_mm_add_epi32(_mm_loadu_si128(m),lo));
+	_mm_storeu_si128(m + 1,_mm_add_epi32(_mm_loadu_si128(m + 1),hi));
+    }
+#endif
+    for (; i < samples; i++)
+	mix[i] += data[i];
+}
+
+// Saturate symmetrically the mix, optionally after substracting some data
+static void mixOut(int16_t* out, const int* mix, unsigned int samples, const int16_t* data = 0)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    const __m128i min = _mm_set1_epi16(-32767);
+    for (; i + 8 <= samples; i += 8) {
+	__m128i lo = _mm_loadu_si128((const __m128i*)(mix + i));
+	__m128i hi = _mm_loadu_si128((const __m128i*)(mix + i + 4));
+	if (data) {
+	    __m128i val = _mm_loadu_si128((const __m128i*)(data + i));
+	    lo = _mm_sub_epi32(lo,_mm_srai_epi32(_mm_unpacklo_epi16(val,val),16));
+	    hi = _mm_sub_epi32(hi,_mm_srai_epi32(_mm_unpackhi_epi16(val,val),16));
+	}
+	// packing saturates to -32768, raise that to keep the range symmetric
+	_mm_storeu_si128((__m128i*)(out + i),_mm_max_epi16(_mm_packs_epi32(lo,hi),min));
+    }
+#endif
+    for (; i < samples; i++) {
+	int val = mix[i];
+	if (data)
+	    val -= data[i];
+	out[i] = (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
+    }
+}
+
+
+bool ConfBuffer::append(const int16_t* data, unsigned int samples)
+{
+    if (m_count + samples > BUF_SAMPLES)
+	return false;
+    unsigned int tail = m_head + m_count;
+    if (tail >= BUF_SAMPLES)
+	tail -= BUF_SAMPLES;
+    unsigned int n = BUF_SAMPLES - tail;
+    if (n > samples)
+	n = samples;
+    ::memcpy(m_data + tail,data,n * sizeof(int16_t));
+    if (n < samples)
+	::memcpy(m_data,data + n,(samples - n) * sizeof(int16_t));
+    m_count += samples;
+    return true;
+}
+
+void ConfBuffer::consume(unsigned int samples)
+{
+    if (samples >= m_count) {
+	clear();
+	return;
+    }
+    m_count -= samples;
+    m_head += samples;
+    if (m_head >= BUF_SAMPLES)
+	m_head -= BUF_SAMPLES;
+}
+
+unsigned int ConfBuffer::span(unsigned int offs, const int16_t*& data) const
+{
+    if (offs >= m_count)
+	return 0;
+    unsigned int pos = m_head + offs;
+    if (pos >= BUF_SAMPLES)
+	pos -= BUF_SAMPLES;
+    data = m_data + pos;
+    unsigned int n = BUF_SAMPLES - pos;
+    return (n < m_count - offs) ? n : (m_count - offs);
+}
+
 
 // Get a pointer to a conference by name, optionally creates it with given parameters
 // If a pointer is returned it must be dereferenced by the caller
@@ -346,6 +474,7 @@ ConfRoom::ConfRoom(const String& name, const NamedList& params)
 	m_trackSpeakers = MAX_SPEAKERS;
     else if ((m_trackSpeakers == 0) && params.getBoolValue("speakers"))
 	m_trackSpeakers = DEF_SPEAKERS;
+    m_mixSpeakers = params.getIntValue("mixspeakers",0,0,MAX_MIXERS);
     m_trackInterval = params.getIntValue("interval",3000);
     if (m_trackInterval <= 0)
 	m_trackInterval = 0;
@@ -554,6 +683,8 @@ void ConfRoom::msgStatus(Message& msg)
 	msg.retValue() << ",notify=" << m_notify;
     if (m_playerId)
 	msg.retValue() << ",player=" << m_playerId;
+    if (m_mixSpeakers)
+	msg.retValue() << ",mixspeakers=" << m_mixSpeakers;
     msg.retValue() << "\r\n";
 }
 
@@ -655,7 +786,11 @@ void ConfRoom::mix(ConfConsumer* cons)
     unsigned int len = MAX_BUFFER;
     unsigned int mlen = 0;
     Lock mylock(this);
+    ConfConsumer* mixCons[MAX_MIXERS];
+    unsigned int mixVol[MAX_MIXERS];
+    int mixers = 0;
     // find out the minimum and maximum amount of data in buffers
+    //  and which channels will be mixed in
     ObjList* l = m_chans.skipNull();
     for (; l; l = l->skipNext()) {
 	ConfChan* ch = static_cast<ConfChan*>(l->get());
@@ -666,6 +801,28 @@ void ConfRoom::mix(ConfConsumer* cons)
 		len = buffered;
 	    if (mlen < buffered)
 		mlen = buffered;
+	    // avoid mixing in noise
+	    co->m_mixed = co->shouldMix();
+	    // keep only the loudest speakers if limited, always mix what we can't rank
+	    if (!(co->m_mixed && m_mixSpeakers && co->smart()))
+		continue;
+	    co->m_mixed = false;
+	    unsigned int vol = co->energy2();
+	    int pos = mixers;
+	    for (; pos > 0; pos--) {
+		if (vol <= mixVol[pos-1])
+		    break;
+		if (pos < m_mixSpeakers) {
+		    mixVol[pos] = mixVol[pos-1];
+		    mixCons[pos] = mixCons[pos-1];
+		}
+	    }
+	    if (pos < m_mixSpeakers) {
+		mixVol[pos] = vol;
+		mixCons[pos] = co;
+		if (mixers < m_mixSpeakers)
+		    mixers++;
+	    }
 	}
     }
     XDebug(DebugAll,"ConfRoom::mix() buffer %u - %u [%p]",len,mlen,this);
@@ -680,6 +837,8 @@ void ConfRoom::mix(ConfConsumer* cons)
     unsigned int chunks = len / DATA_CHUNK;
     if (!chunks)
 	return;
+    while (mixers--)
+	mixCons[mixers]->m_mixed = true;
     int speakVol[MAX_SPEAKERS];
     ConfChan* speakChan[MAX_SPEAKERS];
     int spk;
@@ -688,15 +847,13 @@ void ConfRoom::mix(ConfConsumer* cons)
 	speakChan[spk] = 0;
     }
     len = chunks * DATA_CHUNK / sizeof(int16_t);
-    DataBlock mixbuf(0,len*sizeof(int));
-    int* buf = (int*)mixbuf.data();
+    int* buf = m_mix;
+    ::memset(buf,0,len*sizeof(int));
     for (l = m_chans.skipNull(); l; l = l->skipNext()) {
 	ConfChan* ch = static_cast<ConfChan*>(l->get());
 	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
 	if (co) {
-	    // avoid mixing in noise
-	    if (co->shouldMix()) {
-		unsigned int n = co->m_buffer.length() / 2;
+	    if (co->m_mixed) {
 #ifdef XDEBUG
 		if (ch->debugAt(DebugAll)) {
 		    int noise = co->noise();
@@ -707,15 +864,20 @@ void ConfRoom::mix(ConfConsumer* cons)
 		    if (tip < 0)
 			tip = 0;
 		    Debug(ch,DebugAll,"Cons %p samp=%u |%s%s%s>",
-			co,n,String('#',noise).safe(),
+			co,co->m_buffer.samples(),String('#',noise).safe(),
 			String('=',energy).safe(),String('-',tip).safe());
 		}
 #endif
-		if (n > len)
-		    n = len;
-		const int16_t* p = (const int16_t*)co->m_buffer.data();
-		for (unsigned int i=0; i < n; i++)
-		    buf[i] += *p++;
+		const int16_t* p = 0;
+		for (unsigned int i = 0; i < len; ) {
+		    unsigned int n = co->m_buffer.span(i,p);
+		    if (!n)
+			break;
+		    if (n > len - i)
+			n = len - i;
+		    mixAdd(buf + i,p,n);
+		    i += n;
+		}
 	    }
 	    if (m_trackSpeakers && m_notify && !ch->isUtility() && co->speaking()) {
 		int vol = co->envelope();
@@ -732,21 +894,16 @@ void ConfRoom::mix(ConfConsumer* cons)
 	    }
 	}
     }
+    // the common mix is sent to everybody who did not contribute to it
+    DataBlock data(0,len*sizeof(int16_t));
+    mixOut((int16_t*)data.data(),buf,len);
     // we finished mixing - notify consumers about it
     for (l = m_chans.skipNull(); l; l = l->skipNext()) {
 	ConfChan* ch = static_cast<ConfChan*>(l->get());
 	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
 	if (co)
-	    co->consumed(buf,len);
+	    co->consumed(buf,data,len);
     }
-    DataBlock data(0,len*sizeof(int16_t));
-    int16_t* p = (int16_t*)data.data();
-    for (unsigned int i=0; i < len; i++) {
-	int val = buf[i];
-	// saturate symmetrically the result of addition
-	*p++ = (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
-    }
-    mixbuf.clear();
     Message* m = 0;
     while (m_trackSpeakers && m_notify) {
 	u_int64_t now = Time::now();
@@ -930,8 +1087,7 @@ unsigned long ConfConsumer::Consume(const DataBlock& data, unsigned long tStamp,
 	    m_muted = true;
 	return 0;
     }
-    if (m_buffer.length()+data.length() <= MAX_BUFFER)
-	m_buffer += data;
+    m_buffer.append((const int16_t*)data.data(),data.length() / 2);
     m_room->unlock();
     if (m_buffer.length() >= MIN_BUFFER)
 	m_room->mix(this);
@@ -940,12 +1096,12 @@ unsigned long ConfConsumer::Consume(const DataBlock& data, unsigned long tStamp,
 
 // Take out of the buffer the samples mixed in or skipped
 //  this method is called with the room locked
-void ConfConsumer::consumed(const int* mixed, unsigned int samples)
+void ConfConsumer::consumed(const int* mixed, const DataBlock& common, unsigned int samples)
 {
     if (!samples)
 	return;
-    dataForward(mixed,samples);
-    unsigned int n = m_buffer.length() / 2;
+    dataForward(mixed,common,samples);
+    unsigned int n = m_buffer.samples();
     if (samples > n) {
 	// buffer underflowed
 	m_buffer.clear();
@@ -959,12 +1115,12 @@ void ConfConsumer::consumed(const int* mixed, unsigned int samples)
 	}
 	return;
     }
-    samples *= sizeof(int16_t);
-    m_buffer.cut(-(int)samples);
+    m_buffer.consume(samples);
 }
 
 // Substract our own data from the mix and send it on the no-echo source
-void ConfConsumer::dataForward(const int* mixed, unsigned int samples)
+// If we did not contribute to the mix the common mix is sent instead
+void ConfConsumer::dataForward(const int* mixed, const DataBlock& common, unsigned int samples)
 {
     if (!(m_src && mixed))
 	return;
@@ -975,18 +1131,26 @@ void ConfConsumer::dataForward(const int* mixed, unsigned int samples)
     if (!src)
 	return;
 
-    int16_t* d = (int16_t*)m_buffer.data();
-    unsigned int n = m_buffer.length() / 2;
+    if (!m_mixed) {
+	src->Forward(common);
+	return;
+    }
     DataBlock data(0,samples*sizeof(int16_t));
     int16_t* p = (int16_t*)data.data();
-    for (unsigned int i=0; i < samples; i++) {
-	int val = *mixed++;
-	// substract our own data if we contributed - only as much as we have
-	if ((i < n) && shouldMix())
-	    val -= d[i];
-	// saturate symmetrically the result of additions and substraction
-	*p++ = (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
+    // substract our own data - only as much as we have
+    const int16_t* d = 0;
+    unsigned int i = 0;
+    while (i < samples) {
+	unsigned int n = m_buffer.span(i,d);
+	if (!n)
+	    break;
+	if (n > samples - i)
+	    n = samples - i;
+	mixOut(p + i,mixed + i,n,d);
+	i += n;
     }
+    if (i < samples)
+	::memcpy(p + i,(const int16_t*)common.data() + i,(samples - i) * sizeof(int16_t));
     src->Forward(data);
 }
 
@@ -1354,6 +1518,8 @@ bool ConferenceDriver::received(Message &msg, int id)
 	"notify" - ID used for "chan.notify" room notifications, an empty
 	    string (default) will disable notifications
 	"record" - route that will make an outgoing record-only call
+	"mixspeakers" - mix only this many of the loudest smart channels,
+	    the others hear a common mix; 0 (default) mixes everybody
     Input parameters - per conference leg:
 	"utility" - true creates a channel that is used for housekeeping
 	    tasks like recording or playing prompts to everybody
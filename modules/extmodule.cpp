@@ -56,6 +56,15 @@ namespace { // anonymous
 // Safety wait time after we flushed watchers, relays or messages (in ms)
 #define WAIT_FLUSH 5
 
+// Number of buckets used to index messages waiting for an answer
+#define WAITING_BUCKETS 64
+
+// Number of buckets in the message answer latency histogram
+#define LATENCY_BUCKETS 6
+
+// Length of a string that clears a parameter in binary message answers
+#define BIN_CLEAR 0xffffffff
+
 static Configuration s_cfg;
 static ObjList s_chans;
 static ObjList s_modules;
@@ -64,6 +73,8 @@ static Mutex s_watchMutex(false,"ExtWatchers");
 static int s_waitFlush = WAIT_FLUSH;
 static int s_timeout = MSG_TIMEOUT;
 static bool s_timebomb = false;
+static bool s_async = false;
+static int s_maxInflight = 0;
 static bool s_pluginSafe = true;
 static const char* s_trackName = 0;
 
@@ -76,12 +87,36 @@ static const char* s_cmds[] = {
     0
 };
 
+// Upper limits in milliseconds of the latency histogram buckets, the last one is unlimited
+static const unsigned int s_latencyLimits[LATENCY_BUCKETS - 1] = { 1, 10, 100, 1000, 10000 };
+
 static const char s_helpExternalCmd[] = "external [info] [stop scriptname] [[start|restart] scriptname [parameter]] [execute progname [parameter]]";
 static const char s_helpExternalInfo[] = "List, (re)start and stop scripts or execute an external program";
 
 class ExtModReceiver;
 class ExtModChan;
 
+// Binary framing of the protocol, negotiated with setlocal:binary:true
+// Each frame is a 32 bit big endian payload length followed by length
+//  prefixed strings, the first one holding the keyword (like %%>message)
+// Messages go on with id, time or processed flag, name and return value then
+//  a 32 bit parameter count and name/value string pairs, nothing is escaped
+// The other keywords carry the rest of their text line in a single string
+class BinReader
+{
+public:
+    inline BinReader(const unsigned char* data, unsigned int len)
+	: m_data(data), m_left(len)
+	{ }
+    inline bool eof() const
+	{ return !m_left; }
+    bool get32(u_int32_t& val);
+    bool get(String& str, bool* clear = 0);
+private:
+    const unsigned char* m_data;
+    unsigned int m_left;
+};
+
 class ExtModSource : public ThreadedSource
 {
 public:
@@ -168,6 +203,7 @@ public:
 	{ return m_receiver == recv; }
     inline int decode(const char* str)
 	{ return Message::decode(str,m_id); }
+    bool decode(BinReader& reader);
     inline const String& id() const
 	{ return m_id; }
 private:
@@ -179,13 +215,19 @@ private:
 class MsgHolder : public GenObject, public Semaphore
 {
 public:
-    MsgHolder(Message &msg);
+    MsgHolder(Message &msg, bool async = false, int timeout = 0);
     Message &m_msg;
     bool m_ret;
+    bool m_async;
     String m_id;
+    u_int64_t m_start;
+    u_int64_t m_expire;
     bool decode(const char *s);
+    bool decode(BinReader& reader);
     inline const Message* msg() const
 	{ return &m_msg; }
+    virtual const String& toString() const
+	{ return m_id; }
 };
 
 // Yet Another of Maciek's ideas
@@ -224,9 +266,13 @@ public:
     ~ExtModReceiver();
     virtual bool received(Message& msg, int id);
     bool processLine(const char* line);
+    bool processFrame(const unsigned char* data, unsigned int len);
     bool outputLine(const char* line);
+    bool outputMessage(const Message& msg, const char* id);
+    bool outputAnswer(const Message& msg, const char* id, bool accepted);
     void reportError(const char* line);
     void returnMsg(const Message* msg, const char* id, bool accepted);
+    void expirePending();
     bool addWatched(const String& name);
     bool delWatched(const String& name);
     bool start();
@@ -257,7 +303,11 @@ private:
     void closeIn();
     void closeOut();
     void closeAudio();
-    bool outputLineInternal(const char* line, int len);
+    bool outputData(const char* line, const Message* msg = 0, const char* id = 0,
+	int accepted = -1, int binary = -1);
+    bool outputDataInternal(const char* data, int len, bool eol);
+    void startMessage(ExtMessage* msg);
+    void answered(MsgHolder* holder);
     int m_role;
     bool m_dead;
     bool m_quit;
@@ -277,9 +327,17 @@ private:
     bool m_timebomb;
     bool m_restart;
     bool m_scripted;
+    bool m_async;
+    bool m_binary;
+    unsigned int m_maxInflight;
+    unsigned int m_inflight;
+    unsigned int m_overflows;
+    unsigned int m_timeouts;
+    unsigned int m_latency[LATENCY_BUCKETS];
     DataBlock m_buffer;
     String m_script, m_args;
-    ObjList m_waiting;
+    HashList m_waiting;
+    ObjList m_pending;
     ObjList m_relays;
     String m_trackName;
     String m_reason;
@@ -605,9 +663,108 @@ void ExtModChan::disconnected(bool final, const char *reason)
 }
 
 
-MsgHolder::MsgHolder(Message &msg)
-    : m_msg(msg), m_ret(false)
+// Read the parameter count and name/value pairs ending a binary frame
+static bool binParams(BinReader& reader, Message& msg)
 {
+    u_int32_t count = 0;
+    if (!reader.get32(count))
+	return false;
+    String name;
+    String value;
+    while (count--) {
+	bool clear = false;
+	if (!(reader.get(name) && name && reader.get(value,&clear)))
+	    return false;
+	if (clear)
+	    msg.clearParam(name);
+	else
+	    msg.setParam(name,value);
+    }
+    return reader.eof();
+}
+
+static inline unsigned char* binPut32(unsigned char* ptr, u_int32_t val)
+{
+    *ptr++ = (unsigned char)(val >> 24);
+    *ptr++ = (unsigned char)(val >> 16);
+    *ptr++ = (unsigned char)(val >> 8);
+    *ptr++ = (unsigned char)val;
+    return ptr;
+}
+
+static inline unsigned char* binPut(unsigned char* ptr, const char* str, unsigned int len)
+{
+    ptr = binPut32(ptr,len);
+    if (len)
+	::memcpy(ptr,str,len);
+    return ptr + len;
+}
+
+static inline unsigned char* binPut(unsigned char* ptr, const String& str)
+{
+    return binPut(ptr,str.c_str(),str.length());
+}
+
+// Build the binary frame of a message, sized in advance to allocate once
+static void binMessage(DataBlock& frame, const char* kind, const char* id,
+    const String& info, const Message& msg)
+{
+    const String& name = msg;
+    unsigned int kindLen = ::strlen(kind);
+    unsigned int idLen = TelEngine::null(id) ? 0 : ::strlen(id);
+    unsigned int len = 28 + kindLen + idLen + info.length() +
+	name.length() + msg.retValue().length();
+    unsigned int count = 0;
+    unsigned int n = msg.length();
+    for (unsigned int i = 0; i < n; i++) {
+	const NamedString* param = msg.getParam(i);
+	if (!param)
+	    continue;
+	count++;
+	len += 8 + param->name().length() + param->length();
+    }
+    frame.assign(0,len);
+    unsigned char* ptr = static_cast<unsigned char*>(frame.data());
+    ptr = binPut32(ptr,len - 4);
+    ptr = binPut(ptr,kind,kindLen);
+    ptr = binPut(ptr,id,idLen);
+    ptr = binPut(ptr,info);
+    ptr = binPut(ptr,name);
+    ptr = binPut(ptr,msg.retValue());
+    ptr = binPut32(ptr,count);
+    for (unsigned int i = 0; i < n; i++) {
+	const NamedString* param = msg.getParam(i);
+	if (!param)
+	    continue;
+	ptr = binPut(ptr,param->name());
+	ptr = binPut(ptr,*param);
+    }
+}
+
+// Build the binary frame of a text line, split in keyword and the rest
+static void binLine(DataBlock& frame, const char* line)
+{
+    const char* sep = ::strchr(line,':');
+    unsigned int kindLen = sep ? (sep - line) : ::strlen(line);
+    unsigned int restLen = sep ? ::strlen(sep + 1) : 0;
+    unsigned int len = 8 + kindLen;
+    if (sep)
+	len += 4 + restLen;
+    frame.assign(0,len);
+    unsigned char* ptr = static_cast<unsigned char*>(frame.data());
+    ptr = binPut32(ptr,len - 4);
+    ptr = binPut(ptr,line,kindLen);
+    if (sep)
+	binPut(ptr,sep + 1,restLen);
+}
+
+
+MsgHolder::MsgHolder(Message &msg, bool async, int timeout)
+    : m_msg(msg), m_ret(false), m_async(async),
+      m_start(Time::now()), m_expire(0)
+{
+    if (timeout > 0)
+	m_expire = m_start + 1000 * (u_int64_t)timeout;
     // the address of this object should be unique
     char buf[64];
     ::sprintf(buf,"%p.%ld",this,Random::random());
@@ -619,6 +776,51 @@ bool MsgHolder::decode(const char *s)
     return (m_msg.decode(s,m_ret,m_id) == -2);
 }
 
+// Decode the answer from a binary frame, the id was already matched
+bool MsgHolder::decode(BinReader& reader)
+{
+    String rcvd;
+    String name;
+    if (!(reader.get(rcvd) && reader.get(name) && reader.get(m_msg.retValue())))
+	return false;
+    m_ret = rcvd.toBoolean();
+    if (name)
+	m_msg.assign(name.c_str(),name.length());
+    return binParams(reader,m_msg);
+}
+
+
+bool BinReader::get32(u_int32_t& val)
+{
+    if (m_left < 4)
+	return false;
+    val = ((u_int32_t)m_data[0] << 24) | ((u_int32_t)m_data[1] << 16) |
+	((u_int32_t)m_data[2] << 8) | m_data[3];
+    m_data += 4;
+    m_left -= 4;
+    return true;
+}
+
+bool BinReader::get(String& str, bool* clear)
+{
+    u_int32_t len = 0;
+    if (!get32(len))
+	return false;
+    if (clear) {
+	*clear = (BIN_CLEAR == len);
+	if (*clear) {
+	    str.clear();
+	    return true;
+	}
+    }
+    if (len > m_left)
+	return false;
+    str.assign((const char*)m_data,len);
+    m_data += len;
+    m_left -= len;
+    return true;
+}
+
 
 ExtMessage::~ExtMessage()
 {
@@ -635,6 +837,20 @@ void ExtMessage::startup(ExtModReceiver* recv)
     Engine::enqueue(this);
 }
 
+// Decode a message generated by the script from a binary frame
+bool ExtMessage::decode(BinReader& reader)
+{
+    String tm;
+    String name;
+    if (!(reader.get(m_id) && reader.get(tm) && reader.get(name) && name
+	&& reader.get(retValue())))
+	return false;
+    assign(name.c_str(),name.length());
+    u_int64_t sec = tm.toInt64(0,10,0);
+    msgTime() = sec ? (1000000 * sec) : Time::now();
+    return binParams(reader,*this);
+}
+
 void ExtMessage::dispatched(bool accepted)
 {
     m_accepted = accepted;
@@ -778,8 +994,12 @@ ExtModReceiver::ExtModReceiver(const char* script, const char* args, File* ain,
       m_chan(chan), m_watcher(0),
       m_selfWatch(false), m_reenter(false), m_setdata(true), m_writing(false),
       m_timeout(s_timeout), m_timebomb(s_timebomb), m_restart(false), m_scripted(false),
-      m_buffer(0,DEF_INCOMING_LINE), m_script(script), m_args(args), m_trackName(s_trackName)
+      m_async(s_async), m_binary(false), m_maxInflight(s_maxInflight), m_inflight(0), m_overflows(0), m_timeouts(0),
+      m_buffer(0,DEF_INCOMING_LINE), m_script(script), m_args(args),
+      m_waiting(WAITING_BUCKETS), m_trackName(s_trackName)
 {
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+	m_latency[i] = 0;
     Debug(DebugAll,"ExtModReceiver::ExtModReceiver(\"%s\",\"%s\") [%p]",script,args,this);
     m_script.trimBlanks();
     m_args.trimBlanks();
@@ -796,8 +1016,12 @@ ExtModReceiver::ExtModReceiver(const char* name, Stream* io, ExtModChan* chan, i
       m_chan(chan), m_watcher(0),
       m_selfWatch(false), m_reenter(false), m_setdata(true), m_writing(false),
       m_timeout(s_timeout), m_timebomb(s_timebomb), m_restart(false), m_scripted(false),
-      m_buffer(0,DEF_INCOMING_LINE), m_script(name), m_args(conn), m_trackName(s_trackName)
+      m_async(s_async), m_binary(false), m_maxInflight(s_maxInflight), m_inflight(0), m_overflows(0), m_timeouts(0),
+      m_buffer(0,DEF_INCOMING_LINE), m_script(name), m_args(conn),
+      m_waiting(WAITING_BUCKETS), m_trackName(s_trackName)
 {
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+	m_latency[i] = 0;
     Debug(DebugAll,"ExtModReceiver::ExtModReceiver(\"%s\",%p,%p) [%p]",name,io,chan,this);
     m_script.trimBlanks();
     m_args.trimBlanks();
@@ -890,10 +1114,16 @@ bool ExtModReceiver::flush()
 	    p->setDelete(false);
     }
     bool flushed = false;
-    if (m_waiting.get()) {
+    if (m_inflight) {
 	Debug(DebugInfo,"ExtModReceiver releasing %u pending messages [%p]",
-	    m_waiting.count(),this);
+	    m_inflight,this);
 	m_waiting.clear();
+	m_inflight = 0;
+	// suspended messages go on to the other handlers
+	while (MsgHolder* h = static_cast<MsgHolder*>(m_pending.remove(false))) {
+	    Engine::resume(&h->m_msg,false);
+	    delete h;
+	}
 	needWait = flushed = true;
     }
     unlock();
@@ -981,13 +1211,42 @@ bool ExtModReceiver::received(Message &msg, int id)
 	unlock();
 	return false;
     }
+    if (m_maxInflight && (m_inflight >= m_maxInflight)) {
+	m_overflows++;
+	Debug(DebugMild,"ExtMod not relaying message %p '%s', %u already in flight [%p]",
+	    &msg,msg.c_str(),m_inflight,this);
+	unlock();
+	return false;
+    }
+
+    // A queued message can be suspended so no thread waits for the answer
+    // The call.execute handler (id 1) always needs the answer synchronously
+    if (m_async && !id && Engine::suspend(msg)) {
+	MsgHolder* h = new MsgHolder(msg,true,m_timeout);
+	if (outputMessage(msg,h->m_id)) {
+	    m_waiting.append(h)->setDelete(false);
+	    m_pending.append(h);
+	    m_inflight++;
+	    DDebug(DebugAll,"ExtMod suspended message %p '%s' [%p]",&msg,msg.c_str(),this);
+	    unlock();
+	    return false;
+	}
+	Debug(DebugWarn,"ExtMod could not queue message %p '%s' [%p]",&msg,msg.c_str(),this);
+	delete h;
+	unlock();
+	Engine::resume(&msg,false);
+	if (m_timebomb)
+	    die();
+	return false;
+    }
 
     use();
     bool fail = false;
     u_int64_t tout = (m_timeout > 0) ? Time::now() + 1000 * m_timeout : 0;
     MsgHolder h(msg);
-    if (outputLine(msg.encode(h.m_id))) {
+    if (outputMessage(msg,h.m_id)) {
 	m_waiting.append(&h)->setDelete(false);
+	m_inflight++;
 	DDebug(DebugAll,"ExtMod queued message %p '%s' [%p]",&msg,msg.c_str(),this);
     }
     else {
@@ -1002,11 +1261,13 @@ bool ExtModReceiver::received(Message &msg, int id)
     while (ok) {
 	h.lock(Thread::idleUsec());
 	lock();
-	ok = (m_waiting.find(&h) != 0);
+	ok = (m_waiting.find(&h,h.m_id.hash()) != 0);
 	if (ok && tout && (Time::now() > tout)) {
 	    Alarm("extmodule","performance",DebugWarn,"Message %p '%s' did not return in %d msec [%p]",
 		&msg,msg.c_str(),m_timeout,this);
-	    m_waiting.remove(&h,false);
+	    m_waiting.remove(&h,false,true);
+	    m_inflight--;
+	    m_timeouts++;
 	    ok = false;
 	    fail = true;
 	}
@@ -1146,6 +1407,7 @@ void ExtModReceiver::run()
     DDebug(DebugAll,"ExtModReceiver::run() entering loop [%p]",this);
     for (;;) {
 	use();
+	expirePending();
 	lock();
 	char* buffer = static_cast<char*>(m_buffer.data());
 	int readsize = m_in ? m_in->readData(buffer+posinbuf,m_buffer.length()-posinbuf) : 0;
@@ -1184,6 +1446,36 @@ void ExtModReceiver::run()
 	}
 	buffer[totalsize]=0;
 	for (;;) {
+	    if (m_binary) {
+		// binary frames may follow the line that enabled them
+		if (totalsize < 4)
+		    break;
+		const unsigned char* frame = reinterpret_cast<const unsigned char*>(buffer);
+		unsigned int flen = ((unsigned int)frame[0] << 24) | ((unsigned int)frame[1] << 16) |
+		    ((unsigned int)frame[2] << 8) | frame[3];
+		if (flen >= m_buffer.length() - 4) {
+		    Debug("ExtModule",DebugWarn,"Frame of length %u does not fit in buffer of length %u, closing [%p]",
+			flen,m_buffer.length(),this);
+		    return;
+		}
+		if (totalsize < (int)(flen + 4))
+		    break;
+		readsize = flen + 4;
+		invalid = false;
+		use();
+		bool goOut = processFrame(frame + 4,flen);
+		if (unuse() || goOut)
+		    return;
+		if (totalsize >= (int)m_buffer.length()) {
+		    Debug("ExtModule",DebugWarn,"Lost data shrinking read buffer to %u, closing [%p]",
+			m_buffer.length(),this);
+		    return;
+		}
+		totalsize -= readsize;
+		buffer = static_cast<char*>(m_buffer.data());
+		::memmove(buffer,buffer+readsize,totalsize+1);
+		continue;
+	    }
 	    char *eoline = ::strchr(buffer,'\n');
 	    if (!eoline && ((int)::strlen(buffer) < totalsize))
 		eoline=buffer+::strlen(buffer);
@@ -1217,10 +1509,29 @@ bool ExtModReceiver::outputLine(const char* line)
 {
     if (TelEngine::null(line))
 	return true;
-    int len = ::strlen(line);
+    return outputData(line);
+}
+
+bool ExtModReceiver::outputMessage(const Message& msg, const char* id)
+{
+    return outputData(0,&msg,id);
+}
+
+bool ExtModReceiver::outputAnswer(const Message& msg, const char* id, bool accepted)
+{
+    return outputData(0,&msg,id,accepted ? 1 : 0);
+}
+
+// Write a line, a message (accepted < 0) or a message answer using the framing
+//  in effect when the writer slot is acquired, optionally switching the framing
+//  (binary >= 0) before any other writer can get the slot
+bool ExtModReceiver::outputData(const char* line, const Message* msg, const char* id,
+    int accepted, int binary)
+{
     if (m_dead || !m_out || !m_out->valid() || !use())
 	return false;
     uint64_t tout = (m_timeout > 0) ? (Time::now() + 1000 * (uint64_t)m_timeout) : 0;
+    bool bin = false;
     for (;;) {
 	Lock mylock(this);
 	if (m_dead || !m_out || !m_out->valid()) {
@@ -1229,41 +1540,64 @@ bool ExtModReceiver::outputLine(const char* line)
 	}
 	if (!m_writing) {
 	    m_writing = true;
+	    bin = m_binary;
 	    break;
 	}
 	if (tout && tout < Time::now()) {
 	    if (!m_quit)
-		Alarm("extmodule","performance",DebugWarn,"Timeout %d msec for %d characters [%p]",
-		    m_timeout,len,this);
+		Alarm("extmodule","performance",DebugWarn,"Timeout %d msec waiting to write [%p]",
+		    m_timeout,this);
 	    unuse();
 	    return false;
 	}
 	mylock.drop();
 	Thread::idle();
     }
-    bool ok = outputLineInternal(line,len);
+    bool ok = false;
+    if (bin) {
+	DataBlock frame;
+	if (!msg)
+	    binLine(frame,line);
+	else if (accepted < 0)
+	    binMessage(frame,"%%>message",id,String((unsigned int)msg->msgTime().sec()),*msg);
+	else
+	    binMessage(frame,"%%<message",id,String::boolText(accepted > 0),*msg);
+	ok = outputDataInternal(static_cast<const char*>(frame.data()),frame.length(),false);
+    }
+    else if (msg) {
+	String text((accepted < 0) ? msg->encode(id) : msg->encode(accepted > 0,id));
+	ok = outputDataInternal(text.c_str(),text.length(),true);
+    }
+    else
+	ok = outputDataInternal(line,::strlen(line),true);
+    lock();
+    if (binary >= 0)
+	m_binary = (binary > 0);
     m_writing = false;
+    unlock();
     unuse();
     return ok;
 }
 
-bool ExtModReceiver::outputLineInternal(const char* line, int len)
+bool ExtModReceiver::outputDataInternal(const char* data, int len, bool eol)
 {
-    DDebug("ExtModReceiver",DebugAll,"outputLine len=%d '%s' [%p]",len,line,this);
+    DDebug("ExtModReceiver",DebugAll,"outputData len=%d%s [%p]",len,(eol ? " line" : ""),this);
     // since m_out can be non-blocking (the socket) we have to loop
     while (m_out && m_out->valid() && (len > 0) && !m_dead) {
-	int w = m_out->writeData(line,len);
+	int w = m_out->writeData(data,len);
 	if (w < 0) {
 	    if (m_dead || !m_out || !m_out->canRetry())
 		return false;
 	}
 	else {
-	    line += w;
+	    data += w;
 	    len -= w;
 	}
 	if (len > 0)
 	    Thread::idle();
     }
+    if (!eol)
+	return (len <= 0);
     char nl = '\n';
     for (;;) {
 	if (m_dead || !m_out)
@@ -1287,8 +1621,7 @@ void ExtModReceiver::reportError(const char* line)
 
 void ExtModReceiver::returnMsg(const Message* msg, const char* id, bool accepted)
 {
-    String ret(msg->encode(accepted,id));
-    if (!outputLine(ret) && m_timebomb)
+    if (!outputAnswer(*msg,id,accepted) && m_timebomb)
 	die();
 }
 
@@ -1356,21 +1689,16 @@ bool ExtModReceiver::processLine(const char* line)
 	return true;
     }
     else if (id.startsWith("%%<message:")) {
+	// keep the offsets in sync with length of "%%<message:"
+	int sep = id.find(':',11);
+	String mid;
+	if (sep > 11)
+	    mid = id.substr(11,sep - 11).msgUnescape();
 	Lock mylock(this);
-	ObjList *p = &m_waiting;
-	for (; p; p=p->next()) {
-	    MsgHolder *msg = static_cast<MsgHolder *>(p->get());
-	    if (msg && msg->decode(line)) {
-		DDebug("ExtModReceiver",DebugInfo,"Matched message %p [%p]",msg->msg(),this);
-		if (m_chan && (m_chan->waitMsg() == msg->msg())) {
-		    DDebug("ExtModReceiver",DebugNote,"Entering wait mode on channel %p [%p]",m_chan,this);
-		    m_chan->waitMsg(0);
-		    m_chan->waiting(true);
-		}
-		msg->unlock();
-		p->remove(false);
-		return false;
-	    }
+	MsgHolder* msg = static_cast<MsgHolder*>(m_waiting[mid]);
+	if (msg && msg->decode(line)) {
+	    answered(msg);
+	    return false;
 	}
 	Debug("ExtModReceiver",(m_dead ? DebugInfo : DebugWarn),
 	    "Unmatched%s message: %s [%p]",(m_dead ? " dead" : ""),line,this);
@@ -1497,6 +1825,26 @@ bool ExtModReceiver::processLine(const char* line)
 		val = m_timebomb;
 		ok = true;
 	    }
+	    else if (id == "asyncrelay") {
+		m_async = val.toBoolean(m_async);
+		val = m_async;
+		ok = true;
+	    }
+	    else if (id == "maxinflight") {
+		m_maxInflight = val.toInteger(m_maxInflight,0,0);
+		val = m_maxInflight;
+		ok = true;
+	    }
+	    else if (id == "binary") {
+		// the answer still uses the old framing, the new one starts after it
+		//  and is switched while holding the writer slot of the answer
+		bool bin = val.toBoolean(m_binary);
+		val = bin;
+		String out("%%<setlocal:");
+		out << id << ":" << val << ":" << true;
+		outputData(out,0,0,-1,bin ? 1 : 0);
+		return false;
+	    }
 	    else if (id == "bufsize") {
 		unsigned int len = val.toInteger(m_buffer.length(),0,
 		    MIN_INCOMING_LINE,MAX_INCOMING_LINE);
@@ -1573,52 +1921,7 @@ bool ExtModReceiver::processLine(const char* line)
     else {
 	ExtMessage* m = new ExtMessage;
 	if (m->decode(line) == -2) {
-	    DDebug("ExtModReceiver",DebugAll,"Created message %p '%s' [%p]",m,m->c_str(),this);
-	    lock();
-	    bool note = true;
-	    while (!m_dead && m_chan && m_chan->waiting()) {
-		if (note) {
-		    note = false;
-		    Debug("ExtModReceiver",DebugNote,"Waiting before enqueueing new message %p '%s' [%p]",
-			m,m->c_str(),this);
-		}
-		unlock();
-		Thread::yield();
-		if (m_dead) {
-		    m->destruct();
-		    return false;
-		}
-		lock();
-	    }
-	    ExtModChan* chan = 0;
-	    if ((m_role == RoleChannel) && !m_chan && m_setdata && (*m == "call.execute")) {
-		// we delayed channel creation as there was nothing to ref() it
-		chan = new ExtModChan(this);
-		m_chan = chan;
-		m->setParam("id",chan->id());
-	    }
-	    if (m_setdata)
-		m->userData(m_chan);
-	    // now the newly created channel is referenced by the message
-	    if (chan)
-		chan->deref();
-	    id = m->id();
-	    if (id && !chan) {
-		// Copy the user data pointer from waiting message with same id
-		ObjList *p = &m_waiting;
-		for (; p; p=p->next()) {
-		    MsgHolder *h = static_cast<MsgHolder *>(p->get());
-		    if (h && (h->m_id == id)) {
-			RefObject* ud = h->m_msg.userData();
-			Debug("ExtModReceiver",DebugAll,"Copying data pointer %p from %p '%s' [%p]",
-			    ud,h->msg(),h->msg()->c_str(),this);
-			m->userData(ud);
-			break;
-		    }
-		}
-	    }
-	    m->startup(this);
-	    unlock();
+	    startMessage(m);
 	    return false;
 	}
 	m->destruct();
@@ -1627,6 +1930,96 @@ bool ExtModReceiver::processLine(const char* line)
     return false;
 }
 
+// Enqueue a message received from the script
+void ExtModReceiver::startMessage(ExtMessage* m)
+{
+    DDebug("ExtModReceiver",DebugAll,"Created message %p '%s' [%p]",m,m->c_str(),this);
+    lock();
+    bool note = true;
+    while (!m_dead && m_chan && m_chan->waiting()) {
+	if (note) {
+	    note = false;
+	    Debug("ExtModReceiver",DebugNote,"Waiting before enqueueing new message %p '%s' [%p]",
+		m,m->c_str(),this);
+	}
+	unlock();
+	Thread::yield();
+	if (m_dead) {
+	    m->destruct();
+	    return;
+	}
+	lock();
+    }
+    ExtModChan* chan = 0;
+    if ((m_role == RoleChannel) && !m_chan && m_setdata && (*m == "call.execute")) {
+	// we delayed channel creation as there was nothing to ref() it
+	chan = new ExtModChan(this);
+	m_chan = chan;
+	m->setParam("id",chan->id());
+    }
+    if (m_setdata)
+	m->userData(m_chan);
+    // now the newly created channel is referenced by the message
+    if (chan)
+	chan->deref();
+    const String& id = m->id();
+    if (id && !chan) {
+	// Copy the user data pointer from waiting message with same id
+	MsgHolder* h = static_cast<MsgHolder*>(m_waiting[id]);
+	if (h) {
+	    RefObject* ud = h->m_msg.userData();
+	    Debug("ExtModReceiver",DebugAll,"Copying data pointer %p from %p '%s' [%p]",
+		ud,h->msg(),h->msg()->c_str(),this);
+	    m->userData(ud);
+	}
+    }
+    m->startup(this);
+    unlock();
+}
+
+// Process a binary frame, messages are decoded directly and the other
+//  keywords are handled like their text line
+bool ExtModReceiver::processFrame(const unsigned char* data, unsigned int len)
+{
+    if (m_dead)
+	return false;
+    if (m_quit)
+	return true;
+    BinReader reader(data,len);
+    String kind;
+    if (!reader.get(kind)) {
+	reportError("binary frame");
+	return false;
+    }
+    DDebug("ExtModReceiver",DebugAll,"processFrame len=%u '%s'",len,kind.c_str());
+    if ((kind == YSTRING("%%<message")) && (m_role != RoleUnknown)) {
+	String id;
+	Lock mylock(this);
+	MsgHolder* msg = reader.get(id) ? static_cast<MsgHolder*>(m_waiting[id]) : 0;
+	if (msg && msg->decode(reader)) {
+	    answered(msg);
+	    return false;
+	}
+	Debug("ExtModReceiver",(m_dead ? DebugInfo : DebugWarn),
+	    "Unmatched%s binary message: '%s' [%p]",(m_dead ? " dead" : ""),id.c_str(),this);
+	return false;
+    }
+    if ((kind == YSTRING("%%>message")) && (m_role != RoleUnknown)) {
+	ExtMessage* m = new ExtMessage;
+	if (m->decode(reader)) {
+	    startMessage(m);
+	    return false;
+	}
+	m->destruct();
+	reportError(kind);
+	return false;
+    }
+    String rest;
+    if (reader.get(rest))
+	kind << ":" << rest;
+    return processLine(kind);
+}
+
 void ExtModReceiver::describe(String& rval) const
 {
     rval << "\t";
@@ -1652,9 +2045,85 @@ void ExtModReceiver::describe(String& rval) const
 	rval << ", autorestart";
     if (m_pid > 0)
 	rval << ", pid=" << m_pid;
+    if (m_async)
+	rval << ", async";
+    rval << ", inflight=" << m_inflight;
+    if (m_maxInflight)
+	rval << "/" << m_maxInflight;
+    if (m_overflows)
+	rval << ", overflows=" << m_overflows;
+    if (m_timeouts)
+	rval << ", timeouts=" << m_timeouts;
+    rval << "\r\n\tLatency";
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+	if (i < LATENCY_BUCKETS - 1)
+	    rval << " <" << s_latencyLimits[i] << "ms:";
+	else
+	    rval << " more:";
+	rval << m_latency[i];
+    }
     rval << "\r\n";
 }
 
+// Release a message that got its answer, call with the receiver locked
+void ExtModReceiver::answered(MsgHolder* holder)
+{
+    DDebug("ExtModReceiver",DebugInfo,"Matched message %p [%p]",holder->msg(),this);
+    if (m_chan && (m_chan->waitMsg() == holder->msg())) {
+	DDebug("ExtModReceiver",DebugNote,"Entering wait mode on channel %p [%p]",m_chan,this);
+	m_chan->waitMsg(0);
+	m_chan->waiting(true);
+    }
+    m_waiting.remove(holder,false,true);
+    m_inflight--;
+    // account the answer time in the latency histogram
+    u_int64_t ms = (Time::now() - holder->m_start) / 1000;
+    int i = 0;
+    while ((i < LATENCY_BUCKETS - 1) && (ms >= s_latencyLimits[i]))
+	i++;
+    m_latency[i]++;
+    if (holder->m_async) {
+	Message* m = &holder->m_msg;
+	bool ret = holder->m_ret;
+	m_pending.remove(holder);
+	Engine::resume(m,ret);
+    }
+    else
+	holder->unlock();
+}
+
+// Release the suspended messages that did not get an answer in time
+// The timeout may differ between messages so check all of them
+void ExtModReceiver::expirePending()
+{
+    Lock mylock(this);
+    ObjList* l = m_pending.skipNull();
+    if (!l)
+	return;
+    u_int64_t now = Time::now();
+    bool fail = false;
+    while (l) {
+	MsgHolder* h = static_cast<MsgHolder*>(l->get());
+	if (!h->m_expire || (h->m_expire > now)) {
+	    l = l->skipNext();
+	    continue;
+	}
+	Alarm("extmodule","performance",DebugWarn,"Message %p '%s' did not return in %d msec [%p]",
+	    h->msg(),h->msg()->c_str(),(int)((now - h->m_start) / 1000),this);
+	m_waiting.remove(h,false,true);
+	m_inflight--;
+	m_timeouts++;
+	Message* m = &h->m_msg;
+	l->remove();
+	Engine::resume(m,false);
+	fail = true;
+	l = l->skipNull();
+    }
+    mylock.drop();
+    if (fail && m_timebomb)
+	die();
+}
+
 
 bool ExtModHandler::received(Message& msg)
 {
@@ -1976,6 +2445,8 @@ void ExtModulePlugin::initialize()
     s_cfg.load();
     s_timeout = s_cfg.getIntValue("general","timeout",MSG_TIMEOUT);
     s_timebomb = s_cfg.getBoolValue("general","timebomb",false);
+    s_async = s_cfg.getBoolValue("general","asyncrelay",false);
+    s_maxInflight = s_cfg.getIntValue("general","maxinflight",0,0);
     s_trackName = s_cfg.getBoolValue("general","trackparam",false) ?
 	name().c_str() : (const char*)0;
     int wf = s_cfg.getIntValue("general","waitflush",WAIT_FLUSH);
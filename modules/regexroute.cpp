@@ -30,6 +30,10 @@ namespace { // anonymous
 #define DEFAULT_RULE "^\\(false\\|no\\|off\\|disable\\|f\\|0*\\)$^"
 #define BLOCK_STACK 10
 #define MAX_VAR_LEN 8100
+// Maximum number of index prefixes a rule's character classes can expand to
+#define MAX_PREFIXES 256
+// Maximum length of an index prefix
+#define MAX_PREFIX_LEN 32
 
 static Configuration s_cfg;
 static const char* s_trackName = 0;
@@ -101,6 +105,171 @@ private:
     String m_match;
 };
 
+// A substitution template, text that needs no substitution is used as is
+class RouteTemplate : public String
+{
+public:
+    RouteTemplate(const String& text);
+    // Build the final text from the last match and message parameters
+    void apply(String& out, const String& match, Message& msg) const;
+private:
+    bool m_plain;
+};
+
+// Action of a rule: target with parameter assignments split at load time
+class RouteAction : public GenObject
+{
+public:
+    enum Type {
+	Set,
+	Echo,
+	Enter,
+	Dispatch,
+	Enqueue,
+	Nothing
+    };
+    RouteAction(const String& text);
+    inline Type type() const
+	{ return m_type; }
+    inline const ObjList& parts() const
+	{ return m_parts; }
+private:
+    Type m_type;
+    ObjList m_parts;
+};
+
+// One condition of a rule with its regular expression compiled at load time
+class RouteCond : public GenObject
+{
+public:
+    enum Source {
+	Plain,
+	Param,
+	Func,
+	BadParam,
+	BadFunc,
+	NoParam,
+	NoRule,
+	NoIf
+    };
+    enum Next {
+	End,
+	And,
+	Or
+    };
+    RouteCond(const String& rule, Source source = Plain);
+    ~RouteCond();
+    // Check if the condition matches, match must hold the matched string
+    bool matches(Message& msg, String& match, const String& context, unsigned int rule) const;
+    inline const String& rule() const
+	{ return m_rule; }
+    inline Source source() const
+	{ return m_source; }
+    inline Next next() const
+	{ return m_next; }
+    inline RouteAction* skip() const
+	{ return m_skip; }
+    // Set the connection to the next condition, build the action of a successful 'or'
+    void setNext(Next next, const String& rest = String::empty());
+    // Retrieve the number prefixes a matching string must start with
+    // Return false if the condition can't be indexed
+    bool prefixes(ObjList& list) const;
+private:
+    String m_rule;
+    Source m_source;
+    Next m_next;
+    bool m_match;
+    String m_text;
+    String m_default;
+    Regexp m_regexp;
+    RouteAction* m_skip;
+};
+
+// A configuration line compiled in a chain of conditions and an action
+class RouteRule : public GenObject
+{
+public:
+    RouteRule(const NamedString& line, unsigned int index);
+    ~RouteRule();
+    inline const String& name() const
+	{ return m_name; }
+    inline unsigned int index() const
+	{ return m_index; }
+    inline bool blockEnd() const
+	{ return m_blockEnd; }
+    inline bool blockStart() const
+	{ return m_blockStart; }
+    inline const ObjList& conds() const
+	{ return m_conds; }
+    inline RouteAction* action() const
+	{ return m_action; }
+    // Slot of the rule in the prefix index of its context, negative if not indexed
+    inline int slot() const
+	{ return m_slot; }
+    inline void slot(int pos)
+	{ m_slot = pos; }
+private:
+    String m_name;
+    unsigned int m_index;
+    int m_slot;
+    bool m_blockEnd;
+    bool m_blockStart;
+    ObjList m_conds;
+    RouteAction* m_action;
+};
+
+// Node of a digit trie indexing rules by the number prefix they are anchored to
+class RouteTrie
+{
+public:
+    RouteTrie();
+    ~RouteTrie();
+    // Add a rule under a prefix
+    void add(const char* prefix, const RouteRule* rule);
+    // Mark the slots of the rules whose prefix starts the string
+    void mark(const char* str, unsigned char* marks) const;
+private:
+    RouteTrie* m_next[10];
+    ObjList m_rules;
+};
+
+// All rules of a configuration section
+class RouteContext : public String
+{
+public:
+    RouteContext(const NamedList& sect);
+    inline const ObjList& rules() const
+	{ return m_rules; }
+    // Number of rules in the prefix index
+    inline unsigned int indexed() const
+	{ return m_indexed; }
+    // Mark the indexed rules that may match a string
+    void candidates(const String& str, DataBlock& marks) const;
+private:
+    ObjList m_rules;
+    RouteTrie m_trie;
+    unsigned int m_indexed;
+};
+
+// Immutable set of contexts compiled from the configuration
+class RouteProgram : public RefObject
+{
+public:
+    RouteProgram(const Configuration& cfg);
+    inline const RouteContext* context(const String& name) const
+	{ return static_cast<const RouteContext*>(m_contexts[name]); }
+    inline unsigned int rules() const
+	{ return m_rules; }
+    inline unsigned int indexed() const
+	{ return m_indexed; }
+private:
+    HashList m_contexts;
+    unsigned int m_rules;
+    unsigned int m_indexed;
+};
+
+static RefPointer<RouteProgram> s_program;
+
 class RegexRoutePlugin : public Plugin
 {
 public:
@@ -472,29 +641,25 @@ static void replaceFuncs(String &str, Message& msg)
 }
 
 // handle ;paramname[=value] assignments
-static void setMessage(const String& match, Message& msg, String& line, Message* target = 0)
+static void setMessage(const String& match, Message& msg, const ObjList& parts, String& line,
+    Message* target = 0)
 {
     if (!target)
 	target = &msg;
-    ObjList *strs = line.split(';');
     bool first = true;
-    for (ObjList *p = strs; p; p=p->next()) {
-	String *s = static_cast<String*>(p->get());
-	if (s) {
-	    *s = match.replaceMatches(*s);
-	    msg.replaceParams(*s);
-	    replaceFuncs(*s,msg);
-	}
+    for (ObjList* p = parts.skipNull(); p; p = p->skipNext()) {
+	String s;
+	static_cast<const RouteTemplate*>(p->get())->apply(s,match,msg);
 	if (first) {
 	    first = false;
-	    line = s ? *s : String::empty();
+	    line = s;
 	    continue;
 	}
-	if (s && !s->trimBlanks().null()) {
-	    int q = s->find('=');
+	if (!s.trimBlanks().null()) {
+	    int q = s.find('=');
 	    if (q > 0) {
-		String n = s->substr(0,q);
-		String v = s->substr(q+1);
+		String n = s.substr(0,q);
+		String v = s.substr(q+1);
 		n.trimBlanks();
 		v.trimBlanks();
 		DDebug("RegexRoute",DebugAll,"Setting '%s' to '%s'",n.c_str(),v.c_str());
@@ -504,19 +669,18 @@ static void setMessage(const String& match, Message& msg, String& line, Message*
 		    target->setParam(n,v);
 	    }
 	    else {
-		DDebug("RegexRoute",DebugAll,"Clearing parameter '%s'",s->c_str());
-		if (s->startSkip("$",false))
-		    s_vars.clearParam(*s);
+		DDebug("RegexRoute",DebugAll,"Clearing parameter '%s'",s.c_str());
+		if (s.startSkip("$",false))
+		    s_vars.clearParam(s);
 		else
-		    target->clearParam(*s);
+		    target->clearParam(s);
 	    }
 	}
     }
-    strs->destruct();
 }
 
 // helper function to set the default regexp
-static void setDefault(Regexp& reg)
+static void setDefault(String& reg)
 {
     if (s_defRule.null())
 	return;
@@ -531,69 +695,390 @@ static void setDefault(Regexp& reg)
     }
 }
 
-// helper function to process one match attempt
-static bool oneMatch(Message& msg, Regexp& reg, String& match, const String& context, unsigned int rule)
+RouteTemplate::RouteTemplate(const String& text)
+    : String(text),
+      m_plain(text.find('$') < 0 && text.find('\\') < 0)
+{
+}
+
+void RouteTemplate::apply(String& out, const String& match, Message& msg) const
+{
+    if (m_plain) {
+	out = *this;
+	return;
+    }
+    out = match.replaceMatches(*this);
+    msg.replaceParams(out);
+    replaceFuncs(out,msg);
+}
+
+
+RouteAction::RouteAction(const String& text)
+    : m_type(Set)
 {
+    String val(text);
+    if (val.startSkip("echo") || val.startSkip("output")) {
+	// special case: display the line but don't set params
+	m_type = Echo;
+	m_parts.append(new RouteTemplate(val));
+	return;
+    }
+    if (val == "{") {
+	m_type = Enter;
+	return;
+    }
+    bool disp = val.startSkip("dispatch");
+    if (disp || val.startSkip("enqueue")) {
+	if (!val || (val[0] == ';')) {
+	    m_type = Nothing;
+	    return;
+	}
+	m_type = disp ? Dispatch : Enqueue;
+    }
+    ObjList* strs = val.split(';');
+    for (ObjList* p = strs; p; p = p->next()) {
+	const String* s = static_cast<const String*>(p->get());
+	m_parts.append(new RouteTemplate(s ? *s : String::empty()));
+    }
+    TelEngine::destruct(strs);
+}
+
+
+RouteCond::RouteCond(const String& rule, Source source)
+    : m_rule(rule), m_source(source), m_next(End), m_match(true),
+      m_regexp(0,s_extended,s_insensitive), m_skip(0)
+{
+    if (Plain != m_source)
+	return;
+    String reg(rule);
     if (reg.startsWith("${")) {
 	// handle special matching by param ${paramname}regexp
 	int p = reg.find('}');
 	if (p < 3) {
-	    Debug("RegexRoute",DebugWarn,"Invalid parameter match '%s' in rule #%u in context '%s'",
-		reg.c_str(),rule,context.c_str());
-	    return false;
+	    m_source = BadParam;
+	    return;
 	}
-	match = reg.substr(2,p-2);
+	m_text = reg.substr(2,p-2);
 	reg = reg.substr(p+1);
-	match.trimBlanks();
+	m_text.trimBlanks();
 	reg.trimBlanks();
-	String def;
-	p = match.find('$');
+	p = m_text.find('$');
 	if (p >= 0) {
 	    // param is in ${<name>$<default>} format
-	    def = match.substr(p+1);
-	    match = match.substr(0,p);
-	    match.trimBlanks();
+	    m_default = m_text.substr(p+1);
+	    m_text = m_text.substr(0,p);
+	    m_text.trimBlanks();
 	}
 	setDefault(reg);
-	if (match.null() || reg.null()) {
-	    Debug("RegexRoute",DebugWarn,"Missing parameter or rule in rule #%u in context '%s'",
-		rule,context.c_str());
-	    return false;
+	if (m_text.null() || reg.null()) {
+	    m_source = NoParam;
+	    return;
 	}
-	DDebug("RegexRoute",DebugAll,"Using message parameter '%s' default '%s'",
-	    match.c_str(),def.c_str());
-	match = msg.getValue(match,def);
+	m_source = Param;
     }
     else if (reg.startsWith("$(")) {
 	// handle special matching by param $(function)regexp
 	int p = reg.find(')');
 	if (p < 3) {
-	    Debug("RegexRoute",DebugWarn,"Invalid function match '%s' in rule #%u in context '%s'",
-		reg.c_str(),rule,context.c_str());
-	    return false;
+	    m_source = BadFunc;
+	    return;
 	}
-	match = reg.substr(0,p+1);
+	m_text = reg.substr(0,p+1);
 	reg = reg.substr(p+1);
 	reg.trimBlanks();
 	setDefault(reg);
 	if (reg.null()) {
+	    m_source = NoRule;
+	    return;
+	}
+	m_source = Func;
+    }
+    if (reg.endsWith("^")) {
+	// reverse match on final ^ (makes no sense in a regexp)
+	m_match = false;
+	reg = reg.substr(0,reg.length()-1);
+    }
+    m_regexp = reg;
+    if (!(m_regexp.null() || m_regexp.compile()))
+	Debug("RegexRoute",DebugWarn,"Failed to compile regular expression '%s'",m_regexp.c_str());
+}
+
+RouteCond::~RouteCond()
+{
+    TelEngine::destruct(m_skip);
+}
+
+// Set the connection to the next condition
+// Find the action of a successful 'or' by skipping all remaining conditions
+void RouteCond::setNext(Next next, const String& rest)
+{
+    m_next = next;
+    if (Or != m_next)
+	return;
+    String val(rest);
+    do {
+	int p = val.find('=');
+	if (p < 0)
+	    return;
+	val = val.substr(p+1);
+	val.trimBlanks();
+    } while (val.startSkip("or") || val.startSkip("if") || val.startSkip("and"));
+    m_skip = new RouteAction(val);
+}
+
+// Retrieve the number prefixes a matching string must start with
+// Only positive matches of the routed string anchored on digits or digit
+//  classes qualify, a quantifier or anything else ends the prefix
+bool RouteCond::prefixes(ObjList& list) const
+{
+    if (!(Plain == m_source && m_match && (Or != m_next)))
+	return false;
+    const char* s = m_regexp.c_str();
+    if (!(s && (*s == '^')) || ::strchr(s,'|'))
+	return false;
+    unsigned int sets[MAX_PREFIX_LEN];
+    unsigned int sizes[MAX_PREFIX_LEN];
+    unsigned int count = 0;
+    unsigned int total = 1;
+    for (s++; count < MAX_PREFIX_LEN; ) {
+	unsigned int set = 0;
+	const char* p = s;
+	if (*p >= '0' && *p <= '9')
+	    set = 1 << (*p++ - '0');
+	else if (*p == '[' && p[1] != '^') {
+	    for (p++; *p && (*p != ']'); p++) {
+		if (*p < '0' || *p > '9')
+		    break;
+		if (p[1] == '-' && p[2] >= '0' && p[2] <= '9') {
+		    for (char c = *p; c <= p[2]; c++)
+			set |= 1 << (c - '0');
+		    p += 2;
+		}
+		else
+		    set |= 1 << (*p - '0');
+	    }
+	    if (*p++ != ']')
+		set = 0;
+	}
+	if (!set)
+	    break;
+	// a quantified atom is optional or repeated
+	if (*p == '*' || *p == '?' || *p == '+' || *p == '{' ||
+	    (*p == '\\' && (p[1] == '{' || p[1] == '?' || p[1] == '+')))
+	    break;
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < 10; i++)
+	    if (set & (1 << i))
+		n++;
+	if (total * n > MAX_PREFIXES)
+	    break;
+	total *= n;
+	sets[count] = set;
+	sizes[count++] = n;
+	s = p;
+    }
+    if (!count)
+	return false;
+    // expand character classes, each combination is a prefix
+    for (unsigned int k = 0; k < total; k++) {
+	String* pref = new String;
+	unsigned int rest = k;
+	for (unsigned int i = 0; i < count; i++) {
+	    unsigned int pick = rest % sizes[i];
+	    rest /= sizes[i];
+	    for (char c = '0'; c <= '9'; c++) {
+		if (!(sets[i] & (1 << (c - '0'))))
+		    continue;
+		if (!pick) {
+		    *pref << c;
+		    break;
+		}
+		pick--;
+	    }
+	}
+	list.append(pref);
+    }
+    return true;
+}
+
+// helper function to process one match attempt
+bool RouteCond::matches(Message& msg, String& match, const String& context, unsigned int rule) const
+{
+    switch (m_source) {
+	case BadParam:
+	    Debug("RegexRoute",DebugWarn,"Invalid parameter match '%s' in rule #%u in context '%s'",
+		m_rule.c_str(),rule,context.c_str());
+	    return false;
+	case BadFunc:
+	    Debug("RegexRoute",DebugWarn,"Invalid function match '%s' in rule #%u in context '%s'",
+		m_rule.c_str(),rule,context.c_str());
+	    return false;
+	case NoParam:
+	    Debug("RegexRoute",DebugWarn,"Missing parameter or rule in rule #%u in context '%s'",
+		rule,context.c_str());
+	    return false;
+	case NoRule:
 	    Debug("RegexRoute",DebugWarn,"Missing rule in rule #%u in context '%s'",
 		rule,context.c_str());
 	    return false;
-	}
-	DDebug("RegexRoute",DebugAll,"Using function '%s'",match.c_str());
-	msg.replaceParams(match);
-	replaceFuncs(match,msg);
+	case NoIf:
+	    Debug("RegexRoute",DebugWarn,"Missing 'if' in rule #%u in context '%s'",
+		rule,context.c_str());
+	    return false;
+	case Param:
+	    DDebug("RegexRoute",DebugAll,"Using message parameter '%s' default '%s'",
+		m_text.c_str(),m_default.c_str());
+	    match = msg.getValue(m_text,m_default);
+	    break;
+	case Func:
+	    DDebug("RegexRoute",DebugAll,"Using function '%s'",m_text.c_str());
+	    match = m_text;
+	    msg.replaceParams(match);
+	    replaceFuncs(match,msg);
+	    break;
+	default:
+	    break;
     }
     match.trimBlanks();
+    return (match.matches(m_regexp) == m_match);
+}
 
-    bool doMatch = true;
-    if (reg.endsWith("^")) {
-	// reverse match on final ^ (makes no sense in a regexp)
-	doMatch = false;
-	reg = reg.substr(0,reg.length()-1);
+
+RouteRule::RouteRule(const NamedString& line, unsigned int index)
+    : m_name(line.name()), m_index(index), m_slot(-1),
+      m_blockEnd(false), m_blockStart(false), m_action(0)
+{
+    static const Regexp s_blockStart("\\(=[[:space:]]*\\)\\?{$");
+    String reg(line.name());
+    if (reg.startSkip("}")) {
+	m_blockEnd = true;
+	if (reg.trimBlanks().null())
+	    reg = ".*";
+    }
+    m_blockStart = s_blockStart.matches(line);
+    String val(line);
+    for (;;) {
+	RouteCond* cond = new RouteCond(reg);
+	m_conds.append(cond);
+	if (val.startSkip("or"))
+	    cond->setNext(RouteCond::Or,val);
+	else if (val.startSkip("if") || val.startSkip("and"))
+	    cond->setNext(RouteCond::And);
+	else {
+	    m_action = new RouteAction(val);
+	    break;
+	}
+	int p = val.find('=');
+	if (p >= 1) {
+	    reg = val.substr(0,p);
+	    val = val.substr(p+1);
+	    reg.trimBlanks();
+	    val.trimBlanks();
+	    if (!reg.null())
+		continue;
+	}
+	m_conds.append(new RouteCond(val,RouteCond::NoIf));
+	break;
+    }
+}
+
+RouteRule::~RouteRule()
+{
+    TelEngine::destruct(m_action);
+}
+
+
+RouteTrie::RouteTrie()
+{
+    for (unsigned int i = 0; i < 10; i++)
+	m_next[i] = 0;
+}
+
+RouteTrie::~RouteTrie()
+{
+    for (unsigned int i = 0; i < 10; i++)
+	delete m_next[i];
+}
+
+// Add a rule under a prefix
+void RouteTrie::add(const char* prefix, const RouteRule* rule)
+{
+    RouteTrie* node = this;
+    for (; *prefix; prefix++) {
+	RouteTrie*& next = node->m_next[*prefix - '0'];
+	if (!next)
+	    next = new RouteTrie;
+	node = next;
+    }
+    node->m_rules.append(const_cast<RouteRule*>(rule))->setDelete(false);
+}
+
+// Mark the slots of the rules whose prefix starts the string
+void RouteTrie::mark(const char* str, unsigned char* marks) const
+{
+    const RouteTrie* node = this;
+    for (; str && *str >= '0' && *str <= '9'; str++) {
+	node = node->m_next[*str - '0'];
+	if (!node)
+	    break;
+	for (ObjList* o = node->m_rules.skipNull(); o; o = o->skipNext())
+	    marks[static_cast<const RouteRule*>(o->get())->slot()] = 1;
+    }
+}
+
+
+RouteContext::RouteContext(const NamedList& sect)
+    : String(sect),
+      m_indexed(0)
+{
+    unsigned int len = sect.length();
+    for (unsigned int i = 0; i < len; i++) {
+	const NamedString* n = sect.getParam(i);
+	if (!n)
+	    continue;
+	RouteRule* rule = new RouteRule(*n,i+1);
+	m_rules.append(rule);
+	// rules tested against the routed string are indexed by number prefix
+	const RouteCond* cond = static_cast<const RouteCond*>(rule->conds().get());
+	ObjList prefixes;
+	if (!(cond && cond->prefixes(prefixes)))
+	    continue;
+	rule->slot(m_indexed++);
+	for (ObjList* o = prefixes.skipNull(); o; o = o->skipNext())
+	    m_trie.add(static_cast<const String*>(o->get())->c_str(),rule);
+    }
+}
+
+// Mark the indexed rules that may match a string
+void RouteContext::candidates(const String& str, DataBlock& marks) const
+{
+    if (!m_indexed)
+	return;
+    if (marks.length() != m_indexed)
+	marks.assign(0,m_indexed);
+    else
+	::memset(marks.data(),0,m_indexed);
+    // conditions match the trimmed string
+    const char* s = str.c_str();
+    while (s && (*s == ' ' || *s == '\t'))
+	s++;
+    m_trie.mark(s,static_cast<unsigned char*>(marks.data()));
+}
+
+
+RouteProgram::RouteProgram(const Configuration& cfg)
+    : m_contexts(97), m_rules(0), m_indexed(0)
+{
+    unsigned int n = cfg.sections();
+    for (unsigned int i = 0; i < n; i++) {
+	const NamedList* sect = cfg.getSection(i);
+	if (!sect)
+	    continue;
+	RouteContext* ctx = new RouteContext(*sect);
+	m_rules += ctx->rules().count();
+	m_indexed += ctx->indexed();
+	m_contexts.append(ctx);
     }
-    return (match.matches(reg) == doMatch);
 }
 
 enum BlockState {
@@ -612,36 +1097,34 @@ static bool oneContext(Message &msg, String &str, const String &context, String
 	Debug("RegexRoute",DebugWarn,"Possible loop detected, current context '%s'",context.c_str());
 	return false;
     }
-    NamedList *l = s_cfg.getSection(context);
-    if (l) {
+    const RouteContext* ctx = s_program ? s_program->context(context) : 0;
+    if (ctx) {
 	unsigned int blockDepth = 0;
 	BlockState blockStack[BLOCK_STACK];
-	unsigned int len = l->length();
-	for (unsigned int i = 0; i < len; i++) {
-	    const NamedString* n = l->getParam(i);
-	    if (!n)
-		continue;
+	// indexed rules not marked here can't match the current string
+	DataBlock marks;
+	ctx->candidates(str,marks);
+	const unsigned char* marked = static_cast<const unsigned char*>(marks.data());
+	for (ObjList* o = ctx->rules().skipNull(); o; o = o->skipNext()) {
+	    const RouteRule* r = static_cast<const RouteRule*>(o->get());
+	    unsigned int i = r->index();
 	    BlockState blockThis = (blockDepth > 0) ? blockStack[blockDepth-1] : BlockRun;
 	    BlockState blockLast = BlockSkip;
-	    Regexp reg(n->name(),s_extended,s_insensitive);
-	    if (reg.startSkip("}")) {
+	    if (r->blockEnd()) {
 		if (!blockDepth) {
 		    Debug("RegexRoute",DebugWarn,"Got '}' outside block in line #%u in context '%s'",
-			i+1,context.c_str());
+			i,context.c_str());
 		    continue;
 		}
-		if (reg.trimBlanks().null())
-		    reg = ".*";
 		blockDepth--;
 		blockLast = blockThis;
 		blockThis = (blockDepth > 0) ? blockStack[blockDepth-1] : BlockRun;
 	    }
-	    static Regexp s_blockStart("\\(=[[:space:]]*\\)\\?{$");
-	    if (s_blockStart.matches(*n)) {
+	    if (r->blockStart()) {
 		// start of a new block
 		if (blockDepth >= BLOCK_STACK) {
 		    Debug("RegexRoute",DebugWarn,"Block stack overflow in line #%u in context '%s'",
-			i+1,context.c_str());
+			i,context.c_str());
 		    return false;
 		}
 		// assume block is done
@@ -655,90 +1138,75 @@ static bool oneContext(Message &msg, String &str, const String &context, String
 		}
 		blockStack[blockDepth++] = blockEnter;
 	    }
-	    XDebug("RegexRoute",DebugAll,"%s:%d(%u:%s) %s=%s",context.c_str(),i+1,
-		blockDepth,String::boolText(BlockRun == blockThis),
-		n->name().c_str(),n->c_str());
+	    XDebug("RegexRoute",DebugAll,"%s:%u(%u:%s) %s",context.c_str(),i,
+		blockDepth,String::boolText(BlockRun == blockThis),r->name().c_str());
 	    if (BlockRun != blockThis)
 		continue;
+	    if ((r->slot() >= 0) && !marked[r->slot()])
+		continue;
 
-	    String val(*n);
 	    String match;
-	    bool ok;
-	    do {
+	    const RouteAction* act = 0;
+	    for (ObjList* c = r->conds().skipNull(); c; c = c->skipNext()) {
+		const RouteCond* cond = static_cast<const RouteCond*>(c->get());
 		match = str;
-		ok = oneMatch(msg,reg,match,context,i+1);
-		if (ok) {
-		    if (val.startSkip("or")) {
-			do {
-			    int p = val.find('=');
-			    if (p < 0) {
-				Debug("RegexRoute",DebugWarn,"Malformed 'or' rule #%u in context '%s'",
-				    i+1,context.c_str());
-				ok = false;
-				break;
-			    }
-			    val = val.substr(p+1);
-			    val.trimBlanks();
-			} while (ok && (val.startSkip("or") || val.startSkip("if") || val.startSkip("and")));
+		if (cond->matches(msg,match,context,i)) {
+		    if (RouteCond::Or == cond->next()) {
+			act = cond->skip();
+			if (!act)
+			    Debug("RegexRoute",DebugWarn,"Malformed 'or' rule #%u in context '%s'",
+				i,context.c_str());
 			break;
 		    }
-		    if (!(val.startSkip("if") || val.startSkip("and")))
+		    if (RouteCond::End == cond->next()) {
+			act = r->action();
 			break;
-		}
-		else if (val.startSkip("or"))
-		    ok = true;
-		if (ok) {
-		    int p = val.find('=');
-		    if (p >= 1) {
-			reg = val.substr(0,p);
-			val = val.substr(p+1);
-			reg.trimBlanks();
-			val.trimBlanks();
-			if (!reg.null()) {
-			    NDebug("RegexRoute",DebugAll,"Secondary match rule '%s' by rule #%u in context '%s'",
-				reg.c_str(),i+1,context.c_str());
-			    continue;
-			}
 		    }
-		    Debug("RegexRoute",DebugWarn,"Missing 'if' in rule #%u in context '%s'",
-			i+1,context.c_str());
-		    ok = false;
 		}
-	    } while (ok);
-	    if (!ok)
-		continue;
-
-	    if (val.startSkip("echo") || val.startSkip("output")) {
-		// special case: display the line but don't set params
-		val = match.replaceMatches(val);
-		msg.replaceParams(val);
-		replaceFuncs(val,msg);
-		Output("%s",val.safe());
-		continue;
+		else if (RouteCond::Or != cond->next())
+		    break;
+#ifndef NDEBUG
+		const RouteCond* nextCond = c->skipNext() ?
+		    static_cast<const RouteCond*>(c->skipNext()->get()) : 0;
+		if (nextCond && (RouteCond::NoIf != nextCond->source()))
+		    Debug("RegexRoute",DebugAll,"Secondary match rule '%s' by rule #%u in context '%s'",
+			nextCond->rule().c_str(),i,context.c_str());
+#endif
 	    }
-	    else if (val == "{") {
-		// mark block as being processed now
-		if (blockDepth)
-		    blockStack[blockDepth-1] = BlockRun;
-		else
-		    Debug("RegexRoute",DebugWarn,"Got '{' outside block in line #%u in context '%s'",
-			i+1,context.c_str());
+	    if (!act)
 		continue;
-	    }
-	    bool disp = val.startSkip("dispatch");
-	    if (disp || val.startSkip("enqueue")) {
-		// special case: enqueue or dispatch a new message
-		if (val && (val[0] != ';')) {
+
+	    String val;
+	    switch (act->type()) {
+		case RouteAction::Echo:
+		    static_cast<const RouteTemplate*>(act->parts().get())->apply(val,match,msg);
+		    Output("%s",val.safe());
+		    continue;
+		case RouteAction::Enter:
+		    // mark block as being processed now
+		    if (blockDepth)
+			blockStack[blockDepth-1] = BlockRun;
+		    else
+			Debug("RegexRoute",DebugWarn,"Got '{' outside block in line #%u in context '%s'",
+			    i,context.c_str());
+		    continue;
+		case RouteAction::Nothing:
+		    continue;
+		case RouteAction::Dispatch:
+		case RouteAction::Enqueue:
+		{
+		    // special case: enqueue or dispatch a new message
+		    bool disp = (RouteAction::Dispatch == act->type());
 		    Message* m = new Message("");
 		    // parameters are set in the new message
-		    setMessage(match,msg,val,m);
+		    setMessage(match,msg,act->parts(),val,m);
 		    val.trimBlanks();
 		    if (val) {
 			*m = val;
 			m->userData(msg.userData());
 			NDebug("RegexRoute",DebugAll,"%s new message '%s' by rule #%u '%s' in context '%s'",
 			    (disp ? "Dispatching" : "Enqueueing"),
-			    val.c_str(),i+1,n->name().c_str(),context.c_str());
+			    val.c_str(),i,r->name().c_str(),context.c_str());
 			if (disp) {
 			    s_dispatching++;
 			    Engine::dispatch(m);
@@ -750,10 +1218,12 @@ static bool oneContext(Message &msg, String &str, const String &context, String
 			}
 		    }
 		    TelEngine::destruct(m);
+		    continue;
 		}
-		continue;
+		default:
+		    break;
 	    }
-	    setMessage(match,msg,val);
+	    setMessage(match,msg,act->parts(),val);
 	    warn = true;
 	    val.trimBlanks();
 	    if (val.null()) {
@@ -769,35 +1239,40 @@ static bool oneContext(Message &msg, String &str, const String &context, String
 	    else if (val.startSkip("goto") || val.startSkip("jump") ||
 		((val.startSkip("@goto") || val.startSkip("@jump")) && !(warn = false))) {
 		NDebug("RegexRoute",DebugAll,"Jumping to context '%s' by rule #%u '%s'",
-		    val.c_str(),i+1,n->name().c_str());
+		    val.c_str(),i,r->name().c_str());
 		return oneContext(msg,str,val,ret,warn,depth+1);
 	    }
 	    else if (val.startSkip("include") || val.startSkip("call") ||
 		((val.startSkip("@include") || val.startSkip("@call")) && !(warn = false))) {
 		NDebug("RegexRoute",DebugAll,"Including context '%s' by rule #%u '%s'",
-		    val.c_str(),i+1,n->name().c_str());
+		    val.c_str(),i,r->name().c_str());
 		if (oneContext(msg,str,val,ret,warn,depth+1)) {
 		    DDebug("RegexRoute",DebugAll,"Returning true from context '%s'", context.c_str());
 		    return true;
 		}
+		// the included context may have changed the match string
+		ctx->candidates(str,marks);
+		marked = static_cast<const unsigned char*>(marks.data());
 	    }
 	    else if (val.startSkip("match") || val.startSkip("newmatch")) {
 		if (!val.null()) {
 		    NDebug("RegexRoute",DebugAll,"Setting match string '%s' by rule #%u '%s' in context '%s'",
-			val.c_str(),i+1,n->name().c_str(),context.c_str());
+			val.c_str(),i,r->name().c_str(),context.c_str());
 		    str = val;
+		    ctx->candidates(str,marks);
+		    marked = static_cast<const unsigned char*>(marks.data());
 		}
 	    }
 	    else if (val.startSkip("rename")) {
 		if (!val.null()) {
 		    NDebug("RegexRoute",DebugAll,"Renaming message '%s' to '%s' by rule #%u '%s' in context '%s'",
-			msg.c_str(),val.c_str(),i+1,n->name().c_str(),context.c_str());
+			msg.c_str(),val.c_str(),i,r->name().c_str(),context.c_str());
 		    msg = val;
 		}
 	    }
 	    else {
 		DDebug("RegexRoute",DebugAll,"Returning '%s' for '%s' in context '%s' by rule #%u '%s'",
-		    val.c_str(),str.c_str(),context.c_str(),i+1,n->name().c_str());
+		    val.c_str(),str.c_str(),context.c_str(),i,r->name().c_str());
 		ret = val;
 		return true;
 	    }
@@ -882,6 +1357,8 @@ bool StatusHandler::received(Message &msg)
     Lock lock(s_mutex);
     msg.retValue() << "name=" << __plugin.name()
 	<< ",type=route;sections=" << s_cfg.count()
+	<< ",rules=" << (s_program ? s_program->rules() : 0)
+	<< ",indexed=" << (s_program ? s_program->indexed() : 0)
 	<< ",extra=" << s_extra.count()
 	<< ",variables=" << s_vars.count() << "\r\n";
     return !dest.null();
@@ -960,6 +1437,12 @@ void RegexRoutePlugin::initialize()
 	depth = 100;
     s_maxDepth = depth;
     s_defRule = s_cfg.getValue("priorities","defaultrule",DEFAULT_RULE);
+    // compile all rules once, replace the program used by routing
+    u_int64_t tmr = Time::now();
+    s_program = new RouteProgram(s_cfg);
+    s_program->deref();
+    Debug(DebugInfo,"Compiled %u rules (%u indexed by prefix) in %u sections in " FMT64U " usec",
+	s_program->rules(),s_program->indexed(),s_cfg.sections(),Time::now() - tmr);
     NamedList* l = s_cfg.getSection("extra");
     if (l) {
 	unsigned int len = l->length();
@@ -21,15 +21,20 @@
 
 #include <yatephone.h>
 
+#include <string.h>
+
 
 using namespace TelEngine;
 namespace { // anonymous
 
 class CacheItem;                         // A cache item
+class CacheShard;                        // A locked partition of a cache
 class Cache;                             // A cache hash list
 class CacheThread;                       // Base class for cache threads
 class CacheExpireThread;                 // Cache expire thread
 class CacheLoadThread;                   // Cache load thread
+class CacheSnapshotThread;               // Cache snapshot save thread
+class SnapshotReader;                    // Buffered cache snapshot file reader
 class EngineHandler;                     // engine.start/stop handler
 class CacheModule;
 
@@ -37,46 +42,154 @@ class CacheModule;
 #define EXPIRE_CHECK_MAX 300
 // Min value for cache reload interval in seconds
 #define CACHE_RELOAD_MIN 10
-
-class CacheItem : public NamedList
+// Max number of hash lists in a cache
+#define CACHE_SIZE_MAX 1048576
+// Max number of shards in a cache
+#define CACHE_SHARDS_MAX 64
+// Number of expire wheel slots, each slot holds items expiring in the same second
+#define CACHE_WHEEL_SLOTS 1024
+// Number of items checked by a matching removal before releasing the shard lock
+#define CACHE_MATCH_BATCH 256
+// Min value for cache snapshot interval in seconds
+#define SNAPSHOT_INTERVAL_MIN 60
+// Snapshot record header length: id length, data length, expire time
+#define SNAPSHOT_RECORD_HDR 16
+// Snapshot file read buffer length, a record can't be longer than this
+#define SNAPSHOT_BUFFER 65536
+
+class CacheItem : public GenObject
 {
-    friend class Cache;
+    friend class CacheShard;
 public:
-    inline CacheItem(const String& id, const NamedList& p, const String& copy,
-	u_int64_t expires)
-	: NamedList(id), m_expires(0)
-	{ update(p,copy,expires); }
-    inline void update(const NamedList& p, const String& copy, u_int64_t expires) {
-	    m_expires = expires;
-	    if (copy)
-		copyParams(p,copy);
-	    else
-		copyParams(p);
-	}
+    CacheItem(const String& id, const NamedList& p, const String& copy,
+	u_int64_t expires);
+    // Build from packed parameters (loaded from snapshot)
+    CacheItem(const String& id, const char* data, unsigned int len, u_int64_t expires);
+    virtual ~CacheItem();
+    virtual const String& toString() const
+	{ return m_id; }
     inline u_int64_t expires() const
 	{ return m_expires; }
     inline bool timeout(const Time& time) const
 	{ return m_expires && m_expires < time; }
+    // Approximate memory used by the item
+    inline unsigned int memSize() const
+	{ return sizeof(CacheItem) + m_id.length() + 1 + m_length; }
+    // Copy parameters in list to a destination, clear the ones not stored
+    void copyParams(NamedList& dest, const String& list) const;
+    // Copy all stored parameters to a destination
+    void fillParams(NamedList& dest) const;
+#ifdef XDEBUG
+    // Dump the item to a string
+    void dump(String& buf) const;
+#endif
 protected:
+    String m_id;
     u_int64_t m_expires;
+    char* m_data;                        // Parameters as null terminated name/value pairs
+    unsigned int m_length;               // Length of parameters data
+    CacheItem* m_hashNext;               // Next item in shard hash list
+    CacheItem* m_lruPrev;                // Previous (less recently used) item in shard
+    CacheItem* m_lruNext;                // Next (more recently used) item in shard
+    CacheItem* m_expPrev;                // Previous item in expire wheel slot
+    CacheItem* m_expNext;                // Next item in expire wheel slot
 };
 
-class Cache : public RefObject, public Mutex
+// A cache partition with its own lock, least recently used list and expire wheel
+class CacheShard : public Mutex
 {
 public:
-    Cache(const String& name, int size, const NamedList& params);
-    // Retrieve the number of items in cache
+    CacheShard(unsigned int size);
+    ~CacheShard();
     inline unsigned int count() const
 	{ return m_count; }
+    // Find an item, mark it as recently used. This method is not thread safe
+    CacheItem* find(const String& id);
+    // Add an item, replace an existing one unless it expires later
+    // Return the item kept in cache. The new item is destroyed if not used
+    // This method is not thread safe
+    CacheItem* add(CacheItem* item, bool& found);
+    // Remove an item
+    bool remove(const String& id);
+    // Remove items whose id is matched by a string (regexp)
+    unsigned int removeMatch(const String& match);
+    // Remove timed out items from wheel slots passed since last call
+    unsigned int expire(const Time& time);
+    // Remove least recently used items until count and memory limits are met
+    // This method is not thread safe
+    unsigned int trim(unsigned int maxCount, u_int64_t maxBytes, CacheItem* skip = 0);
+    // Remove all items
+    unsigned int clear();
+    // Increase miss counter
+    inline void miss() {
+	    Lock lck(this);
+	    m_misses++;
+	}
+    // Add shard counters to cache totals
+    void stats(u_int64_t* values);
+    // Write not expired items to a snapshot buffer, least recently used first
+    // Return the number of written items
+    unsigned int snapshot(DataBlock& buf, u_int64_t now);
+#ifdef XDEBUG
+    // Dump shard items to a string
+    unsigned int dump(String& buf, u_int64_t now);
+#endif
+private:
+    // Find the hash list link pointing to an item
+    CacheItem** findLink(const String& id);
+    // Link an item at most recently used position and in its expire wheel slot
+    void link(CacheItem* item);
+    // Remove an item from least recently used list and expire wheel
+    void unlink(CacheItem* item);
+    // Remove an item from shard and destroy it
+    void destroy(CacheItem* item);
+
+    CacheItem** m_items;                 // Hash lists of items by id
+    unsigned int m_size;                 // Number of hash lists
+    CacheItem* m_lruHead;                // Least recently used item
+    CacheItem* m_lruTail;                // Most recently used item
+    CacheItem* m_wheel[CACHE_WHEEL_SLOTS]; // Items with expire time by second
+    u_int64_t m_wheelSec;                // Last checked expire wheel second
+    unsigned int m_count;                // Current number of items
+    u_int64_t m_bytes;                   // Memory used by items
+    u_int64_t m_hits;                    // Number of found items
+    u_int64_t m_misses;                  // Number of items not found
+    u_int64_t m_evicted;                 // Number of items removed to meet limits
+    u_int64_t m_expired;                 // Number of timed out items
+};
+
+class Cache : public RefObject, public Mutex
+{
+public:
+    // Indexes of counters in stats() values
+    enum Stats {
+	StatCount = 0,
+	StatBytes,
+	StatHits,
+	StatMisses,
+	StatEvicted,
+	StatExpired,
+	StatTotal
+    };
+    Cache(const String& name, int size, int shards, const NamedList& params);
     // Retrieve the cache TTL
     inline u_int64_t cacheTtl() const
 	{ return m_cacheTtl; }
     // Check if the cache has reload set
     inline bool canReload()
 	{ return m_loadInterval != 0 || m_reload != 0; }
-    // Retrieve the mutex protecting a given list
-    inline unsigned int index(const String& str) const
-	{ return str.hash() % m_list.length(); }
+    // Check if the cache has a snapshot file
+    inline bool hasSnapshot() {
+	    Lock lck(this);
+	    return !m_snapshotFile.null();
+	}
+    // Check if items loaded from database should be added after loading the snapshot
+    inline bool snapshotReconcile() const
+	{ return m_snapshotReconcile; }
+    // Retrieve the shard holding an item
+    // Shard lists use the low part of the hash, select the shard from the high part
+    inline CacheShard& shard(const String& id) const
+	{ return *m_shards[(id.hash() / m_shardSize) % m_shardCount]; }
     // Safely retrieve the id matching parameter
     inline void getIdParam(String& param) {
 	    Lock lck(this);
@@ -108,28 +221,30 @@ public:
     bool startLoad();
     // Reset the loading flag. Set the next re-load time if we have an interval
     void endLoad(bool triggerReload);
+    // Check if a periodic snapshot is due, schedule the next one if true is returned
+    bool snapshotDue(const Time& time);
+    // Save not expired items to snapshot file. Return true on success
+    bool saveSnapshot();
+    // Load items from snapshot file and allow saving it
+    // Return the number of loaded items, negative if the file is missing or invalid
+    int loadSnapshot();
     // Copy params from cache item. Return true if found
     bool copyParams(const String& id, NamedList& list, const String* cpParams);
     // Add an item to the cache. Remove an existing one
     // Set dbSave=false when loading from database to avoid saving it again
-    void add(const String& id, const NamedList& params, const String* cpParams,
-	bool dbSave = true) {
-	    Lock lock(this);
-	    addUnsafe(id,params,cpParams,dbSave);
-	}
+    inline void add(const String& id, const NamedList& params, const String* cpParams,
+	bool dbSave = true)
+	{ addItem(id,params,cpParams,dbSave); }
     // Add items from NamedList list. Return the number of added items
     unsigned int add(ObjList& list);
-    // Add an item from an Array row
-    inline void add(Array& array, int row, int cols) {
-	    Lock lock(this);
-	    addUnsafe(array,row,cols);
-	}
     // Add items from Array rows. Return the number of added rows
     unsigned int addRows(Array& array);
     // Clear the cache
     unsigned int clear();
     // Remove an item, decrease the item counter
     unsigned int remove(const String& id, bool regexp = false);
+    // Retrieve cache counters, values must have StatTotal elements
+    void stats(u_int64_t* values) const;
     // Retrieve cache name
     virtual const String& toString() const;
     // Dump the cache to output if XDEBUG is defined
@@ -145,23 +260,21 @@ protected:
     // (Re)init
     void doUpdate(const NamedList& params, bool first);
     // Add an item to the cache. Remove an existing one
-    CacheItem* addUnsafe(const String& id, const NamedList& params, const String* cpParams,
-	bool dbSave = true);
-    // Add an item from an Array row
-    CacheItem* addUnsafe(Array& array, int row, int cols);
-    // Find a cache item. This method is not thread safe
-    CacheItem* find(const String& id);
-    // Find a cache item or prefix. This method is not thread safe
-    CacheItem* findPrefix(const String& id);
-    // Adjust cache length to limit
-    void adjustToLimit(CacheItem* skipAdded);
+    // Copy parameters of the item kept in cache to a destination if given
+    bool addItem(const String& id, const NamedList& params, const String* cpParams,
+	bool dbSave, NamedList* dest = 0, const String* destParams = 0);
+    // Find an item and copy its parameters. Return true if found
+    bool findCopy(const String& id, NamedList& list, const String& cpParams);
+    // Find an item or prefix and copy its parameters. Return true if found
+    bool findPrefixCopy(const String& id, NamedList& list, const String& cpParams);
 
     String m_name;                       // Cache name
-    HashList m_list;                     // The list holding the cache
+    CacheShard** m_shards;               // Cache partitions
+    unsigned int m_shardCount;           // Number of partitions
+    unsigned int m_shardSize;            // Number of hash lists in each partition
     u_int64_t m_cacheTtl;                // Cache item TTL (in us)
-    unsigned int m_count;                // Current number of items
     unsigned int m_limit;                // Limit the number of cache items
-    unsigned int m_limitOverflow;        // Allowed limit overflow
+    u_int64_t m_limitBytes;              // Limit the memory used by cache items
     unsigned int m_loadChunk;            // The number of items to load in each DB load query
     u_int32_t m_prefixMin;               // Minimum length of a prefix
     u_int32_t m_prefixMask;              // Bitmask of loaded lengths
@@ -181,6 +294,28 @@ protected:
     String m_queryLoadItemCmd;           // Database load item on command query
     String m_querySave;                  // Database save query
     String m_queryExpire;                // Database expire query
+    String m_snapshotFile;               // Snapshot file path
+    unsigned int m_snapshotInterval;     // Snapshot save interval (in seconds)
+    u_int64_t m_nextSnapshot;            // Next time to save the snapshot
+    bool m_snapshotReconcile;            // Load from database after snapshot load
+    bool m_snapshotReady;                // Snapshot loaded (or missing), it can be saved
+    bool m_snapshotSaving;               // Snapshot is being saved
+};
+
+// Buffered reader for cache snapshot files
+class SnapshotReader : public File
+{
+public:
+    inline SnapshotReader()
+	: m_buffer(0,SNAPSHOT_BUFFER), m_pos(0), m_len(0)
+	{}
+    // Retrieve the next len bytes from file. Return 0 on end of file or error
+    // Returned data is valid until next call
+    const unsigned char* get(unsigned int len);
+private:
+    DataBlock m_buffer;
+    unsigned int m_pos;
+    unsigned int m_len;
 };
 
 class CacheThread : public Thread, public GenObject
@@ -205,9 +340,10 @@ public:
 class CacheLoadThread : public CacheThread
 {
 public:
-    inline CacheLoadThread(const String name, Thread::Priority prio, ObjList* items)
+    inline CacheLoadThread(const String name, Thread::Priority prio, ObjList* items,
+	bool snapshot = false)
 	: CacheThread("CacheLoadThread",prio),
-	m_cache(name), m_items(items)
+	m_cache(name), m_items(items), m_snapshot(snapshot)
 	{}
     ~CacheLoadThread()
 	{ TelEngine::destruct(m_items); }
@@ -215,6 +351,19 @@ public:
 private:
     String m_cache;
     ObjList* m_items;
+    bool m_snapshot;                     // Load snapshot before database
+};
+
+class CacheSnapshotThread : public CacheThread
+{
+public:
+    inline CacheSnapshotThread(const String name)
+	: CacheThread("CacheSnapshotThread",Thread::Low),
+	m_cache(name)
+	{}
+    virtual void run();
+private:
+    String m_cache;
 };
 
 class CacheModule : public Module
@@ -244,6 +393,8 @@ public:
     // Optionally load specific items only (the list will be consumed)
     // Set async=false from loading thread
     void loadCache(const String& name, bool async = true, ObjList* items = 0);
+    // Fill a cache after engine start: load snapshot (if any) and database
+    void startCache(const String& name);
 protected:
     virtual void initialize();
     virtual bool received(Message& msg, int id);
@@ -266,6 +417,8 @@ protected:
     void commandLoad(Cache* cache, NamedList& params, String& retVal);
     // Cache flush handler
     void commandFlush(Cache* cache, NamedList& params, String& retVal);
+    // Cache snapshot handler
+    void commandSnapshot(Cache* cache, String& retVal);
     // Help message handler
     bool commandHelp(String& retVal, const String& line);
 
@@ -284,7 +437,9 @@ static bool s_lnpStoreFailed = false;    // Store failed LNP requests
 static bool s_lnpStoreNpdiBefore = true; // Store LNP when already done
 static bool s_cnamStoreEmpty = false;    // Store empty caller name in CNAM cache
 static unsigned int s_size = 0;          // The number of listst in each cache
+static unsigned int s_shards = 16;       // The number of shards in each cache
 static unsigned int s_limit = 0;         // Default cache limit
+static u_int64_t s_limitBytes = 0;       // Default cache memory limit
 static unsigned int s_loadChunk = 0;     // The number of cache items to load in each DB load query
 static unsigned int s_maxChunks = 1000;  // Maximum number of chunks to load in a cache
 static Thread::Priority s_loadPrio = Thread::Normal; // Cache load thread priority
@@ -300,18 +455,23 @@ static const String s_caches[] = {"lnp", "cnam", ""};
 enum CacheCommands {
     CmdLoad = 0,
     CmdFlush,
+    CmdSnapshot,
     CmdCount
 };
-static const String s_cmd[CmdCount] = {"load","flush"};
-static const String s_cmdCacheFormat = "cache {load|flush} cache_name [[param=value]...]";
+static const String s_cmd[CmdCount] = {"load","flush","snapshot"};
+static const String s_cmdCacheFormat = "cache {load|flush|snapshot} cache_name [[param=value]...]";
 static const String s_cmdFormat[CmdCount] = {
     "cache load cache_name [[param=value]...]",
-    "cache flush cache_name [[param=value]...]"
+    "cache flush cache_name [[param=value]...]",
+    "cache snapshot cache_name"
 };
 static const String s_cmdHelp[CmdCount] = {
     "Load a cache from database. Use 'id' (can be repeated) parameter to load specific item(s) only",
-    "Flush (clear) a cache's memory. Use 'id' (can be repeated) parameter to delete specific item(s) only"
+    "Flush (clear) a cache's memory. Use 'id' (can be repeated) parameter to delete specific item(s) only",
+    "Save a cache's items to its snapshot file"
 };
+// Cache snapshot file signature
+static const char s_snapshotMagic[8] = {'Y','C','S','N','A','P','0','1'};
 
 
 class EngineHandler : public MessageHandler
@@ -342,18 +502,19 @@ static inline unsigned int safeValue(int val)
 // Adjust a cache size
 static inline unsigned int adjustedCacheSize(int val)
 {
-    if (val >= 3 && val <= 1024)
+    if (val >= 3 && val <= CACHE_SIZE_MAX)
 	return val;
-    if (val > 1024)
-	return 1024;
+    if (val > CACHE_SIZE_MAX)
+	return CACHE_SIZE_MAX;
     return 3;
 }
 
-// Adjust a cache limit
-static inline unsigned int adjustedCacheLimit(int val, int size)
+// Adjust a cache shard count
+static inline unsigned int adjustedCacheShards(int val)
 {
-    int sq = size * size;
-    return (val > sq) ? val : sq;
+    if (val >= 1 && val <= CACHE_SHARDS_MAX)
+	return val;
+    return (val > CACHE_SHARDS_MAX) ? CACHE_SHARDS_MAX : 1;
 }
 
 // Adjust a cache TTL
@@ -377,13 +538,49 @@ static inline void dumpItem(Cache& c, CacheItem& item, const char* oper)
 {
 #ifdef XDEBUG
     String tmp;
-    item.dump(tmp," ");
+    item.dump(tmp);
     Debug(&__plugin,DebugAll,"Cache(%s) %s %p %s expires=%u [%p]",
 	c.toString().c_str(),oper,&item,tmp.c_str(),
 	(unsigned int)(item.expires()/1000000),&c);
 #endif
 }
 
+// Build a snapshot record header
+static inline void snapshotHeader(unsigned char* buf, u_int32_t idLen, u_int32_t dataLen,
+    u_int64_t expires)
+{
+    for (int i = 0; i < 4; i++) {
+	buf[i] = (unsigned char)(idLen >> (8 * i));
+	buf[4 + i] = (unsigned char)(dataLen >> (8 * i));
+    }
+    for (int i = 0; i < 8; i++)
+	buf[8 + i] = (unsigned char)(expires >> (8 * i));
+}
+
+// Decode a little endian value from a snapshot record header
+static inline u_int64_t snapshotValue(const unsigned char* buf, int len)
+{
+    u_int64_t val = 0;
+    while (len--)
+	val = (val << 8) | buf[len];
+    return val;
+}
+
+// Check packed snapshot parameters: null terminated name and value pairs
+//  filling exactly the record data
+static bool snapshotParams(const char* data, unsigned int len)
+{
+    if (!len)
+	return true;
+    if (data[len - 1])
+	return false;
+    unsigned int strings = 0;
+    for (unsigned int i = 0; i < len; i++)
+	if (!data[i])
+	    strings++;
+    return 0 == (strings % 2);
+}
+
 // Fill a list of parameters from a string
 static void fillList(NamedList& list, String& buf)
 {
@@ -401,20 +598,417 @@ static void fillList(NamedList& list, String& buf)
 }
 
 
+/*
+ * CacheItem
+ */
+CacheItem::CacheItem(const String& id, const NamedList& p, const String& copy,
+    u_int64_t expires)
+    : m_id(id), m_expires(expires), m_data(0), m_length(0),
+    m_hashNext(0), m_lruPrev(0), m_lruNext(0), m_expPrev(0), m_expNext(0)
+{
+    NamedList tmp("");
+    if (copy)
+	tmp.copyParams(p,copy);
+    else
+	tmp.copyParams(p);
+    NamedIterator iter(tmp);
+    for (const NamedString* ns = 0; 0 != (ns = iter.get());)
+	m_length += ns->name().length() + ns->length() + 2;
+    if (!m_length)
+	return;
+    // Store parameters in a single buffer: name\0value\0name\0value\0...
+    m_data = new char[m_length];
+    char* d = m_data;
+    NamedIterator pack(tmp);
+    for (const NamedString* ns = 0; 0 != (ns = pack.get());) {
+	::memcpy(d,ns->name().c_str(),ns->name().length() + 1);
+	d += ns->name().length() + 1;
+	::memcpy(d,ns->safe(),ns->length() + 1);
+	d += ns->length() + 1;
+    }
+}
+
+// Build from packed parameters (loaded from snapshot)
+CacheItem::CacheItem(const String& id, const char* data, unsigned int len, u_int64_t expires)
+    : m_id(id), m_expires(expires), m_data(0), m_length(len),
+    m_hashNext(0), m_lruPrev(0), m_lruNext(0), m_expPrev(0), m_expNext(0)
+{
+    if (!m_length)
+	return;
+    m_data = new char[m_length];
+    ::memcpy(m_data,data,m_length);
+}
+
+CacheItem::~CacheItem()
+{
+    delete[] m_data;
+}
+
+// Copy parameters in list to a destination, clear the ones not stored
+void CacheItem::copyParams(NamedList& dest, const String& list) const
+{
+    ObjList* l = list.split(',',false);
+    for (ObjList* o = l; o; o = o->next()) {
+	String* name = static_cast<String*>(o->get());
+	if (!name)
+	    continue;
+	name->trimBlanks();
+	if (!*name)
+	    continue;
+	const char* value = 0;
+	const char* end = m_data + m_length;
+	for (const char* n = m_data; n && n < end; ) {
+	    const char* v = n + ::strlen(n) + 1;
+	    if (*name == n) {
+		value = v;
+		break;
+	    }
+	    n = v + ::strlen(v) + 1;
+	}
+	if (value)
+	    dest.setParam(*name,value);
+	else
+	    dest.clearParam(*name);
+    }
+    TelEngine::destruct(l);
+}
+
+// Copy all stored parameters to a destination
+void CacheItem::fillParams(NamedList& dest) const
+{
+    const char* end = m_data + m_length;
+    for (const char* n = m_data; n && n < end; ) {
+	const char* v = n + ::strlen(n) + 1;
+	dest.addParam(n,v);
+	n = v + ::strlen(v) + 1;
+    }
+}
+
+#ifdef XDEBUG
+// Dump the item to a string
+void CacheItem::dump(String& buf) const
+{
+    NamedList tmp(m_id);
+    fillParams(tmp);
+    tmp.dump(buf," ");
+}
+#endif
+
+
+/*
+ * CacheShard
+ */
+CacheShard::CacheShard(unsigned int size)
+    : Mutex(false,"CacheShard"),
+    m_items(0), m_size(size), m_lruHead(0), m_lruTail(0), m_wheelSec(Time::secNow()),
+    m_count(0), m_bytes(0), m_hits(0), m_misses(0), m_evicted(0), m_expired(0)
+{
+    m_items = new CacheItem*[m_size];
+    for (unsigned int i = 0; i < m_size; i++)
+	m_items[i] = 0;
+    for (unsigned int i = 0; i < CACHE_WHEEL_SLOTS; i++)
+	m_wheel[i] = 0;
+}
+
+CacheShard::~CacheShard()
+{
+    clear();
+    delete[] m_items;
+}
+
+// Find an item, mark it as recently used. This method is not thread safe
+CacheItem* CacheShard::find(const String& id)
+{
+    CacheItem** link = findLink(id);
+    if (!link)
+	return 0;
+    CacheItem* item = *link;
+    if (item != m_lruTail) {
+	// Move to most recently used position
+	if (item->m_lruPrev)
+	    item->m_lruPrev->m_lruNext = item->m_lruNext;
+	else
+	    m_lruHead = item->m_lruNext;
+	item->m_lruNext->m_lruPrev = item->m_lruPrev;
+	item->m_lruPrev = m_lruTail;
+	item->m_lruNext = 0;
+	m_lruTail->m_lruNext = item;
+	m_lruTail = item;
+    }
+    m_hits++;
+    return item;
+}
+
+// Add an item, replace an existing one unless it expires later
+// Return the item kept in cache. The new item is destroyed if not used
+// This method is not thread safe
+CacheItem* CacheShard::add(CacheItem* item, bool& found)
+{
+    CacheItem** pos = findLink(item->toString());
+    found = (pos != 0);
+    if (found) {
+	CacheItem* crt = *pos;
+	if (crt->expires() > item->expires()) {
+	    // Deny update for oldest item
+	    TelEngine::destruct(item);
+	    return crt;
+	}
+	destroy(crt);
+    }
+    CacheItem*& head = m_items[item->toString().hash() % m_size];
+    item->m_hashNext = head;
+    head = item;
+    link(item);
+    m_count++;
+    m_bytes += item->memSize();
+    return item;
+}
+
+// Remove an item
+bool CacheShard::remove(const String& id)
+{
+    Lock lck(this);
+    CacheItem** link = findLink(id);
+    if (!link)
+	return false;
+    destroy(*link);
+    return true;
+}
+
+// Remove items whose id is matched by a string (regexp)
+// Walk the hash lists and release the lock between them every few items so
+//  lookups are not stalled by a long scan
+unsigned int CacheShard::removeMatch(const String& match)
+{
+    unsigned int removed = 0;
+    unsigned int checked = 0;
+    Lock lck(this);
+    for (unsigned int i = 0; i < m_size; i++) {
+	for (CacheItem* item = m_items[i]; item; checked++) {
+	    CacheItem* next = item->m_hashNext;
+	    if (match.matches(item->toString())) {
+		destroy(item);
+		removed++;
+	    }
+	    item = next;
+	}
+	if (checked >= CACHE_MATCH_BATCH) {
+	    checked = 0;
+	    lck.drop();
+	    Thread::yield();
+	    lck.acquire(this);
+	}
+    }
+    return removed;
+}
+
+// Remove timed out items from wheel slots passed since last call
+unsigned int CacheShard::expire(const Time& time)
+{
+    u_int64_t sec = time.sec();
+    unsigned int expired = 0;
+    Lock lck(this);
+    // Check the last slot again: it may hold items expiring later in the same second
+    u_int64_t crt = m_wheelSec;
+    if (sec < crt || sec - crt >= CACHE_WHEEL_SLOTS)
+	crt = sec + 1 - CACHE_WHEEL_SLOTS;
+    for (; crt <= sec; crt++) {
+	for (CacheItem* item = m_wheel[crt % CACHE_WHEEL_SLOTS]; item; ) {
+	    CacheItem* next = item->m_expNext;
+	    if (item->timeout(time)) {
+		destroy(item);
+		expired++;
+	    }
+	    item = next;
+	}
+    }
+    m_wheelSec = sec;
+    m_expired += expired;
+    return expired;
+}
+
+// Remove least recently used items until count and memory limits are met
+// This method is not thread safe
+unsigned int CacheShard::trim(unsigned int maxCount, u_int64_t maxBytes, CacheItem* skip)
+{
+    unsigned int evicted = 0;
+    while (m_lruHead && ((maxCount && m_count > maxCount) || (maxBytes && m_bytes > maxBytes))) {
+	CacheItem* item = m_lruHead;
+	if (item == skip) {
+	    item = item->m_lruNext;
+	    if (!item)
+		break;
+	}
+	destroy(item);
+	evicted++;
+    }
+    m_evicted += evicted;
+    return evicted;
+}
+
+// Remove all items
+unsigned int CacheShard::clear()
+{
+    Lock lck(this);
+    unsigned int n = m_count;
+    // All items are in the least recently used list
+    while (m_lruHead) {
+	CacheItem* item = m_lruHead;
+	m_lruHead = item->m_lruNext;
+	TelEngine::destruct(item);
+    }
+    for (unsigned int i = 0; i < m_size; i++)
+	m_items[i] = 0;
+    m_lruTail = 0;
+    for (unsigned int i = 0; i < CACHE_WHEEL_SLOTS; i++)
+	m_wheel[i] = 0;
+    m_count = 0;
+    m_bytes = 0;
+    return n;
+}
+
+// Add shard counters to cache totals
+void CacheShard::stats(u_int64_t* values)
+{
+    Lock lck(this);
+    values[Cache::StatCount] += m_count;
+    values[Cache::StatBytes] += m_bytes;
+    values[Cache::StatHits] += m_hits;
+    values[Cache::StatMisses] += m_misses;
+    values[Cache::StatEvicted] += m_evicted;
+    values[Cache::StatExpired] += m_expired;
+}
+
+// Write not expired items to a snapshot buffer, least recently used first
+// Return the number of written items
+unsigned int CacheShard::snapshot(DataBlock& buf, u_int64_t now)
+{
+    Lock lck(this);
+    unsigned int len = 0;
+    for (CacheItem* item = m_lruHead; item; item = item->m_lruNext)
+	if (!item->timeout(now))
+	    len += SNAPSHOT_RECORD_HDR + item->m_id.length() + item->m_length;
+    if (!len)
+	return 0;
+    buf.assign(0,len);
+    unsigned char* d = (unsigned char*)buf.data();
+    unsigned int n = 0;
+    for (CacheItem* item = m_lruHead; item; item = item->m_lruNext) {
+	if (item->timeout(now))
+	    continue;
+	snapshotHeader(d,item->m_id.length(),item->m_length,item->m_expires);
+	d += SNAPSHOT_RECORD_HDR;
+	::memcpy(d,item->m_id.c_str(),item->m_id.length());
+	d += item->m_id.length();
+	if (item->m_length)
+	    ::memcpy(d,item->m_data,item->m_length);
+	d += item->m_length;
+	n++;
+    }
+    return n;
+}
+
+#ifdef XDEBUG
+// Dump shard items to a string
+unsigned int CacheShard::dump(String& buf, u_int64_t now)
+{
+    Lock lck(this);
+    for (CacheItem* item = m_lruHead; item; item = item->m_lruNext) {
+	String tmp;
+	item->dump(tmp);
+	int ttl = (int)(((int64_t)item->expires() - (int64_t)now) / 1000);
+	buf << "\r\n  " << ttl / 1000 << "." << ttl % 1000 << " " << tmp;
+    }
+    return m_count;
+}
+#endif
+
+// Find the hash list link pointing to an item
+CacheItem** CacheShard::findLink(const String& id)
+{
+    for (CacheItem** link = &m_items[id.hash() % m_size]; *link; link = &(*link)->m_hashNext)
+	if (id == (*link)->toString())
+	    return link;
+    return 0;
+}
+
+// Link an item at most recently used position and in its expire wheel slot
+void CacheShard::link(CacheItem* item)
+{
+    item->m_lruPrev = m_lruTail;
+    item->m_lruNext = 0;
+    if (m_lruTail)
+	m_lruTail->m_lruNext = item;
+    else
+	m_lruHead = item;
+    m_lruTail = item;
+    if (!item->m_expires)
+	return;
+    CacheItem*& slot = m_wheel[(item->m_expires / 1000000) % CACHE_WHEEL_SLOTS];
+    item->m_expPrev = 0;
+    item->m_expNext = slot;
+    if (slot)
+	slot->m_expPrev = item;
+    slot = item;
+}
+
+// Remove an item from least recently used list and expire wheel
+void CacheShard::unlink(CacheItem* item)
+{
+    if (item->m_lruPrev)
+	item->m_lruPrev->m_lruNext = item->m_lruNext;
+    else
+	m_lruHead = item->m_lruNext;
+    if (item->m_lruNext)
+	item->m_lruNext->m_lruPrev = item->m_lruPrev;
+    else
+	m_lruTail = item->m_lruPrev;
+    item->m_lruPrev = item->m_lruNext = 0;
+    if (!item->m_expires)
+	return;
+    if (item->m_expPrev)
+	item->m_expPrev->m_expNext = item->m_expNext;
+    else
+	m_wheel[(item->m_expires / 1000000) % CACHE_WHEEL_SLOTS] = item->m_expNext;
+    if (item->m_expNext)
+	item->m_expNext->m_expPrev = item->m_expPrev;
+    item->m_expPrev = item->m_expNext = 0;
+}
+
+// Remove an item from shard and destroy it
+void CacheShard::destroy(CacheItem* item)
+{
+    unlink(item);
+    CacheItem** link = findLink(item->toString());
+    if (link)
+	*link = item->m_hashNext;
+    m_count--;
+    m_bytes -= item->memSize();
+    TelEngine::destruct(item);
+}
+
+
 /*
  * Cache
  */
-Cache::Cache(const String& name, int size, const NamedList& params)
+Cache::Cache(const String& name, int size, int shards, const NamedList& params)
     : Mutex(false,"Cache"),
-    m_name(name), m_list(size), m_cacheTtl(0), m_count(0), m_limit(0),
-    m_limitOverflow(0), m_loadChunk(0), m_prefixMin(0), m_prefixMask(0),
+    m_name(name), m_shards(0), m_shardCount(shards), m_shardSize(size / shards),
+    m_cacheTtl(0), m_limit(0), m_limitBytes(0),
+    m_loadChunk(0), m_prefixMin(0), m_prefixMask(0),
     m_loadPrio(Thread::Normal),
     m_loading(false), m_loadInterval(0), m_nextLoad(0),
-    m_reload(0), m_reloadItems(0)
-
+    m_reload(0), m_reloadItems(0),
+    m_snapshotInterval(0), m_nextSnapshot(0), m_snapshotReconcile(true),
+    m_snapshotReady(false), m_snapshotSaving(false)
 {
-    Debug(&__plugin,DebugInfo,"Cache(%s) size=%u [%p]",
-	m_name.c_str(),m_list.length(),this);
+    if (m_shardSize < 3)
+	m_shardSize = 3;
+    m_shards = new CacheShard*[m_shardCount];
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	m_shards[i] = new CacheShard(m_shardSize);
+    Debug(&__plugin,DebugInfo,"Cache(%s) size=%u shards=%u [%p]",
+	m_name.c_str(),m_shardSize * m_shardCount,m_shardCount,this);
     m_expireParam << "cache_" << m_name << "_expires";
     doUpdate(params,true);
 }
@@ -490,43 +1084,226 @@ void Cache::endLoad(bool triggerReload)
 	m_nextLoad = m_loadInterval ? (Time::now() + (u_int64_t)m_loadInterval * 1000000) : 0;
 }
 
+// Check if a periodic snapshot is due, schedule the next one if true is returned
+bool Cache::snapshotDue(const Time& time)
+{
+    Lock lck(this);
+    if (!(m_snapshotFile && m_snapshotInterval && m_snapshotReady) || m_snapshotSaving)
+	return false;
+    bool due = m_nextSnapshot && m_nextSnapshot <= time;
+    if (due || !m_nextSnapshot)
+	m_nextSnapshot = time + (u_int64_t)m_snapshotInterval * 1000000;
+    return due;
+}
+
+// Save not expired items to snapshot file. Return true on success
+bool Cache::saveSnapshot()
+{
+    Lock lck(this);
+    if (!(m_snapshotFile && m_snapshotReady) || m_snapshotSaving)
+	return false;
+    m_snapshotSaving = true;
+    String file = m_snapshotFile;
+    lck.drop();
+    u_int64_t start = Time::now();
+    // Write a temporary file and replace the snapshot when done
+    String tmp = file + ".tmp";
+    File f;
+    unsigned int n = 0;
+    bool ok = f.openPath(tmp,true,false,true,false,true) &&
+	f.writeData(s_snapshotMagic,sizeof(s_snapshotMagic)) == (int)sizeof(s_snapshotMagic);
+    for (unsigned int i = 0; ok && i < m_shardCount; i++) {
+	DataBlock buf;
+	n += m_shards[i]->snapshot(buf,start);
+	ok = !buf.length() || f.writeData(buf.data(),buf.length()) == (int)buf.length();
+    }
+    if (ok) {
+	// End record holds the number of items
+	unsigned char end[SNAPSHOT_RECORD_HDR];
+	snapshotHeader(end,0,0,n);
+	ok = f.writeData(end,SNAPSHOT_RECORD_HDR) == SNAPSHOT_RECORD_HDR;
+    }
+    int error = f.error();
+    f.terminate();
+    if (ok)
+	ok = File::rename(tmp,file,&error);
+    else
+	File::remove(tmp);
+    if (ok)
+	Debug(&__plugin,DebugInfo,"Cache(%s) saved %u items to snapshot '%s' in %u ms [%p]",
+	    m_name.c_str(),n,file.c_str(),(unsigned int)((Time::now() - start) / 1000),this);
+    else {
+	String reason;
+	Thread::errorString(reason,error);
+	Debug(&__plugin,DebugWarn,"Cache(%s) failed to save snapshot '%s': %d %s [%p]",
+	    m_name.c_str(),file.c_str(),error,reason.c_str(),this);
+    }
+    lock();
+    m_snapshotSaving = false;
+    unlock();
+    return ok;
+}
+
+// Load items from snapshot file and allow saving it
+// Return the number of loaded items, negative if the file is missing or invalid
+int Cache::loadSnapshot()
+{
+    lock();
+    String file = m_snapshotFile;
+    unsigned int maxCount = m_limit ? (m_limit + m_shardCount - 1) / m_shardCount : 0;
+    u_int64_t maxBytes = m_limitBytes ? (m_limitBytes + m_shardCount - 1) / m_shardCount : 0;
+    unlock();
+    if (!file) {
+	Lock lck(this);
+	m_snapshotReady = true;
+	return -1;
+    }
+    u_int64_t start = Time::now();
+    SnapshotReader f;
+    if (!f.openPath(file,false,true,false,false,true)) {
+	Debug(&__plugin,DebugNote,"Cache(%s) snapshot '%s' not found [%p]",
+	    m_name.c_str(),file.c_str(),this);
+	Lock lck(this);
+	m_snapshotReady = true;
+	return -1;
+    }
+    const unsigned char* d = f.get(sizeof(s_snapshotMagic));
+    bool ok = d && !::memcmp(d,s_snapshotMagic,sizeof(s_snapshotMagic));
+    bool complete = false;
+    unsigned int n = 0;
+    unsigned int expired = 0;
+    unsigned int invalid = 0;
+    u_int32_t mask = 0;
+    while (ok && !complete) {
+	d = f.get(SNAPSHOT_RECORD_HDR);
+	if (!d) {
+	    ok = false;
+	    break;
+	}
+	unsigned int idLen = (unsigned int)snapshotValue(d,4);
+	unsigned int dataLen = (unsigned int)snapshotValue(d + 4,4);
+	u_int64_t expires = snapshotValue(d + 8,8);
+	if (idLen > SNAPSHOT_BUFFER || dataLen > SNAPSHOT_BUFFER) {
+	    ok = false;
+	    break;
+	}
+	if (!idLen) {
+	    // End record
+	    complete = !dataLen && (expires == n + expired + invalid);
+	    ok = complete;
+	    break;
+	}
+	d = f.get(idLen + dataLen);
+	if (!d) {
+	    ok = false;
+	    break;
+	}
+	if (expires && expires < start) {
+	    expired++;
+	    continue;
+	}
+	// Items are read by searching for the string terminators
+	if (!snapshotParams((const char*)d + idLen,dataLen)) {
+	    invalid++;
+	    continue;
+	}
+	String id((const char*)d,idLen);
+	CacheItem* item = new CacheItem(id,(const char*)d + idLen,dataLen,expires);
+	CacheShard& s = shard(id);
+	bool found = false;
+	s.lock();
+	if (s.add(item,found) == item && !found && (maxCount || maxBytes))
+	    s.trim(maxCount,maxBytes,item);
+	s.unlock();
+	n++;
+	if (idLen <= 32 && !(mask & (1 << (idLen - 1)))) {
+	    mask |= (1 << (idLen - 1));
+	    Lock lck(this);
+	    m_prefixMask |= mask;
+	}
+	if (0 == (n % 10000) && exiting())
+	    break;
+    }
+    f.terminate();
+    if (exiting() && !complete) {
+	// Don't save a partially loaded cache over the snapshot
+	Debug(&__plugin,DebugNote,"Cache(%s) snapshot load interrupted after %u items [%p]",
+	    m_name.c_str(),n,this);
+	return -1;
+    }
+    lock();
+    m_snapshotReady = true;
+    unlock();
+    if (!ok) {
+	Debug(&__plugin,DebugWarn,"Cache(%s) invalid or truncated snapshot '%s', loaded %u items [%p]",
+	    m_name.c_str(),file.c_str(),n,this);
+	return -1;
+    }
+    if (invalid)
+	Debug(&__plugin,DebugWarn,"Cache(%s) rejected %u invalid items from snapshot '%s' [%p]",
+	    m_name.c_str(),invalid,file.c_str(),this);
+    Debug(&__plugin,DebugInfo,
+	"Cache(%s) loaded %u items (expired=%u) from snapshot '%s' in %u ms [%p]",
+	m_name.c_str(),n,expired,file.c_str(),(unsigned int)((Time::now() - start) / 1000),this);
+    return n;
+}
+
 // Copy params from cache item. Return true if found
 bool Cache::copyParams(const String& id, NamedList& list, const String* cpParams)
 {
+    String copy;
+    if (!cpParams) {
+	Lock lck(this);
+	copy = m_copyParams;
+	cpParams = &copy;
+    }
+    if (findPrefixCopy(id,list,*cpParams))
+	return true;
+    shard(id).miss();
     lock();
-    CacheItem* item = findPrefix(id);
-    if (!item && m_account && m_queryLoadItem) {
-	// Load from database
-	String query = m_queryLoadItem;
-	NamedList p("");
-	p.addParam("id",id);
-	p.replaceParams(query);
-	Message m("database");
-	m.addParam("account",m_account);
-	m.addParam("query",query);
-	unlock();
-	bool ok = Engine::dispatch(m);
-	lock();
-	const char* error = m.getValue("error");
-	if (ok && !error) {
-	    Array* a = static_cast<Array*>(m.userObject(YATOM("Array")));
-	    int rows = a ? a->getRows() : 0;
-	    if (rows > 0)
-		item = addUnsafe(*a,1,a->getColumns());
-	    else
-		DDebug(&__plugin,DebugAll,"Cache(%s) item '%s' not found in database [%p]",
-		    m_name.c_str(),id.c_str(),this);
+    String account = m_account;
+    String query = m_queryLoadItem;
+    unlock();
+    if (!(account && query))
+	return false;
+    // Load from database
+    NamedList p("");
+    p.addParam("id",id);
+    p.replaceParams(query);
+    Message m("database");
+    m.addParam("account",account);
+    m.addParam("query",query);
+    bool ok = Engine::dispatch(m);
+    const char* error = m.getValue("error");
+    if (ok && !error) {
+	Array* a = static_cast<Array*>(m.userObject(YATOM("Array")));
+	int rows = a ? a->getRows() : 0;
+	if (rows > 0) {
+	    NamedList row("");
+	    int cols = a->getColumns();
+	    for (int col = 0; col < cols; col++) {
+		String* colName = YOBJECT(String,a->get(col,0));
+		if (TelEngine::null(colName))
+		    continue;
+		String* colVal = YOBJECT(String,a->get(col,1));
+		if (!colVal)
+		    continue;
+		if (*colName == s_id)
+		    row.assign(*colVal);
+		else
+		    row.addParam(*colName,*colVal);
+	    }
+	    if (row)
+		return addItem(row,row,0,false,&list,cpParams);
 	}
 	else
-	    Debug(&__plugin,DebugNote,"Cache(%s) failed to load item '%s' %s [%p]",
-		m_name.c_str(),id.c_str(),TelEngine::c_safe(error),this);
+	    DDebug(&__plugin,DebugAll,"Cache(%s) item '%s' not found in database [%p]",
+		m_name.c_str(),id.c_str(),this);
     }
-    if (item) {
-	list.copyParams(*item,!cpParams ? m_copyParams : *cpParams);
-	dumpItem(*this,*item,"found in cache");
-    }
-    unlock();
-    return item != 0;
+    else
+	Debug(&__plugin,DebugNote,"Cache(%s) failed to load item '%s' %s [%p]",
+	    m_name.c_str(),id.c_str(),TelEngine::c_safe(error),this);
+    return false;
 }
 
 // Safely retrieve DB load info
@@ -612,25 +1389,22 @@ void Cache::expire(const Time& time)
 	m->addParam("results",String::boolText(false));
 	Engine::enqueue(m);
     }
-    unsigned int oldCount = m_count;
-    for (unsigned int i = 0; i < m_list.length(); i++) {
+    unsigned int maxCount = m_limit ? (m_limit + m_shardCount - 1) / m_shardCount : 0;
+    u_int64_t maxBytes = m_limitBytes ? (m_limitBytes + m_shardCount - 1) / m_shardCount : 0;
+    lck.drop();
+    unsigned int removed = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++) {
 	if (exiting())
 	    break;
-	ObjList* list = m_list.getHashList(i);
-	if (list)
-	    list = list->skipNull();
-	// Stop when found a non timed out item:
-	//  we put them in the list in ascending order of timeout
-	for (; list; list = list->skipNull()) {
-	    CacheItem* item = static_cast<CacheItem*>(list->get());
-	    if (!item->timeout(time))
-		break;
-	    dumpItem(*this,*item,"removing timed out");
-	    list->remove();
-	    m_count--;
+	CacheShard* s = m_shards[i];
+	removed += s->expire(time);
+	// Apply limits lowered on reload
+	if (maxCount || maxBytes) {
+	    Lock lckShard(s);
+	    removed += s->trim(maxCount,maxBytes);
 	}
     }
-    if (oldCount != m_count)
+    if (removed)
 	dump("Cache::expire()");
 }
 
@@ -639,10 +1413,9 @@ void Cache::expire(const Time& time)
 unsigned int Cache::add(ObjList& list)
 {
     unsigned int added = 0;
-    Lock lck(this);
     for (ObjList* o = list.skipNull(); o; o = o->skipNext()) {
 	NamedList* nl = static_cast<NamedList*>(o->get());
-	if (addUnsafe(*nl,*nl,0,false))
+	if (addItem(*nl,*nl,0,false))
 	    added++;
     }
     return added;
@@ -724,10 +1497,10 @@ unsigned int Cache::addRows(Array& array)
 // Clear the cache
 unsigned int Cache::clear()
 {
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	n += m_shards[i]->clear();
     Lock lck(this);
-    m_list.clear();
-    unsigned int n = m_count;
-    m_count = 0;
     m_prefixMask = 0;
     return n;
 }
@@ -738,36 +1511,14 @@ unsigned int Cache::remove(const String& id, bool regexp)
     if (!id)
 	return 0;
     if (!regexp) {
-	Lock lck(this);
-	ObjList* list = m_list.getHashList(id);
-	GenObject* gen = list ? list->remove(id,false) : 0;
-	if (!gen)
+	if (!shard(id).remove(id))
 	    return 0;
-	CacheItem* item = static_cast<CacheItem*>(gen);
-	dumpItem(*this,*item,"removed");
-	m_count--;
-	TelEngine::destruct(item);
+	DDebug(&__plugin,DebugAll,"Cache(%s) removed '%s' [%p]",m_name.c_str(),id.c_str(),this);
 	return 1;
     }
     unsigned int removed = 0;
-    for (unsigned int i = 0; i < m_list.length(); i++) {
-	Lock lck(this);
-	ObjList* list = m_list.getHashList(i);
-	if (list)
-	    list = list->skipNull();
-	while (list) {
-	    CacheItem* item = static_cast<CacheItem*>(list->get());
-	    if (!id.matches(*item)) {
-		list = list->skipNext();
-		continue;
-	    }
-	    dumpItem(*this,*item,"removed");
-	    list->remove();
-	    list = list->skipNull();
-	    removed++;
-	    m_count--;
-	}
-	lck.drop();
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	removed += m_shards[i]->removeMatch(id);
 	if (exiting())
 	    break;
 	// Someone may need access to the cache
@@ -776,6 +1527,15 @@ unsigned int Cache::remove(const String& id, bool regexp)
     return removed;
 }
 
+// Retrieve cache counters, values must have StatTotal elements
+void Cache::stats(u_int64_t* values) const
+{
+    for (int i = 0; i < StatTotal; i++)
+	values[i] = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	m_shards[i]->stats(values);
+}
+
 // Retrieve cache name
 const String& Cache::toString() const
 {
@@ -788,24 +1548,12 @@ void Cache::dump(const char* oper)
 #ifdef XDEBUG
     if (!__plugin.debugAt(DebugAll))
 	return;
-    Lock lck(locked() ? 0 : this);
     String data("\r\n-----");
     unsigned int n = 0;
-    int64_t now = (int64_t)Time::now();
-    for (unsigned int i = 0; i < m_list.length(); i++) {
-	ObjList* list = m_list.getHashList(i);
-	if (list)
-	    list = list->skipNull();
+    u_int64_t now = Time::now();
+    for (unsigned int i = 0; i < m_shardCount; i++) {
 	String rowData;
-	unsigned int rn = 0;
-	for (; list; list = list->skipNext()) {
-	    rn++;
-	    CacheItem* item = static_cast<CacheItem*>(list->get());
-	    String tmp;
-	    item->dump(tmp," ");
-	    int ttl = (int)(((int64_t)item->expires() - now) / 1000);
-	    rowData << "\r\n  " << ttl / 1000 << "." << ttl % 1000 << " " << tmp;
-	}
+	unsigned int rn = m_shards[i]->dump(rowData,now);
 	if (!rn)
 	    continue;
 	n += rn;
@@ -831,6 +1579,11 @@ void Cache::destroyed()
 {
     Debug(&__plugin,DebugInfo,"Cache(%s) destroyed [%p]",m_name.c_str(),this);
     clear();
+    for (unsigned int i = 0; i < m_shardCount; i++)
+	delete m_shards[i];
+    delete[] m_shards;
+    m_shards = 0;
+    m_shardCount = 0;
     TelEngine::destruct(m_reloadItems);
     RefObject::destroyed();
 }
@@ -847,11 +1600,8 @@ void Cache::doUpdate(const NamedList& params, bool first)
 	int ttl = safeValue(params.getIntValue("ttl",s_cacheTtlSec));
 	m_cacheTtl = (u_int64_t)adjustedCacheTtl(ttl) * 1000000;
     }
-    m_limit = adjustedCacheLimit(params.getIntValue("limit",s_limit),m_list.length());
-    if (m_limit)
-	m_limitOverflow = m_limit + (m_limit / 100);
-    else
-	m_limitOverflow = 0;
+    m_limit = safeValue(params.getIntValue("limit",s_limit));
+    m_limitBytes = params.getInt64Value("limit_bytes",s_limitBytes,0);
     m_loadChunk = adjustedCacheLoadChunk(params.getIntValue("loadchunk",s_loadChunk));
     m_loadPrio = Thread::priority(params.getValue("loadcache_priority"),s_loadPrio);
     m_idParam = params.getValue("id_param");
@@ -881,6 +1631,12 @@ void Cache::doUpdate(const NamedList& params, bool first)
     }
     else
 	m_loadInterval = 0;
+    m_snapshotFile = params.getValue("snapshot_file");
+    m_snapshotInterval = safeValue(params.getIntValue("snapshot_interval",300));
+    if (m_snapshotInterval && m_snapshotInterval < SNAPSHOT_INTERVAL_MIN)
+	m_snapshotInterval = SNAPSHOT_INTERVAL_MIN;
+    m_nextSnapshot = 0;
+    m_snapshotReconcile = params.getBoolValue("snapshot_reconcile",true);
     m_prefixMin = params.getIntValue("shortest_prefix",0);
     if (m_prefixMin > 32)
 	m_prefixMin = 32;
@@ -897,31 +1653,43 @@ void Cache::doUpdate(const NamedList& params, bool first)
 	all << " query_save=" << m_querySave;
 	all << " query_expire=" << m_queryExpire;
 	all << " shortest_prefix=" << m_prefixMin;
+	all << " snapshot_file=" << m_snapshotFile;
+	all << " snapshot_interval=" << m_snapshotInterval;
     }
 #endif
     Debug(&__plugin,DebugInfo,
-	"Cache(%s) updated ttl=%u limit=%u reload_interval=%u copyparams='%s'%s [%p]",
-	m_name.c_str(),(unsigned int)(m_cacheTtl / 1000000),m_limit,m_loadInterval,
+	"Cache(%s) updated ttl=%u limit=%u limit_bytes=" FMT64U " reload_interval=%u copyparams='%s'%s [%p]",
+	m_name.c_str(),(unsigned int)(m_cacheTtl / 1000000),m_limit,m_limitBytes,m_loadInterval,
 	m_copyParams.safe(),all.safe(),this);
 }
 
 // Add an item to the cache. Remove an existing one
-CacheItem* Cache::addUnsafe(const String& id, const NamedList& params, const String* cpParams,
-    bool dbSave)
+// Copy parameters of the item kept in cache to a destination if given
+bool Cache::addItem(const String& id, const NamedList& params, const String* cpParams,
+    bool dbSave, NamedList* dest, const String* destParams)
 {
     XDebug(&__plugin,DebugAll,"Cache::add(%s,%p,'%s',%u) [%p]",
 	id.c_str(),&params,TelEngine::c_safe(cpParams),dbSave,this);
-    unsigned int idx = index(id);
-    ObjList* list = m_list.getHashList(idx);
-    if (list)
-	list = list->skipNull();
-    u_int64_t expires = m_cacheTtl;
+    String copy;
+    String account;
+    String query;
+    lock();
+    u_int64_t ttl = m_cacheTtl;
+    u_int64_t expires = ttl;
     if (dbSave) {
 	int tmp = params.getIntValue(m_expireParam);
 	if (tmp > 0)
 	    expires = (u_int64_t)tmp * 1000000;
+	if (m_account && m_querySave) {
+	    account = m_account;
+	    query = m_querySave;
+	}
     }
-    else {
+    copy = cpParams ? *cpParams : m_copyParams;
+    unsigned int maxCount = m_limit ? (m_limit + m_shardCount - 1) / m_shardCount : 0;
+    u_int64_t maxBytes = m_limitBytes ? (m_limitBytes + m_shardCount - 1) / m_shardCount : 0;
+    unlock();
+    if (!dbSave) {
 	String* exp = params.getParam("expires");
 	if (exp) {
 	    int tmp = (int)exp->toInteger();
@@ -930,151 +1698,109 @@ CacheItem* Cache::addUnsafe(const String& id, const NamedList& params, const Str
 	    else {
 		XDebug(&__plugin,DebugAll,"Cache(%s) item '%s' already expired [%p]",
 		    m_name.c_str(),id.c_str(),this);
-		return 0;
+		return false;
 	    }
 	}
     }
     if (expires)
 	expires += Time::now();
-    // Search for insert/add point and existing item
-    ObjList* insert = 0;
+    // Build the item before locking: it copies the parameters
+    CacheItem* item = new CacheItem(id,params,copy,expires);
+    CacheShard& s = shard(id);
+    NamedList* save = 0;
     bool found = false;
-    while (list) {
-	CacheItem* crt = static_cast<CacheItem*>(list->get());
-	if (!insert && crt->expires() > expires) {
-	    insert = list;
-	    if (found)
-		break;
-	}
-	if (!found && id == crt->toString()) {
-	    if (crt->expires() > expires) {
-		// Deny update for oldest item
-		return crt;
-	    }
-	    if (insert == list)
-		insert = 0;
-	    list->remove();
-	    found = true;
-	    if (insert)
-		break;
+    s.lock();
+    CacheItem* crt = s.add(item,found);
+    if (crt == item) {
+	dumpItem(*this,*item,!found ? "added" : "updated");
+	if (!found && (maxCount || maxBytes))
+	    s.trim(maxCount,maxBytes,item);
+	if (query) {
+	    save = new NamedList("");
+	    item->fillParams(*save);
+	    save->setParam("id",id);
 	}
-	ObjList* next = list->skipNext();
-	if (next)
-	    list = next;
-	else
-	    break;
     }
-    CacheItem* item = new CacheItem(id,params,cpParams ? *cpParams : m_copyParams,expires);
-    if (insert)
-	insert->insert(item);
-    else if (list)
-	list->append(item);
-    else
-	m_list.append(item);
+    if (dest)
+	crt->copyParams(*dest,destParams ? *destParams : copy);
+    s.unlock();
     unsigned int len = id.length();
-    if (len > 0 && len <= 32)
+    if (len > 0 && len <= 32 && !(m_prefixMask & (1 << (len - 1)))) {
+	Lock lck(this);
 	m_prefixMask |= (1 << (len - 1));
-    if (dbSave && m_account && m_querySave) {
-	String query = m_querySave;
-	NamedList p(*item);
-	p.setParam("id",item->toString());
-	p.setParam("expires",String((unsigned int)(m_cacheTtl / 1000000)));
-	p.replaceParams(query);
+    }
+    if (save) {
+	save->setParam("expires",String((unsigned int)(ttl / 1000000)));
+	save->replaceParams(query);
+	TelEngine::destruct(save);
 	Message* m = new Message("database");
-	m->addParam("account",m_account);
+	m->addParam("account",account);
 	m->addParam("query",query);
 	m->addParam("results",String::boolText(false));
 	Engine::enqueue(m);
     }
-    dumpItem(*this,*item,!found ? "added" : "updated");
-    if (found)
-	return item;
-    m_count++;
-    if (m_limitOverflow && m_count > m_limitOverflow)
-	adjustToLimit(item);
-    return item;
-}
-
-// Add an item from an Array row
-CacheItem* Cache::addUnsafe(Array& array, int row, int cols)
-{
-    XDebug(&__plugin,DebugAll,"Cache::add(%p,%d,%d) [%p]",&array,row,cols,this);
-    NamedList p("");
-    for (int col = 0; col < cols; col++) {
-	String* colName = YOBJECT(String,array.get(col,0));
-	if (TelEngine::null(colName))
-	    continue;
-	String* colVal = YOBJECT(String,array.get(col,row));
-	if (!colVal)
-	    continue;
-	if (*colName == s_id)
-	    p.assign(*colVal);
-	else
-	    p.addParam(*colName,*colVal);
-    }
-    return p ? addUnsafe(p,p,0,false) : 0;
+    return true;
 }
 
-// Find a cache item. This method is not thread safe
-CacheItem* Cache::find(const String& id)
+// Find an item and copy its parameters. Return true if found
+bool Cache::findCopy(const String& id, NamedList& list, const String& cpParams)
 {
-    ObjList* o = m_list.find(id);
-    return o ? static_cast<CacheItem*>(o->get()) : 0;
+    CacheShard& s = shard(id);
+    Lock lck(s);
+    CacheItem* item = s.find(id);
+    if (!item)
+	return false;
+    item->copyParams(list,cpParams);
+    dumpItem(*this,*item,"found in cache");
+    return true;
 }
 
-// Find a cache item or prefix. This method is not thread safe
-CacheItem* Cache::findPrefix(const String& id)
+// Find an item or prefix and copy its parameters. Return true if found
+bool Cache::findPrefixCopy(const String& id, NamedList& list, const String& cpParams)
 {
-    CacheItem* it = find(id);
-    if (it || !m_prefixMin)
-	return it;
+    if (findCopy(id,list,cpParams))
+	return true;
+    if (!m_prefixMin)
+	return false;
     unsigned int len = id.length();
     if (len == 0)
-	return 0;
+	return false;
     len--;
     if (len > 32)
 	len = 32;
     for (; len >= m_prefixMin; len--) {
-	if (m_prefixMask & (1 << (len - 1))) {
-	    it = find(id.substr(0,len));
-	    if (it)
-		return it;
-	}
+	if ((m_prefixMask & (1 << (len - 1))) && findCopy(id.substr(0,len),list,cpParams))
+	    return true;
     }
-    return 0;
+    return false;
 }
 
-// Adjust cache length to limit
-void Cache::adjustToLimit(CacheItem* skipAdded)
+
+/*
+ * SnapshotReader
+ */
+// Retrieve the next len bytes from file. Return 0 on end of file or error
+const unsigned char* SnapshotReader::get(unsigned int len)
 {
-    if (!m_limit || m_count <= m_limit)
-	return;
-    Debug(&__plugin,DebugAll,"Cache(%s) adjusting to limit %u count=%u [%p]",
-	m_name.c_str(),m_limit,m_count,this);
-    while (m_count > m_limit) {
-	CacheItem* found = 0;
-	for (unsigned int i = 0; i < m_list.length(); i++) {
-	    ObjList* list = m_list.getHashList(i);
-	    if (list)
-		list = list->skipNull();
-	    CacheItem* item = list ? static_cast<CacheItem*>(list->get()) : 0;
-	    if (!item || item == skipAdded)
-		continue;
-	    if (!found || found->m_expires > item->m_expires)
-		found = item;
-	}
-	if (found) {
-	    dumpItem(*this,*found,"removing oldest");
-	    m_list.remove(found);
-	    m_count--;
-	    continue;
+    if (len > m_buffer.length())
+	return 0;
+    unsigned char* buf = (unsigned char*)m_buffer.data();
+    if (m_len - m_pos < len) {
+	// Move unused data at buffer start and fill the rest
+	m_len -= m_pos;
+	if (m_len)
+	    ::memmove(buf,buf + m_pos,m_len);
+	m_pos = 0;
+	while (m_len < len) {
+	    int rd = readData(buf + m_len,m_buffer.length() - m_len);
+	    if (rd <= 0)
+		return 0;
+	    m_len += rd;
 	}
-	Debug(&__plugin,DebugGoOn,
-	    "Cache(%s) can't find the oldest item count=%u limit=%u [%p]",
-	    m_name.c_str(),m_count,m_limit,this);
-	m_count = m_list.count();
-	break;
     }
+    const unsigned char* d = buf + m_pos;
+    m_pos += len;
+    return d;
 }
 
 
@@ -1132,12 +1858,36 @@ void CacheLoadThread::run()
 	currentName(),m_cache.c_str(),this);
     ObjList* items = m_items;
     m_items = 0;
-    __plugin.loadCache(m_cache,false,items);
+    bool load = true;
+    if (m_snapshot) {
+	RefPointer<Cache> cache;
+	__plugin.getCache(cache,m_cache);
+	if (cache)
+	    load = (cache->loadSnapshot() < 0) || cache->snapshotReconcile();
+	cache = 0;
+    }
+    if (load && !exiting())
+	__plugin.loadCache(m_cache,false,items);
+    else
+	TelEngine::destruct(items);
     Debug(&__plugin,DebugAll,"%s stopped cache=%s [%p]",
 	currentName(),m_cache.c_str(),this);
 }
 
 
+/*
+ * CacheSnapshotThread
+ */
+void CacheSnapshotThread::run()
+{
+    RefPointer<Cache> cache;
+    __plugin.getCache(cache,m_cache);
+    if (cache)
+	cache->saveSnapshot();
+    cache = 0;
+}
+
+
 /*
  * EngineHandler
  */
@@ -1148,8 +1898,8 @@ bool EngineHandler::received(Message& msg)
 	return 0 != CacheThread::s_threads.skipNull();
     }
     s_engineStarted = true;
-    __plugin.loadCache("lnp");
-    __plugin.loadCache("cnam");
+    __plugin.startCache("lnp");
+    __plugin.startCache("cnam");
     return false;
 }
 
@@ -1188,7 +1938,8 @@ void CacheModule::setupCache(const String& name, const NamedList& params)
 	if (!enabled)
 	    return;
 	unsigned int size = adjustedCacheSize(params.getIntValue("size",s_size));
-	*c = new Cache(name,size,params);
+	unsigned int shards = adjustedCacheShards(params.getIntValue("shards",s_shards));
+	*c = new Cache(name,size,shards,params);
 	// Install relays
 	if (lnp) {
 	    // LnpBefore is an alias for Route
@@ -1200,7 +1951,7 @@ void CacheModule::setupCache(const String& name, const NamedList& params)
 	    installRelay(CnamAfter,"call.preroute",params.getIntValue("routeafter",75));
 	}
 	if (s_engineStarted)
-	    loadCache(name);
+	    startCache(name);
 	lck.drop();
 	updateCacheReload();
 	return;
@@ -1350,6 +2101,29 @@ void CacheModule::loadCache(const String& name, bool async, ObjList* items)
     updateCacheReload();
 }
 
+// Fill a cache after engine start: load snapshot (if any) and database
+void CacheModule::startCache(const String& name)
+{
+    RefPointer<Cache> cache;
+    getCache(cache,name);
+    if (!cache)
+	return;
+    if (!cache->hasSnapshot()) {
+	// Nothing to load, just allow saving a snapshot if configured later
+	cache->loadSnapshot();
+	cache = 0;
+	loadCache(name);
+	return;
+    }
+    String account;
+    String query;
+    unsigned int chunk = 0;
+    Thread::Priority prio = Thread::Normal;
+    cache->getDbLoad(account,query,chunk,prio);
+    cache = 0;
+    (new CacheLoadThread(name,prio,0,true))->startup();
+}
+
 void CacheModule::initialize()
 {
     static bool s_first = true;
@@ -1359,7 +2133,9 @@ void CacheModule::initialize()
     Configuration cfg(Engine::configFile("cache"));
     // Globals
     s_size = adjustedCacheSize(cfg.getIntValue("general","size",17));
-    s_limit = adjustedCacheLimit(cfg.getIntValue("general","limit",s_limit),s_size);
+    s_shards = adjustedCacheShards(cfg.getIntValue("general","shards",16));
+    s_limit = safeValue(cfg.getIntValue("general","limit"));
+    s_limitBytes = cfg.getInt64Value("general","limit_bytes",0,0);
     s_loadChunk = adjustedCacheLoadChunk(cfg.getIntValue("general","loadchunk"));
     s_maxChunks = safeValue(cfg.getIntValue("general","maxchunks",1000));
     if (!s_maxChunks)
@@ -1410,6 +2186,7 @@ void CacheModule::initialize()
 	installRelay(Level,120);
 	installRelay(Command,120);
 	installRelay(Help,120);
+	installRelay(Halt,120);
 	Engine::install(new EngineHandler(true));
 	Engine::install(new EngineHandler(false));
 	s_first = false;
@@ -1452,14 +2229,26 @@ bool CacheModule::received(Message& msg, int id)
     if (id == Help)
 	return commandHelp(msg.retValue(),msg[YSTRING("line")]);
     if (id == Timer) {
-	if (m_haveCacheReload) {
-	    for (int i = 0; s_caches[i]; i++) {
-		RefPointer<Cache> cache;
-		getCache(cache,s_caches[i]);
-		if (cache)
-		    cache->reload(msg.msgTime());
-		cache = 0;
-	    }
+	for (int i = 0; s_caches[i]; i++) {
+	    RefPointer<Cache> cache;
+	    getCache(cache,s_caches[i]);
+	    if (!cache)
+		continue;
+	    if (m_haveCacheReload)
+		cache->reload(msg.msgTime());
+	    if (cache->snapshotDue(msg.msgTime()))
+		(new CacheSnapshotThread(s_caches[i]))->startup();
+	    cache = 0;
+	}
+    }
+    else if (id == Halt) {
+	// Save snapshots before unloading, load and save threads are already stopped
+	for (int i = 0; s_caches[i]; i++) {
+	    RefPointer<Cache> cache;
+	    getCache(cache,s_caches[i]);
+	    if (cache)
+		cache->saveSnapshot();
+	    cache = 0;
 	}
     }
     return Module::received(msg,id);
@@ -1467,7 +2256,7 @@ bool CacheModule::received(Message& msg, int id)
 
 void CacheModule::statusModule(String& buf)
 {
-    static const String s_params = "format=Count";
+    static const String s_params = "format=Count|Memory|Hits|Misses|Evicted|Expired";
     Module::statusModule(buf);
     buf.append(s_params,",");
 }
@@ -1523,6 +2312,9 @@ bool CacheModule::commandExecute(String& retVal, const String& line)
 	    case CmdFlush:
 		commandFlush(cache,params,retVal);
 		break;
+	    case CmdSnapshot:
+		commandSnapshot(cache,retVal);
+		break;
 	    default:
 		retVal << "Command not implemented!!!";
 	}
@@ -1596,8 +2388,13 @@ void CacheModule::addCacheDetail(String& buf, Cache* cache)
 {
     if (!cache)
 	return;
-    Lock lock(cache);
-    buf.append(cache->toString() + "=" + String(cache->count()),";");
+    u_int64_t st[Cache::StatTotal];
+    cache->stats(st);
+    String tmp;
+    tmp << cache->toString() << "=" << st[Cache::StatCount];
+    for (int i = Cache::StatBytes; i < Cache::StatTotal; i++)
+	tmp << "|" << st[i];
+    buf.append(tmp,";");
 }
 
 // Handle messages for LNP
@@ -1733,6 +2530,19 @@ void CacheModule::commandFlush(Cache* cache, NamedList& params, String& retVal)
     retVal << "Flushed " << n << " item(s)";
 }
 
+// Cache snapshot handler
+void CacheModule::commandSnapshot(Cache* cache, String& retVal)
+{
+    if (!cache)
+	return;
+    if (cache->hasSnapshot()) {
+	(new CacheSnapshotThread(cache->toString()))->startup();
+	retVal << "Cache snapshot started";
+    }
+    else
+	retVal << "Cache has no snapshot file";
+}
+
 // Help message handler
 bool CacheModule::commandHelp(String& retVal, const String& line)
 {
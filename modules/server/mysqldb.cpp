@@ -22,8 +22,11 @@
 #include <yatephone.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <mysql.h>
 
+#include "sqlbatch.h"
+
 #ifndef CLIENT_MULTI_STATEMENTS
 #define CLIENT_MULTI_STATEMENTS 0
 #define mysql_next_result(x) (-1)
@@ -51,6 +54,24 @@ static ObjList s_conns;
 static unsigned int s_failedConns;
 Mutex s_acctMutex(false,"MySQL::accts");
 
+/**
+  * Class MyStatement
+  * A query template seen on a connection, prepared on its second use
+  */
+class MyStatement : public String
+{
+public:
+    inline MyStatement(const String& tmpl)
+	: String(tmpl), m_stmt(0), m_failed(false), m_lruPrev(0), m_lruNext(0)
+	{ }
+    inline ~MyStatement()
+	{ if (m_stmt) mysql_stmt_close(m_stmt); }
+    MYSQL_STMT* m_stmt;                  // Prepared statement, 0 if not prepared
+    bool m_failed;                       // The server refused to prepare it
+    MyStatement* m_lruPrev;              // Previous (less recently used) template
+    MyStatement* m_lruNext;              // Next (more recently used) template
+};
+
 /**
   * Class MyConn
   * A MySQL connection
@@ -65,19 +86,32 @@ public:
     inline MyConn(const String& name, MyAcct* conn)
 	: String(name),
 	  m_conn(0), m_owner(conn),
-	  m_thread(0)
+	  m_thread(0), m_statements(31),
+	  m_lruHead(0), m_lruTail(0),
+	  m_statementCount(0), m_sessionId(0)
 	{}
     ~MyConn();
 
     void closeConn();
     void runQueries();
-    int queryDbInternal(DbQuery* query);
+    unsigned int runBatch(ObjList& writes);
+    int queryDbInternal(const String& query, Message* msg);
 
 private:
     MYSQL* m_conn;
     MyAcct* m_owner;
     DbThread* m_thread;
+    HashList m_statements;
+    MyStatement* m_lruHead;
+    MyStatement* m_lruTail;
+    unsigned int m_statementCount;
+    unsigned long m_sessionId;
     bool testDb();
+    bool queryPrepared(const String& query, int& res);
+    MyStatement* statement(const String& tmpl, int params);
+    void touch(MyStatement* st);
+    void forget(MyStatement* st);
+    void clearStatements();
 };
 
 /**
@@ -98,11 +132,17 @@ public:
 	{ return 0 != m_connections.skipNull(); }
 
     void appendQuery(DbQuery* query);
+    bool appendWrite(const String& query);
+    bool takeBatch(ObjList& batch);
+    void batchDone(const ObjList& batch, u_int64_t time, unsigned int failed);
+    void flushWrites();
 
     void incTotal();
     void incFailed();
     void incErrorred();
     void incQueryTime(u_int64_t with);
+    void incLatency(u_int64_t with);
+    void incPrepared();
     void lostConn();
     void resetConn();
     inline unsigned int total()
@@ -123,6 +163,11 @@ public:
 	{ return m_retryTime && m_connections.count() < (unsigned int)m_poolSize; }
     inline int poolSize()
 	{ return m_poolSize; }
+    inline bool writeBehind() const
+	{ return m_writeBehind; }
+    inline unsigned int queued() const
+	{ return m_queued; }
+    void statusDetail(String& str);
 private:
     unsigned int m_timeout;
     // interval at which connection initialization should be tried
@@ -140,9 +185,21 @@ private:
     String m_encoding;
 
     int m_poolSize;
+    unsigned int m_prepared;
     ObjList m_connections;
     ObjList m_queryQueue;
 
+    // write-behind queue, protected by the query queue mutex
+    bool m_writeBehind;
+    unsigned int m_batchSize;
+    u_int64_t m_batchInterval;
+    unsigned int m_queueLimit;
+    ObjList m_writeQueue;
+    ObjList* m_writeLast;
+    unsigned int m_queued;
+    bool m_writing;
+    bool m_flush;
+
     Semaphore m_queueSem;
     Mutex m_queueMutex;
 
@@ -152,6 +209,11 @@ private:
     unsigned int m_errorQueries;
     u_int64_t m_queryTime;
     unsigned int m_failedConns;
+    unsigned int m_maxQueued;
+    unsigned int m_batches;
+    unsigned int m_preparedQueries;
+    Histogram m_batchSizes;
+    Histogram m_latency;
     Mutex m_incMutex;
 };
 
@@ -223,7 +285,7 @@ public:
     inline DbQuery(const String& query, Message* msg)
 	: String(query),
 	  Semaphore(1,"MySQL::query"),
-	  m_msg(msg), m_finished(false)
+	  m_msg(msg), m_finished(false), m_time(Time::now())
 	{ DDebug( DebugAll, "DbQuery object [%p] created for query '%s'", this, c_str()); }
 
     inline ~DbQuery()
@@ -242,6 +304,7 @@ public:
 private:
     Message* m_msg;
     bool m_finished;
+    u_int64_t m_time;
 };
 
 static MyModule module;
@@ -278,6 +341,8 @@ void MyConn::closeConn()
     DDebug(&module,DebugInfo,"Database connection '%s' trying to close %p",c_str(),m_conn);
     if (!m_conn)
 	return;
+    // statements belong to the session, close them first
+    clearStatements();
     MYSQL* tmp = m_conn;
     m_conn = 0;
     mysql_close(tmp);
@@ -294,17 +359,27 @@ void MyConn::runQueries()
 
 	Lock mylock(m_owner->m_queueMutex);
 	DbQuery* query = static_cast<DbQuery*>(m_owner->m_queryQueue.remove(false));
-	if (!query)
+	if (!query) {
+	    // no waiting query, see if queued writes need to be executed
+	    ObjList batch;
+	    if (m_owner->takeBatch(batch)) {
+		mylock.drop();
+		u_int64_t start = Time::now();
+		unsigned int failed = runBatch(batch);
+		m_owner->batchDone(batch,start,failed);
+	    }
 	    continue;
+	}
 	m_owner->incTotal();
 	mylock.drop();
 
 	DDebug(&module,DebugAll,"Connection '%s' will try to execute '%s'",
 	    c_str(),query->c_str());
 
-	int res = queryDbInternal(query);
+	int res = queryDbInternal(*query,query->m_msg);
 	if ((res < 0) && query->m_msg)
 	    query->m_msg->setParam("error","failure");
+	m_owner->incLatency(Time::now() - query->m_time);
 
 	query->unlock();
 	query->setFinished();
@@ -312,24 +387,211 @@ void MyConn::runQueries()
     }
 }
 
+// Execute a batch of write-behind queries, coalescing single row INSERTs
+// Coalesced rows are retried one by one if their statement fails
+// Return the number of queries that were not written
+unsigned int MyConn::runBatch(ObjList& writes)
+{
+    ObjList stmts;
+    buildBatch(writes,stmts,SqlBackslash | SqlMySQL);
+    unsigned int failed = 0;
+    bool lost = false;
+    for (ObjList* o = stmts.skipNull(); o; o = o->skipNext()) {
+	SqlBatchStmt* st = static_cast<SqlBatchStmt*>(o->get());
+	unsigned int n = st->m_queries.count();
+	if (lost) {
+	    failed += n;
+	    continue;
+	}
+	int res = queryDbInternal(*st,0);
+	if (res >= 0)
+	    continue;
+	if ((-1 == res) && (n > 1)) {
+	    Debug(&module,DebugInfo,"Connection '%s' retrying insert of %u rows one by one",
+		c_str(),n);
+	    for (ObjList* q = st->m_queries.skipNull(); q; q = q->skipNext()) {
+		if (lost) {
+		    failed++;
+		    continue;
+		}
+		res = queryDbInternal(*static_cast<String*>(q->get()),0);
+		// a lost connection was already counted as failed
+		if (-2 == res)
+		    lost = true;
+		else if (res < 0)
+		    failed++;
+	    }
+	}
+	else {
+	    lost = (-2 == res);
+	    failed += lost ? n - 1 : n;
+	}
+	if (lost)
+	    Debug(&module,DebugWarn,"Connection '%s' lost, failing remaining queued writes",c_str());
+    }
+    return failed;
+}
+
 bool MyConn::testDb()
 {
      return m_conn && !mysql_ping(m_conn);
 }
 
+// Execute a query without results as a prepared statement
+// Return false if the query must be sent as text
+bool MyConn::queryPrepared(const String& query, int& res)
+{
+    // a reconnect by the client library loses the server side statements
+    unsigned long session = mysql_thread_id(m_conn);
+    if (session != m_sessionId) {
+	clearStatements();
+	m_sessionId = session;
+    }
+    String tmpl;
+    ObjList values;
+    int params = queryTemplate(query,tmpl,values,SqlBackslash | SqlMySQL);
+    if (params < 0)
+	return false;
+    MyStatement* st = statement(tmpl,params);
+    if (!st)
+	return false;
+    MYSQL_BIND* bind = params ? new MYSQL_BIND[params] : 0;
+    unsigned long* lengths = params ? new unsigned long[params] : 0;
+    if (bind)
+	::memset(bind,0,params * sizeof(MYSQL_BIND));
+    int n = 0;
+    for (ObjList* o = values.skipNull(); o; o = o->skipNext(), n++) {
+	String* val = static_cast<String*>(o->get());
+	lengths[n] = val->length();
+	bind[n].buffer_type = MYSQL_TYPE_STRING;
+	bind[n].buffer = (void*)val->safe();
+	bind[n].buffer_length = lengths[n];
+	bind[n].length = &lengths[n];
+    }
+    bool ok = !(mysql_stmt_bind_param(st->m_stmt,bind) || mysql_stmt_execute(st->m_stmt));
+    delete[] bind;
+    delete[] lengths;
+    m_owner->incPrepared();
+    res = 0;
+    if (ok)
+	return true;
+    Debug(&module,DebugWarn,"Query for '%s' failed: %s",c_str(),mysql_stmt_error(st->m_stmt));
+    // the statement may be unusable after an error, prepare it again if needed
+    forget(st);
+    m_owner->incErrorred();
+    res = -1;
+    return true;
+}
+
+// Find or prepare the statement of a query template
+// A template is only prepared when used again so one-off queries cost no
+//  extra round trip, the least recently used one is forgotten when full
+// Return the template if it has a prepared statement
+MyStatement* MyConn::statement(const String& tmpl, int params)
+{
+    MyStatement* st = static_cast<MyStatement*>(m_statements[tmpl]);
+    if (!st) {
+	while (m_lruHead && (m_statementCount >= m_owner->m_prepared))
+	    forget(m_lruHead);
+	st = new MyStatement(tmpl);
+	m_statements.append(st);
+	touch(st);
+	m_statementCount++;
+	return 0;
+    }
+    touch(st);
+    if (st->m_stmt || st->m_failed)
+	return st->m_stmt ? st : 0;
+    // stored procedures may return result sets, leave them to text queries
+    const char* s = tmpl.c_str();
+    while (spaceChar(*s))
+	s++;
+    if (!::strncasecmp(s,"CALL",4) && !identChar(s[4])) {
+	st->m_failed = true;
+	return 0;
+    }
+    st->m_stmt = mysql_stmt_init(m_conn);
+    if (st->m_stmt && !mysql_stmt_prepare(st->m_stmt,tmpl.c_str(),tmpl.length())) {
+	// statements returning a result set would need one to be fetched
+	if ((mysql_stmt_param_count(st->m_stmt) == (unsigned long)params) &&
+		!mysql_stmt_field_count(st->m_stmt)) {
+	    DDebug(&module,DebugAll,"Statement on '%s' prepared: %s",c_str(),tmpl.c_str());
+	    return st;
+	}
+    }
+    else if (st->m_stmt)
+	Debug(&module,DebugInfo,"Statement for '%s' will not be prepared: %s",
+	    c_str(),mysql_stmt_error(st->m_stmt));
+    // remember templates that failed so they are not prepared again
+    if (st->m_stmt)
+	mysql_stmt_close(st->m_stmt);
+    st->m_stmt = 0;
+    st->m_failed = true;
+    return 0;
+}
+
+void MyConn::touch(MyStatement* st)
+{
+    if (st == m_lruTail)
+	return;
+    if (st->m_lruNext) {
+	if (st->m_lruPrev)
+	    st->m_lruPrev->m_lruNext = st->m_lruNext;
+	else
+	    m_lruHead = st->m_lruNext;
+	st->m_lruNext->m_lruPrev = st->m_lruPrev;
+    }
+    st->m_lruPrev = m_lruTail;
+    st->m_lruNext = 0;
+    if (m_lruTail)
+	m_lruTail->m_lruNext = st;
+    else
+	m_lruHead = st;
+    m_lruTail = st;
+}
+
+// Forget a query template, closing its statement if prepared
+void MyConn::forget(MyStatement* st)
+{
+    if (st->m_lruPrev)
+	st->m_lruPrev->m_lruNext = st->m_lruNext;
+    else
+	m_lruHead = st->m_lruNext;
+    if (st->m_lruNext)
+	st->m_lruNext->m_lruPrev = st->m_lruPrev;
+    else
+	m_lruTail = st->m_lruPrev;
+    m_statementCount--;
+    m_statements.remove(st,true,true);
+}
+
+void MyConn::clearStatements()
+{
+    m_statements.clear();
+    m_lruHead = m_lruTail = 0;
+    m_statementCount = 0;
+}
+
 // perform the query, fill the message with data
-//  return number of rows, -1 for error
-int MyConn::queryDbInternal(DbQuery* query)
+//  return number of rows, -1 for error, -2 if the connection is lost
+int MyConn::queryDbInternal(const String& query, Message* msg)
 {
     if (!testDb()) {
  	m_owner->lostConn();
  	m_owner->incFailed();
-	return -1;
+	return -2;
     }
     m_owner->resetConn();
     u_int64_t start = Time::now();
 
-    if (mysql_real_query(m_conn,query->safe(),query->length())) {
+    // queries that return nothing to the sender may use prepared statements
+    int prep = 0;
+    if (!msg && m_owner->m_prepared && queryPrepared(query,prep)) {
+	m_owner->incQueryTime(Time::now() - start);
+	return prep;
+    }
+
+    if (mysql_real_query(m_conn,query.safe(),query.length())) {
 	Debug(&module,DebugWarn,"Query for '%s' failed: %s",c_str(),mysql_error(m_conn));
 	u_int64_t duration = Time::now() - start;
 	m_owner->incQueryTime(duration);
@@ -352,10 +614,10 @@ int MyConn::queryDbInternal(DbQuery* query)
 	    unsigned int rows = (unsigned int)mysql_num_rows(res);
 	    Debug(&module,DebugAll,"Got result set %p rows=%u cols=%u",res,rows,cols);
 	    total += rows;
-	    if (query->m_msg) {
+	    if (msg) {
 		MYSQL_FIELD* fields = mysql_fetch_fields(res);
-		query->m_msg->setParam("columns",String(cols));
-		query->m_msg->setParam("rows",String(rows));
+		msg->setParam("columns",String(cols));
+		msg->setParam("rows",String(rows));
 		Array *a = new Array(cols,rows+1);
 		unsigned int c;
 		ObjList** columns = new ObjList*[cols];
@@ -399,7 +661,7 @@ int MyConn::queryDbInternal(DbQuery* query)
 		    }
 		}
 		delete[] columns;
-		query->m_msg->userData(a);
+		msg->userData(a);
 		a->deref();
 	    }
 	    mysql_free_result(res);
@@ -414,10 +676,10 @@ int MyConn::queryDbInternal(DbQuery* query)
 	(unsigned int)((finish-inter+500)/1000));
 #endif
 
-    if (query->m_msg) {
-	query->m_msg->setParam("affected",String(affected));
+    if (msg) {
+	msg->setParam("affected",String(affected));
 	if (warns)
-	    query->m_msg->setParam("warnings",String(warns));
+	    msg->setParam("warnings",String(warns));
     }
     return total;
 }
@@ -429,10 +691,19 @@ MyAcct::MyAcct(const NamedList* sect)
     : String(*sect),
       Mutex(true,"MySQL::acct"),
       m_poolSize(sect->getIntValue("poolsize",1,1)),
+      m_prepared(sect->getIntValue("prepared",0,0,1000)),
+      m_writeBehind(sect->getBoolValue("writebehind")),
+      m_batchSize(sect->getIntValue("batch_size",100,1,1000)),
+      m_batchInterval((u_int64_t)1000 * sect->getIntValue("batch_interval",200,10,10000)),
+      m_queueLimit(sect->getIntValue("queue_limit",10000,m_batchSize)),
+      m_writeLast(&m_writeQueue), m_queued(0),
+      m_writing(false), m_flush(false),
       m_queueSem(m_poolSize,"MySQL::queue"),
       m_queueMutex(false,"MySQL::queue"),
       m_totalQueries(0), m_failedQueries(0), m_errorQueries(0),
       m_queryTime(0), m_failedConns(0),
+      m_maxQueued(0), m_batches(0), m_preparedQueries(0),
+      m_batchSizes(1), m_latency(1000),
       m_incMutex(false,"MySQL::inc")
 {
     int tout = sect->getIntValue("timeout",10000);
@@ -450,8 +721,8 @@ MyAcct::MyAcct(const NamedList* sect)
     m_compress = sect->getBoolValue("compress");
     m_encoding = sect->getValue("encoding");
 
-    Debug(&module, DebugNote, "For account '%s' connection pool size is %d",
-	c_str(),m_poolSize);
+    Debug(&module, DebugNote, "For account '%s' connection pool size is %d, prepared %u, write-behind %s",
+	c_str(),m_poolSize,m_prepared,String::boolText(m_writeBehind));
 
     m_retryTime = sect->getIntValue("initretry",10); // default value is 10 seconds
     setRetryWhen(); // set retry interval
@@ -573,6 +844,11 @@ void MyAcct::dropDb()
 	    c->closeConn();
     }
     m_queryQueue.clear();
+    if (m_queued)
+	Debug(&module,DebugWarn,"Database account '%s' dropping %u queued writes",c_str(),m_queued);
+    m_writeQueue.clear();
+    m_writeLast = &m_writeQueue;
+    m_queued = 0;
     Debug(&module,DebugNote,"Database account '%s' closed",c_str());
 
     s_libMutex.lock();
@@ -619,6 +895,20 @@ void MyAcct::incQueryTime(u_int64_t with)
     module.changed();
 }
 
+void MyAcct::incLatency(u_int64_t with)
+{
+    m_incMutex.lock();
+    m_latency.add(with);
+    m_incMutex.unlock();
+}
+
+void MyAcct::incPrepared()
+{
+    m_incMutex.lock();
+    m_preparedQueries++;
+    m_incMutex.unlock();
+}
+
 void MyAcct::lostConn()
 {
     DDebug(&module,DebugAll,"MyAcct::lostConn() [%p]",this);
@@ -646,6 +936,132 @@ void MyAcct::appendQuery(DbQuery* query)
     m_queueSem.unlock();
 }
 
+// Queue a query for write-behind, waiting for room while the queue is full
+// Return false if no batch completed for a query timeout
+bool MyAcct::appendWrite(const String& query)
+{
+    Lock mylock(m_queueMutex);
+    u_int64_t tout = (u_int64_t)1000000 * (m_timeout ? m_timeout : 10);
+    u_int64_t stop = Time::now() + tout;
+    unsigned int last = m_queued;
+    while (m_queued >= m_queueLimit) {
+	mylock.drop();
+	if (Thread::check(false))
+	    return false;
+	m_queueSem.unlock();
+	Thread::idle();
+	mylock.acquire(m_queueMutex);
+	if (m_queued != last) {
+	    last = m_queued;
+	    stop = Time::now() + tout;
+	}
+	else if (Time::now() > stop) {
+	    Debug(&module,DebugWarn,"Account '%s' timed out waiting for room in write queue",c_str());
+	    return false;
+	}
+    }
+    m_writeLast = m_writeLast->append(new SqlWrite(query));
+    if (++m_queued > m_maxQueued)
+	m_maxQueued = m_queued;
+    bool full = (m_queued >= m_batchSize);
+    mylock.drop();
+    if (full)
+	m_queueSem.unlock();
+    return true;
+}
+
+// Take a batch of queued writes if full, old enough or flushing
+// Only one batch runs at a time so queries are executed in order
+// Called with the queue mutex locked
+bool MyAcct::takeBatch(ObjList& batch)
+{
+    SqlWrite* w = static_cast<SqlWrite*>(m_writeQueue.get());
+    if (!w || m_writing)
+	return false;
+    if (!m_flush && (m_queued < m_batchSize) && (Time::now() < w->m_time + m_batchInterval))
+	return false;
+    ObjList* last = &batch;
+    for (unsigned int n = m_batchSize; n && m_writeQueue.get(); n--) {
+	// removing the head moves the next item into it
+	ObjList* next = m_writeQueue.next();
+	last = last->append(m_writeQueue.remove(false));
+	if (m_writeLast == next)
+	    m_writeLast = &m_writeQueue;
+	m_queued--;
+    }
+    m_writing = true;
+    return true;
+}
+
+// Account a finished batch and allow the next one to run
+void MyAcct::batchDone(const ObjList& batch, u_int64_t time, unsigned int failed)
+{
+    m_queueMutex.lock();
+    m_writing = false;
+    bool more = (m_queued >= m_batchSize);
+    m_queueMutex.unlock();
+    if (more)
+	m_queueSem.unlock();
+    u_int64_t finish = Time::now();
+    m_incMutex.lock();
+    unsigned int count = 0;
+    for (ObjList* o = batch.skipNull(); o; o = o->skipNext()) {
+	m_latency.add(finish - static_cast<SqlWrite*>(o->get())->m_time);
+	count++;
+    }
+    m_totalQueries += count;
+    m_failedQueries += failed;
+    m_batches++;
+    m_batchSizes.add(count);
+    m_incMutex.unlock();
+    if (failed)
+	Debug(&module,DebugWarn,"Account '%s' failed to write %u of %u queued queries",
+	    c_str(),failed,count);
+    DDebug(&module,DebugAll,"Account '%s' wrote batch of %u queries in " FMT64U " usec",
+	c_str(),count,finish - time);
+    module.changed();
+}
+
+// Execute all queued writes, give up if no batch completes for a query timeout
+void MyAcct::flushWrites()
+{
+    Lock mylock(m_queueMutex);
+    if (!(m_queued || m_writing) || !ok())
+	return;
+    Debug(&module,DebugInfo,"Flushing %u queued writes for '%s'",m_queued,c_str());
+    u_int64_t tout = (u_int64_t)1000000 * (m_timeout ? m_timeout : 10);
+    u_int64_t stop = Time::now() + tout;
+    unsigned int last = m_queued;
+    m_flush = true;
+    while ((m_queued || m_writing) && (Time::now() < stop)) {
+	mylock.drop();
+	m_queueSem.unlock();
+	Thread::idle();
+	mylock.acquire(m_queueMutex);
+	if (m_queued != last) {
+	    last = m_queued;
+	    stop = Time::now() + tout;
+	}
+    }
+    m_flush = false;
+}
+
+void MyAcct::statusDetail(String& str)
+{
+    str.append(c_str(),",") << "=" << total() << "|" << failed() << "|" << errorred() << "|";
+    if (total() - failed() > 0)
+	str << (queryTime() / (total() - failed()) / 1000); //miliseconds
+    else
+	str << "0";
+    str << "|" << m_queued << "|" << m_maxQueued << "|" << m_batches << "|";
+    m_incMutex.lock();
+    str << m_preparedQueries << "|";
+    m_batchSizes.dump(str);
+    str << "|";
+    m_latency.dump(str);
+    m_incMutex.unlock();
+}
+
 /**
   * DbThread
   */
@@ -692,7 +1108,17 @@ bool MyHandler::received(Message& msg)
 
     str = msg.getParam("query");
     if (!TelEngine::null(str)) {
-	if (msg.getBoolValue("results",true)) {
+	bool results = msg.getBoolValue("results",true);
+	// fire-and-forget queries may be written behind, the queue being full
+	//  makes the sender wait for room
+	if (!results && db->writeBehind()) {
+	    if (!db->appendWrite(*str)) {
+		db->incTotal();
+		db->incFailed();
+		msg.setParam("error","failure");
+	    }
+	}
+	else if (results) {
 	    DbQuery* q = new DbQuery(*str,&msg);
 	    db->appendQuery(q);
 
@@ -783,7 +1209,7 @@ MyModule::~MyModule()
 void MyModule::statusModule(String& str)
 {
     Module::statusModule(str);
-    str.append("format=Total|Failed|Errors|AvgExecTime",",");
+    str.append("format=Total|Failed|Errors|AvgExecTime|Queued|MaxQueued|Batches|Prepared|BatchSizes|Latency",",");
 }
 
 void MyModule::statusParams(String& str)
@@ -794,14 +1220,8 @@ void MyModule::statusParams(String& str)
 
 void MyModule::statusDetail(String& str)
 {
-    for (unsigned int i = 0; i < s_conns.count(); i++) {
-	MyAcct* acc = static_cast<MyAcct*>(s_conns[i]);
-	str.append(acc->c_str(),",") << "=" << acc->total() << "|" << acc->failed() << "|" << acc->errorred() << "|";
-	if (acc->total() - acc->failed() > 0)
-	    str << (acc->queryTime() / (acc->total() - acc->failed()) / 1000); //miliseconds
-        else
-	    str << "0";
-    }
+    for (unsigned int i = 0; i < s_conns.count(); i++)
+	static_cast<MyAcct*>(s_conns[i])->statusDetail(str);
 }
 
 void MyModule::initialize()
@@ -841,6 +1261,13 @@ bool MyModule::received(Message& msg, int id)
     if (id == Halt) {
 	if (m_initThread)
 	    m_initThread->cancel(true);
+	// write queued queries before the engine stops
+	Lock lock(s_acctMutex);
+	for (ObjList* o = s_conns.skipNull(); o; o = o->skipNext()) {
+	    MyAcct* acc = static_cast<MyAcct*>(o->get());
+	    if (acc->writeBehind())
+		acc->flushWrites();
+	}
     }
     return Module::received(msg,id);
 }
@@ -857,6 +1284,7 @@ void MyModule::genUpdate(Message& msg)
 	msg.setParam(String("errorred.") << index,String(acc->errorred()));
 	msg.setParam(String("hasconn.") << index,String::boolText(acc->hasConn()));
 	msg.setParam(String("querytime.") << index,String(acc->queryTime()));
+	msg.setParam(String("queued.") << index,String(acc->queued()));
 	index++;
     }
     msg.setParam("count",String(index));
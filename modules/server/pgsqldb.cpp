@@ -22,18 +22,35 @@
 #include <yatephone.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <libpq-fe.h>
 
+#include "sqlbatch.h"
+
 using namespace TelEngine;
 namespace { // anonymous
 
 class PGConn;                            // A database connection
 class PgAccount;                         // Database account holding the connection(s)
+class PgWriter;                          // Thread executing write-behind batches
 
 static ObjList s_accounts;
 Mutex s_conmutex(false,"PgSQL::acc");
 static unsigned int s_failedConns;
 
+// A query template seen on a connection, prepared on its second use
+class PgStatement : public String
+{
+public:
+    inline PgStatement(const String& tmpl)
+	: String(tmpl), m_failed(false), m_lruPrev(0), m_lruNext(0)
+	{ }
+    String m_name;                       // Statement name, empty if not prepared
+    bool m_failed;                       // The server refused to prepare it
+    PgStatement* m_lruPrev;              // Previous (less recently used) template
+    PgStatement* m_lruNext;              // Next (more recently used) template
+};
+
 // A database connection
 class PgConn : public String
 {
@@ -50,32 +67,61 @@ public:
 	{ return m_conn && (CONNECTION_OK == PQstatus(m_conn)); }
     bool initDb();
     void dropDb();
+    // Check if the server handles backslashes in string literals as escapes
+    bool backslashEscapes() const;
     // Perform the query, fill the message with data
+    // Set failed if any statement returned an error
     // Return number of rows, -1 for non-retryable errors and -2 to retry
-    int queryDb(const char* query, Message* dest);
+    int queryDb(const char* query, Message* dest, bool* failed = 0);
     virtual void destruct();
 private:
     // Init DB connection
     bool initDbInternal(int retry);
     // Perform the query, fill the message with data
     // Return number of rows, -1 for non-retryable errors and -2 to retry
-    int queryDbInternal(const char* query, Message* dest);
+    int queryDbInternal(const char* query, Message* dest, bool* failed);
+    // Find or prepare the statement of a query template
+    // Return the statement name, 0 to send the query as text
+    const char* statement(const String& tmpl, int params, u_int64_t timeout);
+    // Prepare a statement, wait for the server to confirm it
+    bool prepare(const String& name, const String& tmpl, int params, u_int64_t timeout);
+    // Forget a query template, deallocate its statement if prepared
+    // Return false if the connection was dropped
+    bool forget(PgStatement* st, u_int64_t timeout);
+    // Move a query template to the most recently used end of the list
+    void touch(PgStatement* st);
 
     PgAccount* m_account;
     bool m_busy;
     PGconn* m_conn;
+    HashList m_statements;
+    PgStatement* m_lruHead;
+    PgStatement* m_lruTail;
+    unsigned int m_statementCount;
+    unsigned int m_statementId;
 };
 
 // Database account holding the connection(s)
 class PgAccount : public RefObject, public Mutex
 {
     friend class PgConn;
+    friend class PgWriter;
 public:
     PgAccount(const NamedList& sect);
     // Try to initialize DB connections. Return true if at least one of them is active
     bool initDb();
     // Make a query
     int queryDb(const char* query, Message* dest);
+    // Queue a query for write-behind, waiting for room while the queue is full
+    // Return 1 if queued, 0 if it must be executed directly, -1 on timeout
+    int appendWrite(const String& query);
+    // Execute a batch of queued writes if full, old enough or forced
+    // Return true if a batch was executed
+    bool writeBatch(bool force);
+    // Execute all queued writes, used when the engine halts
+    void flushWrites();
+    // Account a query that could not be queued for write-behind
+    void writeFailed(Message* dest);
     bool hasConn();
     virtual const String& toString() const
 	{ return m_name; }
@@ -89,15 +135,28 @@ public:
 	{ return m_errorQueries; }
     inline unsigned int queryTime()
         { return (unsigned int) m_queryTime; }
+    inline bool writeBehind() const
+	{ return m_writeBehind; }
+    inline unsigned int queued() const
+	{ return m_queued; }
+    void statusDetail(String& str);
 
 protected:
     inline void incErrorQueriesSafe() {
 	    Lock mylock(m_statsMutex);
 	    m_errorQueries++;
 	}
+    inline void incPreparedSafe() {
+	    Lock mylock(m_statsMutex);
+	    m_preparedQueries++;
+	}
 
 private:
     void dropDb();
+    // Pick a connection that is not busy and mark it busy
+    PgConn* getConn();
+    // Execute a batch of write-behind queries
+    void runBatch(ObjList& writes);
 
     String m_name;
     String m_connection;
@@ -106,12 +165,42 @@ private:
     u_int64_t m_timeout;
     PgConn* m_connPool;
     unsigned int m_connPoolSize;
+    unsigned int m_prepared;
+    // write-behind queue
+    bool m_writeBehind;
+    unsigned int m_batchSize;
+    u_int64_t m_batchInterval;
+    unsigned int m_queueLimit;
+    Mutex m_writeMutex;
+    ObjList m_writeQueue;
+    ObjList* m_writeLast;
+    unsigned int m_queued;
+    bool m_writing;
+    PgWriter* m_writer;
     // stat counters
     Mutex* m_statsMutex;
     unsigned int m_totalQueries;
     unsigned int m_failedQueries;
     unsigned int m_errorQueries;
     u_int64_t m_queryTime;
+    unsigned int m_preparedQueries;
+    unsigned int m_maxQueued;
+    unsigned int m_batches;
+    Histogram m_batchSizes;
+    Histogram m_latency;
+};
+
+// Thread executing the write-behind batches of an account
+class PgWriter : public Thread
+{
+public:
+    inline PgWriter(PgAccount* account)
+	: Thread("PgSQL Writer",Thread::Low), m_account(account)
+	{ }
+    ~PgWriter();
+    virtual void run();
+private:
+    PgAccount* m_account;
 };
 
 class PgModule : public Module
@@ -125,6 +214,7 @@ protected:
     virtual void statusParams(String& str);
     virtual void statusDetail(String& str);
     virtual void genUpdate(Message& msg);
+    virtual bool received(Message& msg, int id);
 private:
     bool m_init;
 };
@@ -147,7 +237,8 @@ public:
 //
 PgConn::PgConn(PgAccount* account)
     : m_account(account), m_busy(false),
-    m_conn(0)
+    m_conn(0), m_statements(31), m_lruHead(0), m_lruTail(0),
+    m_statementCount(0), m_statementId(0)
 {
 }
 
@@ -179,19 +270,31 @@ void PgConn::dropDb()
 	return;
     PGconn* tmp = m_conn;
     m_conn = 0;
+    // prepared statements are lost with the session
+    m_statements.clear();
+    m_lruHead = m_lruTail = 0;
+    m_statementCount = 0;
     XDebug(&module,DebugAll,"Connection '%s' dropped [%p]",c_str(),m_account);
     PQfinish(tmp);
 }
 
+bool PgConn::backslashEscapes() const
+{
+    const char* scs = m_conn ? PQparameterStatus(m_conn,"standard_conforming_strings") : 0;
+    return !(scs && !::strcmp(scs,"on"));
+}
+
 // Perform the query, fill the message with data
 // Return number of rows, -1 for non-retryable errors and -2 to retry
-int PgConn::queryDb(const char* query, Message* dest)
+int PgConn::queryDb(const char* query, Message* dest, bool* failed)
 {
     int retry = m_account->m_retry;
     for (int i = 0; i < retry; i++) {
 	XDebug(&module,DebugAll,"Connection '%s' performing query (retry=%d): %s [%p]",
 	    c_str(),i + 1,query,m_account);
-	int res = queryDbInternal(query,dest);
+	if (failed)
+	    *failed = false;
+	int res = queryDbInternal(query,dest,failed);
 	if (res > -2)
 	    return res;
     }
@@ -286,15 +389,170 @@ bool PgConn::initDbInternal(int retry)
     return false;
 }
 
+// Find or prepare the statement of a query template
+// A template is only prepared when used again so one-off queries cost no
+//  extra round trip, the least recently used one is forgotten when full
+// Return the statement name, 0 to send the query as text
+const char* PgConn::statement(const String& tmpl, int params, u_int64_t timeout)
+{
+    PgStatement* st = static_cast<PgStatement*>(m_statements[tmpl]);
+    if (!st) {
+	while (m_lruHead && (m_statementCount >= m_account->m_prepared)) {
+	    if (!forget(m_lruHead,timeout))
+		return 0;
+	}
+	st = new PgStatement(tmpl);
+	m_statements.append(st);
+	touch(st);
+	m_statementCount++;
+	return 0;
+    }
+    touch(st);
+    if (st->m_name || st->m_failed)
+	return st->m_name.null() ? 0 : st->m_name.c_str();
+    String name("yate_");
+    name << ++m_statementId;
+    bool ok = prepare(name,tmpl,params,timeout);
+    if (!m_conn)
+	return 0;
+    // remember templates that failed so they are not prepared again
+    if (!ok) {
+	st->m_failed = true;
+	return 0;
+    }
+    st->m_name = name;
+    return st->m_name.c_str();
+}
+
+void PgConn::touch(PgStatement* st)
+{
+    if (st == m_lruTail)
+	return;
+    if (st->m_lruNext) {
+	if (st->m_lruPrev)
+	    st->m_lruPrev->m_lruNext = st->m_lruNext;
+	else
+	    m_lruHead = st->m_lruNext;
+	st->m_lruNext->m_lruPrev = st->m_lruPrev;
+    }
+    st->m_lruPrev = m_lruTail;
+    st->m_lruNext = 0;
+    if (m_lruTail)
+	m_lruTail->m_lruNext = st;
+    else
+	m_lruHead = st;
+    m_lruTail = st;
+}
+
+// Forget a query template, deallocate its statement if prepared
+bool PgConn::forget(PgStatement* st, u_int64_t timeout)
+{
+    if (st->m_lruPrev)
+	st->m_lruPrev->m_lruNext = st->m_lruNext;
+    else
+	m_lruHead = st->m_lruNext;
+    if (st->m_lruNext)
+	st->m_lruNext->m_lruPrev = st->m_lruPrev;
+    else
+	m_lruTail = st->m_lruPrev;
+    m_statementCount--;
+    String sql;
+    if (st->m_name)
+	sql << "DEALLOCATE " << st->m_name;
+    m_statements.remove(st,true,true);
+    if (sql.null())
+	return true;
+    if (!PQsendQuery(m_conn,sql) || PQflush(m_conn)) {
+	Debug(&module,DebugMild,"Deallocate for '%s' failed: %s [%p]",
+	    c_str(),PQerrorMessage(m_conn),m_account);
+	dropDb();
+	return false;
+    }
+    while (Time::now() < timeout) {
+	PQconsumeInput(m_conn);
+	if (PQisBusy(m_conn)) {
+	    Thread::yield();
+	    continue;
+	}
+	PGresult* res = PQgetResult(m_conn);
+	if (!res)
+	    return true;
+	if (PGRES_COMMAND_OK != PQresultStatus(res))
+	    Debug(&module,DebugInfo,"Deallocate for '%s' failed: %s [%p]",
+		c_str(),PQresultErrorMessage(res),m_account);
+	PQclear(res);
+    }
+    Debug(&module,DebugWarn,"Deallocate timed out for '%s' [%p]",c_str(),m_account);
+    dropDb();
+    return false;
+}
+
+// Prepare a statement, wait for the server to confirm it
+bool PgConn::prepare(const String& name, const String& tmpl, int params, u_int64_t timeout)
+{
+    if (!PQsendPrepare(m_conn,name,tmpl,params,0) || PQflush(m_conn)) {
+	Debug(&module,DebugMild,"Prepare for '%s' failed: %s [%p]",
+	    c_str(),PQerrorMessage(m_conn),m_account);
+	return false;
+    }
+    bool ok = false;
+    while (Time::now() < timeout) {
+	PQconsumeInput(m_conn);
+	if (PQisBusy(m_conn)) {
+	    Thread::yield();
+	    continue;
+	}
+	PGresult* res = PQgetResult(m_conn);
+	if (!res) {
+	    DDebug(&module,DebugAll,"Statement '%s' on '%s'%s prepared: %s [%p]",
+		name.c_str(),c_str(),(ok ? "" : " not"),tmpl.c_str(),m_account);
+	    return ok;
+	}
+	if (PGRES_COMMAND_OK == PQresultStatus(res))
+	    ok = true;
+	else
+	    Debug(&module,DebugInfo,"Statement for '%s' will not be prepared: %s [%p]",
+		c_str(),PQresultErrorMessage(res),m_account);
+	PQclear(res);
+    }
+    Debug(&module,DebugWarn,"Prepare timed out for '%s' [%p]",c_str(),m_account);
+    dropDb();
+    return false;
+}
+
 // Perform the query, fill the message with data
 // Return number of rows, -1 for non-retryable errors and -2 to retry
-int PgConn::queryDbInternal(const char* query, Message* dest)
+int PgConn::queryDbInternal(const char* query, Message* dest, bool* failed)
 {
     if (!initDb())
 	// no retry - initDb already tried and failed...
 	return -1;
     u_int64_t timeout = Time::now() + m_account->m_timeout;
-    if (!PQsendQuery(m_conn,query)) {
+    const char* stmt = 0;
+    ObjList values;
+    if (m_account->m_prepared) {
+	String tmpl;
+	int params = queryTemplate(query,tmpl,values,backslashEscapes() ? SqlBackslash : 0);
+	if (params >= 0) {
+	    stmt = statement(tmpl,params,timeout);
+	    if (!m_conn)
+		return -2;
+	}
+    }
+    int sent = 0;
+    if (stmt) {
+	unsigned int n = values.count();
+	const char** vals = n ? new const char*[n] : 0;
+	n = 0;
+	for (ObjList* o = values.skipNull(); o; o = o->skipNext())
+	    vals[n++] = static_cast<String*>(o->get())->safe();
+	sent = PQsendQueryPrepared(m_conn,stmt,n,vals,0,0,0);
+	delete[] vals;
+	m_account->incPreparedSafe();
+    }
+    else
+	sent = PQsendQuery(m_conn,query);
+    if (!sent) {
 	// a connection failure cannot be detected at this point so any
 	//  error must be caused by the query itself - bad syntax or so
 	Debug(&module,DebugWarn,"Query '%s' for '%s' failed: %s [%p]",
@@ -396,6 +654,8 @@ int PgConn::queryDbInternal(const char* query, Message* dest)
 		    query,c_str(),PQresultErrorMessage(res),m_account);
 		if (dest)
 		    dest->setParam("error",PQresultErrorMessage(res));
+		if (failed)
+		    *failed = true;
 		m_account->incErrorQueriesSafe();
 		module.changed();
 	}
@@ -415,10 +675,15 @@ int PgConn::queryDbInternal(const char* query, Message* dest)
 PgAccount::PgAccount(const NamedList& sect)
     : Mutex(true,"PgAccount"),
       m_name(sect),
-      m_connPool(0), m_connPoolSize(0),
+      m_connPool(0), m_connPoolSize(0), m_prepared(0),
+      m_writeBehind(false), m_batchSize(100), m_batchInterval(200000), m_queueLimit(10000),
+      m_writeMutex(false,"PgSQL::write"),
+      m_writeLast(&m_writeQueue), m_queued(0), m_writing(false), m_writer(0),
       m_statsMutex(&s_conmutex),
       m_totalQueries(0), m_failedQueries(0),
-      m_errorQueries(0), m_queryTime(0)
+      m_errorQueries(0), m_queryTime(0),
+      m_preparedQueries(0), m_maxQueued(0), m_batches(0),
+      m_batchSizes(1), m_latency(1000)
 {
     m_connection = sect.getValue("connection");
     if (m_connection.null()) {
@@ -447,8 +712,23 @@ PgAccount::PgAccount(const NamedList& sect)
 	m_connPool[i].m_account = this;
 	m_connPool[i].assign(m_name + "." + String(i + 1));
     }
-    Debug(&module,DebugInfo,"Database account '%s' created poolsize=%u [%p]",
-	m_name.c_str(),m_connPoolSize,this);
+    m_prepared = sect.getIntValue("prepared",0,0,1000);
+    m_writeBehind = sect.getBoolValue("writebehind");
+    if (m_writeBehind) {
+	m_batchSize = sect.getIntValue("batch_size",100,1,1000);
+	m_batchInterval = (u_int64_t)1000 * sect.getIntValue("batch_interval",200,10,10000);
+	m_queueLimit = sect.getIntValue("queue_limit",10000,m_batchSize);
+	m_writer = new PgWriter(this);
+	if (!m_writer->startup()) {
+	    Debug(&module,DebugWarn,"Failed to start writer for '%s', write-behind disabled [%p]",
+		m_name.c_str(),this);
+	    delete m_writer;
+	    m_writer = 0;
+	    m_writeBehind = false;
+	}
+    }
+    Debug(&module,DebugInfo,"Database account '%s' created poolsize=%u prepared=%u writebehind=%s [%p]",
+	m_name.c_str(),m_connPoolSize,m_prepared,String::boolText(m_writeBehind),this);
 }
 
 // Init the connections the connection
@@ -465,6 +745,18 @@ void PgAccount::destroyed()
     s_conmutex.lock();
     s_accounts.remove(this,false);
     s_conmutex.unlock();
+    m_writeMutex.lock();
+    if (m_writer)
+	m_writer->cancel();
+    m_writeMutex.unlock();
+    while (m_writer)
+	Thread::idle();
+    if (m_queued)
+	Debug(&module,DebugWarn,"Database account '%s' dropping %u queued writes [%p]",
+	    m_name.c_str(),m_queued,this);
+    m_writeQueue.clear();
+    m_writeLast = &m_writeQueue;
+    m_queued = 0;
     dropDb();
     if (m_connPool)
 	delete[] m_connPool;
@@ -486,72 +778,75 @@ static bool failure(Message* m)
     return false;
 }
 
+// Pick a connection that is not busy and mark it busy
+PgConn* PgAccount::getConn()
+{
+    Lock mylock(this,(long)m_timeout);
+    if (!mylock.locked()) {
+	Debug(&module,DebugWarn,"Failed to lock '%s' for " FMT64U " usec",
+	    m_name.c_str(),m_timeout);
+	return 0;
+    }
+    // Find a non busy connection
+    PgConn* conn = 0;
+    PgConn* notConnected = 0;
+    for (unsigned int i = 0; i < m_connPoolSize; i++) {
+	if (m_connPool[i].isBusy())
+	    continue;
+	if (m_connPool[i].testDb()) {
+	    conn = &(m_connPool[i]);
+	    break;
+	}
+	if (!notConnected)
+	    notConnected = &(m_connPool[i]);
+    }
+    if (!conn)
+	conn = notConnected;
+    if (!conn) {
+	// Wait for a connection to become non-busy
+	// Round up the number of intervals to wait
+	unsigned int n = (unsigned int)((m_timeout + 999999) / Thread::idleUsec());
+	for (unsigned int i = 0; i < n; i++) {
+	    for (unsigned int j = 0; j < m_connPoolSize; j++) {
+		if (!m_connPool[j].isBusy() && m_connPool[j].testDb()) {
+		    conn = &(m_connPool[j]);
+		    break;
+		}
+	    }
+	    if (conn || Thread::check(false))
+		break;
+	    Thread::idle();
+	}
+    }
+    if (conn)
+	conn->setBusy(true);
+    else
+	Debug(&module,DebugWarn,"Account '%s' failed to pick a connection [%p]",m_name.c_str(),this);
+    return conn;
+}
+
 int PgAccount::queryDb(const char* query, Message* dest)
 {
     if (TelEngine::null(query))
 	return -1;
     Debug(&module,DebugAll,"Performing query \"%s\" for '%s'",
 	query,m_name.c_str());
-    // Use a while() to break to the end to update statistics
     int res = -1;
     u_int64_t start = Time::now();
-    while (true) {
-	Lock mylock(this,(long)m_timeout);
-	if (!mylock.locked()) {
-	    Debug(&module,DebugWarn,"Failed to lock '%s' for " FMT64U " usec",
-		m_name.c_str(),m_timeout);
-	    break;
-	}
-	// Find a non busy connection
-	PgConn* conn = 0;
-	PgConn* notConnected = 0;
-	for (unsigned int i = 0; i < m_connPoolSize; i++) {
-	    if (m_connPool[i].isBusy())
-		continue;
-	    if (m_connPool[i].testDb()) {
-		conn = &(m_connPool[i]);
-		break;
-	    }
-	    if (!notConnected)
-		notConnected = &(m_connPool[i]);
-        }
-	if (!conn)
-	    conn = notConnected;
-	if (!conn) {
-	    // Wait for a connection to become non-busy
-	    // Round up the number of intervals to wait
-	    unsigned int n = (unsigned int)((m_timeout + 999999) / Thread::idleUsec());
-	    for (unsigned int i = 0; i < n; i++) {
-		for (unsigned int j = 0; j < m_connPoolSize; j++) {
-		    if (!m_connPool[j].isBusy() && m_connPool[j].testDb()) {
-			conn = &(m_connPool[j]);
-			break;
-		    }
-		}
-		if (conn || Thread::check(false))
-		    break;
-		Thread::idle();
-	    }
-	}
-	if (conn)
-	    conn->setBusy(true);
-	else
-	    Debug(&module,DebugWarn,"Account '%s' failed to pick a connection [%p]",m_name.c_str(),this);
-	mylock.drop();
-	if (conn) {
-	    res = conn->queryDb(query,dest);
-	    conn->setBusy(false);
-	}
-	break;
+    PgConn* conn = getConn();
+    if (conn) {
+	res = conn->queryDb(query,dest);
+	conn->setBusy(false);
     }
+    u_int64_t finish = Time::now() - start;
     Lock stats(m_statsMutex);
     m_totalQueries++;
     if (res > -2) {
 	if (res < 0)
 	    m_failedQueries++;
-	u_int64_t finish = Time::now() - start;
 	m_queryTime += finish;
     }
+    m_latency.add(finish);
     stats.drop();
     module.changed();
     if (res < 0)
@@ -559,6 +854,166 @@ int PgAccount::queryDb(const char* query, Message* dest)
     return res;
 }
 
+// Queue a query for write-behind, waiting for room while the queue is full
+// Without a writer thread the sender drains the queue itself and only then
+//  executes the query directly so earlier writes are never overtaken
+int PgAccount::appendWrite(const String& query)
+{
+    Lock lck(m_writeMutex);
+    u_int64_t stop = Time::now() + m_timeout;
+    unsigned int last = m_queued;
+    while (m_writer ? (m_queued >= m_queueLimit) : (m_queued || m_writing)) {
+	bool force = !m_writer;
+	lck.drop();
+	if (Thread::check(false))
+	    return -1;
+	if (!writeBatch(force))
+	    Thread::idle();
+	lck.acquire(m_writeMutex);
+	if (m_queued != last) {
+	    last = m_queued;
+	    stop = Time::now() + m_timeout;
+	}
+	else if (Time::now() > stop) {
+	    Debug(&module,DebugWarn,"Account '%s' timed out waiting for room in write queue [%p]",
+		m_name.c_str(),this);
+	    return -1;
+	}
+    }
+    if (!m_writer)
+	return 0;
+    m_writeLast = m_writeLast->append(new SqlWrite(query));
+    if (++m_queued > m_maxQueued)
+	m_maxQueued = m_queued;
+    return 1;
+}
+
+// Execute a batch of queued writes if full, old enough or forced
+// Only one batch runs at a time so queries are executed in order
+bool PgAccount::writeBatch(bool force)
+{
+    Lock lck(m_writeMutex);
+    SqlWrite* w = static_cast<SqlWrite*>(m_writeQueue.get());
+    if (!w || m_writing)
+	return false;
+    if (!force && (m_queued < m_batchSize) && (Time::now() < w->m_time + m_batchInterval))
+	return false;
+    ObjList batch;
+    ObjList* last = &batch;
+    for (unsigned int n = m_batchSize; n && m_writeQueue.get(); n--) {
+	// removing the head moves the next item into it
+	ObjList* next = m_writeQueue.next();
+	last = last->append(m_writeQueue.remove(false));
+	if (m_writeLast == next)
+	    m_writeLast = &m_writeQueue;
+	m_queued--;
+    }
+    m_writing = true;
+    lck.drop();
+    runBatch(batch);
+    lck.acquire(m_writeMutex);
+    m_writing = false;
+    return true;
+}
+
+// Execute a batch of write-behind queries on a single connection
+// Statements are sent together, on failure they are retried one by one
+void PgAccount::runBatch(ObjList& writes)
+{
+    unsigned int count = writes.count();
+    unsigned int failed = count;
+    u_int64_t start = Time::now();
+    PgConn* conn = getConn();
+    if (conn && conn->initDb()) {
+	ObjList stmts;
+	buildBatch(writes,stmts,conn->backslashEscapes() ? SqlBackslash : 0);
+	bool err = false;
+	if (stmts.count() > 1) {
+	    String sql;
+	    sql.append(stmts,";\n");
+	    if (conn->queryDb(sql,0,&err) >= 0 && !err)
+		failed = 0;
+	    else if (conn->testDb())
+		Debug(&module,DebugInfo,"Batch of %u statements failed for '%s', retrying one by one [%p]",
+		    stmts.count(),m_name.c_str(),this);
+	}
+	for (ObjList* o = stmts.skipNull(); failed && o && conn->testDb(); o = o->skipNext()) {
+	    SqlBatchStmt* st = static_cast<SqlBatchStmt*>(o->get());
+	    unsigned int n = st->m_queries.count();
+	    if (conn->queryDb(*st,0,&err) >= 0 && !err) {
+		failed -= n;
+		continue;
+	    }
+	    if (n < 2 || !conn->testDb())
+		continue;
+	    Debug(&module,DebugInfo,"Insert of %u rows failed for '%s', retrying one by one [%p]",
+		n,m_name.c_str(),this);
+	    for (ObjList* q = st->m_queries.skipNull(); q; q = q->skipNext()) {
+		if (conn->queryDb(*static_cast<String*>(q->get()),0,&err) >= 0 && !err)
+		    failed--;
+	    }
+	}
+    }
+    if (conn)
+	conn->setBusy(false);
+    if (failed)
+	Debug(&module,DebugWarn,"Account '%s' failed to write %u of %u queued queries [%p]",
+	    m_name.c_str(),failed,count,this);
+    u_int64_t finish = Time::now();
+    Lock stats(m_statsMutex);
+    m_totalQueries += count;
+    m_failedQueries += failed;
+    m_queryTime += finish - start;
+    m_batches++;
+    m_batchSizes.add(count);
+    for (ObjList* o = writes.skipNull(); o; o = o->skipNext())
+	m_latency.add(finish - static_cast<SqlWrite*>(o->get())->m_time);
+    stats.drop();
+    module.changed();
+}
+
+// Account a query that could not be queued for write-behind
+void PgAccount::writeFailed(Message* dest)
+{
+    Lock stats(m_statsMutex);
+    m_totalQueries++;
+    m_failedQueries++;
+    stats.drop();
+    module.changed();
+    failure(dest);
+}
+
+// Execute all queued writes, give up if no batch can run for a query timeout
+void PgAccount::flushWrites()
+{
+    if (!m_queued)
+	return;
+    Debug(&module,DebugInfo,"Flushing %u queued writes for '%s' [%p]",
+	m_queued,m_name.c_str(),this);
+    u_int64_t stop = Time::now() + m_timeout;
+    while (m_queued && (Time::now() < stop)) {
+	if (writeBatch(true))
+	    stop = Time::now() + m_timeout;
+	else
+	    Thread::idle();
+    }
+}
+
+// Called with the stats mutex locked
+void PgAccount::statusDetail(String& str)
+{
+    str.append(toString().c_str(),",") << "=" << m_totalQueries << "|" << m_failedQueries
+	<< "|" << m_errorQueries << "|";
+    if (m_totalQueries - m_failedQueries > 0)
+	str << (queryTime() / (m_totalQueries - m_failedQueries) / 1000); //miliseconds
+    else
+	str << "0";
+    str << "|" << m_queued << "|" << m_maxQueued << "|" << m_batches << "|" << m_preparedQueries << "|";
+    m_batchSizes.dump(str);
+    str << "|";
+    m_latency.dump(str);
+}
+
 bool PgAccount::hasConn()
 {
     for (unsigned int i = 0; i < m_connPoolSize; i++)
@@ -574,6 +1029,24 @@ static PgAccount* findDb(const String& account)
     return static_cast<PgAccount*>(s_accounts[account]);
 }
 
+//
+// PgWriter
+//
+PgWriter::~PgWriter()
+{
+    Lock lck(m_account->m_writeMutex);
+    m_account->m_writer = 0;
+}
+
+void PgWriter::run()
+{
+    while (!Thread::check(false)) {
+	if (!m_account->writeBatch(false))
+	    Thread::idle();
+    }
+}
+
+
 bool PgHandler::received(Message& msg)
 {
     const String* str = msg.getParam("account");
@@ -585,8 +1058,17 @@ bool PgHandler::received(Message& msg)
     if (!db)
 	return false;
     str = msg.getParam("query");
-    if (!TelEngine::null(str))
-	db->queryDb(*str,&msg);
+    if (!TelEngine::null(str)) {
+	// fire-and-forget queries may be written behind, the queue being full
+	//  makes the sender wait for room
+	int res = 0;
+	if (db->writeBehind() && !msg.getBoolValue("results",true))
+	    res = db->appendWrite(*str);
+	if (!res)
+	    db->queryDb(*str,&msg);
+	else if (res < 0)
+	    db->writeFailed(&msg);
+    }
     db = 0;
     msg.setParam("dbtype","pgsqldb");
     return true;
@@ -607,7 +1089,7 @@ PgModule::~PgModule()
 void PgModule::statusModule(String& str)
 {
     Module::statusModule(str);
-    str.append("format=Total|Failed|Errors|AvgExecTime",",");
+    str.append("format=Total|Failed|Errors|AvgExecTime|Queued|MaxQueued|Batches|Prepared|BatchSizes|Latency",",");
 }
 
 void PgModule::statusParams(String& str)
@@ -622,13 +1104,7 @@ void PgModule::statusDetail(String& str)
 {
     s_conmutex.lock();
     for (ObjList* o = s_accounts.skipNull(); o; o = o->skipNext()) {
-	PgAccount* acc = static_cast<PgAccount*>(o->get());
-	str.append(acc->toString().c_str(),",") << "=" << acc->total() << "|" << acc->failed()
-	    << "|" << acc->errorred() << "|";
-	if (acc->total() - acc->failed() > 0)
-	    str << (acc->queryTime() / (acc->total() - acc->failed()) / 1000); //miliseconds
-        else
-	    str << "0";
+	static_cast<PgAccount*>(o->get())->statusDetail(str);
     }
     s_conmutex.unlock();
 }
@@ -642,6 +1118,7 @@ void PgModule::initialize()
     Output("Initializing module PostgreSQL");
     Configuration cfg(Engine::configFile("pgsqldb"));
     Engine::install(new PgHandler(cfg.getIntValue("general","priority",100)));
+    installRelay(Halt);
     unsigned int i;
     for (i = 0; i < cfg.sections(); i++) {
 	NamedList* sec = cfg.getSection(i);
@@ -671,12 +1148,31 @@ void PgModule::genUpdate(Message& msg)
 	msg.setParam(String("errorred.") << index,String(acc->errorred()));
 	msg.setParam(String("hasconn.") << index,String::boolText(acc->hasConn()));
 	msg.setParam(String("querytime.") << index,String(acc->queryTime()));
+	msg.setParam(String("queued.") << index,String(acc->queued()));
 	index++;
     }
     s_conmutex.unlock();
     msg.setParam("count",String(index));
 }
 
+bool PgModule::received(Message& msg, int id)
+{
+    if (id == Halt) {
+	// write queued queries before the engine stops
+	ObjList accounts;
+	s_conmutex.lock();
+	for (ObjList* o = s_accounts.skipNull(); o; o = o->skipNext()) {
+	    PgAccount* acc = static_cast<PgAccount*>(o->get());
+	    if (acc->writeBehind() && acc->ref())
+		accounts.append(acc);
+	}
+	s_conmutex.unlock();
+	for (ObjList* o = accounts.skipNull(); o; o = o->skipNext())
+	    static_cast<PgAccount*>(o->get())->flushWrites();
+    }
+    return Module::received(msg,id);
+}
+
 }; // anonymous namespace
 
 /* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,307 @@
+/**
+ * sqlbatch.h
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Write-behind batching and query templates shared by the SQL database modules
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2014 Null Team
+ *
+ * This software is distributed under multiple licenses;
+ * see the COPYING file in the main directory for licensing
+ * information for this specific distribution.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __SQLBATCH_H
+#define __SQLBATCH_H
+
+#include <yateclass.h>
+
+#include <string.h>
+
+namespace { // anonymous
+
+using namespace TelEngine;
+
+// Query syntax differences between the database servers
+enum SqlSyntax {
+    SqlBackslash = 0x01,                 // Backslash escapes characters in string literals
+    SqlMySQL = 0x02,                     // Backtick identifiers, # comments, ? parameters
+};
+
+// Counters in fixed decade buckets
+class Histogram
+{
+public:
+    inline Histogram(unsigned int first)
+	: m_first(first)
+	{ ::memset(m_count,0,sizeof(m_count)); }
+    inline void add(u_int64_t value)
+	{
+	    unsigned int i = 0;
+	    for (u_int64_t lim = m_first; (i < 4) && (value > lim); lim *= 10)
+		i++;
+	    m_count[i]++;
+	}
+    inline void dump(String& str) const
+	{
+	    for (unsigned int i = 0; i < 5; i++) {
+		if (i)
+		    str << "/";
+		str << m_count[i];
+	    }
+	}
+private:
+    unsigned int m_first;
+    unsigned int m_count[5];
+};
+
+// A query waiting in the write-behind queue of an account
+class SqlWrite : public String
+{
+public:
+    inline SqlWrite(const String& query)
+	: String(query), m_time(Time::now())
+	{ }
+    u_int64_t m_time;
+};
+
+// A statement of a write-behind batch built from one or more queued queries
+class SqlBatchStmt : public String
+{
+public:
+    ObjList m_queries;
+};
+
+static inline bool identChar(char c)
+{
+    return ('_' == c) || ('$' == c) || ((unsigned char)c >= 0x80) ||
+	(c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool spaceChar(char c)
+{
+    return (' ' == c) || ('\t' == c) || ('\r' == c) || ('\n' == c);
+}
+
+// Check if a character starts a quoted string or identifier
+static inline bool quoteChar(char c, int syntax)
+{
+    return ('\'' == c) || ('"' == c) || (('`' == c) && (syntax & SqlMySQL));
+}
+
+// Check if a comment starts at a position
+static inline bool commentStart(const char* s, int syntax)
+{
+    return (('-' == *s || '/' == *s) && (s[1] == *s || ('/' == *s && '*' == s[1]))) ||
+	(('#' == *s) && (syntax & SqlMySQL));
+}
+
+// Skip over a quoted string or identifier
+// Return pointer after the closing quote, 0 if unterminated
+static const char* skipQuoted(const char* s, bool backslash)
+{
+    char q = *s++;
+    while (*s) {
+	char c = *s++;
+	if (c == q) {
+	    if (*s != q)
+		return s;
+	    s++;
+	}
+	else if (backslash && ('\\' == c) && *s)
+	    s++;
+    }
+    return 0;
+}
+
+// Check if a query is a single row INSERT ... VALUES (...)
+// Return the offsets after VALUES, of the row and after the row
+static bool splitInsert(const char* query, unsigned int& values,
+    unsigned int& row, unsigned int& end, int syntax)
+{
+    bool backslash = (0 != (syntax & SqlBackslash));
+    const char* s = query;
+    while (spaceChar(*s))
+	s++;
+    if (::strncasecmp(s,"INSERT",6) || !spaceChar(s[6]))
+	return false;
+    s += 6;
+    const char* v = 0;
+    while (*s && !v) {
+	if (quoteChar(*s,syntax)) {
+	    s = skipQuoted(s,backslash);
+	    if (!s)
+		return false;
+	    continue;
+	}
+	// refuse to deal with comments
+	if (commentStart(s,syntax))
+	    return false;
+	if (('v' == *s || 'V' == *s) &&
+	    !(identChar(s[-1]) || ::strncasecmp(s,"VALUES",6) || identChar(s[6])))
+	    v = s + 6;
+	s++;
+    }
+    if (!v)
+	return false;
+    s = v;
+    while (spaceChar(*s))
+	s++;
+    if ('(' != *s)
+	return false;
+    row = s - query;
+    int depth = 0;
+    while (*s) {
+	char c = *s;
+	if (quoteChar(c,syntax)) {
+	    s = skipQuoted(s,backslash);
+	    if (!s)
+		return false;
+	    continue;
+	}
+	s++;
+	if ('(' == c)
+	    depth++;
+	else if (')' == c && !--depth)
+	    break;
+    }
+    if (depth)
+	return false;
+    end = s - query;
+    while (spaceChar(*s) || ';' == *s)
+	s++;
+    if (*s)
+	return false;
+    values = v - query;
+    return true;
+}
+
+// Length of a query without trailing blanks and semicolons
+static unsigned int stmtLength(const String& query)
+{
+    unsigned int len = query.length();
+    while (len && (spaceChar(query.at(len - 1)) || ';' == query.at(len - 1)))
+	len--;
+    return len;
+}
+
+// Build the statements of a write-behind batch, coalescing consecutive
+//  single row INSERT queries that are identical up to the row values
+static void buildBatch(const ObjList& writes, ObjList& stmts, int syntax)
+{
+    ObjList* last = &stmts;
+    SqlBatchStmt* insert = 0;
+    unsigned int prefix = 0;
+    for (ObjList* o = writes.skipNull(); o; o = o->skipNext()) {
+	SqlWrite* w = static_cast<SqlWrite*>(o->get());
+	unsigned int values = 0;
+	unsigned int row = 0;
+	unsigned int end = 0;
+	bool ins = splitInsert(w->c_str(),values,row,end,syntax);
+	if (ins && insert && (values == prefix) && !::strncmp(insert->c_str(),w->c_str(),prefix)) {
+	    *insert << ",";
+	    insert->append(w->c_str() + row,end - row);
+	    insert->m_queries.append(w)->setDelete(false);
+	    continue;
+	}
+	SqlBatchStmt* st = new SqlBatchStmt;
+	st->assign(w->c_str(),ins ? end : stmtLength(*w));
+	st->m_queries.append(w)->setDelete(false);
+	last = last->append(st);
+	insert = ins ? st : 0;
+	prefix = values;
+    }
+}
+
+// Replace the plain quoted literals of a single statement with parameters,
+//  numbered $1, $2... or ? for MySQL, the trailing semicolon is dropped
+// Return the number of parameters, -1 if the query can't be used as template
+static int queryTemplate(const char* query, String& tmpl, ObjList& values, int syntax)
+{
+    bool backslash = (0 != (syntax & SqlBackslash));
+    bool mysql = (0 != (syntax & SqlMySQL));
+    int params = 0;
+    ObjList* last = &values;
+    const char* seg = query;
+    const char* s = query;
+    while (*s) {
+	switch (*s) {
+	    case '\'':
+		{
+		    // prefixed literals like E'', B'', U&'', _utf8'' or typed ones are not plain
+		    if (s > query && (identChar(s[-1]) || '&' == s[-1]))
+			return -1;
+		    const char* e = skipQuoted(s,backslash);
+		    if (!e || params >= 65535)
+			return -1;
+		    String* val = new String(s + 1,e - s - 2);
+		    if (backslash && (val->find('\\') >= 0)) {
+			TelEngine::destruct(val);
+			return -1;
+		    }
+		    for (int pos = 0; (pos = val->find("''",pos)) >= 0; pos++)
+			*val = val->substr(0,pos + 1) + val->substr(pos + 2);
+		    last = last->append(val);
+		    tmpl.append(seg,s - seg);
+		    if (mysql)
+			tmpl << "?";
+		    else
+			tmpl << "$" << (params + 1);
+		    params++;
+		    s = seg = e;
+		}
+		continue;
+	    case '"':
+		// a string literal in MySQL unless ANSI_QUOTES is set
+		if (mysql)
+		    return -1;
+		s = skipQuoted(s,false);
+		if (!s)
+		    return -1;
+		continue;
+	    case '`':
+		if (!mysql)
+		    break;
+		s = skipQuoted(s,false);
+		if (!s)
+		    return -1;
+		continue;
+	    case '$':
+		// refuse existing parameters and dollar quoting
+		if (!mysql && (s == query || !identChar(s[-1])))
+		    return -1;
+		break;
+	    case '?':
+		if (mysql)
+		    return -1;
+		break;
+	    case ';':
+		// must be a single statement
+		for (const char* e = s + 1; *e; e++)
+		    if (!spaceChar(*e))
+			return -1;
+		tmpl.append(seg,s - seg);
+		return params;
+	    default:
+		if (commentStart(s,syntax))
+		    return -1;
+	}
+	s++;
+    }
+    tmpl.append(seg,s - seg);
+    return params;
+}
+
+}; // anonymous namespace
+
+#endif /* __SQLBATCH_H */
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,125 @@
+/**
+ * listiter.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2014 Null Team
+ *
+ * This software is distributed under multiple licenses;
+ * see the COPYING file in the main directory for licensing
+ * information for this specific distribution.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <yatengine.h>
+
+using namespace TelEngine;
+
+class TestListIter : public Plugin
+{
+public:
+    TestListIter();
+    virtual void initialize();
+    void report(const char* test, const String& result, const char* expect);
+};
+
+// Build a list of single letter strings
+static void fill(ObjList& list, const char* items)
+{
+    list.clear();
+    for (; *items; items++)
+	list.append(new String(*items));
+}
+
+// Iterate a list, calling an action on the first item, return seen items
+static String iterate(ObjList& list, void (*action)(ObjList& list))
+{
+    String seen;
+    ListIterator iter(list);
+    bool first = true;
+    while (GenObject* obj = iter.get()) {
+	seen << obj->toString();
+	if (first && action)
+	    action(list);
+	first = false;
+    }
+    return seen;
+}
+
+static void removeB(ObjList& list)
+{
+    list.remove(list["b"]);
+}
+
+static void moveBToEnd(ObjList& list)
+{
+    GenObject* b = list["b"];
+    list.remove(b,false);
+    list.append(b);
+}
+
+static void moveBToFront(ObjList& list)
+{
+    GenObject* b = list["b"];
+    list.remove(b,false);
+    list.insert(b);
+}
+
+static void duplicateB(ObjList& list)
+{
+    GenObject* b = list["b"];
+    list.append(b)->setDelete(false);
+    list.remove(b,false);
+    list.find(b)->setDelete(true);
+}
+
+static void removeBThenC(ObjList& list)
+{
+    list.remove(list["b"]);
+    list.remove(list["c"]);
+}
+
+TestListIter::TestListIter()
+    : Plugin("testlistiter")
+{
+    Output("Hello, I am module TestListIter");
+}
+
+void TestListIter::report(const char* test, const String& result, const char* expect)
+{
+    if (result == expect)
+	Debug(test,DebugInfo,"Iterated expected '%s'",expect);
+    else
+	Debug(test,DebugWarn,"Iterated '%s' but expected '%s'",result.c_str(),expect);
+}
+
+void TestListIter::initialize()
+{
+    Output("Initializing module TestListIter");
+
+    ObjList list;
+    fill(list,"abcd");
+    report("iter-plain",iterate(list,0),"abcd");
+    fill(list,"abcd");
+    report("iter-remove",iterate(list,removeB),"acd");
+    fill(list,"abcd");
+    report("iter-remove-2",iterate(list,removeBThenC),"ad");
+    // An object removed and added back is still in the list
+    fill(list,"abcd");
+    report("iter-move-end",iterate(list,moveBToEnd),"abcd");
+    fill(list,"abcd");
+    report("iter-move-front",iterate(list,moveBToFront),"abcd");
+    fill(list,"abcd");
+    report("iter-duplicate",iterate(list,duplicateB),"abcd");
+    list.clear();
+}
+
+INIT_PLUGIN(TestListIter);
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -90,6 +90,7 @@ static bool s_warnLater = false;
 static bool s_monitor   = false;
 static bool s_rtcp  = true;
 static bool s_drill = false;
+static bool s_sendBatch = false;
 
 static Thread::Priority s_priority = Thread::Normal;
 static int s_tos     = Socket::Normal;
@@ -1579,6 +1580,12 @@ void YRTPPlugin::statusParams(String& str)
     s_refMutex.lock();
     str.append("mirrors=",",") << s_mirrors.count();
     s_refMutex.unlock();
+    if (s_sendBatch) {
+	u_int64_t packets = 0;
+	u_int64_t calls = 0;
+	RTPGroup::sendStats(packets,calls);
+	str << ",txpackets=" << packets << ",txcalls=" << calls;
+    }
 }
 
 void YRTPPlugin::statusDetail(String& str)
@@ -1867,6 +1874,9 @@ void YRTPPlugin::initialize()
     s_monitor = cfg.getBoolValue("general","monitoring",false);
     s_sleep = cfg.getIntValue("general","defsleep",5);
     RTPGroup::setMinSleep(cfg.getIntValue("general","minsleep"));
+    RTPGroup::setEvents(cfg.getBoolValue("general","eventgroups"));
+    s_sendBatch = cfg.getBoolValue("general","sendbatch");
+    RTPGroup::setBatching(s_sendBatch);
     s_priority = Thread::priority(cfg.getValue("general","thread"));
     s_rtpWarnSeq = cfg.getBoolValue("general","rtp_warn_seq",true);
     s_timeout = cfg.getIntValue("timeouts","timeout",3000);
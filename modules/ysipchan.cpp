@@ -25,6 +25,12 @@
 
 #include <string.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 using namespace TelEngine;
 namespace { // anonymous
@@ -35,12 +41,14 @@ class YateSIPTransport;                  // SIP transport: keeps a socket, read/
 class YateSIPUDPTransport;               // UDP transport
 class YateSIPTCPTransport;               // TCP/TLS transport
 class YateSIPTransportWorker;            // A transport worker
+class YateSIPTCPReactor;                 // Thread multiplexing many TCP/TLS transports
 class YateSIPTCPListener;                // A TCP listener
 class YateUDPParty;                      // A SIP UDP party
 class YateTCPParty;                      // A SIP TCP/TLS party
 class YateSIPEngine;                     // The SIP engine
 class YateSIPLine;                       // A line
 class YateSIPEndPoint;                   // Endpoint processor
+class YateSIPShardWorker;                // Processor of a SIP engine shard
 class SIPDriver;
 
 #define EXPIRES_MIN 60
@@ -58,6 +66,21 @@ class SIPDriver;
 // 1 minute
 #define BIND_RETRY_MAX 60000
 
+// Maximum time the endpoint thread sleeps waiting for SIP events in microseconds
+#define SIP_EVENT_WAIT 100000
+// Maximum number of SIP engine shards, each one is processed by its own thread
+#define SIP_MAX_SHARDS 32
+// Number of hash buckets used to find connections by Call-ID
+#define SIP_CALL_BUCKETS 257
+
+// Interval in milliseconds a TCP/TLS reactor processes all its transports
+//  to check idle timeouts and engine termination
+#define REACTOR_SWEEP 1000
+// Number of socket events handled by a reactor in one batch
+#define REACTOR_EVENTS 64
+// Number of reads from a transport before moving to the next one
+#define REACTOR_READS 16
+
 static const TokenDict dict_errors[] = {
     { "incomplete", 484 },
     { "noroute", 404 },
@@ -453,6 +476,7 @@ class YateSIPTCPTransport : public YateSIPTransport
 {
     YCLASS(YateSIPTCPTransport,YateSIPTransport);
     friend class YateTCPParty;
+    friend class YateSIPTCPReactor;
 public:
     // Build an outgoing transport
     YateSIPTCPTransport(bool tls, const String& laddr, const String& raddr, int rport);
@@ -481,6 +505,8 @@ public:
     bool send(SIPEvent* event);
     // Process data (read/send)
     virtual int process();
+    // Stop being processed by a reactor
+    void leaveReactor();
 protected:
     virtual void destroyed();
     // Status changed notification
@@ -528,6 +554,10 @@ protected:
     String m_localAddr;                  // Optional local address to bind to
     unsigned int m_connectRetry;         // Number of re-connect
     u_int64_t m_nextConnect;             // Interval to try ro re-connect
+    // Incoming processed by a reactor instead of a worker
+    YateSIPTCPReactor* m_reactor;        // Reactor processing this transport
+    bool m_reactorReady;                 // Waiting in the reactor's ready list
+    bool m_reactorOut;                   // Reactor is watching for socket writable
 };
 
 // Transport worker
@@ -543,6 +573,66 @@ private:
     YateSIPTransport* m_transport;
 };
 
+// Thread multiplexing incoming TCP/TLS transports using edge triggered epoll
+// Each transport is processed when its socket becomes readable or writable,
+//  when it has messages queued for sending and periodically to check timeouts
+class YateSIPTCPReactor : public Thread, public GenObject
+{
+    friend class YateSIPEndPoint;
+public:
+    YateSIPTCPReactor(unsigned int index, Thread::Priority prio);
+    ~YateSIPTCPReactor();
+    inline bool valid() const
+	{ return m_epoll >= 0; }
+    // Number of transports processed by this reactor
+    inline unsigned int count() const
+	{ return m_count; }
+    // Start processing a transport, take over the reference held by the caller
+    // Must be called with the transport locked
+    bool add(YateSIPTCPTransport* trans);
+    // Stop processing a transport
+    // Return true if the caller must release the reference held by the reactor
+    // Must be called with the transport locked
+    bool remove(YateSIPTCPTransport* trans);
+    // Stop watching a transport's socket before closing it
+    // Must be called with the transport locked
+    void unwatch(YateSIPTCPTransport* trans);
+    // Schedule a transport for processing
+    void wake(YateSIPTCPTransport* trans);
+    // Schedule all transports for processing
+    void wakeAll();
+    virtual void run();
+    virtual const String& toString() const
+	{ return m_name; }
+private:
+    enum WatchOp {
+	WatchAdd,
+	WatchModify,
+	WatchRemove
+    };
+    // Wake up the thread
+    void signal();
+    // Append a transport to ready list, must be called with the reactor locked
+    // Return false if already there
+    bool setReady(YateSIPTCPTransport* trans);
+    // Update the events watched for a transport's socket
+    bool watch(YateSIPTCPTransport* trans, WatchOp op, bool out);
+    // Process a transport until it has nothing to read
+    void process(YateSIPTCPTransport* trans);
+    // Release all transports
+    void cleanup();
+
+    String m_name;                       // Reactor name
+    Mutex m_mutex;                       // Protect transport lists
+    int m_epoll;                         // Event poll handle
+    int m_event;                         // Event handle used to wake up the thread
+    unsigned int m_count;                // Number of transports
+    unsigned int m_removed;              // Incremented each time a transport is removed
+    HashList m_transports;               // Transports, the reactor holds a reference
+    ObjList m_ready;                     // Transports waiting to be processed
+    u_int64_t m_nextSweep;               // Time to process all transports
+};
+
 class YateSIPTCPListener : public Thread, public GenObject, public ProtocolHolder, public YateSIPListener
 {
     friend class SIPDriver;
@@ -643,11 +733,6 @@ public:
     bool hasActiveTransaction(YateSIPTransport* trans);
     // Check if the engine has pending transactions
     bool hasInitialTransaction();
-    // Clear transactions
-    inline void clearTransactions() {
-	    Lock lck(this);
-	    m_transList.clear();
-	}
     inline bool prack() const
 	{ return m_prack; }
     inline bool info() const
@@ -798,6 +883,24 @@ public:
     bool removeListener(YateSIPTCPListener* listener);
     // Remove a listener from list. Remove all if name is empty. Wait for termination
     void cancelListener(const String& name = String::empty(), const char* reason = 0);
+    // Start TCP/TLS reactor threads up to the requested count
+    void setupReactors(unsigned int count, Thread::Priority prio);
+    // Hand an incoming TCP/TLS transport to the least loaded reactor
+    bool addToReactor(YateSIPTCPTransport* trans);
+    // Remove a reactor from list. Return true if found
+    bool removeReactor(YateSIPTCPReactor* reactor);
+    // Schedule all transports of all reactors for processing
+    void wakeReactors();
+    // Stop all reactors. Wait for termination
+    void cancelReactors();
+    // Start processing threads for all engine shards except the first one
+    void setupWorkers(Thread::Priority prio);
+    // Remove a shard worker from list. Return true if found
+    bool removeWorker(YateSIPShardWorker* worker);
+    // Stop all shard workers. Wait for termination
+    void cancelWorkers();
+    // Get and process the events of an engine shard until cancelled
+    void process(unsigned int shard);
     // This method is called by the driver when start/end initializing
     void initializing(bool start);
     inline YateSIPEngine* engine() const
@@ -825,19 +928,38 @@ public:
     MutexPool m_partyMutexPool;          // SIPParty mutex pool
     // Check if data is allowed to be read from socket(s) and processed
     static bool canRead();
-    static int s_evCount;
+    // Retrieve the highest count of consecutive events handled by a shard
+    static int evCount();
+    static int s_evCount[SIP_MAX_SHARDS];
 private:
     YateSIPEngine *m_engine;
     Mutex m_mutex;                       // Protect transports and listeners
     ObjList m_transports;                // All transports (non UDP are not owned)
     YateSIPUDPTransport* m_defTransport; // Default transport (pointer to object in m_transports)
     ObjList m_listeners;                 // Listeners list
+    ObjList m_reactors;                  // TCP/TLS reactors list
+    ObjList m_workers;                   // Engine shard processing threads
 
     unsigned int m_failedAuths;
     unsigned int m_timedOutTrs;
     unsigned int m_timedOutByes;
 };
 
+// Thread getting and processing the events of a SIP engine shard
+// The endpoint thread itself processes the first shard
+class YateSIPShardWorker : public Thread, public GenObject
+{
+public:
+    YateSIPShardWorker(unsigned int shard, Thread::Priority prio);
+    virtual void run();
+    virtual void cleanup();
+    virtual const String& toString() const
+	{ return m_name; }
+private:
+    String m_name;
+    unsigned int m_shard;
+};
+
 // Handle transfer requests
 // Respond to the enclosed transaction
 class YateSIPRefer : public Thread
@@ -961,6 +1083,9 @@ public:
 	{ return m_tr; }
     inline const String& callid() const
 	{ return m_dialog; }
+    // Call-ID used to index the connection, never changes
+    inline const String& indexCallId() const
+	{ return m_indexCallId; }
     inline const String& user() const
 	{ return m_user; }
     inline int getPort() const
@@ -1035,6 +1160,8 @@ private:
     int m_reasonCode;
     // SIP dialog of this call, used for re-INVITE or BYE
     SIPDialog m_dialog;
+    // Call-ID of the dialog, used in driver's index
+    String m_indexCallId;
     // remote URI as we send in dialog messages
     URI m_uri;
     String m_domain;
@@ -1127,6 +1254,10 @@ public:
 	const String& toTag, bool incRef = false);
     YateSIPLine* findLine(const String& line) const;
     YateSIPLine* findLine(const String& addr, int port, const String& user = String::empty());
+    // Add a connection to the Call-ID index
+    void addCall(YateSIPConnection* conn);
+    // Remove a connection from the Call-ID index
+    void removeCall(YateSIPConnection* conn);
     // Drop channels belonging using a given transport
     // Return the number of disconnected channels
     unsigned int transportTerminated(YateSIPTransport* trans);
@@ -1153,6 +1284,8 @@ private:
 
     SDPParser m_parser;
     YateSIPEndPoint *m_endpoint;
+    Mutex m_callsMutex;                  // Protect the Call-ID index
+    ObjList m_calls[SIP_CALL_BUCKETS];   // Connections by Call-ID hash (not owned)
 };
 
 static SIPDriver plugin;
@@ -1243,7 +1376,7 @@ static const String s_username = "username";
 
 static u_int64_t s_printFloodTime = 0;
 
-int YateSIPEndPoint::s_evCount = 0;
+int YateSIPEndPoint::s_evCount[SIP_MAX_SHARDS];
 
 // DTMF methods
 static bool s_checkAllowInfo = true;         // Check Allow in INVITE and OK for INFO support
@@ -2878,6 +3011,10 @@ void YateSIPTransport::terminate(const char* reason)
 	    m_reason = reason;
     }
     changeStatus(Terminated);
+    // This may release the last reference so it must be done last
+    YateSIPTCPTransport* tcp = tcpTransport();
+    if (tcp)
+	tcp->leaveReactor();
 }
 
 const String& YateSIPTransport::toString() const
@@ -3145,7 +3282,7 @@ int YateSIPUDPTransport::process()
 	    m_setRtpAddr = false;
 	}
     }
-    int& evc = YateSIPEndPoint::s_evCount;
+    int evc = YateSIPEndPoint::evCount();
     // Do nothing if the endpoint is flooded with events or terminating
     if (!(YateSIPEndPoint::canRead() || ((evc & 3) == 0)))
 	return Thread::idleUsec();
@@ -3189,7 +3326,7 @@ int YateSIPUDPTransport::process()
     if (s_printMsg)
 	printRecvMsg(b,res);
 
-    if (s_floodProtection && s_floodEvents && evc >= s_floodEvents) {
+    if (s_floodProtection && s_floodEvents && YateSIPEndPoint::evCount() >= s_floodEvents) {
 	if (!s_printFloodTime)
 	    Alarm(&plugin,"performance",DebugWarn,
 		"Flood detected, dropping INVITE/REGISTER/SUBSCRIBE/OPTIONS, allowing reINVITES");
@@ -3217,7 +3354,8 @@ YateSIPTCPTransport::YateSIPTCPTransport(bool tls, const String& laddr, const St
     m_flowTimer(false), m_keepAlivePending(false),
     m_msg(0), m_sipBufOffs(0), m_contentLen(0),
     m_remoteAddr(raddr), m_remotePort(rport), m_localAddr(laddr),
-    m_connectRetry(s_tcpConnectRetry), m_nextConnect(0)
+    m_connectRetry(s_tcpConnectRetry), m_nextConnect(0),
+    m_reactor(0), m_reactorReady(false), m_reactorOut(false)
 {
     m_maxpkt = s_tcpMaxpkt;
     if (m_remotePort <= 0)
@@ -3236,7 +3374,8 @@ YateSIPTCPTransport::YateSIPTCPTransport(Socket* sock, bool tls)
     m_idleInterval(TCP_IDLE_DEF), m_idleTimeout(0),
     m_flowTimer(false), m_keepAlivePending(false),
     m_msg(0), m_sipBufOffs(0), m_contentLen(0),
-    m_remotePort(0), m_connectRetry(0), m_nextConnect(0)
+    m_remotePort(0), m_connectRetry(0), m_nextConnect(0),
+    m_reactor(0), m_reactorReady(false), m_reactorOut(false)
 {
     m_maxpkt = s_tcpMaxpkt;
     m_id << (tls ? "tls:" : "tcp:");
@@ -3268,8 +3407,12 @@ bool YateSIPTCPTransport::init(const NamedList& params, bool first, Thread::Prio
     Debug(&plugin,DebugAll,
 	"Transport(%s) initialized maxpkt=%u rtp_localip=%s nat_address=%s tcp_idle=%u [%p]",
 	m_id.c_str(),m_maxpkt,m_rtpLocalAddr.c_str(),m_rtpNatAddr.c_str(),m_idleInterval,this);
-    if (ok && first)
+    if (ok && first) {
+	// Incoming connections are multiplexed by reactors if available
+	if (!m_outgoing && plugin.ep() && plugin.ep()->addToReactor(this))
+	    return true;
 	ok = startWorker(prio);
+    }
     return ok;
 }
 
@@ -3308,6 +3451,8 @@ bool YateSIPTCPTransport::send(SIPEvent* event)
     Debug(&plugin,DebugAll,"Transport(%s) enqueued (%p,%s) [%p]",
 	m_id.c_str(),msg,tmp.c_str(),this);
 #endif
+    if (m_reactor)
+	m_reactor->wake(this);
     return true;
 }
 
@@ -3408,6 +3553,16 @@ void YateSIPTCPTransport::destroyed()
     YateSIPTransport::destroyed();
 }
 
+// Stop being processed by a reactor, release the reference it was holding
+void YateSIPTCPTransport::leaveReactor()
+{
+    Lock lck(this);
+    if (!(m_reactor && m_reactor->remove(this)))
+	return;
+    lck.drop();
+    deref();
+}
+
 // Status changed notification for descendents
 void YateSIPTCPTransport::statusChanged()
 {
@@ -3796,6 +3951,9 @@ void YateSIPTCPTransport::resetConnection(Socket* sock)
     setProtoAddr(false);
     // Reset socket and addresses
     if (m_sock) {
+	// Stop watching the handle before it can be reused by a new socket
+	if (m_reactor)
+	    m_reactor->unwatch(this);
 	resetSocket(m_sock,-1);
 	m_local.clear();
 	m_remote.clear();
@@ -3899,6 +4057,278 @@ void YateSIPTransportWorker::cleanupTransport(bool final, bool terminate)
 }
 
 
+YateSIPTCPReactor::YateSIPTCPReactor(unsigned int index, Thread::Priority prio)
+    : Thread("YSIP Reactor",prio),
+    m_mutex(false,"YSIPReactor"),
+    m_epoll(-1), m_event(-1), m_count(0), m_removed(0),
+    m_transports(251), m_nextSweep(0)
+{
+    m_name << "reactor/" << index;
+#ifdef HAVE_EPOLL
+    m_epoll = ::epoll_create(REACTOR_EVENTS);
+    if (m_epoll < 0) {
+	Debug(&plugin,DebugWarn,"Reactor(%s) failed to create epoll, error %d [%p]",
+	    m_name.c_str(),errno,this);
+	return;
+    }
+    m_event = ::eventfd(0,EFD_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    // A null pointer marks the wake up event
+    ev.data.ptr = 0;
+    if (m_event >= 0 && !::epoll_ctl(m_epoll,EPOLL_CTL_ADD,m_event,&ev))
+	return;
+    Debug(&plugin,DebugWarn,"Reactor(%s) failed to create wake up event, error %d [%p]",
+	m_name.c_str(),errno,this);
+    if (m_event >= 0)
+	::close(m_event);
+    ::close(m_epoll);
+    m_event = m_epoll = -1;
+#endif
+}
+
+YateSIPTCPReactor::~YateSIPTCPReactor()
+{
+    cleanup();
+#ifdef HAVE_EPOLL
+    if (m_event >= 0)
+	::close(m_event);
+    if (m_epoll >= 0)
+	::close(m_epoll);
+#endif
+}
+
+// Start processing a transport, must be called with the transport locked
+bool YateSIPTCPReactor::add(YateSIPTCPTransport* trans)
+{
+    if (!(trans && valid()))
+	return false;
+    Lock lck(m_mutex);
+    if (trans->m_reactor)
+	return trans->m_reactor == this;
+    if (!watch(trans,WatchAdd,false))
+	return false;
+    trans->m_reactor = this;
+    m_transports.append(trans)->setDelete(false);
+    m_count++;
+    // Data may be already waiting (i.e. SSL handshake)
+    setReady(trans);
+    signal();
+    DDebug(&plugin,DebugAll,"Reactor(%s) added transport (%p,'%s') count=%u [%p]",
+	m_name.c_str(),trans,trans->toString().c_str(),m_count,this);
+    return true;
+}
+
+// Stop processing a transport, must be called with the transport locked
+bool YateSIPTCPReactor::remove(YateSIPTCPTransport* trans)
+{
+    if (!trans)
+	return false;
+    Lock lck(m_mutex);
+    if (trans->m_reactor != this)
+	return false;
+    watch(trans,WatchRemove,false);
+    m_transports.remove(trans,false,true);
+    if (trans->m_reactorReady) {
+	m_ready.remove(trans,false);
+	trans->m_reactorReady = false;
+    }
+    trans->m_reactor = 0;
+    m_count--;
+    m_removed++;
+    DDebug(&plugin,DebugAll,"Reactor(%s) removed transport (%p,'%s') count=%u [%p]",
+	m_name.c_str(),trans,trans->toString().c_str(),m_count,this);
+    return true;
+}
+
+// Stop watching a transport's socket, must be called with the transport locked
+void YateSIPTCPReactor::unwatch(YateSIPTCPTransport* trans)
+{
+    Lock lck(m_mutex);
+    if (trans && trans->m_reactor == this)
+	watch(trans,WatchRemove,false);
+}
+
+// Schedule a transport for processing
+void YateSIPTCPReactor::wake(YateSIPTCPTransport* trans)
+{
+    Lock lck(m_mutex);
+    if (trans && trans->m_reactor == this && setReady(trans))
+	signal();
+}
+
+// Schedule all transports for processing
+void YateSIPTCPReactor::wakeAll()
+{
+    Lock lck(m_mutex);
+    m_nextSweep = 0;
+    signal();
+}
+
+void YateSIPTCPReactor::run()
+{
+    DDebug(&plugin,DebugAll,"Reactor(%s) started [%p]",m_name.c_str(),this);
+#ifdef HAVE_EPOLL
+    struct epoll_event ev[REACTOR_EVENTS];
+    while (!Thread::check(false)) {
+	m_mutex.lock();
+	int msec = 0;
+	if (!m_ready.skipNull()) {
+	    int64_t wait = (int64_t)m_nextSweep - (int64_t)Time::now();
+	    if (wait > 0)
+		msec = (int)((wait + 999) / 1000);
+	}
+	// Check often for unreferenced transports when exiting
+	if (s_engineHalt && msec > (int)Thread::idleMsec())
+	    msec = Thread::idleMsec();
+	unsigned int removed = m_removed;
+	m_mutex.unlock();
+	int cnt = ::epoll_wait(m_epoll,ev,REACTOR_EVENTS,msec);
+	if (Thread::check(false))
+	    break;
+	Time now;
+	m_mutex.lock();
+	for (int i = 0; i < cnt; i++) {
+	    YateSIPTCPTransport* trans = static_cast<YateSIPTCPTransport*>(ev[i].data.ptr);
+	    if (!trans) {
+		u_int64_t val = 0;
+		if (::read(m_event,&val,sizeof(val)) < 0 && errno != EAGAIN)
+		    Debug(&plugin,DebugMild,"Reactor(%s) failed to read wake up event, error %d [%p]",
+			m_name.c_str(),errno,this);
+		continue;
+	    }
+	    // Transports may have been removed by other threads while we waited
+	    if (removed != m_removed && !m_transports.find(trans))
+		continue;
+	    setReady(trans);
+	}
+	if (s_engineHalt || m_nextSweep <= now) {
+	    m_nextSweep = now + (u_int64_t)REACTOR_SWEEP * 1000;
+	    for (unsigned int i = 0; i < m_transports.length(); i++) {
+		ObjList* o = m_transports.getList(i);
+		for (o = o ? o->skipNull() : 0; o; o = o->skipNext())
+		    setReady(static_cast<YateSIPTCPTransport*>(o->get()));
+	    }
+	}
+	// Transports set ready while processing are handled in the next loop
+	unsigned int n = m_ready.count();
+	m_mutex.unlock();
+	while (n--) {
+	    Lock lck(m_mutex);
+	    ObjList* o = m_ready.skipNull();
+	    if (!o)
+		break;
+	    // Keep the transport alive while processing it, we hold a reference
+	    //  so this can't fail
+	    RefPointer<YateSIPTCPTransport> trans = static_cast<YateSIPTCPTransport*>(o->remove(false));
+	    if (trans)
+		trans->m_reactorReady = false;
+	    lck.drop();
+	    if (trans)
+		process(trans);
+	}
+    }
+#endif
+    cleanup();
+    DDebug(&plugin,DebugAll,"Reactor(%s) terminated [%p]",m_name.c_str(),this);
+}
+
+// Wake up the thread
+void YateSIPTCPReactor::signal()
+{
+#ifdef HAVE_EPOLL
+    u_int64_t val = 1;
+    if (m_event >= 0 && ::write(m_event,&val,sizeof(val)) < 0 && errno != EAGAIN)
+	Debug(&plugin,DebugMild,"Reactor(%s) failed to signal wake up event, error %d [%p]",
+	    m_name.c_str(),errno,this);
+#endif
+}
+
+// Append a transport to ready list, must be called with the reactor locked
+bool YateSIPTCPReactor::setReady(YateSIPTCPTransport* trans)
+{
+    if (trans->m_reactorReady)
+	return false;
+    trans->m_reactorReady = true;
+    m_ready.append(trans)->setDelete(false);
+    return true;
+}
+
+// Update the events watched for a transport's socket
+bool YateSIPTCPReactor::watch(YateSIPTCPTransport* trans, WatchOp op, bool out)
+{
+#ifdef HAVE_EPOLL
+    Socket* sock = trans->m_sock;
+    if (!(sock && sock->valid()))
+	return false;
+    int ctl = EPOLL_CTL_MOD;
+    if (op == WatchAdd)
+	ctl = EPOLL_CTL_ADD;
+    else if (op == WatchRemove)
+	ctl = EPOLL_CTL_DEL;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    if (out)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = trans;
+    if (!::epoll_ctl(m_epoll,ctl,sock->handle(),&ev)) {
+	trans->m_reactorOut = out;
+	return true;
+    }
+    if (op != WatchRemove)
+	Debug(&plugin,DebugWarn,"Reactor(%s) failed to watch socket %d for '%s', error %d [%p]",
+	    m_name.c_str(),sock->handle(),trans->toString().c_str(),errno,this);
+#endif
+    return false;
+}
+
+// Process a transport until it has nothing more to read
+void YateSIPTCPReactor::process(YateSIPTCPTransport* trans)
+{
+    int n = 0;
+    for (unsigned int i = 0; i < REACTOR_READS && !n; i++)
+	n = trans->process();
+    if (n < 0) {
+	// This will release the reference held by the reactor
+	trans->terminate();
+	return;
+    }
+    Lock lckTrans(trans);
+    bool out = (0 != trans->m_queue.skipNull());
+    Lock lck(m_mutex);
+    if (trans->m_reactor != this)
+	return;
+    // Edge triggered events won't tell again about data not read yet
+    if (!n)
+	setReady(trans);
+    // Watch for socket writable only while there is data left to send
+    if (out != trans->m_reactorOut)
+	watch(trans,WatchModify,out);
+}
+
+// Release all transports
+void YateSIPTCPReactor::cleanup()
+{
+    while (true) {
+	Lock lck(m_mutex);
+	YateSIPTCPTransport* t = 0;
+	for (unsigned int i = 0; !t && i < m_transports.length(); i++) {
+	    ObjList* o = m_transports.getList(i);
+	    o = o ? o->skipNull() : 0;
+	    if (o)
+		t = static_cast<YateSIPTCPTransport*>(o->get());
+	}
+	RefPointer<YateSIPTCPTransport> trans = t;
+	lck.drop();
+	if (!trans)
+	    break;
+	trans->terminate("Reactor terminated");
+    }
+    if (plugin.ep())
+	plugin.ep()->removeReactor(this);
+}
+
+
 YateSIPTCPListener::YateSIPTCPListener(int proto, const String& name, const NamedList& params)
     : Thread("YSIP Listener",Thread::priority(params.getValue("thread"))),
     ProtocolHolder(proto),
@@ -4070,7 +4500,10 @@ void YateSIPTCPListener::run()
 	SocketAddr addr;
 	Socket* sock = m_socket->accept(addr);
 	if (!sock) {
-	    Thread::idle();
+	    // Wait for the next connection instead of sleeping a fixed interval
+	    bool readable = false;
+	    if (!(m_socket->canSelect() && m_socket->select(&readable,0,0,Thread::idleUsec())))
+		Thread::idle();
 	    continue;
 	}
 	Debug(&plugin,DebugAll,"Listener(%s,'%s') '%s' got conn from '%s' [%p]",
@@ -4361,7 +4794,8 @@ void YateTCPParty::destroyed()
 
 
 YateSIPEngine::YateSIPEngine(YateSIPEndPoint* ep)
-    : SIPEngine(s_cfg.getValue("general","useragent")),
+    : SIPEngine(s_cfg.getValue("general","useragent"),
+	s_cfg.getIntValue("general","shards",1,1,SIP_MAX_SHARDS)),
       m_ep(ep), m_prack(false), m_info(false), m_foreignAuth(false)
 {
     addAllowed("INVITE");
@@ -4437,16 +4871,18 @@ void YateSIPEngine::transportChangedStatus(YateSIPTransport* trans, int stat, co
     if (!(trans && stat == YateSIPTransport::Terminated))
 	return;
     // Clear transactions
-    Lock lock(this);
-    for (ObjList* l = m_transList.skipNull(); l; l = l->skipNext()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (t->initialMessage() && t->initialMessage()->getParty() &&
-	    trans == t->initialMessage()->getParty()->getTransport()) {
-	    bool active = t->isActive();
-	    Debug(this,active ? DebugInfo : DebugAll,
-		"Clearing %stransaction (%p) transport terminated reason=%s",
-		active ? "active " : "",t,reason.c_str());
-	    t->setCleared();
+    for (unsigned int i = 0; i < shards(); i++) {
+	Lock lock(shard(i));
+	for (ObjList* l = shard(i)->transactions().skipNull(); l; l = l->skipNext()) {
+	    SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
+	    if (t->initialMessage() && t->initialMessage()->getParty() &&
+		trans == t->initialMessage()->getParty()->getTransport()) {
+		bool active = t->isActive();
+		Debug(this,active ? DebugInfo : DebugAll,
+		    "Clearing %stransaction (%p) transport terminated reason=%s",
+		    active ? "active " : "",t,reason.c_str());
+		t->setCleared();
+	    }
 	}
     }
 }
@@ -4456,12 +4892,14 @@ bool YateSIPEngine::hasActiveTransaction(YateSIPTransport* trans)
 {
     if (!trans)
 	return false;
-    Lock lock(this);
-    for (ObjList* l = m_transList.skipNull(); l; l = l->skipNext()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (t->isActive() && t->initialMessage() && t->initialMessage()->getParty() &&
-	    trans == t->initialMessage()->getParty()->getTransport())
-	    return true;
+    for (unsigned int i = 0; i < shards(); i++) {
+	Lock lock(shard(i));
+	for (ObjList* l = shard(i)->transactions().skipNull(); l; l = l->skipNext()) {
+	    SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
+	    if (t->isActive() && t->initialMessage() && t->initialMessage()->getParty() &&
+		trans == t->initialMessage()->getParty()->getTransport())
+		return true;
+	}
     }
     return false;
 }
@@ -4469,11 +4907,13 @@ bool YateSIPEngine::hasActiveTransaction(YateSIPTransport* trans)
 // Check if the engine has pending transactions
 bool YateSIPEngine::hasInitialTransaction()
 {
-    Lock lock(this);
-    for (ObjList* l = m_transList.skipNull(); l; l = l->skipNext()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (t->getState() == SIPTransaction::Initial)
-	    return true;
+    for (unsigned int i = 0; i < shards(); i++) {
+	Lock lock(shard(i));
+	for (ObjList* l = shard(i)->transactions().skipNull(); l; l = l->skipNext()) {
+	    SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
+	    if (t->getState() == SIPTransaction::Initial)
+		return true;
+	}
     }
     return false;
 }
@@ -5024,6 +5464,148 @@ void YateSIPEndPoint::cancelListener(const String& name, const char* reason)
     	Debug(&plugin,DebugAll,"Stopped listener '%s'",name.c_str());
 }
 
+// Start TCP/TLS reactor threads up to the requested count
+void YateSIPEndPoint::setupReactors(unsigned int count, Thread::Priority prio)
+{
+    Lock lck(m_mutex);
+    unsigned int n = m_reactors.count();
+    if (n >= count)
+	return;
+    while (n < count) {
+	YateSIPTCPReactor* r = new YateSIPTCPReactor(n,prio);
+	if (!r->valid()) {
+	    delete r;
+	    break;
+	}
+	m_reactors.append(r)->setDelete(false);
+	if (!r->startup()) {
+	    Debug(&plugin,DebugWarn,"Failed to start reactor '%s'",r->toString().c_str());
+	    delete r;
+	    break;
+	}
+	n++;
+    }
+    if (n)
+	Debug(&plugin,DebugInfo,"Running %u reactor(s) for incoming TCP/TLS connections",n);
+    else
+	Debug(&plugin,DebugNote,"Reactors not available, using a thread for each TCP/TLS connection");
+}
+
+// Hand an incoming TCP/TLS transport to the least loaded reactor
+bool YateSIPEndPoint::addToReactor(YateSIPTCPTransport* trans)
+{
+    if (!trans)
+	return false;
+    Lock lck(m_mutex);
+    YateSIPTCPReactor* reactor = 0;
+    for (ObjList* o = m_reactors.skipNull(); o; o = o->skipNext()) {
+	YateSIPTCPReactor* r = static_cast<YateSIPTCPReactor*>(o->get());
+	if (!reactor || r->count() < reactor->count())
+	    reactor = r;
+    }
+    lck.drop();
+    if (!reactor)
+	return false;
+    // Reactors are removed only when exiting
+    Lock lckTrans(trans);
+    return reactor->add(trans);
+}
+
+// Remove a reactor from list
+bool YateSIPEndPoint::removeReactor(YateSIPTCPReactor* reactor)
+{
+    if (!reactor)
+	return false;
+    Lock lock(m_mutex);
+    if (!m_reactors.remove(reactor,false))
+	return false;
+    DDebug(&plugin,DebugAll,"Removed reactor (%p,'%s')",reactor,reactor->toString().c_str());
+    return true;
+}
+
+// Schedule all transports of all reactors for processing
+void YateSIPEndPoint::wakeReactors()
+{
+    Lock lock(m_mutex);
+    for (ObjList* o = m_reactors.skipNull(); o; o = o->skipNext())
+	static_cast<YateSIPTCPReactor*>(o->get())->wakeAll();
+}
+
+// Stop all reactors. Wait for termination
+void YateSIPEndPoint::cancelReactors()
+{
+    m_mutex.lock();
+    bool wait = false;
+    for (ObjList* o = m_reactors.skipNull(); o; o = o->skipNext()) {
+	YateSIPTCPReactor* r = static_cast<YateSIPTCPReactor*>(o->get());
+	wait = true;
+	r->cancel();
+	r->signal();
+    }
+    m_mutex.unlock();
+    if (!wait)
+	return;
+    while (true) {
+	Thread::idle();
+	Lock lck(m_mutex);
+	if (!m_reactors.skipNull())
+	    break;
+    }
+    Debug(&plugin,DebugAll,"Stopped all reactors");
+}
+
+// Start processing threads for all engine shards except the first one
+void YateSIPEndPoint::setupWorkers(Thread::Priority prio)
+{
+    Lock lck(m_mutex);
+    for (unsigned int i = m_workers.count() + 1; i < m_engine->shards(); i++) {
+	YateSIPShardWorker* w = new YateSIPShardWorker(i,prio);
+	m_workers.append(w)->setDelete(false);
+	if (!w->startup()) {
+	    Debug(&plugin,DebugWarn,"Failed to start worker '%s'",w->toString().c_str());
+	    m_workers.remove(w,false);
+	    delete w;
+	    break;
+	}
+    }
+    if (m_workers.skipNull())
+	Debug(&plugin,DebugInfo,"Processing %u engine shards in %u threads",
+	    m_engine->shards(),m_workers.count() + 1);
+}
+
+// Remove a shard worker from list
+bool YateSIPEndPoint::removeWorker(YateSIPShardWorker* worker)
+{
+    if (!worker)
+	return false;
+    Lock lock(m_mutex);
+    if (!m_workers.remove(worker,false))
+	return false;
+    DDebug(&plugin,DebugAll,"Removed shard worker (%p,'%s')",worker,worker->toString().c_str());
+    return true;
+}
+
+// Stop all shard workers. Wait for termination
+void YateSIPEndPoint::cancelWorkers()
+{
+    m_mutex.lock();
+    bool wait = false;
+    for (ObjList* o = m_workers.skipNull(); o; o = o->skipNext()) {
+	wait = true;
+	static_cast<YateSIPShardWorker*>(o->get())->cancel();
+    }
+    m_mutex.unlock();
+    if (!wait)
+	return;
+    while (true) {
+	Thread::idle();
+	Lock lck(m_mutex);
+	if (!m_workers.skipNull())
+	    break;
+    }
+    Debug(&plugin,DebugAll,"Stopped all shard workers");
+}
+
 // This method is called by the driver when start/end initializing
 // start==true: Reset initialized flag for listeners and UDP transports
 // start==false: Terminate not initialized listeners and UDP transports
@@ -5058,6 +5640,26 @@ void YateSIPEndPoint::initializing(bool start)
 	removeUdpTransport(o->get()->toString(),"Deleted");
 }
 
+YateSIPShardWorker::YateSIPShardWorker(unsigned int shard, Thread::Priority prio)
+    : Thread("YSIP Shard",prio),
+      m_shard(shard)
+{
+    m_name << "shard/" << shard;
+}
+
+void YateSIPShardWorker::run()
+{
+    if (plugin.ep())
+	plugin.ep()->process(m_shard);
+}
+
+void YateSIPShardWorker::cleanup()
+{
+    if (plugin.ep())
+	plugin.ep()->removeWorker(this);
+}
+
+
 bool YateSIPEndPoint::Init()
 {
     m_engine = new YateSIPEngine(this);
@@ -5068,24 +5670,41 @@ bool YateSIPEndPoint::Init()
 // Check if data is allowed to be read from socket(s) and processed
 bool YateSIPEndPoint::canRead()
 {
-    return s_floodEvents <= 1 || (s_evCount < s_floodEvents) || Engine::exiting();
+    return s_floodEvents <= 1 || (evCount() < s_floodEvents) || Engine::exiting();
+}
+
+// Retrieve the highest count of consecutive events handled by a shard
+int YateSIPEndPoint::evCount()
+{
+    int n = 0;
+    for (unsigned int i = 0; i < SIP_MAX_SHARDS; i++)
+	if (n < s_evCount[i])
+	    n = s_evCount[i];
+    return n;
 }
 
 void YateSIPEndPoint::run()
 {
+    process(0);
+}
+
+// Get and process the events of an engine shard until cancelled
+void YateSIPEndPoint::process(unsigned int shard)
+{
+    int& evc = s_evCount[shard];
     for (;;)
     {
-	if (!canRead()) {
-	    if (s_evCount == s_floodEvents)
-	        Debug(&plugin,DebugMild,"Flood detected: %d handled events",s_evCount);
-	    else if ((s_evCount % s_floodEvents) == 0)
-	        Debug(&plugin,DebugWarn,"Severe flood detected: %d events",s_evCount);
+	if (s_floodEvents > 1 && evc >= s_floodEvents && !Engine::exiting()) {
+	    if (evc == s_floodEvents)
+	        Debug(&plugin,DebugMild,"Flood detected: %d handled events",evc);
+	    else if ((evc % s_floodEvents) == 0)
+	        Debug(&plugin,DebugWarn,"Severe flood detected: %d events",evc);
 	}
-	SIPEvent* e = m_engine->getEvent();
+	SIPEvent* e = m_engine->getEvent(shard);
 	if (e)
-	    s_evCount++;
+	    evc++;
 	else
-	    s_evCount = 0;
+	    evc = 0;
 	// hack: use a loop so we can use break and continue
 	for (; e; m_engine->processEvent(e),e = 0) {
 	    SIPTransaction* t = e->getTransaction();
@@ -5141,10 +5760,10 @@ void YateSIPEndPoint::run()
 		break;
 	    }
 	}
-	if (s_evCount || s_engineHalt)
+	if (evc || s_engineHalt)
 	    Thread::check();
 	else
-	    Thread::usleep(Thread::idleUsec());
+	    m_engine->waitEvent(SIP_EVENT_WAIT,shard);
     }
 }
 
@@ -5777,6 +6396,8 @@ YateSIPConnection::YateSIPConnection(SIPEvent* ev, SIPTransaction* tr)
     m_tr->ref();
     m_routes = m_tr->initialMessage()->getRoutes();
     m_dialog = *m_tr->initialMessage();
+    m_indexCallId = m_dialog;
+    plugin.addCall(this);
     m_tr->initialMessage()->getParty()->getAddr(m_host,m_port,false);
     SocketAddr::appendTo(m_address,m_host,m_port);
     filterDebug(m_address);
@@ -6065,6 +6686,8 @@ YateSIPConnection::YateSIPConnection(Message& msg, const String& uri, const char
     SocketAddr::appendTo(m_address,m_host,m_port);
     filterDebug(m_address);
     m_dialog = *m;
+    m_indexCallId = m_dialog;
+    plugin.addCall(this);
     m_dialog.setCSeq(m->getCSeq());
     m_dialog.remoteCSeq = msg.getIntValue("remote_cseq",-1);
     if (s_privacy)
@@ -6149,6 +6772,7 @@ YateSIPConnection::~YateSIPConnection()
 void YateSIPConnection::destroyed()
 {
     DDebug(this,DebugAll,"YateSIPConnection::destroyed() [%p]",this);
+    plugin.removeCall(this);
     hangup();
     clearTransaction();
     TelEngine::destruct(m_route);
@@ -8632,11 +9256,11 @@ bool SipHandler::received(Message &msg)
 YateSIPConnection* SIPDriver::findCall(const String& callid, bool incRef)
 {
     XDebug(this,DebugAll,"SIPDriver finding call '%s'",callid.c_str());
-    Lock mylock(this);
-    ObjList* l = channels().skipNull();
+    Lock mylock(m_callsMutex);
+    ObjList* l = m_calls[callid.hash() % SIP_CALL_BUCKETS].skipNull();
     for (; l; l = l->skipNext()) {
 	YateSIPConnection* c = static_cast<YateSIPConnection*>(l->get());
-	if (c->callid() == callid)
+	if (c->indexCallId() == callid)
 	    return (incRef ? c->ref() : c->alive()) ? c : 0;
     }
     return 0;
@@ -8645,8 +9269,10 @@ YateSIPConnection* SIPDriver::findCall(const String& callid, bool incRef)
 YateSIPConnection* SIPDriver::findDialog(const SIPDialog& dialog, bool incRef)
 {
     XDebug(this,DebugAll,"SIPDriver finding dialog '%s'",dialog.c_str());
+    // Dialog tags are changed with the driver locked
     Lock mylock(this);
-    ObjList* l = channels().skipNull();
+    Lock lck(m_callsMutex);
+    ObjList* l = m_calls[dialog.hash() % SIP_CALL_BUCKETS].skipNull();
     for (; l; l = l->skipNext()) {
 	YateSIPConnection* c = static_cast<YateSIPConnection*>(l->get());
 	if (c->dialog() &= dialog)
@@ -8661,7 +9287,9 @@ YateSIPConnection* SIPDriver::findDialog(const String& dialog, const String& fro
     XDebug(this,DebugAll,"SIPDriver finding dialog '%s' fromTag='%s' toTag='%s'",
 	dialog.c_str(),fromTag.c_str(),toTag.c_str());
     Lock mylock(this);
-    for (ObjList* o = channels().skipNull(); o; o = o->skipNext()) {
+    Lock lck(m_callsMutex);
+    ObjList* o = m_calls[dialog.hash() % SIP_CALL_BUCKETS].skipNull();
+    for (; o; o = o->skipNext()) {
 	YateSIPConnection* c = static_cast<YateSIPConnection*>(o->get());
 	if (c->isDialog(dialog,fromTag,toTag))
 	    return (incRef ? c->ref() : c->alive()) ? c : 0;
@@ -8669,6 +9297,24 @@ YateSIPConnection* SIPDriver::findDialog(const String& dialog, const String& fro
     return 0;
 }
 
+// Add a connection to the Call-ID index
+void SIPDriver::addCall(YateSIPConnection* conn)
+{
+    if (!(conn && conn->indexCallId()))
+	return;
+    Lock mylock(m_callsMutex);
+    m_calls[conn->indexCallId().hash() % SIP_CALL_BUCKETS].append(conn)->setDelete(false);
+}
+
+// Remove a connection from the Call-ID index
+void SIPDriver::removeCall(YateSIPConnection* conn)
+{
+    if (!(conn && conn->indexCallId()))
+	return;
+    Lock mylock(m_callsMutex);
+    m_calls[conn->indexCallId().hash() % SIP_CALL_BUCKETS].remove(conn,false);
+}
+
 // find line by name
 YateSIPLine* SIPDriver::findLine(const String& line) const
 {
@@ -8770,6 +9416,7 @@ bool SIPDriver::received(Message& msg, int id)
 	// Clear transactions: they keep references to parties and transports
 	m_endpoint->engine()->clearTransactions();
 	m_endpoint->clearUdpTransports("Exiting");
+	m_endpoint->wakeReactors();
 	// Wait for transports to terminate
 	unsigned int n = 100;
 	while (--n) {
@@ -8784,6 +9431,8 @@ bool SIPDriver::received(Message& msg, int id)
 	if (n)
 	    Debug(this,DebugGoOn,"Exiting with %u transports in queue",n);
 	m_endpoint->m_mutex.unlock();
+	m_endpoint->cancelReactors();
+	m_endpoint->cancelWorkers();
 	m_endpoint->cancel();
     }
     else if (id == Status) {
@@ -8842,7 +9491,7 @@ bool SIPDriver::msgExecute(Message& msg, String& dest)
 SIPDriver::SIPDriver()
     : Driver("sip","varchans"),
       m_parser("sip","SIP Call"),
-      m_endpoint(0)
+      m_endpoint(0), m_callsMutex(false,"SIPCalls")
 {
     Output("Loaded module SIP Channel");
     m_parser.debugChain(this);
@@ -8932,6 +9581,8 @@ void SIPDriver::initialize()
 	    return;
 	}
 	m_endpoint->startup();
+	m_endpoint->setupWorkers(prio);
+	m_endpoint->setupReactors(s_cfg.getIntValue("general","tcp_reactors",2,0,64),prio);
 	setup();
 	installRelay(Halt);
 	installRelay(Progress);
@@ -1220,6 +1220,7 @@ public:
 class YATE_API ObjList : public GenObject
 {
     YNOCOPY(ObjList); // no automatic copies please
+    friend class ListIterator;
 public:
     /**
      * Creates a new, empty list.
@@ -1426,6 +1427,15 @@ public:
     inline void setDelete(bool autodelete)
 	{ m_delete = autodelete; }
 
+    /**
+     * Get the modification generation of the list this item belongs to.
+     * It changes every time an object is added, removed or replaced anywhere
+     *  in the list.
+     * @return Current generation of the list
+     */
+    inline unsigned int generation() const
+	{ return m_head ? m_head->m_generation : m_generation; }
+
     /**
      * A static empty object list
      * @return Reference to a static empty list
@@ -1446,9 +1456,19 @@ public:
      */
     void sort(int (*callbackCompare)(GenObject* obj1, GenObject* obj2, void* context), void* context = 0);
 private:
+    inline ObjList* head()
+	{ return m_head ? m_head : this; }
+    inline void changed(GenObject* obj, bool added)
+	{ ObjList* h = head(); h->m_generation++; h->m_changed = obj; h->m_added = added; }
+    inline const ObjList* headConst() const
+	{ return m_head ? m_head : this; }
     ObjList* m_next;
     GenObject* m_obj;
+    ObjList* m_head;
     bool m_delete;
+    bool m_added;
+    unsigned int m_generation;
+    GenObject* m_changed;
 };
 
 /**
@@ -3397,15 +3417,28 @@ public:
      */
     bool resync();
 
+    /**
+     * Get the generation of the hash list. It changes only when the internal
+     *  lists are destroyed, individual lists keep their own generation.
+     * @return Current generation of the hash list
+     */
+    inline unsigned int generation() const
+	{ return m_generation; }
+
 private:
     unsigned int m_size;
     ObjList** m_lists;
+    unsigned int m_generation;
 };
 
 /**
  * An ObjList or HashList iterator that can be used even when list elements
  * are changed while iterating. Note that it will not detect that an item was
  * removed and another with the same address was inserted back in list.
+ * Items are checked against the list only if the list generation changed
+ * since the last check. A single addition or removal since the last check
+ * is looked up by address so iterating while removing the current item is
+ * also linear.
  * @short Class used to iterate the items of a list
  */
 class YATE_API ListIterator
@@ -3495,12 +3528,18 @@ public:
 	{ m_current = 0; }
 
 private:
+    void revalidate() const;
     ObjList* m_objList;
     HashList* m_hashList;
     GenObject** m_objects;
     unsigned int* m_hashes;
+    unsigned int* m_generations;
+    mutable unsigned int* m_index;
+    mutable unsigned int m_indexMask;
+    mutable unsigned char* m_states;
     unsigned int m_length;
     unsigned int m_current;
+    mutable unsigned int m_generation;
 };
 
 /**
@@ -7287,6 +7326,13 @@ public:
      */
     void clearFilters();
 
+    /**
+     * Check if the socket has any packet filters installed
+     * @return True if at least one packet filter is installed
+     */
+    inline bool filtered() const
+	{ return 0 != m_filters.skipNull(); }
+
     /**
      * Run whatever actions required on idle thread runs.
      * The default implementation calls @ref SocketFilter::timerTick()
@@ -44,7 +44,7 @@ public:
     /**
      * Constructor.
      * Builds a MIME header line from a string buffer.
-     * Splits the value into header parameters
+     * Parameters are kept unparsed and split into the list on first access
      * @param name The header name
      * @param value The header value
      * @param sep Optional parameter separator. If 0, the default ';' will be used
@@ -97,7 +97,7 @@ public:
      * @return This header's list of parameters
      */
     inline const ObjList& params() const
-	{ return m_params; }
+	{ checkParams(); return m_params; }
 
     /**
      * Get the character used as separator in header line
@@ -174,9 +174,32 @@ public:
     static void buildHeaders(String& buf, const ObjList& headers);
 
 protected:
+    /**
+     * Split the parameters text received in constructor into the list
+     * @param text Parameters text starting with the first separator
+     */
+    virtual void parseParams(const String& text);
+
+    /**
+     * Parse the parameters if not already done, must be called before
+     *  accessing the list of parameters
+     */
+    inline void checkParams() const
+	{ if (m_parseState) const_cast<MimeHeaderLine*>(this)->parseRaw(); }
+
+    /**
+     * Keep parameters text to be parsed on first access
+     * @param text Parameters text starting with the first separator
+     */
+    inline void setRawParams(const char* text)
+	{ m_rawParams = text; m_parseState = m_rawParams.null() ? 0 : 1; }
+
     ObjList m_params;                    // Header list of parameters
     char m_separator;                    // Parameter separator
 private:
+    void parseRaw();
+    String m_rawParams;                  // Parameters not parsed yet
+    volatile int m_parseState;           // 0 parsed, 1 not parsed, 2 being parsed
     void operator=(const MimeHeaderLine&); // no assignment
 };
 
@@ -190,7 +213,7 @@ public:
     /**
      * Constructor.
      * Builds a MIME authentication header line from a string buffer.
-     * Splits the value into header parameters
+     * Parameters are kept unparsed and split into the list on first access
      * @param name The header name
      * @param value The header value
      */
@@ -225,6 +248,13 @@ public:
      */
     virtual void buildLine(String& line, bool header = true) const;
 
+protected:
+    /**
+     * Split the authentication parameters text into the list
+     * @param text Parameters text starting after the authentication scheme
+     */
+    virtual void parseParams(const String& text);
+
 private:
     void operator=(const MimeAuthLine&); // no assignment
 };
@@ -474,6 +474,11 @@ private:
     RefObject* m_data;
     bool m_notify;
     bool m_broadcast;
+    bool m_queued;
+    bool m_handled;
+    int m_suspend;
+    unsigned int m_resumePrio;
+    const void* m_resumeAddr;
     void commonEncode(String& str) const;
     int commonDecode(const char* str, int offs);
 };
@@ -733,6 +738,8 @@ public:
      * Synchronously dispatch a message to the installed handlers.
      * Handlers matching the message name and filter parameter are called in
      *  their installed order (based on priority) until one returns true.
+     * Handlers are indexed by message name so only the ones installed for
+     *  the message name and the broadcast (null name) ones are checked.
      * If the message has the broadcast flag set all matching handlers are
      *  called and the return value is true if any handler returned true.
      * Note that in some cases when a handler is removed from the list
@@ -745,10 +752,31 @@ public:
     /**
      * Put a message in the waiting queue for asynchronous dispatching
      * @param msg The message to enqueue, will be destroyed after dispatching
-     * @return True if successfully queued, false otherwise
+     * @return True if successfully queued, false otherwise (already queued)
      */
     bool enqueue(Message* msg);
 
+    /**
+     * Suspend dispatching a message taken from the waiting queue.
+     * This method must be called only from the received() method of the
+     *  handler currently processing the message. On success the handler
+     *  should return false and call @ref resume() later, possibly from
+     *  another thread, the dispatching thread is released meanwhile.
+     * @param msg The message being dispatched
+     * @return True if the message was suspended, false if it is not
+     *  asynchronously dispatched and must be handled synchronously
+     */
+    bool suspend(Message& msg);
+
+    /**
+     * Resume dispatching a suspended message, the handlers placed after the
+     *  one that suspended it will be called from the waiting queue
+     * @param msg The suspended message
+     * @param handled True if the handler that suspended the message accepted it
+     * @return True if resumed, false if the message was not suspended
+     */
+    bool resume(Message* msg, bool handled);
+
     /**
      * Dispatch all messages from the waiting queue
      */
@@ -767,11 +795,35 @@ public:
     inline void warnTime(u_int64_t usec)
 	{ m_warnTime = usec; }
 
+    /**
+     * Set the number of slots of the bounded waiting queue.
+     * Messages are kept in a preallocated ring and threads waiting in
+     *  @ref waitMessage() are woken up when a message is enqueued.
+     * Messages that don't fit in the ring are kept in order in an unbounded list
+     * @param slots Number of ring slots, zero to use only the unbounded list
+     */
+    void queueSize(unsigned int slots);
+
+    /**
+     * Retrieve the number of slots of the bounded waiting queue
+     * @return Number of ring slots, zero if only the unbounded list is used
+     */
+    inline unsigned int queueSize() const
+	{ return m_ringSize; }
+
+    /**
+     * Wait until a message is put in the bounded waiting queue
+     * @param maxwait Maximum time to wait in microseconds
+     * @return True if a message was enqueued, false on timeout or if
+     *  the bounded waiting queue is not used
+     */
+    bool waitMessage(long maxwait);
+
     /**
      * Clear all the message handlers and post-dispatch hooks
      */
     inline void clear()
-	{ m_handlers.clear(); m_hookAppend = &m_hooks; m_hooks.clear(); }
+	{ m_index.clear(); m_wildcards.clear(); m_handlers.clear(); m_hookAppend = &m_hooks; m_hooks.clear(); }
 
     /**
      * Get the number of messages waiting in the queue
@@ -807,10 +859,21 @@ protected:
 	{ m_trackParam = paramName; }
 
 private:
+    bool dispatchInternal(Message& msg, bool* suspended);
+    Message* popMessage();
     ObjList m_handlers;
+    HashList m_index;
+    ObjList m_wildcards;
     ObjList m_messages;
     ObjList m_hooks;
+    Mutex m_msgMutex;
+    Semaphore m_msgSemaphore;
     Mutex m_hookMutex;
+    Message** m_ring;
+    unsigned int m_ringSize;
+    unsigned int m_ringHead;
+    unsigned int m_ringCount;
+    unsigned int m_msgCount;
     ObjList* m_msgAppend;
     ObjList* m_hookAppend;
     String m_trackParam;
@@ -1395,6 +1458,24 @@ public:
     inline static bool enqueue(const char* name, bool broadcast = false)
 	{ return name && *name && enqueue(new Message(name,0,broadcast)); }
 
+    /**
+     * Suspend dispatching a message taken from the message queue.
+     * Must be called from the received() method of the handler currently
+     *  processing the message, the handler should then return false and
+     *  call @ref resume() when the processing is complete.
+     * @param msg The message being dispatched
+     * @return True if suspended, false if the message must be handled synchronously
+     */
+    static bool suspend(Message& msg);
+
+    /**
+     * Resume dispatching a previously suspended message from the message queue
+     * @param msg The suspended message
+     * @param handled True if the handler that suspended the message accepted it
+     * @return True if resumed, false if the message was not suspended
+     */
+    static bool resume(Message* msg, bool handled);
+
     /**
      * Synchronously dispatch a message to the registered handlers
      * @param msg Pointer to the message to dispatch
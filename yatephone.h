@@ -390,6 +390,7 @@ class DataSource;
 class DataTranslator;
 class TranslatorFactory;
 class ThreadedSourcePrivate;
+class TranslatorTable;
 
 /**
  * A data consumer
@@ -810,6 +811,7 @@ private:
     static void compose();
     static void compose(TranslatorFactory* factory);
     static bool canConvert(const FormatInfo* fmt1, const FormatInfo* fmt2);
+    static TranslatorTable* table();
     DataSource* m_tsource;
     static Mutex s_mutex;
     static ObjList s_factories;
@@ -1642,6 +1644,7 @@ class YATE_API Channel : public CallEndpoint, public DebugEnabler, public Messag
 {
     friend class Driver;
     friend class Router;
+    friend class RouterPool;
     YNOCOPY(Channel); // no automatic copies please
 private:
     NamedList m_parameters;
@@ -1650,6 +1653,8 @@ private:
     u_int64_t m_timeout;
     u_int64_t m_maxcall;
     u_int64_t m_maxPDD;          // Timeout while waiting for some progress on outgoing calls
+    u_int64_t m_timerCheck;      // Extra time at which timers must be checked
+    int m_timerSlot;             // Slot in the driver's timer wheel, -1 if none
     u_int64_t m_dtmfTime;
     unsigned int m_toutAns;
     unsigned int m_dtmfSeq;
@@ -1803,7 +1808,12 @@ public:
     virtual bool msgControl(Message& msg);
 
     /**
-     * Timer check method, by default handles channel timeouts
+     * Timer check method, by default handles channel timeouts.
+     * It is not called on every engine timer tick, the driver calls it only
+     *  once the earliest of timeout(), maxcall(), maxPDD() or timerCheck() has
+     *  expired. Overrides that need to run periodically must schedule their
+     *  next check with timerCheck(), an expired timerCheck() that is left
+     *  unchanged keeps the channel checked on every timer tick
      * @param msg Timer message
      * @param tmr Current time against which timers are compared
      */
@@ -1911,7 +1921,7 @@ public:
      * @param tout New timeout time or zero to disable
      */
     inline void timeout(u_int64_t tout)
-	{ m_timeout = tout; }
+	{ m_timeout = tout; updateTimers(); }
 
     /**
      * Get the time this channel will time out on outgoing calls
@@ -1925,7 +1935,7 @@ public:
      * @param tout New timeout time or zero to disable
      */
     inline void maxcall(u_int64_t tout)
-	{ m_maxcall = tout; }
+	{ m_maxcall = tout; updateTimers(); }
 
     /**
      * Set the time this channel will time out on outgoing calls
@@ -1956,7 +1966,7 @@ public:
      * @param tout New timeout time or zero to disable
      */
     inline void maxPDD(u_int64_t tout)
-	{ m_maxPDD = tout; }
+	{ m_maxPDD = tout; updateTimers(); }
 
     /**
      * Set the time this channel will time out while waiting for some progress
@@ -2081,6 +2091,21 @@ protected:
      */
     virtual void setId(const char* newId);
 
+    /**
+     * Get the extra time at which timers must be checked
+     * @return Time of the extra timer check or zero if none
+     */
+    inline u_int64_t timerCheck() const
+	{ return m_timerCheck; }
+
+    /**
+     * Request checkTimers() to be called once a custom timer expires.
+     * Only channels with an expired timer are checked on each engine timer
+     * @param when Time of the extra timer check or zero to disable
+     */
+    inline void timerCheck(u_int64_t when)
+	{ m_timerCheck = when; updateTimers(); }
+
     /**
      * Create a properly populated chan.disconnect message
      * @param reason Channel disconnect reason if available
@@ -2147,6 +2172,8 @@ protected:
 
 private:
     void init();
+    void updateTimers();
+    u_int64_t nextTimer() const;
     Channel(); // no default constructor please
 };
 
@@ -2157,6 +2184,7 @@ private:
 class YATE_API Driver : public Module
 {
     friend class Router;
+    friend class RouterPool;
     friend class Channel;
 
 private:
@@ -2167,12 +2195,18 @@ private:
     int m_routing;
     int m_routed;
     int m_total;
+    unsigned int m_routeWait;
+    unsigned int m_routeTime;
     unsigned int m_nextid;
     int m_timeout;
     int m_maxroute;
     int m_maxchans;
     int m_chanCount;
     bool m_dtmfDups;
+    HashList m_chanIndex;
+    ObjList* m_timerWheel;
+    u_int64_t m_timerSec;
+    void dueTimers(ObjList& due, const Time& now);
 
 public:
     /**
@@ -2298,6 +2332,11 @@ protected:
      */
     Driver(const char* name, const char* type = 0);
 
+    /**
+     * Destructor
+     */
+    virtual ~Driver();
+
     /**
      * This method is called to initialize the loaded module
      */